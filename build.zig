@@ -24,5 +24,17 @@ pub fn build(builder: *std.Build) void {
     // ...
 
     build_step.dependOn(&builder.addRunArtifact(vasm_unit_tests).step);
+
+    // fuzz target for the lexer, parser and codegen. `zig build fuzz --fuzz` runs it
+    // coverage-guided, without `--fuzz` it runs the seed corpus once.
+    const fuzz_tests = builder.addTest(.{
+        .root_source_file = builder.path("src/fuzz.zig"),
+        .target = target,
+        .optimize = .ReleaseSafe,
+    });
+
+    const fuzz_step = builder.step("fuzz", "Fuzzes the lexer, parser and codegen for crashes and performance cliffs. Use with --fuzz.");
+    fuzz_step.dependOn(&builder.addRunArtifact(fuzz_tests).step);
+
     builder.installArtifact(frontend_exe);
 }
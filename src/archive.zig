@@ -0,0 +1,340 @@
+//! ## Procedure Libraries
+//!
+//! `vasm ar` generates every procedure of its inputs for one format and packs the binaries into a
+//! library, with an index of their names sorted for lookups:
+//!
+//! ```sh
+//! vasm ar -f nexfuse strings.asm io.vo -o std.vlib
+//! vasm main.asm -f nexfuse -l std.vlib -o main.bin
+//! ```
+//!
+//! Codegen looks up an instruction the format does not have in the libraries given with `-l`
+//! before it reports that the instruction does not exist, and folds the binary it finds into the
+//! procedure, the way it folds a procedure of the program. Library procedures are never parsed or
+//! generated again. Libraries are mapped into memory instead of read and a lookup is a binary
+//! search of the index, so a compile only touches the pages of the procedures it uses.
+//!
+//! A library is made for a single format. The endianness is not part of it: codegen never depends
+//! on it, the linker applies it once it encodes the binary.
+//!
+//! Procedures that refer to other procedures by name (the target of a `jmp`, for one) are left out
+//! of a library, the procedures they refer to would not be in the program that uses them.
+//!
+
+const std = @import("std");
+const builtin = @import("builtin");
+
+/// Starts every library. The last byte is the version of the encoding.
+pub const magic = "VASMLIB\x01";
+
+pub const Error = error{
+    /// The input does not start with `magic`
+    NotALibrary,
+
+    /// The header or an entry of the index points past the end of the library
+    TruncatedLibrary,
+
+    /// Two procedures of the same name, a lookup could not tell them apart
+    DuplicateProcedure,
+};
+
+/// A procedure to pack, its binary encoded with `encode`.
+pub const Procedure = struct {
+    name: []const u8,
+    binary: []const u8,
+};
+
+/// The size of an entry of the index: the offset and length of the name, then of the binary.
+const entry_size = 4 * @sizeOf(u32);
+
+/// Mapping files needs `mmap`, elsewhere libraries are read into memory.
+const can_map = builtin.os.tag != .windows and builtin.os.tag != .wasi;
+
+fn Bits(comptime T: type) type {
+    return std.meta.Int(.unsigned, @bitSizeOf(T));
+}
+
+/// Encodes a generated binary the way libraries store it: every element little endian, in as many
+/// bytes as the element type has.
+pub fn encode(comptime T: type, allocator: std.mem.Allocator, binary: []const T) ![]u8 {
+    const bytes = try allocator.alloc(u8, binary.len * @sizeOf(T));
+
+    for (binary, 0..) |it, i| {
+        std.mem.writeInt(Bits(T), bytes[i * @sizeOf(T) ..][0..@sizeOf(T)], @bitCast(it), .little);
+    }
+
+    return bytes;
+}
+
+/// The element at `index` of a binary encoded with `encode`.
+pub fn element(comptime T: type, binary: []const u8, index: usize) T {
+    return @bitCast(std.mem.readInt(Bits(T), binary[index * @sizeOf(T) ..][0..@sizeOf(T)], .little));
+}
+
+fn nameLessThan(_: void, a: Procedure, b: Procedure) bool {
+    return std.mem.lessThan(u8, a.name, b.name);
+}
+
+/// Writes a library of `procedures` for `format`, whose binaries have elements of
+/// `element_size` bytes.
+///
+/// ```
+/// magic
+/// u8 element size, u8 format length, format
+/// u32 procedure count
+/// index, sorted by name: u32 name offset, u32 name length, u32 binary offset, u32 binary length
+/// names
+/// binaries
+/// ```
+///
+/// Integers are little endian, offsets count from the start of the library.
+pub fn write(allocator: std.mem.Allocator, writer: anytype, format: []const u8, element_size: u8, procedures: []const Procedure) !void {
+    const sorted = try allocator.dupe(Procedure, procedures);
+    defer allocator.free(sorted);
+
+    std.mem.sort(Procedure, sorted, {}, nameLessThan);
+
+    for (1..sorted.len) |i| {
+        if (std.mem.eql(u8, sorted[i - 1].name, sorted[i].name)) return error.DuplicateProcedure;
+    }
+
+    try writer.writeAll(magic);
+    try writer.writeByte(element_size);
+    try writer.writeByte(@intCast(format.len));
+    try writer.writeAll(format);
+    try writer.writeInt(u32, @intCast(sorted.len), .little);
+
+    var name_offset = magic.len + 2 + format.len + @sizeOf(u32) + sorted.len * entry_size;
+    var binary_offset = name_offset;
+
+    for (sorted) |procedure| {
+        binary_offset += procedure.name.len;
+    }
+
+    for (sorted) |procedure| {
+        try writer.writeInt(u32, @intCast(name_offset), .little);
+        try writer.writeInt(u32, @intCast(procedure.name.len), .little);
+        try writer.writeInt(u32, @intCast(binary_offset), .little);
+        try writer.writeInt(u32, @intCast(procedure.binary.len), .little);
+
+        name_offset += procedure.name.len;
+        binary_offset += procedure.binary.len;
+    }
+
+    for (sorted) |procedure| {
+        try writer.writeAll(procedure.name);
+    }
+
+    for (sorted) |procedure| {
+        try writer.writeAll(procedure.binary);
+    }
+}
+
+/// A library, mapped into memory (`open`) or from bytes the caller owns (`init`).
+pub const Library = struct {
+    /// The whole library
+    bytes: []const u8,
+
+    /// The format the procedures were generated for
+    format: []const u8,
+
+    /// The size of an element of the binaries, in bytes
+    element_size: u8,
+
+    /// The entries of the index, sorted by name
+    index: []const u8,
+
+    backing: Backing = .none,
+
+    const Backing = union(enum) {
+        /// The caller owns the bytes
+        none,
+        mapped,
+        allocated: std.mem.Allocator,
+    };
+
+    /// Reads the header of `bytes`. Entries are only checked once they are looked up, so opening
+    /// a library does not touch its index.
+    pub fn init(bytes: []const u8) Error!Library {
+        if (!std.mem.startsWith(u8, bytes, magic)) return error.NotALibrary;
+
+        var pos: usize = magic.len;
+
+        if (bytes.len < pos + 2) return error.TruncatedLibrary;
+
+        const element_size = bytes[pos];
+        const format_len = bytes[pos + 1];
+        pos += 2;
+
+        if (element_size == 0) return error.NotALibrary;
+        if (bytes.len < pos + format_len + @sizeOf(u32)) return error.TruncatedLibrary;
+
+        const format = bytes[pos..][0..format_len];
+        pos += format_len;
+
+        const procedure_count: usize = std.mem.readInt(u32, bytes[pos..][0..@sizeOf(u32)], .little);
+        pos += @sizeOf(u32);
+
+        if ((bytes.len - pos) / entry_size < procedure_count) return error.TruncatedLibrary;
+
+        return Library{
+            .bytes = bytes,
+            .format = format,
+            .element_size = element_size,
+            .index = bytes[pos..][0 .. procedure_count * entry_size],
+        };
+    }
+
+    /// Maps the library at `path` into memory. Where files can not be mapped, the library is read
+    /// with `allocator` instead.
+    pub fn open(allocator: std.mem.Allocator, dir: std.fs.Dir, path: []const u8) !Library {
+        const file = try dir.openFile(path, .{});
+        defer file.close();
+
+        if (comptime !can_map) return readLibrary(allocator, file);
+
+        const size = try file.getEndPos();
+
+        // an empty file can not be mapped, it is not a library either way
+        if (size == 0) return error.NotALibrary;
+
+        const mapped = try std.posix.mmap(null, @intCast(size), std.posix.PROT.READ, .{ .TYPE = .PRIVATE }, file.handle, 0);
+        errdefer std.posix.munmap(mapped);
+
+        var library = try init(mapped);
+        library.backing = .mapped;
+
+        return library;
+    }
+
+    fn readLibrary(allocator: std.mem.Allocator, file: std.fs.File) !Library {
+        const bytes = try file.readToEndAlloc(allocator, std.math.maxInt(usize));
+        errdefer allocator.free(bytes);
+
+        var library = try init(bytes);
+        library.backing = .{ .allocated = allocator };
+
+        return library;
+    }
+
+    /// Unmaps or frees the library. Binaries found in it are no longer valid.
+    pub fn close(self: *Library) void {
+        switch (self.backing) {
+            .none => {},
+            .mapped => if (comptime can_map) std.posix.munmap(@alignCast(self.bytes)) else unreachable,
+            .allocated => |allocator| allocator.free(self.bytes),
+        }
+
+        self.* = undefined;
+    }
+
+    /// How many procedures the library has.
+    pub fn count(self: *const Library) usize {
+        return self.index.len / entry_size;
+    }
+
+    /// The binary of the procedure `name`, encoded (see `element`). Null when the library does not
+    /// have it. Points into the library.
+    pub fn find(self: *const Library, name: []const u8) Error!?[]const u8 {
+        var low: usize = 0;
+        var high: usize = self.count();
+
+        while (low < high) {
+            const middle = low + (high - low) / 2;
+
+            switch (std.mem.order(u8, name, try self.field(middle, 0))) {
+                .eq => {
+                    const binary = try self.field(middle, 2);
+
+                    if (binary.len % self.element_size != 0) return error.TruncatedLibrary;
+
+                    return binary;
+                },
+
+                .lt => high = middle,
+                .gt => low = middle + 1,
+            }
+        }
+
+        return null;
+    }
+
+    /// The bytes the offset at `which` of entry `entry` and the length after it point to.
+    fn field(self: *const Library, entry: usize, which: usize) Error![]const u8 {
+        const at = self.index[entry * entry_size + which * @sizeOf(u32) ..];
+
+        const offset = std.mem.readInt(u32, at[0..@sizeOf(u32)], .little);
+        const len = std.mem.readInt(u32, at[@sizeOf(u32)..][0..@sizeOf(u32)], .little);
+
+        if (offset > self.bytes.len or len > self.bytes.len - offset) return error.TruncatedLibrary;
+
+        return self.bytes[offset..][0..len];
+    }
+};
+
+fn testLibrary(allocator: std.mem.Allocator, procedures: []const Procedure) ![]u8 {
+    var bytes = std.ArrayList(u8).init(allocator);
+    try write(allocator, bytes.writer(), "nexfuse", 1, procedures);
+
+    return bytes.toOwnedSlice();
+}
+
+test Library {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const bytes = try testLibrary(arena.allocator(), &.{
+        .{ .name = "print", .binary = &.{ 40, 'a', 0 } },
+        .{ .name = "exit", .binary = &.{22} },
+        .{ .name = "newline", .binary = &.{ 40, 0x0a, 0 } },
+    });
+
+    var library = try Library.init(bytes);
+    defer library.close();
+
+    try std.testing.expectEqualStrings("nexfuse", library.format);
+    try std.testing.expectEqual(1, library.element_size);
+    try std.testing.expectEqual(3, library.count());
+
+    // written in any order, found by name
+    try std.testing.expectEqualSlices(u8, &.{22}, (try library.find("exit")).?);
+    try std.testing.expectEqualSlices(u8, &.{ 40, 0x0a, 0 }, (try library.find("newline")).?);
+    try std.testing.expectEqualSlices(u8, &.{ 40, 'a', 0 }, (try library.find("print")).?);
+
+    try std.testing.expectEqual(null, try library.find("a"));
+    try std.testing.expectEqual(null, try library.find("more"));
+    try std.testing.expectEqual(null, try library.find("zero"));
+}
+
+test "invalid libraries" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const bytes = try testLibrary(arena.allocator(), &.{.{ .name = "exit", .binary = &.{22} }});
+
+    try std.testing.expectError(error.NotALibrary, Library.init("VASMOBJ\x01"));
+    try std.testing.expectError(error.TruncatedLibrary, Library.init(bytes[0 .. bytes.len - 6]));
+
+    // the index is intact, the binary it points to is not
+    const cut = try Library.init(bytes[0 .. bytes.len - 1]);
+    try std.testing.expectError(error.TruncatedLibrary, cut.find("exit"));
+
+    try std.testing.expectError(error.DuplicateProcedure, testLibrary(arena.allocator(), &.{
+        .{ .name = "exit", .binary = &.{22} },
+        .{ .name = "exit", .binary = &.{} },
+    }));
+}
+
+test encode {
+    const binary = [_]i32{ -2, 7, std.math.maxInt(i32) };
+
+    const bytes = try encode(i32, std.testing.allocator, &binary);
+    defer std.testing.allocator.free(bytes);
+
+    try std.testing.expectEqual(12, bytes.len);
+    try std.testing.expectEqualSlices(u8, &.{ 0xfe, 0xff, 0xff, 0xff }, bytes[0..4]);
+
+    for (binary, 0..) |it, i| {
+        try std.testing.expectEqual(it, element(i32, bytes, i));
+    }
+}
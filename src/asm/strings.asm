@@ -0,0 +1,6 @@
+[compat nexfuse]
+
+_start:
+    echo 'Hello, world!\n' ; filled into a register from -O1
+    lsl R1, 'abc', 0x0a
+    each R1
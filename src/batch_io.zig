@@ -0,0 +1,616 @@
+//! ## Batched File I/O
+//!
+//! Reads inputs and writes outputs a whole batch at a time. With the io_uring backend (Linux only,
+//! `--io-uring`) every step of a batch goes to the kernel in one submission: all files are opened
+//! (and sized) together, then all of them are read or written, then all of them are closed. This
+//! takes a few syscalls per batch instead of several per file.
+//!
+//! Where io_uring is not available (other systems, old kernels, sandboxes that forbid it), a batch
+//! falls back to regular syscalls, one file at a time. Kernels from 5.1 to 5.5 have rings, but not
+//! every operation a batch takes, the ring is probed for them before it is used.
+//!
+//! ```zig
+//! const inputs = switch (batch_io.readFiles(allocator, std.fs.cwd(), paths, .io_uring)) {
+//!     .ok => |contents| contents,
+//!     .failed => |failure| ...,
+//! };
+//! ```
+//!
+
+const std = @import("std");
+const builtin = @import("builtin");
+const linux = std.os.linux;
+
+pub const Backend = enum {
+    syscalls,
+    io_uring,
+};
+
+/// Operations in flight at once.
+const ring_entries = 64;
+
+pub const Write = struct {
+    path: []const u8,
+    bytes: []const u8,
+};
+
+/// The file a batch failed on, and why.
+pub const Failure = struct {
+    path: []const u8,
+    err: anyerror,
+};
+
+pub const ReadResult = union(enum) {
+    /// The contents of every file, in the order of the paths. Owned by the caller.
+    ok: [][]u8,
+    failed: Failure,
+};
+
+/// Reads every file in `paths`, relative to `dir`.
+pub fn readFiles(allocator: std.mem.Allocator, dir: std.fs.Dir, paths: []const []const u8, backend: Backend) ReadResult {
+    if (comptime builtin.os.tag == .linux) {
+        if (backend == .io_uring) {
+            if (initRing()) |ring_value| {
+                var ring = ring_value;
+                defer ring.deinit();
+
+                return readWithRing(allocator, &ring, dir, paths);
+            }
+        }
+    }
+
+    return readWithSyscalls(allocator, dir, paths);
+}
+
+/// Writes every file in `writes`, relative to `dir`, replacing what was there. Null when all of
+/// them were written.
+pub fn writeFiles(allocator: std.mem.Allocator, dir: std.fs.Dir, writes: []const Write, backend: Backend) ?Failure {
+    if (comptime builtin.os.tag == .linux) {
+        if (backend == .io_uring) {
+            if (initRing()) |ring_value| {
+                var ring = ring_value;
+                defer ring.deinit();
+
+                return writeWithRing(allocator, &ring, dir, writes);
+            }
+        }
+    }
+
+    return writeWithSyscalls(dir, writes);
+}
+
+/// Every operation a batch takes.
+const batch_ops = [_]linux.IORING_OP{ .NOP, .OPENAT, .STATX, .READ, .WRITE, .CLOSE };
+
+/// What `IORING_REGISTER_PROBE` fills in (`struct io_uring_probe`), with room for every opcode.
+const Probe = extern struct {
+    last_op: u8 = 0,
+    ops_len: u8 = 0,
+    resv: u16 = 0,
+    resv2: [3]u32 = .{ 0, 0, 0 },
+    ops: [256]ProbeOp = [_]ProbeOp{.{}} ** 256,
+
+    const ProbeOp = extern struct {
+        op: u8 = 0,
+        resv: u8 = 0,
+        flags: u16 = 0,
+        resv2: u32 = 0,
+    };
+
+    /// `IO_URING_OP_SUPPORTED`
+    const op_supported = 1;
+
+    fn supports(self: *const Probe, op: linux.IORING_OP) bool {
+        const code = @intFromEnum(op);
+
+        return code <= self.last_op and self.ops[code].flags & op_supported != 0;
+    }
+};
+
+/// A ring that takes every operation of a batch. Null when there is none, or the kernel lacks
+/// one of them. Probing came with 5.6, a kernel that can not probe lacks OPENAT and STATX too.
+fn initRing() ?linux.IoUring {
+    var ring = linux.IoUring.init(ring_entries, 0) catch return null;
+
+    var probe = Probe{};
+    const rc = linux.io_uring_register(ring.fd, .REGISTER_PROBE, &probe, probe.ops.len);
+
+    if (linux.E.init(rc) == .SUCCESS) {
+        for (batch_ops) |op| {
+            if (!probe.supports(op)) break;
+        } else return ring;
+    }
+
+    ring.deinit();
+    return null;
+}
+
+/// Outputs from several threads, collected to be written in one batch.
+pub const Outputs = struct {
+    arena: std.heap.ArenaAllocator,
+    writes: std.ArrayListUnmanaged(Write) = .{},
+    mutex: std.Thread.Mutex = .{},
+
+    pub fn init(child_allocator: std.mem.Allocator) Outputs {
+        return Outputs{
+            .arena = std.heap.ArenaAllocator.init(child_allocator),
+        };
+    }
+
+    pub fn deinit(self: *Outputs) void {
+        self.arena.deinit();
+    }
+
+    /// Keeps a copy of `bytes`, to be written to `path` by `flush`.
+    pub fn add(self: *Outputs, path: []const u8, bytes: []const u8) error{OutOfMemory}!void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        const allocator = self.arena.allocator();
+
+        try self.writes.append(allocator, Write{
+            .path = try allocator.dupe(u8, path),
+            .bytes = try allocator.dupe(u8, bytes),
+        });
+    }
+
+    /// Writes everything added so far, relative to the working directory.
+    pub fn flush(self: *Outputs, backend: Backend) ?Failure {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        return writeFiles(self.arena.allocator(), std.fs.cwd(), self.writes.items, backend);
+    }
+};
+
+fn readWithSyscalls(allocator: std.mem.Allocator, dir: std.fs.Dir, paths: []const []const u8) ReadResult {
+    const contents = allocator.alloc([]u8, paths.len) catch |err| return .{ .failed = .{ .path = "", .err = err } };
+    var read: usize = 0;
+
+    for (paths) |path| {
+        contents[read] = dir.readFileAlloc(allocator, path, std.math.maxInt(usize)) catch |err| {
+            freeContents(allocator, contents[0..read]);
+            allocator.free(contents);
+
+            return .{ .failed = .{ .path = path, .err = err } };
+        };
+        read += 1;
+    }
+
+    return .{ .ok = contents };
+}
+
+fn writeWithSyscalls(dir: std.fs.Dir, writes: []const Write) ?Failure {
+    for (writes) |write| {
+        dir.writeFile(.{ .sub_path = write.path, .data = write.bytes }) catch |err| {
+            return Failure{ .path = write.path, .err = err };
+        };
+    }
+
+    return null;
+}
+
+fn freeContents(allocator: std.mem.Allocator, contents: []const []u8) void {
+    for (contents) |content| {
+        allocator.free(content);
+    }
+}
+
+/// The value of a completion, or the error it failed with.
+fn check(res: i32) !usize {
+    if (res >= 0) return @intCast(res);
+
+    return switch (@as(linux.E, @enumFromInt(@as(u16, @intCast(-res))))) {
+        .NOENT => error.FileNotFound,
+        .ACCES, .PERM => error.AccessDenied,
+        .ISDIR => error.IsDir,
+        .NOSPC => error.NoSpaceLeft,
+        .MFILE, .NFILE => error.ProcessFdQuotaExceeded,
+        else => |errno| std.posix.unexpectedErrno(errno),
+    };
+}
+
+/// Runs `count` operations, `ring_entries` at a time. `ops.prepare(ring, op)` queues operation
+/// `op` with `op` as its user data, `ops.complete(op, res)` takes its result. A failed operation
+/// does not stop the rest of its submission, the kernel may still be using their buffers. Its
+/// error is returned once they are all done, with `failed_op` set to it.
+fn runAll(ring: *linux.IoUring, count: usize, ops: anytype, failed_op: *usize) !void {
+    var cqes: [ring_entries]linux.io_uring_cqe = undefined;
+    var first_error: ?anyerror = null;
+    var next: usize = 0;
+
+    while (next < count and first_error == null) {
+        const batch = @min(count - next, ring_entries);
+
+        for (next..next + batch) |op| {
+            try ops.prepare(ring, op);
+        }
+
+        _ = try ring.submit_and_wait(@intCast(batch));
+
+        var done: usize = 0;
+
+        while (done < batch) {
+            const copied = try ring.copy_cqes(&cqes, 1);
+
+            for (cqes[0..copied]) |cqe| {
+                const op: usize = @intCast(cqe.user_data);
+
+                ops.complete(op, cqe.res) catch |err| {
+                    if (first_error == null) {
+                        first_error = err;
+                        failed_op.* = op;
+                    }
+                };
+            }
+
+            done += copied;
+        }
+
+        next += batch;
+    }
+
+    if (first_error) |err| return err;
+}
+
+/// Closes every descriptor in `fds` that is open, in one batch.
+fn closeAll(ring: *linux.IoUring, fds: []linux.fd_t) void {
+    var failed_op: usize = 0;
+
+    runAll(ring, fds.len, CloseFiles{ .fds = fds }, &failed_op) catch {};
+
+    // anything the ring could not take is closed one at a time
+    for (fds) |fd| {
+        if (fd >= 0) std.posix.close(fd);
+    }
+}
+
+const CloseFiles = struct {
+    fds: []linux.fd_t,
+
+    fn prepare(self: CloseFiles, ring: *linux.IoUring, op: usize) !void {
+        // keeps the operations and completions lined up
+        if (self.fds[op] < 0) {
+            _ = try ring.nop(op);
+            return;
+        }
+
+        _ = try ring.close(op, self.fds[op]);
+    }
+
+    fn complete(self: CloseFiles, op: usize, res: i32) !void {
+        _ = res;
+
+        // a descriptor is gone even when closing it failed
+        self.fds[op] = -1;
+    }
+};
+
+/// Opens files and finds their sizes, two operations per file.
+const OpenForRead = struct {
+    dir: linux.fd_t,
+    names: []const [:0]const u8,
+    fds: []linux.fd_t,
+    stats: []linux.Statx,
+
+    fn prepare(self: OpenForRead, ring: *linux.IoUring, op: usize) !void {
+        const i = op / 2;
+
+        if (op % 2 == 0) {
+            _ = try ring.openat(op, self.dir, self.names[i], .{ .ACCMODE = .RDONLY, .CLOEXEC = true }, 0);
+        } else {
+            _ = try ring.statx(op, self.dir, self.names[i], 0, linux.STATX_SIZE, &self.stats[i]);
+        }
+    }
+
+    fn complete(self: OpenForRead, op: usize, res: i32) !void {
+        const value = try check(res);
+
+        if (op % 2 == 0) self.fds[op / 2] = @intCast(value);
+    }
+};
+
+/// Reads what is left of the files in `pending`.
+const ReadRest = struct {
+    fds: []const linux.fd_t,
+    contents: []const []u8,
+    filled: []usize,
+
+    /// Set for files that ended before their size, they shrank since they were opened
+    ended: []bool,
+
+    pending: []const usize,
+
+    fn prepare(self: ReadRest, ring: *linux.IoUring, op: usize) !void {
+        const i = self.pending[op];
+
+        _ = try ring.read(op, self.fds[i], .{ .buffer = self.contents[i][self.filled[i]..] }, self.filled[i]);
+    }
+
+    fn complete(self: ReadRest, op: usize, res: i32) !void {
+        const i = self.pending[op];
+        const read = try check(res);
+
+        if (read == 0) self.ended[i] = true;
+        self.filled[i] += read;
+    }
+};
+
+fn readWithRing(allocator: std.mem.Allocator, ring: *linux.IoUring, dir: std.fs.Dir, paths: []const []const u8) ReadResult {
+    var failed_op: usize = 0;
+
+    const contents = readAllWithRing(allocator, ring, dir, paths, &failed_op) catch |err| {
+        const path = if (paths.len > 0) paths[@min(failed_op / 2, paths.len - 1)] else "";
+        return .{ .failed = .{ .path = path, .err = err } };
+    };
+
+    return .{ .ok = contents };
+}
+
+fn readAllWithRing(allocator: std.mem.Allocator, ring: *linux.IoUring, dir: std.fs.Dir, paths: []const []const u8, failed_op: *usize) ![][]u8 {
+    var scratch = std.heap.ArenaAllocator.init(allocator);
+    defer scratch.deinit();
+
+    const temporary = scratch.allocator();
+    const count = paths.len;
+
+    const names = try temporary.alloc([:0]const u8, count);
+
+    for (names, paths) |*name, path| {
+        name.* = try temporary.dupeZ(u8, path);
+    }
+
+    const fds = try temporary.alloc(linux.fd_t, count);
+    @memset(fds, -1);
+    defer closeAll(ring, fds);
+
+    const stats = try temporary.alloc(linux.Statx, count);
+
+    // open and size every file at once
+    try runAll(ring, count * 2, OpenForRead{ .dir = dir.fd, .names = names, .fds = fds, .stats = stats }, failed_op);
+
+    const contents = try allocator.alloc([]u8, count);
+    var allocated: usize = 0;
+
+    errdefer {
+        freeContents(allocator, contents[0..allocated]);
+        allocator.free(contents);
+    }
+
+    for (contents, stats) |*content, stat| {
+        content.* = try allocator.alloc(u8, @intCast(stat.size));
+        allocated += 1;
+    }
+
+    const filled = try temporary.alloc(usize, count);
+    @memset(filled, 0);
+
+    const ended = try temporary.alloc(bool, count);
+    @memset(ended, false);
+
+    var pending = try std.ArrayList(usize).initCapacity(temporary, count);
+
+    for (contents, 0..) |content, i| {
+        if (content.len > 0) pending.appendAssumeCapacity(i);
+    }
+
+    // reads can come back short, read the rest until every file is full
+    while (pending.items.len > 0) {
+        var failed_read: usize = 0;
+
+        runAll(ring, pending.items.len, ReadRest{
+            .fds = fds,
+            .contents = contents,
+            .filled = filled,
+            .ended = ended,
+            .pending = pending.items,
+        }, &failed_read) catch |err| {
+            failed_op.* = pending.items[failed_read] * 2;
+            return err;
+        };
+
+        var kept: usize = 0;
+
+        for (pending.items) |i| {
+            if (filled[i] < contents[i].len and !ended[i]) {
+                pending.items[kept] = i;
+                kept += 1;
+            }
+        }
+
+        pending.shrinkRetainingCapacity(kept);
+    }
+
+    for (contents, filled) |*content, size| {
+        if (size < content.len) content.* = try allocator.realloc(content.*, size);
+    }
+
+    return contents;
+}
+
+/// Creates (or truncates) files for writing, one operation per file.
+const OpenForWrite = struct {
+    dir: linux.fd_t,
+    names: []const [:0]const u8,
+    fds: []linux.fd_t,
+
+    fn prepare(self: OpenForWrite, ring: *linux.IoUring, op: usize) !void {
+        _ = try ring.openat(op, self.dir, self.names[op], .{ .ACCMODE = .WRONLY, .CREAT = true, .TRUNC = true, .CLOEXEC = true }, 0o666);
+    }
+
+    fn complete(self: OpenForWrite, op: usize, res: i32) !void {
+        self.fds[op] = @intCast(try check(res));
+    }
+};
+
+/// Writes what is left of the files in `pending`.
+const WriteRest = struct {
+    fds: []const linux.fd_t,
+    writes: []const Write,
+    written: []usize,
+    pending: []const usize,
+
+    fn prepare(self: WriteRest, ring: *linux.IoUring, op: usize) !void {
+        const i = self.pending[op];
+
+        _ = try ring.write(op, self.fds[i], self.writes[i].bytes[self.written[i]..], self.written[i]);
+    }
+
+    fn complete(self: WriteRest, op: usize, res: i32) !void {
+        const i = self.pending[op];
+        const written = try check(res);
+
+        // nothing written while bytes are left, the disk is full
+        if (written == 0) return error.NoSpaceLeft;
+
+        self.written[i] += written;
+    }
+};
+
+fn writeWithRing(allocator: std.mem.Allocator, ring: *linux.IoUring, dir: std.fs.Dir, writes: []const Write) ?Failure {
+    var failed: usize = 0;
+
+    writeAllWithRing(allocator, ring, dir, writes, &failed) catch |err| {
+        const path = if (writes.len > 0) writes[@min(failed, writes.len - 1)].path else "";
+        return Failure{ .path = path, .err = err };
+    };
+
+    return null;
+}
+
+fn writeAllWithRing(allocator: std.mem.Allocator, ring: *linux.IoUring, dir: std.fs.Dir, writes: []const Write, failed: *usize) !void {
+    var scratch = std.heap.ArenaAllocator.init(allocator);
+    defer scratch.deinit();
+
+    const temporary = scratch.allocator();
+    const count = writes.len;
+
+    const names = try temporary.alloc([:0]const u8, count);
+
+    for (names, writes) |*name, write| {
+        name.* = try temporary.dupeZ(u8, write.path);
+    }
+
+    const fds = try temporary.alloc(linux.fd_t, count);
+    @memset(fds, -1);
+    defer closeAll(ring, fds);
+
+    try runAll(ring, count, OpenForWrite{ .dir = dir.fd, .names = names, .fds = fds }, failed);
+
+    const written = try temporary.alloc(usize, count);
+    @memset(written, 0);
+
+    var pending = try std.ArrayList(usize).initCapacity(temporary, count);
+
+    for (writes, 0..) |write, i| {
+        if (write.bytes.len > 0) pending.appendAssumeCapacity(i);
+    }
+
+    // writes can come back short as well
+    while (pending.items.len > 0) {
+        var failed_write: usize = 0;
+
+        runAll(ring, pending.items.len, WriteRest{
+            .fds = fds,
+            .writes = writes,
+            .written = written,
+            .pending = pending.items,
+        }, &failed_write) catch |err| {
+            failed.* = pending.items[failed_write];
+            return err;
+        };
+
+        var kept: usize = 0;
+
+        for (pending.items) |i| {
+            if (written[i] < writes[i].bytes.len) {
+                pending.items[kept] = i;
+                kept += 1;
+            }
+        }
+
+        pending.shrinkRetainingCapacity(kept);
+    }
+}
+
+fn expectRoundTrip(backend: Backend) !void {
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+
+    const writes = [_]Write{
+        .{ .path = "a.bin", .bytes = "first" },
+        .{ .path = "empty.bin", .bytes = "" },
+        .{ .path = "b.bin", .bytes = "x" ** 5000 },
+    };
+
+    try std.testing.expectEqual(null, writeFiles(std.testing.allocator, tmp.dir, &writes, backend));
+
+    const paths = [_][]const u8{ "b.bin", "a.bin", "empty.bin" };
+
+    const contents = switch (readFiles(std.testing.allocator, tmp.dir, &paths, backend)) {
+        .ok => |contents| contents,
+        .failed => |failure| return failure.err,
+    };
+
+    defer {
+        freeContents(std.testing.allocator, contents);
+        std.testing.allocator.free(contents);
+    }
+
+    try std.testing.expectEqualStrings("x" ** 5000, contents[0]);
+    try std.testing.expectEqualStrings("first", contents[1]);
+    try std.testing.expectEqualStrings("", contents[2]);
+}
+
+test readFiles {
+    // io_uring falls back to syscalls where it is not available, both have to give the same files
+    try expectRoundTrip(.syscalls);
+    try expectRoundTrip(.io_uring);
+}
+
+test "batches that fail" {
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+
+    try tmp.dir.writeFile(.{ .sub_path = "here.asm", .data = "_start: mov R1, 1\n" });
+
+    const paths = [_][]const u8{ "here.asm", "missing.asm" };
+
+    for ([_]Backend{ .syscalls, .io_uring }) |backend| {
+        const res = readFiles(std.testing.allocator, tmp.dir, &paths, backend);
+
+        try std.testing.expectEqualStrings("missing.asm", res.failed.path);
+        try std.testing.expectEqual(error.FileNotFound, res.failed.err);
+
+        // the directory does not exist
+        const failure = writeFiles(std.testing.allocator, tmp.dir, &.{.{ .path = "nowhere/out.bin", .bytes = "1" }}, backend).?;
+
+        try std.testing.expectEqualStrings("nowhere/out.bin", failure.path);
+        try std.testing.expectEqual(error.FileNotFound, failure.err);
+    }
+}
+
+test Probe {
+    var probe = Probe{ .last_op = @intFromEnum(linux.IORING_OP.READ) };
+    probe.ops[@intFromEnum(linux.IORING_OP.READ)].flags = Probe.op_supported;
+
+    try std.testing.expect(probe.supports(.READ));
+    try std.testing.expect(!probe.supports(.NOP));
+
+    // past the last opcode the kernel knows
+    probe.ops[@intFromEnum(linux.IORING_OP.WRITE)].flags = Probe.op_supported;
+    try std.testing.expect(!probe.supports(.WRITE));
+}
+
+test Outputs {
+    var outputs = Outputs.init(std.testing.allocator);
+    defer outputs.deinit();
+
+    var bytes = [_]u8{ 1, 2, 3 };
+    try outputs.add("out.bin", &bytes);
+
+    // the outputs keep a copy
+    bytes[0] = 9;
+
+    try std.testing.expectEqualSlices(u8, &.{ 1, 2, 3 }, outputs.writes.items[0].bytes);
+}
@@ -13,6 +13,9 @@
 //! Code generation stage is meant to generate actual byte code depending on the Vendor struct and the given
 //! instruction set.
 //!
+//! Codegen reads the format-neutral program from `ir.zig` rather than the syntax tree, so one parse can be
+//! generated for several formats at once.
+//!
 
 const std = @import("std");
 const peephole = @import("peephole.zig");
@@ -20,6 +23,14 @@ const instruction_result = @import("instruction_result.zig");
 const lex = @import("lexer.zig");
 const parse = @import("parser.zig");
 const token_stream = @import("token_stream.zig");
+const trace = @import("trace.zig");
+const source_map = @import("source_map.zig");
+const profile = @import("profile.zig");
+const ir = @import("ir.zig");
+const registers = @import("registers.zig");
+const layout = @import("layout.zig");
+const archive = @import("archive.zig");
+const codegen_cache = @import("codegen_cache.zig");
 
 const Lexer = lex.Lexer;
 const LexerArea = lex.LexerArea;
@@ -45,6 +56,9 @@ pub const InstructionError = error{
     TestExpectedEqual,
     InstructionError,
     ParamsToInstructionAreWrong,
+
+    /// More procedures are referenced than an index can address (see `Vendor.procedureReference`)
+    TooManyProcedures,
 };
 
 pub const CodegenError = error{
@@ -205,31 +219,87 @@ pub fn Generator(comptime T: type) type {
     };
 }
 
-/// Best to allocate with an arena.
+/// How a format prints a run of `echo`s from a register instead: empty the register, fill it with
+/// every byte of the run in one instruction, print it. Long messages then dispatch three
+/// instructions instead of one per character. The sizes make up the cost model that decides which
+/// runs are worth it.
+pub const EchoBuffer = struct {
+    /// Empties a register, taking the register
+    reset: []const u8,
+
+    /// Adds any number of bytes to a register, taking the register and then the bytes
+    fill: []const u8,
+
+    /// Prints a register, taking the register
+    print: []const u8,
+
+    /// Binary elements of an `echo` of a single byte
+    echo_size: usize,
+
+    /// Binary elements of the three instructions, without the bytes of the run
+    overhead: usize,
+
+    /// Instructions a buffered run dispatches, however long it is
+    pub const instructions = 3;
+
+    /// Is printing `bytes` from a register both fewer instructions and no larger than echoing them
+    /// one at a time?
+    pub fn pays(self: EchoBuffer, bytes: usize) bool {
+        return bytes > instructions and bytes + self.overhead <= bytes * self.echo_size;
+    }
+};
+
+/// The number of bytes an `echo` statement prints, when it can be part of a buffered run.
+/// Escapes that are not understood and the nul byte (which ends a fill early) stay `echo`s.
+fn echoedLength(statement: ir.Statement) ?usize {
+    if (statement != .instruction) return null;
+
+    const ins = statement.instruction;
+
+    if (!std.mem.eql(u8, ins.name.toString(), "echo")) return null;
+    if (ins.operands.len != 1 or ins.operands[0] != .literal) return null;
+
+    var characters = ins.operands[0].literal.iterator();
+    var length: usize = 0;
+
+    while (characters.next() catch return null) |byte| {
+        if (byte == 0) return null;
+        length += 1;
+    }
+
+    return if (length == 0) null else length;
+}
+
+/// The instruction set of a format: its instructions, their annotations and the bytes placed
+/// around them.
 ///
-/// A VENDOR for text -> instructions and macros. It is safest to run using an arena allocator, and parent to the desired
-/// allocator. Reason being memory will become more complex and hard to manage as the data structure grows. So it's
-/// best to just use an arena and save the trouble.
+/// An ISA is built once (see the drivers in `platforms/`) and is read-only afterwards, so one
+/// ISA can be shared by any number of compiles, on any number of threads. Everything a single
+/// compile changes lives in its `Vendor`.
 ///
-pub fn Vendor(comptime format_type: type) type {
+/// ```zig
+/// var isa = Isa(i8).init(allocator);
+/// try drivers.openlud.vendor(&isa);
+///
+/// var vend1 = Vendor(i8).init(allocator, &isa);
+/// ```
+pub fn Isa(comptime format_type: type) type {
     return struct {
         const Self = @This();
 
         /// the parent allocator.
         parent_allocator: std.mem.Allocator,
 
-        /// The procedure map holds `name` -> `binary`. Essentially the .sections section in the file
-        procedure_map: std.StringHashMap(std.ArrayList(format_type)),
-
         /// The list of strings to instructions. These
         /// are ran with their respective parameters.
         instruction_set: std.StringHashMap(Instruction(format_type)),
 
-        /// The dead code eliminator
-        peephole_optimizer: peephole.PeepholeOptimizer(format_type),
+        /// A map of annotations.
+        annotations: std.StringHashMap(Annotation),
 
-        /// Values as replacements for other values.
-        expandables: std.StringHashMap(Value) = undefined,
+        /// How instructions use their register operands. Instructions without one are barriers
+        /// to register optimizations (see `registers.zig`).
+        effects: std.StringHashMap(registers.Effect),
 
         /// Place a NULL byte at the end of an instruction binary?
         nul_after_sequence: bool = false,
@@ -239,36 +309,27 @@ pub fn Vendor(comptime format_type: type) type {
         procedure_add_end: bool = false,
         end_byte: format_type = 0,
 
-        /// A list of instruction results ran from each instruction.
-        results: std.ArrayList(InstructionResult),
-
-        /// A map of annotations.
-        annotations: std.StringHashMap(Annotation) = undefined,
+        /// Prints runs of `echo` from a register, see `Vendor.buffer_echoes`. Null when the format
+        /// can not fill a register with several bytes at once.
+        echo_buffer: ?EchoBuffer = null,
 
         pub fn init(parent_allocator: std.mem.Allocator) Self {
             return Self{
                 .parent_allocator = parent_allocator,
-                .peephole_optimizer = peephole.PeepholeOptimizer(format_type).init(parent_allocator),
-
-                .results = std.ArrayList(InstructionResult).init(parent_allocator),
-
-                .expandables = std.StringHashMap(Value).init(parent_allocator),
                 .instruction_set = std.StringHashMap(Instruction(format_type)).init(parent_allocator),
-                .procedure_map = std.StringHashMap(std.ArrayList(format_type)).init(parent_allocator),
                 .annotations = std.StringHashMap(Annotation).init(parent_allocator),
+                .effects = std.StringHashMap(registers.Effect).init(parent_allocator),
             };
         }
 
         pub fn deinit(self: *Self) void {
-            self.procedure_map.deinit();
             self.instruction_set.deinit();
-            self.peephole_optimizer.deinit();
             self.annotations.deinit();
-            self.results.deinit();
+            self.effects.deinit();
         }
 
         /// Puts `name` to `instruction`
-        pub fn implementInstruction(self: *Self, name: []const u8, instruction: *Instruction(format_type)) !void {
+        pub fn implementInstruction(self: *Self, name: []const u8, instruction: *const Instruction(format_type)) !void {
             try self.instruction_set.put(name, instruction.*);
         }
 
@@ -307,6 +368,11 @@ pub fn Vendor(comptime format_type: type) type {
             try self.registerAnnotation(name, type_list);
         }
 
+        /// Describes how the instruction `for_function` uses its register operands.
+        pub fn registerEffect(self: *Self, for_function: []const u8, effect: registers.Effect) !void {
+            try self.effects.put(for_function, effect);
+        }
+
         pub fn registerAnnotation(self: *Self, for_function: []const u8, type_list: []const Type) !void {
             try self.annotations.put(for_function, Annotation.init(
                 self.parent_allocator,
@@ -314,181 +380,706 @@ pub fn Vendor(comptime format_type: type) type {
             ));
         }
 
+        /// Checks `ins` the way codegen does before generating it: the instruction exists, its
+        /// registers fit the format and its operands match the annotation. Null when it can be
+        /// generated. Only reads the ISA, so a single procedure can be checked on its own.
+        pub fn checkInstruction(self: *const Self, ins: ir.Instruction) ?Result {
+            if (!self.instruction_set.contains(ins.name.toString())) {
+                return Result{
+                    .instruction_doesnt_exist = ins.name.span,
+                };
+            }
+
+            for (ins.operands) |it| {
+                if (it.getType() == .register and it.toRegister().getRegisterNumber() > std.math.maxInt(format_type)) {
+                    return Result{
+                        .register_number_too_large = it.toRegister(),
+                    };
+                }
+            }
+
+            const annotation = self.annotations.get(ins.name.toString()) orelse return null;
+
+            // conditions for annotations
+            // the param list and annotation list must be the same len
+            // they must have the same types
+            // annotation list and check it against the param list
+            // if its a multiple type, check for either type.
+
+            if (ins.operands.len < annotation.type_list.items.len) {
+                return Result{
+                    .too_little_params = TooLittleInfoEr{
+                        .annotation = annotation,
+                        .name = ins.name.toString(),
+                        .span = ins.name.span,
+                    },
+                };
+            }
+
+            // operands past the annotation are left to the instruction
+            for (ins.operands[0..annotation.type_list.items.len], annotation.type_list.items) |it, cur_annot| {
+                // if any type can be a parameter, skip
+                if (cur_annot.getParamType() == .any) continue;
+
+                if (cur_annot.getParamType() == .single_type) {
+                    if (it.getType() != cur_annot.asSingleType()) {
+                        return Result{
+                            .params_to_instruction_are_wrong = Mismatch{
+                                .expected = cur_annot.asSingleType(),
+                                .actual = it.getType(),
+                                .span = it.getSpan(),
+                            },
+                        };
+                    }
+                } else {
+                    // TODO: check for multiple types
+                }
+            }
+
+            return null;
+        }
+    };
+}
+
+/// Best to allocate with an arena.
+///
+/// The state of a single compile: text -> instructions and macros, using a shared `Isa`. It is safest to run using an
+/// arena allocator, and parent to the desired allocator. Reason being memory will become more complex and hard to manage
+/// as the data structure grows. So it's best to just use an arena and save the trouble.
+///
+/// A vendor is cheap to create. Compiles running at the same time each get their own vendor over the same ISA.
+///
+pub fn Vendor(comptime format_type: type) type {
+    return struct {
+        const Self = @This();
+
+        /// the parent allocator.
+        parent_allocator: std.mem.Allocator,
+
+        /// The instruction set. Shared, never changed by codegen.
+        isa: *const Isa(format_type),
+
+        /// The procedure map holds `name` -> `binary`. Essentially the .sections section in the file
+        procedure_map: std.StringHashMap(std.ArrayList(format_type)),
+
+        /// The dead code eliminator
+        peephole_optimizer: peephole.PeepholeOptimizer(format_type),
+
+        /// A list of instruction results ran from each instruction.
+        results: std.ArrayList(InstructionResult),
+
+        /// Receives a trace event for every generated procedure. Null disables tracing.
+        tracer: ?*trace.Tracer = null,
+
+        /// Refer to procedures by a dense index instead of the first letter of their name.
+        /// Linked with `Linker.linkIndexedWithContext`.
+        index_procedures: bool = false,
+
+        /// Procedure name -> index, in the order procedures were first defined or referenced.
+        procedure_indices: std.StringArrayHashMap(void),
+
+        /// Receives the source segments of every generated procedure. Null disables source maps.
+        source_map: ?*source_map.SourceMap = null,
+
+        /// Execution counts from `--profile-use`. Null folds every procedure call.
+        profile: ?*const profile.Profile = null,
+
+        /// Record how every generated instruction uses registers, in `accesses`. Needed by the
+        /// dead write pass (see `passes.zig`).
+        track_registers: bool = false,
+
+        /// Procedure name -> the register accesses of its instructions, in order. Only filled
+        /// when `track_registers` is set.
+        accesses: std.StringHashMap(std.ArrayList(registers.Access)),
+
+        /// Resolve references to forwarding procedures to the procedure they end up calling (see
+        /// `ir.Program.findForwards`). Needs `call_instruction`.
+        thread_jumps: bool = false,
+
+        /// Forwarding procedure -> the procedure references to it resolve to.
+        forwards: std.StringHashMap([]const u8),
+
+        /// The instruction that calls a procedure, taking its name. When the profile says a
+        /// procedure is cold, calls to it use this instead of folding the procedure in. Only set
+        /// for formats that keep procedures in the binary (non-folded).
+        call_instruction: ?[]const u8 = null,
+
+        /// Which procedure references which, and how often. The linker places procedures by it
+        /// (see `layout.zig`).
+        call_graph: layout.CallGraph,
+
+        /// The procedure being generated, the caller of every procedure reference.
+        current_procedure: []const u8 = "",
+
+        /// Print runs of `echo` from a register the program never names, when the format has an
+        /// `Isa.echo_buffer` and its cost model says the run pays.
+        buffer_echoes: bool = false,
+
+        /// The register buffered runs go through. Null when runs are not buffered, the program
+        /// names every register, or it folds in library procedures, whose registers are unknown.
+        echo_register: ?usize = null,
+
+        /// How many runs of `echo` were buffered, for `-Ostats`. Runs of cached procedures are
+        /// not counted.
+        buffered_runs: usize = 0,
+
+        /// Libraries generated for this format (`-l`). Instructions the format does not have are
+        /// looked up in them, in order, and folded in like procedures (see `archive.zig`).
+        libraries: []const archive.Library = &.{},
+
+        /// Keeps what was generated of every procedure between compiles (`--codegen-cache`, see
+        /// `codegen_cache.zig`). Null generates every procedure.
+        cache: ?*codegen_cache.Cache = null,
+
+        /// The cache key of every procedure generated so far, hashed into the keys of the
+        /// procedures that fold it in.
+        cache_keys: std.StringHashMap(codegen_cache.Key),
+
+        pub fn init(parent_allocator: std.mem.Allocator, isa: *const Isa(format_type)) Self {
+            return Self{
+                .parent_allocator = parent_allocator,
+                .isa = isa,
+                .peephole_optimizer = peephole.PeepholeOptimizer(format_type).init(parent_allocator),
+
+                .results = std.ArrayList(InstructionResult).init(parent_allocator),
+
+                .procedure_map = std.StringHashMap(std.ArrayList(format_type)).init(parent_allocator),
+                .procedure_indices = std.StringArrayHashMap(void).init(parent_allocator),
+                .accesses = std.StringHashMap(std.ArrayList(registers.Access)).init(parent_allocator),
+                .forwards = std.StringHashMap([]const u8).init(parent_allocator),
+                .call_graph = layout.CallGraph.init(parent_allocator),
+                .cache_keys = std.StringHashMap(codegen_cache.Key).init(parent_allocator),
+            };
+        }
+
+        pub fn deinit(self: *Self) void {
+            self.procedure_map.deinit();
+            self.procedure_indices.deinit();
+            self.accesses.deinit();
+            self.forwards.deinit();
+            self.call_graph.deinit();
+            self.cache_keys.deinit();
+            self.peephole_optimizer.deinit();
+            self.results.deinit();
+        }
+
+        /// The value an instruction emits to refer to the procedure `name`. Either the first letter
+        /// of the name, or its index when `index_procedures` is set. Marks the procedure as in use.
+        /// References to forwarding procedures resolve to their target when threading jumps.
+        pub fn procedureReference(self: *Self, referenced: []const u8) InstructionError!format_type {
+            // calling a forwarding procedure calls its target, the forward itself is never reached
+            const name = self.forwards.get(referenced) orelse referenced;
+
+            // a referenced procedure is in use, the optimizer has to keep it
+            try self.peephole_optimizer.remember(name);
+
+            if (self.current_procedure.len > 0) {
+                try self.call_graph.addCall(self.current_procedure, name, 1);
+            }
+
+            if (!self.index_procedures) {
+                return @intCast(name[0]);
+            }
+
+            const entry = try self.procedure_indices.getOrPut(name);
+
+            return std.math.cast(format_type, entry.index) orelse error.TooManyProcedures;
+        }
+
+        /// Does any instruction of `program` stand for a library procedure? Libraries only hold
+        /// binaries, so the registers their procedures use are not known.
+        fn foldsLibraryProcedures(self: *const Self, program: *const ir.Program) archive.Error!bool {
+            if (self.libraries.len == 0) return false;
+
+            for (program.procedures.items) |procedure| {
+                for (procedure.statements.items) |statement| {
+                    if (statement != .instruction) continue;
+
+                    if (try self.libraryProcedure(statement.instruction) != null) return true;
+                }
+            }
+
+            return false;
+        }
+
+        /// The binary of the library procedure `ins` stands for, when the format has no instruction
+        /// of its name. Library procedures take no operands.
+        fn libraryProcedure(self: *const Self, ins: ir.Instruction) archive.Error!?[]const u8 {
+            const name = ins.name.toString();
+
+            if (self.libraries.len == 0 or ins.operands.len > 0 or self.isa.instruction_set.contains(name)) {
+                return null;
+            }
+
+            for (self.libraries) |*library| {
+                if (library.element_size != @sizeOf(format_type)) continue;
+
+                if (try library.find(name)) |binary| return binary;
+            }
+
+            return null;
+        }
+
         /// Populates the vendor's procedure map with instructions by running their
-        /// respective functions.
+        /// respective functions. Lowers `node` on the way, see `generateProgram` to generate
+        /// an already lowered program.
         pub fn generateBinary(self: *Self, node: Node) !Result {
-            switch (node) {
-                .root => |*root_node| {
-                    for (root_node.children.items) |*child| {
-                        switch (child.*) {
-                            .procedure => |*proc| {
-                                const res = try self.generateBinaryProcedure(proc);
-
-                                switch (res) {
-                                    .ok => {}, // continue
-                                    else => {
-                                        return res;
-                                    },
-                                }
-                            },
+            var program = try ir.lower(self.parent_allocator, node);
+            defer program.deinit();
 
-                            // ignore macros, that's for the macro stage
-                            .macro => |_| {},
+            return self.generateProgram(&program);
+        }
 
-                            .aside => |*aside| {
-                                try self.runAside(aside);
-                            },
+        /// Populates the vendor's procedure map from a lowered program. The program is only read,
+        /// so vendors for different formats can generate from the same one at once.
+        pub fn generateProgram(self: *Self, program: *const ir.Program) !Result {
+            if (self.thread_jumps) {
+                if (self.call_instruction) |call_instruction| {
+                    self.forwards.deinit();
+                    self.forwards = try program.findForwards(self.parent_allocator, call_instruction);
+                }
+            }
 
-                            else => {
-                                return error.InvalidExpressionRoot;
-                            },
-                        }
+            self.echo_register = null;
+
+            if (self.buffer_echoes) {
+                if (self.isa.echo_buffer) |buffer| {
+                    // a format narrowed down to a common instruction set may have lost some of them
+                    const has_instructions = self.isa.instruction_set.contains(buffer.reset) and
+                        self.isa.instruction_set.contains(buffer.fill) and
+                        self.isa.instruction_set.contains(buffer.print);
+
+                    if (has_instructions and !try self.foldsLibraryProcedures(program)) {
+                        self.echo_register = program.findUnusedRegister(std.math.maxInt(format_type));
                     }
-                },
+                }
+            }
 
-                else => {},
+            for (program.procedures.items) |*procedure| {
+                const res = try self.generateBinaryProcedure(procedure);
+
+                switch (res) {
+                    .ok => {}, // continue
+                    else => {
+                        return res;
+                    },
+                }
             }
 
             return Result{ .ok = 0 };
         }
 
-        /// Generates the memory layout of a procedure. Iterates the instructions and runs them
+        /// Generates the memory layout of a procedure. Iterates the statements and runs them
         /// one by one in order, populating their space in the procedure map in the process.
         ///
-        /// This function will also take into account instructions that are a part of the
-        /// procedure map, and also run those accordingly. User-defined procedures have higher
+        /// Calls to procedures fold the procedure in, unless the profile says it is cold. Lowering
+        /// already decided which statements are calls, user-defined procedures have higher
         /// precedent over instruction set procedures.
         ///
-        pub fn generateBinaryProcedure(self: *Self, child: *Procedure) !Result {
-            const procedure_name = child.header;
+        pub fn generateBinaryProcedure(self: *Self, procedure: *const ir.Procedure) !Result {
+            const procedure_name = procedure.name;
+
+            const scope = trace.begin(self.tracer, "codegen", procedure_name);
+            defer scope.end();
+
+            self.current_procedure = procedure_name;
+            defer self.current_procedure = "";
+
+            // definitions take the next index, unless the procedure was referenced before
+            if (self.index_procedures) {
+                _ = try self.procedure_indices.getOrPut(procedure_name);
+            }
+
+            const key = try self.cacheKey(procedure);
+
+            if (key) |it| {
+                if (try self.loadCached(procedure, it)) return Result{ .ok = 0 };
+            }
+
+            // every edge after these is a reference of this procedure
+            const edges_before = self.call_graph.edges.count();
+
             var generator = Generator(format_type).init(self.parent_allocator);
 
-            for (child.children.items[0..]) |call| {
-                switch (call) {
-                    // if its an instruction call
-                    .instruction_call => |ins| {
-                        if (self.procedure_map.get(ins.name.identifier_string)) |proc| {
+            // only filled when there is a source map
+            var segments = std.ArrayList(source_map.Segment).init(self.parent_allocator);
+
+            // only filled when tracking registers
+            var accesses = std.ArrayList(registers.Access).init(self.parent_allocator);
+
+            // statements already generated as part of a buffered echo run
+            var skip_until: usize = 0;
+
+            for (procedure.statements.items, 0..) |statement, index| {
+                if (index < skip_until) continue;
+
+                const run = self.echoRunAt(procedure.statements.items, index);
+
+                if (run > 0) {
+                    const res = try self.generateEchoRun(&generator, procedure.statements.items[index .. index + run], &segments, &accesses);
+
+                    switch (res) {
+                        .ok => {},
+                        else => return res,
+                    }
+
+                    skip_until = index + run;
+                    continue;
+                }
+
+                const name = statement.name();
+                const instruction_begin = generator.binary.items.len;
+
+                // a barrier, unless the instruction has an effect
+                var access = registers.Access{};
+
+                // library procedures end in nul bytes of their own
+                var ends_sequence = true;
+
+                switch (statement) {
+                    .call => |callee| {
+                        if (self.coldCallInstruction(callee.toString())) |call_instruction| {
+                            // cold procedures are called, their body stays in the binary once
+                            var call_args = [_]Value{Value{ .identifier = callee }};
+
+                            const res = try call_instruction.function(&generator, self, call_args[0..]);
+
+                            if (self.track_registers) {
+                                access = registers.Access.of(self.isa.effects.get(call_instruction.name), call_args[0..]);
+                            }
+
+                            switch (res) {
+                                .ok => {},
+
+                                else => {
+                                    return Result{
+                                        .instruction_coughed_up_bad_result = res,
+                                    };
+                                },
+                            }
+                        } else {
+                            // procedures can only call the ones before them, an object file can
+                            // still name any procedure
+                            const proc = self.procedure_map.get(callee.toString()) orelse {
+                                return Result{
+                                    .instruction_doesnt_exist = callee.span,
+                                };
+                            };
+
+                            if (self.source_map) |map| {
+                                try map.foldInto(&segments, callee.toString(), generator.binary.items.len);
+                            }
+
+                            if (self.accesses.get(callee.toString())) |callee_accesses| {
+                                try registers.foldInto(&accesses, callee_accesses.items, generator.binary.items.len);
+                            }
+
+                            // the references in the folded body are now made from here
+                            try self.call_graph.addFolded(procedure_name, callee.toString());
+
                             for (proc.items) |byt| {
                                 try generator.append(byt);
                             }
 
                             // that instruction has been expanded once and is in use
-                            try self.peephole_optimizer.remember(ins.name.identifier_string);
-                        } else {
-                            // create a mock parameters object to
-                            // manage expanded variables
-                            var params_clone = std.ArrayList(Value).init(self.parent_allocator);
-                            defer params_clone.deinit();
-
-                            // copy each parameter into this clone
-                            for (ins.parameters.items) |it| {
-                                // if its an identifier
-                                if (it.getType() == .identifier) {
-                                    // and it exists
-                                    if (self.expandables.get(it.toIdentifier().identifier_string)) |value| {
-                                        try params_clone.append(value);
-                                        continue;
-                                    }
-
-                                    try params_clone.append(it);
-                                } else {
-                                    // otherwise append it anyway regular
-                                    try params_clone.append(it);
-                                }
+                            try self.peephole_optimizer.remember(callee.toString());
+
+                            continue;
+                        }
+                    },
+
+                    .instruction => |ins| {
+                        const parameters = ins.operands;
+
+                        // an instruction the format does not have may be a procedure of a library
+                        if (try self.libraryProcedure(ins)) |binary| {
+                            for (0..binary.len / @sizeOf(format_type)) |i| {
+                                try generator.append(archive.element(format_type, binary, i));
                             }
 
-                            const parameters = params_clone;
-
-                            // Try to get a built-in instruction
-                            if (self.instruction_set.get(ins.name.identifier_string)) |map_item| {
-                                for (parameters.items) |it| {
-                                    if (it.getType() == .register and it.toRegister().getRegisterNumber() > std.math.maxInt(format_type)) {
-                                        return Result{
-                                            .register_number_too_large = it.toRegister(),
-                                        };
-                                    }
-                                }
-
-                                if (self.annotations.get(ins.name.identifier_string)) |annotation| {
-                                    // conditions for annotations
-                                    // the param list and annotation list must be the same len
-                                    // they must have the same types
-                                    // annotation list and check it against the param list
-                                    // if its a multiple type, check for either type.
-
-                                    if (parameters.items.len < annotation.type_list.items.len) {
-                                        return Result{
-                                            .too_little_params = TooLittleInfoEr{
-                                                .annotation = annotation,
-                                                .name = ins.name.identifier_string,
-                                                .span = ins.name.span,
-                                            },
-                                        };
-                                    }
-
-                                    for (0..parameters.items.len) |i| {
-                                        const it = parameters.items[i];
-                                        const cur_annot = annotation.type_list.items[i];
-
-                                        // if any type can be a parameter, skip
-                                        if (cur_annot.getParamType() == .any) continue;
-
-                                        if (cur_annot.getParamType() == .single_type) {
-                                            if (it.getType() != cur_annot.asSingleType()) {
-                                                return Result{
-                                                    .params_to_instruction_are_wrong = Mismatch{
-                                                        .expected = cur_annot.asSingleType(),
-                                                        .actual = it.getType(),
-                                                        .span = it.getSpan(),
-                                                    },
-                                                };
-                                            }
-                                        } else {
-                                            // TODO: check for multiple types
-                                        }
-                                    }
-                                }
-
-                                const res = try map_item.function(&generator, self, params_clone.items[0..]);
-
-                                switch (res) {
-                                    .ok => {},
-
-                                    else => {
-                                        return Result{
-                                            .instruction_coughed_up_bad_result = res,
-                                        };
-                                    },
-                                }
-                            } else {
-                                return Result{
-                                    .instruction_doesnt_exist = ins.name.span,
-                                };
+                            ends_sequence = false;
+                        } else {
+                            // the checks an editor runs as well (see `lsp.zig`)
+                            if (self.isa.checkInstruction(ins)) |res| return res;
+
+                            const map_item = self.isa.instruction_set.get(ins.name.toString()).?;
+
+                            // instructions get their own copy, the program is shared
+                            const arguments = try self.parent_allocator.dupe(Value, parameters);
+                            defer self.parent_allocator.free(arguments);
+
+                            const res = try map_item.function(&generator, self, arguments);
+
+                            if (self.track_registers) {
+                                access = registers.Access.of(self.isa.effects.get(ins.name.toString()), parameters);
                             }
 
-                            // add the null byte to the end of the function if needed
-                            if (self.nul_after_sequence) {
-                                try generator.append(self.nul_byte);
+                            switch (res) {
+                                .ok => {},
+
+                                else => {
+                                    return Result{
+                                        .instruction_coughed_up_bad_result = res,
+                                    };
+                                },
                             }
                         }
                     },
+                }
+
+                // add the null byte to the end of the function if needed
+                if (self.isa.nul_after_sequence and ends_sequence) {
+                    try generator.append(self.isa.nul_byte);
+                }
 
-                    else => {},
+                if (self.source_map != null) {
+                    try segments.append(source_map.Segment{
+                        .begin = @intCast(instruction_begin),
+                        .len = @intCast(generator.binary.items.len - instruction_begin),
+                        .span = name.span,
+                    });
+                }
+
+                if (self.track_registers) {
+                    access.begin = @intCast(instruction_begin);
+                    access.len = @intCast(generator.binary.items.len - instruction_begin);
+
+                    try accesses.append(access);
                 }
             }
 
             try self.procedure_map.put(procedure_name, generator.binary);
 
+            if (self.track_registers) {
+                try self.accesses.put(procedure_name, accesses);
+            }
+
+            if (self.source_map) |map| {
+                try map.recordProcedure(procedure_name, segments);
+            }
+
+            if (key) |it| {
+                try self.storeCached(procedure_name, it, edges_before);
+            }
+
+            return Result{ .ok = 0 };
+        }
+
+        /// The key of `procedure` in the cache. Null without a cache, or when generating the
+        /// procedure depends on more than the procedure (see `codegen_cache.zig`). Folded
+        /// procedures are generated before the procedures that fold them in, so their keys are
+        /// known. A folded procedure without one leaves its callers uncached.
+        fn cacheKey(self: *Self, procedure: *const ir.Procedure) !?codegen_cache.Key {
+            const cache = self.cache orelse return null;
+
+            if (self.source_map != null or self.index_procedures) return null;
+
+            var hasher = codegen_cache.Hasher.init(cache.format, @sizeOf(format_type));
+
+            hasher.int(@intFromBool(self.track_registers));
+            hasher.int(if (self.echo_register) |register| register + 1 else 0);
+            hasher.statements(procedure);
+
+            for (procedure.statements.items) |statement| {
+                switch (statement) {
+                    .call => |callee| {
+                        const name = callee.toString();
+
+                        if (self.coldCallInstruction(name) != null) {
+                            hasher.call(.cold);
+                            hasher.string(self.forwards.get(name) orelse name);
+                            continue;
+                        }
+
+                        // covers the binary of the callee, and the references it makes
+                        const callee_key = self.cache_keys.get(name) orelse return null;
+
+                        hasher.call(.folded);
+                        hasher.string(&callee_key);
+                    },
+
+                    .instruction => |ins| {
+                        if (try self.libraryProcedure(ins)) |binary| {
+                            hasher.string(binary);
+                            continue;
+                        }
+
+                        for (ins.operands) |operand| {
+                            if (operand != .identifier) continue;
+
+                            hasher.string(self.forwards.get(operand.identifier.toString()) orelse "");
+                        }
+                    },
+                }
+            }
+
+            const key = hasher.final();
+            try self.cache_keys.put(procedure.name, key);
+
+            return key;
+        }
+
+        /// Puts the cached binary of `procedure` into the procedure map, along with what
+        /// generating it did besides. False when it is not cached.
+        fn loadCached(self: *Self, procedure: *const ir.Procedure, key: codegen_cache.Key) !bool {
+            const entry = (try self.cache.?.load(format_type, self.parent_allocator, key)) orelse return false;
+
+            var binary = std.ArrayList(format_type).init(self.parent_allocator);
+            try binary.appendSlice(entry.binary);
+            try self.procedure_map.put(procedure.name, binary);
+
+            // tracking is part of the key, the entry has every access
+            if (self.track_registers) {
+                var accesses = std.ArrayList(registers.Access).init(self.parent_allocator);
+                try accesses.appendSlice(entry.accesses);
+                try self.accesses.put(procedure.name, accesses);
+            }
+
+            for (entry.references) |reference| {
+                try self.peephole_optimizer.remember(reference.callee);
+                try self.call_graph.addCall(procedure.name, reference.callee, reference.count);
+            }
+
+            // folding a procedure puts it in use, it makes no reference
+            for (procedure.statements.items) |statement| {
+                if (statement == .call) try self.peephole_optimizer.remember(statement.call.toString());
+            }
+
+            return true;
+        }
+
+        /// Writes what generating `procedure_name` made to the cache. The cache only saves time,
+        /// a compile does not fail when it can not be written.
+        fn storeCached(self: *Self, procedure_name: []const u8, key: codegen_cache.Key, edges_before: usize) !void {
+            var references = std.ArrayList(codegen_cache.Reference).init(self.parent_allocator);
+            defer references.deinit();
+
+            const edges = &self.call_graph.edges;
+
+            for (edges.keys()[edges_before..], edges.values()[edges_before..]) |edge, count| {
+                if (!std.mem.eql(u8, edge.caller, procedure_name)) continue;
+
+                try references.append(.{ .callee = edge.callee, .count = count });
+            }
+
+            self.cache.?.store(format_type, self.parent_allocator, key, .{
+                .binary = self.procedure_map.get(procedure_name).?.items,
+                .accesses = if (self.track_registers) self.accesses.get(procedure_name).?.items else &.{},
+                .references = references.items,
+            }) catch |err| switch (err) {
+                error.OutOfMemory => return error.OutOfMemory,
+                else => {},
+            };
+        }
+
+        /// The number of `echo`s in a row from `statements[index]` on, when buffering the bytes
+        /// they print pays. 0 otherwise.
+        fn echoRunAt(self: *const Self, statements: []const ir.Statement, index: usize) usize {
+            const buffer = self.isa.echo_buffer orelse return 0;
+
+            if (self.echo_register == null) return 0;
+
+            var run: usize = 0;
+            var bytes: usize = 0;
+
+            while (index + run < statements.len) : (run += 1) {
+                bytes += echoedLength(statements[index + run]) orelse break;
+            }
+
+            return if (run > 0 and buffer.pays(bytes)) run else 0;
+        }
+
+        /// Generates `run`, a row of `echo` statements, as a fill of the echo register and a print
+        /// of it. The run is a single source map segment.
+        fn generateEchoRun(
+            self: *Self,
+            generator: *Generator(format_type),
+            run: []const ir.Statement,
+            segments: *std.ArrayList(source_map.Segment),
+            accesses: *std.ArrayList(registers.Access),
+        ) !Result {
+            const buffer = self.isa.echo_buffer.?;
+            const register = Value{ .register = parse.Register.init(self.echo_register.?) };
+            const run_begin = generator.binary.items.len;
+
+            self.buffered_runs += 1;
+
+            const fill_args = try self.parent_allocator.alloc(Value, run.len + 1);
+            defer self.parent_allocator.free(fill_args);
+
+            fill_args[0] = register;
+
+            for (run, fill_args[1..]) |statement, *arg| {
+                arg.* = statement.instruction.operands[0];
+            }
+
+            var reset_args = [_]Value{register};
+            var print_args = [_]Value{register};
+
+            const steps = [_]struct { []const u8, []Value }{
+                .{ buffer.reset, reset_args[0..] },
+                .{ buffer.fill, fill_args },
+                .{ buffer.print, print_args[0..] },
+            };
+
+            for (steps) |step| {
+                const instruction_begin = generator.binary.items.len;
+                const instruction = self.isa.instruction_set.get(step[0]).?;
+
+                const res = try instruction.function(generator, self, step[1]);
+
+                switch (res) {
+                    .ok => {},
+
+                    else => {
+                        return Result{
+                            .instruction_coughed_up_bad_result = res,
+                        };
+                    },
+                }
+
+                if (self.isa.nul_after_sequence) {
+                    try generator.append(self.isa.nul_byte);
+                }
+
+                if (self.track_registers) {
+                    var access = registers.Access.of(self.isa.effects.get(step[0]), step[1]);
+
+                    access.begin = @intCast(instruction_begin);
+                    access.len = @intCast(generator.binary.items.len - instruction_begin);
+
+                    try accesses.append(access);
+                }
+            }
+
+            if (self.source_map != null) {
+                const first = run[0].name().span;
+                const last = run[run.len - 1].name().span;
+
+                try segments.append(source_map.Segment{
+                    .begin = @intCast(run_begin),
+                    .len = @intCast(generator.binary.items.len - run_begin),
+                    .span = .{
+                        .begin = first.begin,
+                        .len = @intCast(@min(last.end() - first.begin, std.math.maxInt(u16))),
+                    },
+                });
+            }
+
             return Result{ .ok = 0 };
         }
 
-        pub fn runAside(self: *Self, aside: *Aside) !void {
-            if (std.ascii.eqlIgnoreCase(aside.name.identifier_string, "set")) {
-                const ident_name = aside.parameters.items[0].toIdentifier().identifier_string;
-                const value = aside.parameters.items[1];
+        /// The instruction to call `procedure` with instead of folding it in. Null unless the
+        /// procedure exists and the profile says it is cold.
+        fn coldCallInstruction(self: *Self, procedure: []const u8) ?Instruction(format_type) {
+            const prof = self.profile orelse return null;
+            const call_name = self.call_instruction orelse return null;
 
-                try self.expandables.put(ident_name, value);
+            if (!self.procedure_map.contains(procedure) or prof.heatOf(procedure) != .cold) {
+                return null;
             }
+
+            return self.isa.instruction_set.get(call_name);
         }
 
         pub fn peepholeOptimizeBinary(self: *Self) !void {
@@ -497,6 +1088,9 @@ pub fn Vendor(comptime format_type: type) type {
     };
 }
 
+/// The per-compilation half of code generation, next to the shared `Isa`.
+pub const CodegenState = Vendor;
+
 // =====- Tests -===== //
 
 fn movInstructionTest(generator: *Generator(i32), vendor: *Vendor(i32), args: []Value) !InstructionResult {
@@ -568,10 +1162,11 @@ test "creating and using a vendor with 0 argument function and one statement" {
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sibc = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
 
     var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
-    try sibc.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("mov", &mov_ins);
 
     const root = try createNodeFrom(allocatir, "a: mov");
 
@@ -585,10 +1180,11 @@ test "creating and using a vendor with 0 argument function and two statements" {
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sibc = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
 
     var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
-    try sibc.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("mov", &mov_ins);
 
     const root = try createNodeFrom(allocatir, "a: mov\nmov");
 
@@ -602,10 +1198,11 @@ test "creating and using a vendor with 0 argument functions, one calling the oth
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sibc = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
 
     var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
-    try sibc.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("mov", &mov_ins);
 
     const root = try createNodeFrom(allocatir, "a: mov\nmov\n\nb: a\n");
 
@@ -617,15 +1214,221 @@ test "creating and using a vendor with 0 argument functions, one calling the oth
     try std.testing.expectEqual(2, sibc.procedure_map.get("b").?.items.len);
 }
 
+test "sharing an isa between vendors" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+    defer arena.deinit();
+
+    var isa = Isa(i32).init(allocatir);
+
+    var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
+    try isa.implementInstruction("mov", &mov_ins);
+
+    // two compiles over the same instruction tables
+    var first = Vendor(i32).init(allocatir, &isa);
+    var second = Vendor(i32).init(allocatir, &isa);
+
+    _ = try first.generateBinary(try createNodeFrom(allocatir, "a: mov"));
+    _ = try second.generateBinary(try createNodeFrom(allocatir, "b: mov\nmov"));
+
+    try std.testing.expectEqual(1, first.procedure_map.count());
+    try std.testing.expectEqual(2, second.procedure_map.get("b").?.items.len);
+    try std.testing.expect(first.procedure_map.get("b") == null);
+    try std.testing.expectEqual(1, isa.instruction_set.count());
+}
+
+test "folding library procedures" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+    defer arena.deinit();
+
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
+
+    var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
+    try isa.implementInstruction("mov", &mov_ins);
+
+    var bytes = std.ArrayList(u8).init(allocatir);
+    try archive.write(allocatir, bytes.writer(), "test", @sizeOf(i32), &.{
+        .{ .name = "twice", .binary = try archive.encode(i32, allocatir, &.{ -1, 300 }) },
+
+        // the format's own instructions come first
+        .{ .name = "mov", .binary = try archive.encode(i32, allocatir, &.{9}) },
+    });
+
+    const libraries = [_]archive.Library{try archive.Library.init(bytes.items)};
+    sibc.libraries = &libraries;
+
+    _ = try sibc.generateBinary(try createNodeFrom(allocatir, "a: mov\ntwice\nmov"));
+    try std.testing.expectEqualSlices(i32, &.{ 5, -1, 300, 5 }, sibc.procedure_map.get("a").?.items);
+
+    // still an error when no library has it
+    const res = try sibc.generateBinary(try createNodeFrom(allocatir, "b: thrice"));
+    try std.testing.expect(res == .instruction_doesnt_exist);
+}
+
+test "reusing cached procedures" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+    defer arena.deinit();
+
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+
+    var isa = Isa(i32).init(allocatir);
+
+    var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
+    try isa.implementInstruction("mov", &mov_ins);
+
+    var first_cache = codegen_cache.Cache{ .dir = tmp.dir, .format = "test" };
+    var first = Vendor(i32).init(allocatir, &isa);
+    first.cache = &first_cache;
+
+    _ = try first.generateBinary(try createNodeFrom(allocatir, "a: mov\nmov\n\nb: a\nmov\n\nc: mov"));
+    try std.testing.expectEqual(3, first_cache.misses);
+
+    // `a` changed, `b` folds it in
+    var second_cache = codegen_cache.Cache{ .dir = tmp.dir, .format = "test" };
+    var second = Vendor(i32).init(allocatir, &isa);
+    second.cache = &second_cache;
+
+    _ = try second.generateBinary(try createNodeFrom(allocatir, "a: mov\n\nb: a\nmov\n\nc: mov"));
+    try std.testing.expectEqual(1, second_cache.hits);
+    try std.testing.expectEqual(2, second_cache.misses);
+
+    try std.testing.expectEqual(2, second.procedure_map.get("b").?.items.len);
+    try std.testing.expectEqual(1, second.procedure_map.get("c").?.items.len);
+}
+
+test "cached procedures folding in procedures with other references" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+    defer arena.deinit();
+
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+
+    var isa = Isa(i32).init(allocatir);
+
+    var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
+    var call_ins = Instruction(i32).init("call", &callInstructionTest);
+    try isa.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("call", &call_ins);
+
+    var first_cache = codegen_cache.Cache{ .dir = tmp.dir, .format = "test" };
+    var first = Vendor(i32).init(allocatir, &isa);
+    first.cache = &first_cache;
+
+    _ = try first.generateBinary(try createNodeFrom(allocatir, "foo: mov\n\nfab: mov\n\na: call foo\n\nb: a"));
+
+    // `a` makes the same bytes, but references `fab` now
+    var second_cache = codegen_cache.Cache{ .dir = tmp.dir, .format = "test" };
+    var second = Vendor(i32).init(allocatir, &isa);
+    second.cache = &second_cache;
+
+    _ = try second.generateBinary(try createNodeFrom(allocatir, "foo: mov\n\nfab: mov\n\na: call fab\n\nb: a"));
+    try std.testing.expectEqual(2, second_cache.hits);
+    try std.testing.expectEqual(2, second_cache.misses);
+}
+
+test "calling a procedure that has no binary" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+    defer arena.deinit();
+
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
+
+    var program = ir.Program.init(allocatir);
+
+    var procedure = ir.Procedure{
+        .name = "a",
+        .statements = std.ArrayList(ir.Statement).init(allocatir),
+        .callees = std.ArrayList([]const u8).init(allocatir),
+    };
+
+    try procedure.statements.append(ir.Statement{ .call = try token_stream.Identifier.init("nowhere") });
+    try program.procedures.append(procedure);
+
+    const res = try sibc.generateProgram(&program);
+
+    try std.testing.expect(res == .instruction_doesnt_exist);
+}
+
+fn callInstructionTest(generator: *Generator(i32), vendor: *Vendor(i32), args: []Value) !InstructionResult {
+    try generator.append(15);
+    try generator.append(try vendor.procedureReference(args[0].toIdentifier().toString()));
+
+    return .ok;
+}
+
+test "calling cold procedures instead of folding them" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+    defer arena.deinit();
+
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
+
+    var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
+    var call_ins = Instruction(i32).init("call", &callInstructionTest);
+    try isa.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("call", &call_ins);
+
+    var prof = profile.Profile.init(allocatir);
+    try prof.add("hot", 1000);
+    try prof.add("cold", 2);
+
+    sibc.profile = &prof;
+    sibc.call_instruction = "call";
+
+    const root = try createNodeFrom(allocatir, "hot: mov\nmov\n\ncold: mov\nmov\n\nb: hot\ncold\n");
+
+    _ = try sibc.generateBinary(root);
+
+    // hot is folded in (2 bytes), cold is called (2 bytes)
+    const b = sibc.procedure_map.get("b").?.items;
+
+    try std.testing.expectEqualSlices(i32, &.{ 5, 5, 15, 'c' }, b);
+}
+
+test "threading jumps through forwarding procedures" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+    defer arena.deinit();
+
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
+
+    var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
+    var call_ins = Instruction(i32).init("call", &callInstructionTest);
+    try isa.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("call", &call_ins);
+
+    sibc.call_instruction = "call";
+    sibc.thread_jumps = true;
+
+    const root = try createNodeFrom(allocatir, "work: mov\n\nbridge: call work\n\nfirst: call bridge\n\n_start: call first\n");
+
+    _ = try sibc.generateBinary(root);
+
+    // _start calls `work` right away, nothing references the forwards any more
+    try std.testing.expectEqualSlices(i32, &.{ 15, 'w' }, sibc.procedure_map.get("_start").?.items);
+    try std.testing.expect(sibc.peephole_optimizer.used_instructions.get("work") != null);
+    try std.testing.expect(sibc.peephole_optimizer.used_instructions.get("first") == null);
+    try std.testing.expect(sibc.peephole_optimizer.used_instructions.get("bridge") == null);
+}
+
 test "creating and using a vendor with 0 argument functions but multiple subroutines" {
     var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sibc = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
 
     var mov_ins = Instruction(i32).init("mov", &movInstructionTest);
-    try sibc.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("mov", &mov_ins);
 
     const root = try createNodeFrom(allocatir, "a: mov\nb: a\n");
 
@@ -642,10 +1445,11 @@ test "creating and using a vendor with 1 argument function" {
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sample_vendor = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sample_vendor = Vendor(i32).init(allocatir, &isa);
 
     var one_ins = Instruction(i32).init("mov", &oneArgumentInstruction);
-    try sample_vendor.implementInstruction("one", &one_ins);
+    try isa.implementInstruction("one", &one_ins);
 
     const root = try createNodeFrom(allocatir, "a: one 0x0A ;; runs the `one` instruction with `0x0A`");
 
@@ -659,10 +1463,11 @@ test "dead code elimination" {
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sample_vendor = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sample_vendor = Vendor(i32).init(allocatir, &isa);
 
     var one_ins = Instruction(i32).init("one", &oneArgumentInstruction);
-    try sample_vendor.implementInstruction("one", &one_ins);
+    try isa.implementInstruction("one", &one_ins);
 
     const root = try createNodeFrom(allocatir, "a: one 0x0A\n b: one 0x0A\n _start: a\n ");
 
@@ -682,10 +1487,11 @@ test "creating and using a vendor with 0 argument functions that returns an erro
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sibc = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
 
     var mov_ins = Instruction(i32).init("mov", &movInstructionTestError);
-    try sibc.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("mov", &mov_ins);
 
     const root = try createNodeFrom(allocatir, "a: mov\nb: a\n");
 
@@ -701,10 +1507,11 @@ test "aside" {
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sibc = Vendor(i32).init(allocatir);
+    var isa = Isa(i32).init(allocatir);
+    var sibc = Vendor(i32).init(allocatir, &isa);
 
     var mov_ins = Instruction(i32).init("mov", &movInstructionTestTypes);
-    try sibc.implementInstruction("mov", &mov_ins);
+    try isa.implementInstruction("mov", &mov_ins);
 
     const root = try createNodeFrom(allocatir, ":set REG_ONE R1\na: mov REG_ONE, 1\n");
 
@@ -717,10 +1524,11 @@ test "register too big" {
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sample_vendor = Vendor(i8).init(allocatir);
+    var isa = Isa(i8).init(allocatir);
+    var sample_vendor = Vendor(i8).init(allocatir, &isa);
 
     var one_ins = Instruction(i8).init("one", &registerSample);
-    try sample_vendor.implementInstruction("one", &one_ins);
+    try isa.implementInstruction("one", &one_ins);
 
     const root = try createNodeFrom(allocatir, "_start: one R15353135");
 
@@ -740,12 +1548,13 @@ test "annotations" {
     const allocatir = arena.allocator();
     defer arena.deinit();
 
-    var sample_vendor = Vendor(i8).init(allocatir);
+    var isa = Isa(i8).init(allocatir);
+    var sample_vendor = Vendor(i8).init(allocatir, &isa);
 
     var one_ins = Instruction(i8).init("one", &registerSample);
-    try sample_vendor.implementInstruction("one", &one_ins);
+    try isa.implementInstruction("one", &one_ins);
 
-    try sample_vendor.registerAnnotation(
+    try isa.registerAnnotation(
         "one",
         &[_]Type{
             .{
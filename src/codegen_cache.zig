@@ -0,0 +1,414 @@
+//! ## Codegen Cache
+//!
+//! `--codegen-cache DIR` keeps what codegen made of every procedure in DIR, under a hash of
+//! everything that went into it:
+//!
+//! - the vasm build, as a hash of the sources codegen and the formats are made of, with the
+//!   lexer and parser that make the statements codegen reads, and the passes that run in codegen
+//! - the format
+//! - the statements of the procedure, without their spans. Preprocessing already put the values of
+//!   the expandables (`:set`) the procedure uses into its operands
+//! - the key of every procedure folded in, and the binary of every library procedure (see
+//!   `archive.zig`)
+//! - where its calls and procedure references go: which calls are cold, which procedures forward
+//!   to others, the register buffered echoes go through
+//!
+//! A compile that hashes a procedure the same as an earlier one puts the cached binary into the
+//! procedure map instead of generating it. After a small edit only the procedures that changed,
+//! and the ones they are folded into, are generated again.
+//!
+//! Source maps (`--emit-map`) and indexed procedures (`--index-procedures`) depend on more than a
+//! single procedure, compiles with either generate every procedure.
+//!
+
+const std = @import("std");
+const ir = @import("ir.zig");
+const object = @import("object.zig");
+const registers = @import("registers.zig");
+
+const Sha256 = std.crypto.hash.sha2.Sha256;
+
+/// Starts every entry. The last byte is the version of the encoding, and part of every key.
+pub const magic = "VASMCGC\x01";
+
+pub const Key = [Sha256.digest_length]u8;
+
+pub const Error = error{
+    /// The input does not start with `magic`, or is for elements of another size
+    NotAnEntry,
+
+    /// The input ends in the middle of the entry
+    TruncatedEntry,
+};
+
+const register_set_bytes = registers.RegisterSet.bit_length / 8;
+
+/// What a binary depends on besides its procedure. Another vasm build keys its entries apart.
+const build_sources = [_][]const u8{
+    @embedFile("codegen.zig"),
+    @embedFile("codegen_cache.zig"),
+    @embedFile("drivers.zig"),
+    @embedFile("platforms/nexfuse.zig"),
+    @embedFile("platforms/openlud.zig"),
+    @embedFile("instruction_result.zig"),
+    @embedFile("peephole.zig"),
+    @embedFile("registers.zig"),
+    @embedFile("archive.zig"),
+    @embedFile("object.zig"),
+    @embedFile("ir.zig"),
+    @embedFile("lexer.zig"),
+    @embedFile("token_stream.zig"),
+    @embedFile("parser.zig"),
+    @embedFile("hybrid.zig"),
+    @embedFile("passes.zig"),
+};
+
+var build_id: Key = undefined;
+var build_id_once = std.once(hashBuild);
+
+fn hashBuild() void {
+    var sha = Sha256.init(.{});
+
+    for (build_sources) |source| {
+        sha.update(std.mem.asBytes(&@as(u64, source.len)));
+        sha.update(source);
+    }
+
+    build_id = sha.finalResult();
+}
+
+/// How a call reached its callee, so a cold call and a folded one never hash the same.
+pub const Call = enum(u8) {
+    /// The call instruction, with the name of the callee
+    cold,
+
+    /// The callee itself
+    folded,
+};
+
+/// Hashes what goes into generating a procedure, into its `Key`.
+pub const Hasher = struct {
+    sha: Sha256 = Sha256.init(.{}),
+
+    /// A hasher for procedures of `format`, whose binaries have elements of `element_size` bytes.
+    pub fn init(format: []const u8, element_size: usize) Hasher {
+        var hasher = Hasher{};
+
+        build_id_once.call();
+
+        hasher.string(magic);
+        hasher.string(&build_id);
+        hasher.string(format);
+        hasher.int(element_size);
+
+        return hasher;
+    }
+
+    pub fn int(self: *Hasher, value: u64) void {
+        var bytes: [@sizeOf(u64)]u8 = undefined;
+        std.mem.writeInt(u64, &bytes, value, .little);
+
+        self.sha.update(&bytes);
+    }
+
+    pub fn string(self: *Hasher, bytes: []const u8) void {
+        self.int(bytes.len);
+        self.sha.update(bytes);
+    }
+
+    /// The statements of `procedure`, without its name.
+    pub fn statements(self: *Hasher, procedure: *const ir.Procedure) void {
+        object.writeStatements(self.sha.writer(), procedure) catch unreachable;
+    }
+
+    pub fn call(self: *Hasher, kind: Call) void {
+        self.sha.update(&.{@intFromEnum(kind)});
+    }
+
+    pub fn final(self: *Hasher) Key {
+        return self.sha.finalResult();
+    }
+};
+
+/// A reference a procedure made while it was generated, replayed into the call graph on a hit.
+pub const Reference = struct {
+    callee: []const u8,
+    count: u64,
+};
+
+/// What generating a procedure made.
+pub fn Entry(comptime T: type) type {
+    return struct {
+        binary: []const T,
+
+        /// Empty unless registers were tracked
+        accesses: []const registers.Access = &.{},
+
+        references: []const Reference = &.{},
+    };
+}
+
+fn Bits(comptime T: type) type {
+    return std.meta.Int(.unsigned, @bitSizeOf(T));
+}
+
+/// Writes `entry`.
+///
+/// ```
+/// magic
+/// u8 element size
+/// u32 element count, elements
+/// u32 reference count
+///     string callee, u64 count
+/// u32 access count
+///     u32 begin, u32 len, reads, writes, resets, u8 flags
+/// ```
+///
+/// Integers are little endian, strings are a u32 length followed by the bytes and register sets
+/// are a bit per register.
+pub fn write(comptime T: type, writer: anytype, entry: Entry(T)) !void {
+    try writer.writeAll(magic);
+    try writer.writeByte(@sizeOf(T));
+
+    try writer.writeInt(u32, @intCast(entry.binary.len), .little);
+
+    for (entry.binary) |it| {
+        try writer.writeInt(Bits(T), @bitCast(it), .little);
+    }
+
+    try writer.writeInt(u32, @intCast(entry.references.len), .little);
+
+    for (entry.references) |reference| {
+        try writer.writeInt(u32, @intCast(reference.callee.len), .little);
+        try writer.writeAll(reference.callee);
+        try writer.writeInt(u64, reference.count, .little);
+    }
+
+    try writer.writeInt(u32, @intCast(entry.accesses.len), .little);
+
+    for (entry.accesses) |access| {
+        try writeAccess(writer, access);
+    }
+}
+
+fn writeAccess(writer: anytype, access: registers.Access) !void {
+    try writer.writeInt(u32, access.begin, .little);
+    try writer.writeInt(u32, access.len, .little);
+
+    for ([_]registers.RegisterSet{ access.reads, access.writes, access.resets }) |set| {
+        var bytes = [_]u8{0} ** register_set_bytes;
+        var it = set.iterator(.{});
+
+        while (it.next()) |register| {
+            bytes[register / 8] |= @as(u8, 1) << @intCast(register % 8);
+        }
+
+        try writer.writeAll(&bytes);
+    }
+
+    const flags = @as(u8, @intFromBool(access.resets_all)) |
+        @as(u8, @intFromBool(access.side_effects)) << 1 |
+        @as(u8, @intFromBool(access.barrier)) << 2;
+
+    try writer.writeByte(flags);
+}
+
+/// Reads an entry. Callees point into `bytes`, which has to outlive the entry.
+pub fn read(comptime T: type, allocator: std.mem.Allocator, bytes: []const u8) !Entry(T) {
+    if (!std.mem.startsWith(u8, bytes, magic)) return error.NotAnEntry;
+
+    var reader = Reader{ .bytes = bytes, .pos = magic.len };
+
+    if (try reader.int(u8) != @sizeOf(T)) return error.NotAnEntry;
+
+    const binary = try allocator.alloc(T, try reader.count(@sizeOf(T)));
+
+    for (binary) |*it| {
+        it.* = @bitCast(try reader.int(Bits(T)));
+    }
+
+    const references = try allocator.alloc(Reference, try reader.count(@sizeOf(u32) + @sizeOf(u64)));
+
+    for (references) |*reference| {
+        reference.* = .{
+            .callee = try reader.take(try reader.int(u32)),
+            .count = try reader.int(u64),
+        };
+    }
+
+    const accesses = try allocator.alloc(registers.Access, try reader.count(2 * @sizeOf(u32) + 3 * register_set_bytes + 1));
+
+    for (accesses) |*access| {
+        access.* = try reader.access();
+    }
+
+    return Entry(T){
+        .binary = binary,
+        .accesses = accesses,
+        .references = references,
+    };
+}
+
+const Reader = struct {
+    bytes: []const u8,
+    pos: usize,
+
+    fn take(self: *Reader, len: usize) ![]const u8 {
+        if (self.bytes.len - self.pos < len) return error.TruncatedEntry;
+
+        defer self.pos += len;
+        return self.bytes[self.pos..][0..len];
+    }
+
+    fn int(self: *Reader, comptime T: type) !T {
+        return std.mem.readInt(T, (try self.take(@sizeOf(T)))[0..@sizeOf(T)], .little);
+    }
+
+    /// A count of items of at least `item_size` bytes each. Checked against what is left, so a
+    /// broken entry can not make the reader allocate more than its size.
+    fn count(self: *Reader, item_size: usize) !u32 {
+        const value = try self.int(u32);
+
+        if ((self.bytes.len - self.pos) / item_size < value) return error.TruncatedEntry;
+
+        return value;
+    }
+
+    fn access(self: *Reader) !registers.Access {
+        var result = registers.Access{
+            .begin = try self.int(u32),
+            .len = try self.int(u32),
+        };
+
+        for ([_]*registers.RegisterSet{ &result.reads, &result.writes, &result.resets }) |set| {
+            const bytes = try self.take(register_set_bytes);
+
+            for (0..registers.RegisterSet.bit_length) |register| {
+                if ((bytes[register / 8] >> @intCast(register % 8)) & 1 == 1) set.set(register);
+            }
+        }
+
+        const flags = try self.int(u8);
+
+        result.resets_all = flags & 1 != 0;
+        result.side_effects = flags & 2 != 0;
+        result.barrier = flags & 4 != 0;
+
+        return result;
+    }
+};
+
+/// The entries of one format in a cache directory. Every target has its own, they can share the
+/// directory.
+pub const Cache = struct {
+    dir: std.fs.Dir,
+
+    /// The format entries are generated for
+    format: []const u8,
+
+    hits: usize = 0,
+    misses: usize = 0,
+
+    /// The entry of `key`, read with `allocator`. Null when there is none, or it can not be read,
+    /// the procedure is generated again either way.
+    pub fn load(self: *Cache, comptime T: type, allocator: std.mem.Allocator, key: Key) !?Entry(T) {
+        const name = std.fmt.bytesToHex(key, .lower);
+
+        const bytes = self.dir.readFileAlloc(allocator, &name, std.math.maxInt(u32)) catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+
+            else => {
+                self.misses += 1;
+                return null;
+            },
+        };
+
+        const entry = read(T, allocator, bytes) catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+
+            else => {
+                self.misses += 1;
+                return null;
+            },
+        };
+
+        self.hits += 1;
+
+        return entry;
+    }
+
+    /// Writes the entry of `key`. Replaces the entry whole, so a compile reading it at the same
+    /// time never sees half of one.
+    pub fn store(self: *Cache, comptime T: type, allocator: std.mem.Allocator, key: Key, entry: Entry(T)) !void {
+        var bytes = std.ArrayList(u8).init(allocator);
+        defer bytes.deinit();
+
+        try write(T, bytes.writer(), entry);
+
+        const name = std.fmt.bytesToHex(key, .lower);
+
+        var file = try self.dir.atomicFile(&name, .{});
+        defer file.deinit();
+
+        try file.file.writeAll(bytes.items);
+        try file.finish();
+    }
+};
+
+test read {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var dead = registers.Access{ .begin = 3, .len = 2, .barrier = false, .side_effects = true };
+    dead.writes.set(1);
+    dead.reads.set(255);
+
+    const entry = Entry(i32){
+        .binary = &.{ -1, 5, 300 },
+        .accesses = &.{ .{ .len = 3 }, dead },
+        .references = &.{.{ .callee = "print", .count = 2 }},
+    };
+
+    var bytes = std.ArrayList(u8).init(arena.allocator());
+    try write(i32, bytes.writer(), entry);
+
+    const back = try read(i32, arena.allocator(), bytes.items);
+
+    try std.testing.expectEqualSlices(i32, entry.binary, back.binary);
+    try std.testing.expectEqualStrings("print", back.references[0].callee);
+    try std.testing.expectEqual(2, back.references[0].count);
+    try std.testing.expectEqual(2, back.accesses.len);
+    try std.testing.expect(back.accesses[0].barrier);
+    try std.testing.expect(back.accesses[1].writes.isSet(1));
+    try std.testing.expect(back.accesses[1].reads.isSet(255));
+    try std.testing.expect(back.accesses[1].side_effects and !back.accesses[1].barrier);
+    try std.testing.expectEqual(3, back.accesses[1].begin);
+
+    // another element size, or a cut entry
+    try std.testing.expectError(error.NotAnEntry, read(u8, arena.allocator(), bytes.items));
+    try std.testing.expectError(error.TruncatedEntry, read(i32, arena.allocator(), bytes.items[0 .. bytes.items.len - 1]));
+}
+
+test Cache {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+
+    var cache = Cache{ .dir = tmp.dir, .format = "nexfuse" };
+
+    var hasher = Hasher.init(cache.format, 1);
+    hasher.string("a");
+    const key = hasher.final();
+
+    try std.testing.expectEqual(null, try cache.load(u8, arena.allocator(), key));
+
+    try cache.store(u8, arena.allocator(), key, .{ .binary = &.{ 40, 'a', 0 } });
+
+    const entry = (try cache.load(u8, arena.allocator(), key)).?;
+    try std.testing.expectEqualSlices(u8, &.{ 40, 'a', 0 }, entry.binary);
+
+    try std.testing.expectEqual(1, cache.hits);
+    try std.testing.expectEqual(1, cache.misses);
+}
@@ -11,7 +11,7 @@ pub fn compatDirective(pp: *preprocessor.Preprocessor, args: []const parser.Valu
         return error.InvalidArgumentType;
     }
 
-    pp.options.format = args[0].toIdentifier().identifier_string;
+    pp.options.format = args[0].toIdentifier().toString();
 }
 
 pub fn endianDirective(pp: *preprocessor.Preprocessor, args: []const parser.Value) anyerror!void {
@@ -25,11 +25,11 @@ pub fn endianDirective(pp: *preprocessor.Preprocessor, args: []const parser.Valu
 
     const end = args[0].toIdentifier();
 
-    if (std.mem.eql(u8, end.identifier_string, "little")) {
+    if (std.mem.eql(u8, end.toString(), "little")) {
         pp.options.endian = .little;
     }
 
-    if (std.mem.eql(u8, end.identifier_string, "big")) {
+    if (std.mem.eql(u8, end.toString(), "big")) {
         pp.options.endian = .big;
     }
 }
@@ -47,14 +47,8 @@ pub fn compile_if(pp: *preprocessor.Preprocessor, args: []const parser.Value) an
         return error.InvalidArgumentType;
     }
 
-    if (!std.mem.eql(u8, args[0].toIdentifier().identifier_string, pp.options.format.?)) {
-        std.log.err("compile-if: expected format '{s}' but found '{s}'.", .{
-            args[0].toIdentifier().identifier_string,
-            pp.options.format.?,
-        });
-
-        std.log.err("program will exit and compilation is over.", .{});
-
-        std.process.exit(1);
+    // reported by whoever runs the preprocessor, so `--diagnostics-format` output is kept
+    if (!std.mem.eql(u8, args[0].toIdentifier().toString(), pp.options.format.?)) {
+        return error.FormatMismatch;
     }
 }
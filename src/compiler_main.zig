@@ -5,6 +5,7 @@ const std = @import("std");
 const builtin = @import("builtin");
 
 const compiler_output = @import("compiler_output.zig");
+const diagnostics = @import("diagnostics.zig");
 
 const ArrayList = std.ArrayList;
 
@@ -12,12 +13,58 @@ const ArrayList = std.ArrayList;
 pub const Options = struct {
     files: ArrayList([]const u8),
     output: []const u8 = "a.out",
+
+    /// One format, or several separated by commas (see `frontend.parseTargets`).
     format: ?[]const u8 = null,
     stylist: bool = true,
     strict_stylist: bool = false,
     allow_big_numbers: bool = false,
     endian: std.builtin.Endian = .little,
     optimization_level: u8 = 1,
+
+    /// Print what every optimization pass did (`-Ostats`).
+    optimization_stats: bool = false,
+
+    /// Optimization passes to skip whatever the level (`-Ono-NAME`).
+    disabled_passes: std.ArrayListUnmanaged([]const u8) = .{},
+
+    /// Where to write a Chrome trace of the compile (`--trace`). Null disables tracing.
+    trace_file: ?[]const u8 = null,
+
+    /// Link non-folded procedures through an index table (`--index-procedures`).
+    index_procedures: bool = false,
+
+    /// Lex, parse and lower on threads of their own, overlapping (`--pipeline`).
+    pipeline: bool = false,
+
+    /// Read and write files in batches through io_uring, where the system has it (`--io-uring`).
+    io_uring: bool = false,
+
+    /// Where to write the source map of the binary (`--emit-map`). Null disables it.
+    map_file: ?[]const u8 = null,
+
+    /// An execution profile to optimize with (`--profile-use`).
+    profile_file: ?[]const u8 = null,
+
+    /// Write a depfile next to the output (`-MD`).
+    emit_depfile: bool = false,
+
+    /// Where to write the depfile instead (`-MF`). Also enables it.
+    depfile: ?[]const u8 = null,
+
+    /// Write the lowered program to an object file instead of generating a binary (`-c`).
+    compile_only: bool = false,
+
+    /// Procedure libraries to look up instructions a format does not have in (`-l`).
+    libraries: std.ArrayListUnmanaged([]const u8) = .{},
+
+    /// Where to keep generated procedures between compiles (`--codegen-cache`). Null generates
+    /// every procedure.
+    codegen_cache: ?[]const u8 = null,
+
+    /// How to report diagnostics (`--diagnostics-format=`). Anything but text is collected and
+    /// written to standard output at once.
+    diagnostics_format: diagnostics.Format = .text,
 };
 
 pub fn printHelpClassic() void {
@@ -67,8 +114,81 @@ pub fn extractOptions(allocator: std.mem.Allocator, arg_slice: [][:0]u8, report:
             }
 
             return_opt.output = arg_slice[i];
+        } else if (std.mem.eql(u8, arg_slice[i], "--trace")) {
+            i += 1;
+
+            if (i >= arg_slice.len) {
+                report.errorMessage("--trace expects an OUTFILE argument.", .{});
+                std.process.exit(1);
+            }
+
+            return_opt.trace_file = arg_slice[i];
         } else if (std.mem.eql(u8, arg_slice[i], "--help") or std.mem.eql(u8, arg_slice[i], "-h")) {
             runManPage(allocator, report);
+        } else if (std.mem.eql(u8, arg_slice[i], "--emit-map")) {
+            i += 1;
+
+            if (i >= arg_slice.len) {
+                report.errorMessage("--emit-map expects an OUTFILE argument.", .{});
+                std.process.exit(1);
+            }
+
+            return_opt.map_file = arg_slice[i];
+        } else if (std.mem.eql(u8, arg_slice[i], "--profile-use")) {
+            i += 1;
+
+            if (i >= arg_slice.len) {
+                report.errorMessage("--profile-use expects a PROFILE argument.", .{});
+                std.process.exit(1);
+            }
+
+            return_opt.profile_file = arg_slice[i];
+        } else if (std.mem.eql(u8, arg_slice[i], "-MD")) {
+            return_opt.emit_depfile = true;
+        } else if (std.mem.eql(u8, arg_slice[i], "-MF")) {
+            i += 1;
+
+            if (i >= arg_slice.len) {
+                report.errorMessage("-MF expects a DEPFILE argument.", .{});
+                std.process.exit(1);
+            }
+
+            return_opt.depfile = arg_slice[i];
+        } else if (std.mem.eql(u8, arg_slice[i], "--library") or std.mem.eql(u8, arg_slice[i], "-l")) {
+            i += 1;
+
+            if (i >= arg_slice.len) {
+                report.errorMessage("--library expects a LIBRARY argument.", .{});
+                std.process.exit(1);
+            }
+
+            return_opt.libraries.append(allocator, arg_slice[i]) catch {
+                report.errorMessage("Out of memory", .{});
+            };
+        } else if (std.mem.eql(u8, arg_slice[i], "--codegen-cache")) {
+            i += 1;
+
+            if (i >= arg_slice.len) {
+                report.errorMessage("--codegen-cache expects a DIR argument.", .{});
+                std.process.exit(1);
+            }
+
+            return_opt.codegen_cache = arg_slice[i];
+        } else if (std.mem.startsWith(u8, arg_slice[i], "--diagnostics-format=")) {
+            const name = arg_slice[i]["--diagnostics-format=".len..];
+
+            return_opt.diagnostics_format = diagnostics.parseFormat(name) orelse {
+                report.errorMessage("unknown diagnostics format '{s}' (expected text, json or sarif)", .{name});
+                std.process.exit(1);
+            };
+        } else if (std.mem.eql(u8, arg_slice[i], "-c")) {
+            return_opt.compile_only = true;
+        } else if (std.mem.eql(u8, arg_slice[i], "--index-procedures")) {
+            return_opt.index_procedures = true;
+        } else if (std.mem.eql(u8, arg_slice[i], "--pipeline")) {
+            return_opt.pipeline = true;
+        } else if (std.mem.eql(u8, arg_slice[i], "--io-uring")) {
+            return_opt.io_uring = true;
         } else if (std.mem.eql(u8, arg_slice[i], "--no-stylist")) {
             return_opt.stylist = false;
         } else if (std.mem.eql(u8, arg_slice[i], "--strict") or std.mem.eql(u8, arg_slice[i], "--enforce-stylist")) {
@@ -79,16 +199,23 @@ pub fn extractOptions(allocator: std.mem.Allocator, arg_slice: [][:0]u8, report:
             return_opt.endian = .big;
         } else if (std.mem.eql(u8, arg_slice[i], "-le")) {
             return_opt.endian = .little;
-        } else if (arg_slice[i][0] == '-' and arg_slice[i][1] == 'O') {
+        } else if (std.mem.eql(u8, arg_slice[i], "-Ostats")) {
+            return_opt.optimization_stats = true;
+        } else if (std.mem.startsWith(u8, arg_slice[i], "-Ono-")) {
+            return_opt.disabled_passes.append(allocator, arg_slice[i]["-Ono-".len..]) catch {
+                report.errorMessage("Out of memory", .{});
+            };
+        } else if (std.mem.startsWith(u8, arg_slice[i], "-O")) {
             if (arg_slice[i].len < 3) {
                 report.errorMessage("-O must be followed by a number", .{});
                 std.process.exit(1);
             }
-            const op_number: u8 = arg_slice[i][2] - '0';
 
-            if (op_number > return_opt.optimization_level) {
-                return_opt.optimization_level = op_number;
-            }
+            // the last level given wins, so -O0 can turn optimizations off
+            return_opt.optimization_level = std.fmt.parseInt(u8, arg_slice[i][2..], 10) catch {
+                report.errorMessage("invalid optimization level '{s}'", .{arg_slice[i][2..]});
+                std.process.exit(1);
+            };
         } else {
             if (arg_slice[i][0] == '-') {
                 report.errorMessage("unrecognized flag '{s}'", .{arg_slice[i]});
@@ -6,6 +6,8 @@ const linker = @import("linker.zig");
 const parser = @import("parser.zig");
 const compiler_status = @import("compiler_status.zig");
 const codegen = @import("codegen.zig");
+const diagnostics = @import("diagnostics.zig");
+const Span = @import("token_stream.zig").Span;
 
 const Result = codegen.Result;
 
@@ -16,6 +18,9 @@ pub const Reporter = struct {
     stdout_config: tty.Config = undefined,
     stderr_config: tty.Config = undefined,
 
+    /// Collects diagnostics instead of printing them (`--diagnostics-format`). Null prints them.
+    sink: ?*diagnostics.Sink = null,
+
     pub fn init() Reporter {
         var rep: Reporter = .{
             .stderr = std.io.getStdErr(),
@@ -36,6 +41,30 @@ pub const Reporter = struct {
         self.stderr_config.setColor(self.stderr.writer(), color) catch unreachable;
     }
 
+    /// Writes what the sink collected, in a single write. Nothing without a sink.
+    pub fn flush(self: *Reporter) void {
+        const sink = self.sink orelse return;
+
+        sink.flush(self.stdout) catch {};
+    }
+
+    /// Flushes the sink and exits with `status`. Use this instead of `std.process.exit` after
+    /// reporting an error, so collected diagnostics are not lost.
+    pub fn exit(self: *Reporter, status: u8) noreturn {
+        self.flush();
+        std.process.exit(status);
+    }
+
+    /// Adds a diagnostic to the sink. False without a sink, or when the sink is out of memory, the
+    /// caller prints it as text to stderr then, which keeps stdout for the sink.
+    pub fn addToSink(self: *Reporter, severity: diagnostics.Severity, code: []const u8, location: ?diagnostics.Location, comptime format: []const u8, args: anytype) bool {
+        const sink = self.sink orelse return false;
+
+        sink.add(severity, code, location, format, args) catch return false;
+
+        return true;
+    }
+
     pub fn importantMessage(self: *Reporter, comptime format: []const u8, args: anytype) void {
         var writer = self.stdout.writer();
 
@@ -49,6 +78,8 @@ pub const Reporter = struct {
     }
 
     pub fn errorMessage(self: *Reporter, comptime format: []const u8, args: anytype) void {
+        if (self.addToSink(.@"error", "error", null, format, args)) return;
+
         const wri = self.stderr.writer();
 
         wri.print("vasm: ", .{}) catch unreachable;
@@ -67,6 +98,8 @@ pub const Reporter = struct {
     }
 
     pub fn preprocessErrorMessage(self: *Reporter, comptime format: []const u8, args: anytype) void {
+        if (self.addToSink(.@"error", "preprocessor", null, format, args)) return;
+
         const wri = self.stderr.writer();
 
         wri.print("vasm: ", .{}) catch unreachable;
@@ -85,6 +118,8 @@ pub const Reporter = struct {
     }
 
     pub fn leaveNote(self: *Reporter, comptime format: []const u8, args: anytype) void {
+        if (self.addToSink(.note, "note", null, format, args)) return;
+
         const wri = self.stderr.writer();
 
         wri.print("vasm: ", .{}) catch unreachable;
@@ -99,47 +134,76 @@ pub const Reporter = struct {
         wri.print("\n", .{}) catch unreachable;
     }
 
+    /// Reports an error at `location`, printed as `file:line:column: message`. `code` names the
+    /// error for the sink.
+    pub fn errorAt(self: *Reporter, code: []const u8, location: diagnostics.Location, comptime format: []const u8, args: anytype) void {
+        if (self.addToSink(.@"error", code, location, format, args)) return;
+
+        self.errorMessage("{s}:{d}:{d}: " ++ format, .{ location.file, location.line, location.column } ++ args);
+    }
+
+    /// Where the lexer's area is in `file`.
+    fn lexerLocation(file: []const u8, lex: *lexer.Lexer) diagnostics.Location {
+        return .{
+            .file = file,
+            .line = lex.area.line_number,
+            .column = lex.area.char_pos,
+        };
+    }
+
     /// Prints error `err` and tries to get the source location using the lexer `lex`.
     pub fn printError(self: *Reporter, lex: *lexer.Lexer, filename: []const u8, err: anyerror) noreturn {
         switch (err) {
             error.UnexpectedToken => {
-                self.errorMessage("{s}:{d}:{d}: unexpected token `{c}'", .{
-                    filename,
-                    lex.getLineNumber(),
-                    lex.area.char_pos,
-                    lex.getCurrentCharacter(),
-                });
+                self.errorAt(@errorName(err), .{
+                    .file = filename,
+                    .line = lex.getLineNumber(),
+                    .column = lex.area.char_pos,
+                }, "unexpected token `{c}'", .{lex.getCurrentCharacter()});
 
                 self.getSourceLocation(lex, .suggestion);
             },
 
             error.NumberTooBig => {
-                self.errorMessage("{s}:{d}:{d}: number too big (note that max size is {d})", .{
-                    filename,
-                    lex.getLineNumber(),
-                    lex.area.char_pos,
-                    lex.rules.max_number_size,
-                });
+                self.errorAt(@errorName(err), .{
+                    .file = filename,
+                    .line = lex.getLineNumber(),
+                    .column = lex.area.char_pos,
+                }, "number too big (note that max size is {d})", .{lex.rules.max_number_size});
 
                 self.getSourceLocation(lex, .suggestion);
             },
 
-            else => {
-                self.errorMessage("{s}:{d}:{d}: {s}", .{
-                    filename,
-                    lex.getLineNumber(),
-                    lex.area.char_pos,
-                    @errorName(err),
-                });
+            error.TokenTooLong => {
+                self.errorAt(@errorName(err), .{
+                    .file = filename,
+                    .line = lex.getLineNumber(),
+                    .column = lex.area.char_pos,
+                }, "token too long (note that max size is {d} bytes)", .{std.math.maxInt(u16)});
+
+                self.getSourceLocation(lex, .erroneous);
+            },
 
-                std.process.exit(1);
+            error.FormatMismatch => {
+                self.errorMessage("{s}: compile-if names another format than the one being compiled, compilation is over.", .{filename});
+            },
+
+            else => {
+                self.errorAt(@errorName(err), .{
+                    .file = filename,
+                    .line = lex.getLineNumber(),
+                    .column = lex.area.char_pos,
+                }, "{s}", .{@errorName(err)});
             },
         }
 
-        std.process.exit(1);
+        self.exit(1);
     }
 
     pub fn getCustomarySourceLocationUsingLexer(self: *Reporter, existing_lexer: anytype, begin: anytype, end: anytype, line_number: anytype) void {
+        // collected diagnostics carry their location instead
+        if (self.sink != null) return;
+
         var lines = existing_lexer.*.splitInputTextIntoLines();
         var i: usize = 0;
 
@@ -174,6 +238,8 @@ pub const Reporter = struct {
     }
 
     pub fn getSourceLocation(self: *Reporter, lexer_state: *lexer.Lexer, status: compiler_status.Status) void {
+        if (self.sink != null) return;
+
         var lines = lexer_state.splitInputTextIntoLines();
         var i: usize = 0;
 
@@ -217,66 +283,51 @@ pub const Reporter = struct {
         }
     }
 
+    /// Moves the lexer's area to where `span` starts, so `getSourceLocation` points at it.
+    fn moveToSpan(lex: *lexer.Lexer, span: Span) void {
+        lex.area.line_number = span.lineNumber(lex.input_text);
+        lex.area.char_pos = span.column(lex.input_text);
+    }
+
     pub fn genError(self: *Reporter, err: Result, gen: anytype, ctx: anytype) noreturn {
         _ = gen;
         switch (err) {
             .register_number_too_large => |reg| {
-                self.errorMessage("{s}:{d}:{d}: {s}", .{
-                    ctx.file_name,
-                    reg.span.line_number,
-                    reg.span.char_begin,
-                    "register number too large",
-                });
+                moveToSpan(ctx.lexer, reg.span);
 
-                ctx.lexer.area.char_pos = reg.span.char_begin;
-                ctx.lexer.area.line_number = reg.span.line_number;
+                self.errorAt(@tagName(err), lexerLocation(ctx.file_name, ctx.lexer), "register number too large", .{});
 
                 self.getSourceLocation(ctx.lexer, .suggestion);
             },
 
             .instruction_doesnt_exist => |span| {
-                self.errorMessage("{s}:{d}:{d}: {s}", .{
-                    ctx.file_name,
-                    span.line_number,
-                    span.char_begin,
-                    "instruction does not exist for this architecture",
-                });
+                moveToSpan(ctx.lexer, span);
 
-                ctx.lexer.area.char_pos = span.char_begin;
-                ctx.lexer.area.line_number = span.line_number;
+                self.errorAt(@tagName(err), lexerLocation(ctx.file_name, ctx.lexer), "instruction does not exist for this architecture", .{});
 
                 self.getSourceLocation(ctx.lexer, .erroneous);
             },
 
             .params_to_instruction_are_wrong => |mismatch| {
-                self.errorMessage("{s}:{d}:{d}: expected '{s}', got '{s}'", .{
-                    ctx.file_name,
-                    mismatch.span.line_number,
-                    mismatch.span.char_begin,
+                moveToSpan(ctx.lexer, mismatch.span);
+
+                self.errorAt(@tagName(err), lexerLocation(ctx.file_name, ctx.lexer), "expected '{s}', got '{s}'", .{
                     @tagName(mismatch.expected),
                     @tagName(mismatch.actual),
                 });
 
-                ctx.lexer.area.char_pos = mismatch.span.char_begin;
-                ctx.lexer.area.line_number = mismatch.span.line_number;
-
                 self.getSourceLocation(ctx.lexer, .erroneous);
             },
 
             .too_little_params => |too_little_info| {
-                const span = too_little_info.span;
-
-                self.errorMessage("{s}:{d}:{d}: the parameters to this function are incorrect.", .{
-                    ctx.file_name,
-                    span.line_number,
-                    span.char_begin,
-                });
+                moveToSpan(ctx.lexer, too_little_info.span);
 
-                ctx.lexer.area.char_pos = span.char_begin;
-                ctx.lexer.area.line_number = span.line_number;
+                self.errorAt(@tagName(err), lexerLocation(ctx.file_name, ctx.lexer), "the parameters to this function are incorrect.", .{});
 
                 self.getSourceLocation(ctx.lexer, .erroneous);
 
+                if (self.sink != null) self.exit(1);
+
                 var stderr = std.io.getStdErr().writer();
 
                 stderr.print("help: function '{s}' has a type signature of: {s} ", .{ too_little_info.name, too_little_info.name }) catch unreachable;
@@ -296,16 +347,15 @@ pub const Reporter = struct {
             },
         }
 
-        std.process.exit(1);
+        self.exit(1);
     }
 
     pub fn printPreprocessError(self: *Reporter, err_result: anytype, lex: *lexer.Lexer) noreturn {
         switch (err_result) {
             .nonexistent_directive => {
-                self.preprocessErrorMessage("unknown directive `{s}`", .{err_result.nonexistent_directive.identifier_string});
+                self.preprocessErrorMessage("unknown directive `{s}`", .{err_result.nonexistent_directive.toString()});
 
-                lex.area.char_pos = err_result.nonexistent_directive.span.char_begin;
-                lex.area.line_number = err_result.nonexistent_directive.span.line_number;
+                moveToSpan(lex, err_result.nonexistent_directive.span);
 
                 self.getSourceLocation(lex, .suggestion);
             },
@@ -315,7 +365,7 @@ pub const Reporter = struct {
             },
         }
 
-        std.process.exit(1);
+        self.exit(1);
     }
 
     pub fn astError(self: *Reporter, err: anytype, ctx: anytype, lex: *lexer.Lexer, pars: *parser.Parser) noreturn {
@@ -323,53 +373,31 @@ pub const Reporter = struct {
 
         switch (err) {
             error.RangeExpectsSeparator => {
-                lex.area.char_pos = last.number.span.char_begin;
-                lex.area.line_number = last.number.span.line_number;
+                moveToSpan(lex, last.number.span);
 
-                self.errorMessage("{s}:{d}:{d}: range expects separator", .{
-                    ctx.file_name,
-                    lex.area.line_number,
-                    lex.area.char_pos,
-                });
+                self.errorAt(@errorName(err), lexerLocation(ctx.file_name, lex), "range expects separator", .{});
                 self.getSourceLocation(lex, .suggestion);
             },
 
             error.RangeExpectsEnd => {
-                lex.area.char_pos = last.number.span.char_begin;
-                lex.area.line_number = last.number.span.line_number;
+                moveToSpan(lex, last.number.span);
 
-                self.errorMessage("{s}:{d}:{d}: range expects '{c}'", .{
-                    ctx.file_name,
-                    lex.area.line_number,
-                    lex.area.char_pos,
-                    '}',
-                });
+                self.errorAt(@errorName(err), lexerLocation(ctx.file_name, lex), "range expects '{c}'", .{'}'});
                 self.getSourceLocation(lex, .suggestion);
             },
 
             error.RangeStartsAfterEnd => {
-                lex.area.char_pos = last.getSpan().char_begin;
-                lex.area.line_number = last.getSpan().line_number;
+                moveToSpan(lex, last.getSpan());
 
-                self.errorMessage("{s}:{d}:{d}: range starts after end (syntax is start:end)", .{
-                    ctx.file_name,
-                    lex.area.line_number,
-                    lex.area.char_pos,
-                });
+                self.errorAt(@errorName(err), lexerLocation(ctx.file_name, lex), "range starts after end (syntax is start:end)", .{});
 
                 self.getSourceLocation(lex, .suggestion);
             },
 
             error.InvalidTokenValue => {
-                lex.area.char_pos = last.getSpan().char_begin;
-                lex.area.line_number = last.getSpan().line_number;
+                moveToSpan(lex, last.getSpan());
 
-                self.errorMessage("{s}:{d}:{d}: range expects '{c}'", .{
-                    ctx.file_name,
-                    lex.area.line_number,
-                    lex.area.char_pos,
-                    '}',
-                });
+                self.errorAt(@errorName(err), lexerLocation(ctx.file_name, lex), "range expects '{c}'", .{'}'});
                 self.getSourceLocation(lex, .suggestion);
             },
 
@@ -380,7 +408,7 @@ pub const Reporter = struct {
                 self.getSourceLocation(lex, .erroneous);
             },
         }
-        std.process.exit(1);
+        self.exit(1);
     }
 
     pub fn linkerError(self: *Reporter, err: anyerror, link: anytype, ctx: anytype) noreturn {
@@ -389,7 +417,7 @@ pub const Reporter = struct {
 
         self.leaveNote("linker error {any}", .{err});
 
-        std.process.exit(1);
+        self.exit(1);
     }
 
     pub fn linkerWriteError(self: *Reporter, err: anyerror, link: anytype, ctx: anytype) noreturn {
@@ -398,7 +426,7 @@ pub const Reporter = struct {
 
         self.leaveNote("linker write error {any}", .{err});
 
-        std.process.exit(1);
+        self.exit(1);
     }
 
     pub fn stylistMessage(self: *Reporter, comptime format: []const u8, args: anytype) void {
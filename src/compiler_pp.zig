@@ -11,14 +11,25 @@ const parser = @import("parser.zig");
 
 const compiler_rt = @import("compiler-rt/directives.zig");
 const compiler_main = @import("compiler_main.zig");
+const trace = @import("trace.zig");
 
-pub fn preprocessWithDefaultRuntime(allocator: std.mem.Allocator, options: *compiler_main.Options, ast_root: *parser.Node) !preprocessor.PreprocessorResult {
-    var pp = preprocessor.Preprocessor.init(allocator, options);
+pub fn preprocessWithDefaultRuntime(allocator: std.mem.Allocator, options: *compiler_main.Options, ast_root: *parser.Node, tracer: ?*trace.Tracer) !preprocessor.PreprocessorResult {
+    var pp = try initDefaultRuntime(allocator, options, tracer);
     defer pp.deinit();
 
+    return try pp.handleAstDirectives(ast_root);
+}
+
+/// A preprocessor with the compiler's directives, for running them one node at a time.
+pub fn initDefaultRuntime(allocator: std.mem.Allocator, options: *compiler_main.Options, tracer: ?*trace.Tracer) !preprocessor.Preprocessor {
+    var pp = preprocessor.Preprocessor.init(allocator, options);
+    errdefer pp.deinit();
+
+    pp.tracer = tracer;
+
     try pp.addDirective("compat", &compiler_rt.compatDirective);
     try pp.addDirective("endian", &compiler_rt.endianDirective);
     try pp.addDirective("compile-if", &compiler_rt.compile_if);
 
-    return try pp.handleAstDirectives(ast_root);
+    return pp;
 }
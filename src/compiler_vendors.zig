@@ -8,5 +8,8 @@ pub const Tag = enum {
     jade,
     solarisvm,
     siax,
+
+    /// Every 8-bit format at once, compiled through a hybrid vendor (see `hybrid.zig`)
+    standard,
     unknown,
 };
@@ -0,0 +1,114 @@
+//! ## Dependency Files
+//!
+//! A depfile (`-MD`, `-MF`) is a make rule naming every file a compile wrote as a target, and
+//! every file it read as a prerequisite. make and ninja read it back after the compile and only
+//! run vasm again when one of the prerequisites changed.
+//!
+//! ```make
+//! program.bin program.bin.map: program.asm program.profile
+//! ```
+//!
+//! `compat` and `endian` directives live in the source, so a change to them is a change to the
+//! input file.
+//!
+
+const std = @import("std");
+
+pub const Depfile = struct {
+    /// The files the compile wrote
+    targets: std.ArrayList([]const u8),
+
+    /// The files the compile read, each one once
+    dependencies: std.ArrayList([]const u8),
+
+    pub fn init(parent_allocator: std.mem.Allocator) Depfile {
+        return Depfile{
+            .targets = std.ArrayList([]const u8).init(parent_allocator),
+            .dependencies = std.ArrayList([]const u8).init(parent_allocator),
+        };
+    }
+
+    pub fn deinit(self: *Depfile) void {
+        self.targets.deinit();
+        self.dependencies.deinit();
+    }
+
+    pub fn addTarget(self: *Depfile, path: []const u8) !void {
+        try self.targets.append(path);
+    }
+
+    pub fn addDependency(self: *Depfile, path: []const u8) !void {
+        for (self.dependencies.items) |dependency| {
+            if (std.mem.eql(u8, dependency, path)) return;
+        }
+
+        try self.dependencies.append(path);
+    }
+
+    /// Writes the rule.
+    pub fn write(self: *const Depfile, writer: anytype) !void {
+        for (self.targets.items, 0..) |target, i| {
+            if (i > 0) try writer.writeByte(' ');
+            try writePath(writer, target);
+        }
+
+        try writer.writeByte(':');
+
+        // one prerequisite per line keeps long rules readable
+        for (self.dependencies.items) |dependency| {
+            try writer.writeAll(" \\\n  ");
+            try writePath(writer, dependency);
+        }
+
+        try writer.writeByte('\n');
+    }
+
+    pub fn writeToFile(self: *const Depfile, file_name: []const u8) !void {
+        var file = try std.fs.cwd().createFile(file_name, .{});
+        defer file.close();
+
+        var buffered = std.io.bufferedWriter(file.writer());
+
+        try self.write(buffered.writer());
+        try buffered.flush();
+    }
+};
+
+/// Writes `path` escaped the way make (and ninja's depfile parser) reads it back.
+fn writePath(writer: anytype, path: []const u8) !void {
+    for (path) |c| {
+        switch (c) {
+            ' ', '#' => try writer.print("\\{c}", .{c}),
+            '$' => try writer.writeAll("$$"),
+            else => try writer.writeByte(c),
+        }
+    }
+}
+
+test Depfile {
+    var depfile = Depfile.init(std.testing.allocator);
+    defer depfile.deinit();
+
+    try depfile.addTarget("out.bin");
+    try depfile.addTarget("out.bin.map");
+
+    try depfile.addDependency("program.asm");
+    try depfile.addDependency("program.profile");
+    try depfile.addDependency("program.asm");
+
+    var output = std.ArrayList(u8).init(std.testing.allocator);
+    defer output.deinit();
+
+    try depfile.write(output.writer());
+
+    try std.testing.expectEqualStrings("out.bin out.bin.map: \\\n  program.asm \\\n  program.profile\n", output.items);
+}
+
+test "escaping paths" {
+    var output = std.ArrayList(u8).init(std.testing.allocator);
+    defer output.deinit();
+
+    try writePath(output.writer(), "my dir/#1 $HOME.asm");
+
+    try std.testing.expectEqualStrings("my\\ dir/\\#1\\ $$HOME.asm", output.items);
+}
@@ -0,0 +1,303 @@
+//! ## Structured Diagnostics
+//!
+//! `--diagnostics-format=json` and `--diagnostics-format=sarif` collect what a compile reports into
+//! a `Sink`, instead of printing every message in color as it comes: stylist suggestions, lexer,
+//! parser and preprocessor errors, codegen results and every other error or note. The sink is
+//! written to standard output in a single write once the compile ends, or right before it exits
+//! on an error (see `compiler_output.Reporter.exit`).
+//!
+//! JSON is an array with an object per diagnostic:
+//!
+//! ```json
+//! [{"severity":"error","code":"instruction_doesnt_exist","message":"instruction does not exist for this architecture","file":"a.asm","line":3,"column":1}]
+//! ```
+//!
+//! SARIF is version 2.1.0, with a single run whose results are the diagnostics. Codes are the
+//! rule ids. Lines and columns count from 1, diagnostics without a place in the source (a file
+//! that can not be read, for one) have no location.
+//!
+
+const std = @import("std");
+
+pub const Format = enum {
+    /// Printed in color as they come
+    text,
+    json,
+    sarif,
+};
+
+/// The format named `name`, as given to `--diagnostics-format`.
+pub fn parseFormat(name: []const u8) ?Format {
+    return std.meta.stringToEnum(Format, name);
+}
+
+/// The names are the levels of SARIF.
+pub const Severity = enum {
+    @"error",
+    warning,
+    note,
+};
+
+pub const Location = struct {
+    file: []const u8,
+    line: usize,
+    column: usize,
+
+    /// The column after the last one, when the diagnostic covers more than a point
+    end_column: ?usize = null,
+};
+
+pub const Diagnostic = struct {
+    severity: Severity,
+
+    /// What kind of diagnostic it is: the name of the error or codegen result, or the type of a
+    /// stylist suggestion
+    code: []const u8,
+
+    message: []const u8,
+    location: ?Location = null,
+};
+
+/// Collects diagnostics, from any thread, and writes them at once.
+pub const Sink = struct {
+    allocator: std.mem.Allocator,
+    format: Format,
+    diagnostics: std.ArrayListUnmanaged(Diagnostic) = .{},
+    mutex: std.Thread.Mutex = .{},
+
+    /// Only the first flush writes, the output is a single document
+    flushed: bool = false,
+
+    pub fn init(allocator: std.mem.Allocator, format: Format) Sink {
+        return Sink{
+            .allocator = allocator,
+            .format = format,
+        };
+    }
+
+    pub fn deinit(self: *Sink) void {
+        for (self.diagnostics.items) |it| {
+            self.allocator.free(it.message);
+        }
+
+        self.diagnostics.deinit(self.allocator);
+    }
+
+    /// Adds a diagnostic. The message is formatted into the sink's allocator, `code` and the file
+    /// of `location` have to outlive the sink.
+    pub fn add(self: *Sink, severity: Severity, code: []const u8, location: ?Location, comptime format: []const u8, args: anytype) !void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        const message = try std.fmt.allocPrint(self.allocator, format, args);
+        errdefer self.allocator.free(message);
+
+        try self.diagnostics.append(self.allocator, .{
+            .severity = severity,
+            .code = code,
+            .message = message,
+            .location = location,
+        });
+    }
+
+    /// Writes every diagnostic to `file` in a single write. Does nothing after the first time.
+    pub fn flush(self: *Sink, file: std.fs.File) !void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        if (self.flushed) return;
+        self.flushed = true;
+
+        var output = std.ArrayList(u8).init(self.allocator);
+        defer output.deinit();
+
+        try self.write(output.writer());
+        try output.append('\n');
+
+        try file.writeAll(output.items);
+    }
+
+    /// Writes every diagnostic in the sink's format. Text is never collected, it writes nothing.
+    pub fn write(self: *const Sink, writer: anytype) !void {
+        switch (self.format) {
+            .text => {},
+            .json => try writeJson(self.diagnostics.items, writer),
+            .sarif => try writeSarif(self.diagnostics.items, writer),
+        }
+    }
+};
+
+fn writeJson(diagnostics: []const Diagnostic, writer: anytype) !void {
+    var stream = std.json.writeStream(writer, .{});
+    defer stream.deinit();
+
+    try stream.beginArray();
+
+    for (diagnostics) |it| {
+        try stream.beginObject();
+
+        try stream.objectField("severity");
+        try stream.write(it.severity);
+        try stream.objectField("code");
+        try stream.write(it.code);
+        try stream.objectField("message");
+        try stream.write(it.message);
+
+        if (it.location) |location| {
+            try stream.objectField("file");
+            try stream.write(location.file);
+            try stream.objectField("line");
+            try stream.write(location.line);
+            try stream.objectField("column");
+            try stream.write(location.column);
+
+            if (location.end_column) |end_column| {
+                try stream.objectField("end_column");
+                try stream.write(end_column);
+            }
+        }
+
+        try stream.endObject();
+    }
+
+    try stream.endArray();
+}
+
+fn writeSarif(diagnostics: []const Diagnostic, writer: anytype) !void {
+    var stream = std.json.writeStream(writer, .{});
+    defer stream.deinit();
+
+    try stream.beginObject();
+
+    try stream.objectField("version");
+    try stream.write("2.1.0");
+    try stream.objectField("$schema");
+    try stream.write("https://json.schemastore.org/sarif-2.1.0.json");
+
+    try stream.objectField("runs");
+    try stream.beginArray();
+    try stream.beginObject();
+
+    try stream.objectField("tool");
+    try stream.write(.{ .driver = .{ .name = "vasm" } });
+
+    try stream.objectField("results");
+    try stream.beginArray();
+
+    for (diagnostics) |it| {
+        try stream.beginObject();
+
+        try stream.objectField("ruleId");
+        try stream.write(it.code);
+        try stream.objectField("level");
+        try stream.write(it.severity);
+        try stream.objectField("message");
+        try stream.write(.{ .text = it.message });
+
+        if (it.location) |location| {
+            try stream.objectField("locations");
+            try stream.beginArray();
+            try stream.beginObject();
+
+            try stream.objectField("physicalLocation");
+            try stream.beginObject();
+
+            try stream.objectField("artifactLocation");
+            try stream.write(.{ .uri = location.file });
+
+            try stream.objectField("region");
+            try stream.beginObject();
+            try stream.objectField("startLine");
+            try stream.write(location.line);
+            try stream.objectField("startColumn");
+            try stream.write(location.column);
+
+            if (location.end_column) |end_column| {
+                try stream.objectField("endColumn");
+                try stream.write(end_column);
+            }
+
+            try stream.endObject();
+
+            try stream.endObject();
+            try stream.endObject();
+            try stream.endArray();
+        }
+
+        try stream.endObject();
+    }
+
+    try stream.endArray();
+
+    try stream.endObject();
+    try stream.endArray();
+
+    try stream.endObject();
+}
+
+fn testSink(format: Format) !Sink {
+    var sink = Sink.init(std.testing.allocator, format);
+    errdefer sink.deinit();
+
+    try sink.add(.warning, "good_practice", .{ .file = "a.asm", .line = 2, .column = 8, .end_column = 9 }, "{s}", .{"trailing comma"});
+    try sink.add(.@"error", "error", null, "could not read '{s}'", .{"b.asm"});
+
+    return sink;
+}
+
+test writeJson {
+    var sink = try testSink(.json);
+    defer sink.deinit();
+
+    var output = std.ArrayList(u8).init(std.testing.allocator);
+    defer output.deinit();
+
+    try sink.write(output.writer());
+
+    const parsed = try std.json.parseFromSlice(std.json.Value, std.testing.allocator, output.items, .{});
+    defer parsed.deinit();
+
+    const items = parsed.value.array.items;
+
+    try std.testing.expectEqual(2, items.len);
+    try std.testing.expectEqualStrings("warning", items[0].object.get("severity").?.string);
+    try std.testing.expectEqualStrings("good_practice", items[0].object.get("code").?.string);
+    try std.testing.expectEqual(8, items[0].object.get("column").?.integer);
+    try std.testing.expectEqual(9, items[0].object.get("end_column").?.integer);
+    try std.testing.expectEqualStrings("could not read 'b.asm'", items[1].object.get("message").?.string);
+
+    // no place in the source, no location
+    try std.testing.expectEqual(null, items[1].object.get("file"));
+}
+
+test writeSarif {
+    var sink = try testSink(.sarif);
+    defer sink.deinit();
+
+    var output = std.ArrayList(u8).init(std.testing.allocator);
+    defer output.deinit();
+
+    try sink.write(output.writer());
+
+    const parsed = try std.json.parseFromSlice(std.json.Value, std.testing.allocator, output.items, .{});
+    defer parsed.deinit();
+
+    try std.testing.expectEqualStrings("2.1.0", parsed.value.object.get("version").?.string);
+
+    const run = parsed.value.object.get("runs").?.array.items[0];
+    const results = run.object.get("results").?.array.items;
+
+    try std.testing.expectEqual(2, results.len);
+    try std.testing.expectEqualStrings("error", results[1].object.get("level").?.string);
+
+    const location = results[0].object.get("locations").?.array.items[0].object.get("physicalLocation").?;
+
+    try std.testing.expectEqualStrings("a.asm", location.object.get("artifactLocation").?.object.get("uri").?.string);
+    try std.testing.expectEqual(2, location.object.get("region").?.object.get("startLine").?.integer);
+    try std.testing.expectEqual(null, results[1].object.get("locations"));
+}
+
+test parseFormat {
+    try std.testing.expectEqual(.sarif, parseFormat("sarif").?);
+    try std.testing.expectEqual(null, parseFormat("xml"));
+}
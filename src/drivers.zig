@@ -29,9 +29,10 @@ test "populate vendor using openlud" {
     defer arena.deinit();
 
     var link = linker.Linker(i8).init(allocator);
-    var vend1 = codegen.Vendor(i8).init(allocator);
+    var isa = codegen.Isa(i8).init(allocator);
+    var vend1 = codegen.Vendor(i8).init(allocator, &isa);
 
-    try openlud.vendor(&vend1);
+    try openlud.vendor(&isa);
 
     var root = try ast(allocator, "b: echo 'A'\n_start: b\n");
 
@@ -54,9 +55,10 @@ test "populate vendor using openlud program 2" {
     defer arena.deinit();
 
     var link = linker.Linker(i8).init(allocator);
-    var vend1 = codegen.Vendor(i8).init(allocator);
+    var isa = codegen.Isa(i8).init(allocator);
+    var vend1 = codegen.Vendor(i8).init(allocator, &isa);
 
-    try openlud.vendor(&vend1);
+    try openlud.vendor(&isa);
 
     var root = try ast(allocator, "_start: init R1\n mov R1,65\n each R1\n");
 
@@ -81,9 +83,10 @@ test "populate vendor using openlud program 3" {
     defer arena.deinit();
 
     var link = linker.Linker(i8).init(allocator);
-    var vend1 = codegen.Vendor(i8).init(allocator);
+    var isa = codegen.Isa(i8).init(allocator);
+    var vend1 = codegen.Vendor(i8).init(allocator, &isa);
 
-    try openlud.vendor(&vend1);
+    try openlud.vendor(&isa);
 
     var root = try ast(allocator, "_start: echo 'A';");
 
@@ -108,9 +111,10 @@ test "populate vendor using openlud program 4" {
     defer arena.deinit();
 
     var link = linker.Linker(i8).init(allocator);
-    var vend1 = codegen.Vendor(i8).init(allocator);
+    var isa = codegen.Isa(i8).init(allocator);
+    var vend1 = codegen.Vendor(i8).init(allocator, &isa);
 
-    try openlud.vendor(&vend1);
+    try openlud.vendor(&isa);
 
     var root = try ast(allocator, "_start:\n    init R1;\n    put R1,65,1; ;; put 65 in register 1 at position 1\n    each R1;");
 
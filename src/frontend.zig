@@ -16,9 +16,57 @@ const compiler_pp = @import("compiler_pp.zig");
 const stylist = @import("stylist.zig");
 const diagnostic = @import("stylist_diagnostic.zig");
 const preprocessor = @import("preprocessor.zig");
+const trace = @import("trace.zig");
+const hybrid = @import("hybrid.zig");
+const source_map = @import("source_map.zig");
+const profile = @import("profile.zig");
+const ir = @import("ir.zig");
+const passes = @import("passes.zig");
+const pipeline = @import("pipeline.zig");
+const token_stream = @import("token_stream.zig");
+const batch_io = @import("batch_io.zig");
+const depfile = @import("depfile.zig");
+const lsp = @import("lsp.zig");
+const object = @import("object.zig");
+const archive = @import("archive.zig");
+const codegen_cache = @import("codegen_cache.zig");
+const diagnostics = @import("diagnostics.zig");
 
 const stringCompare = std.ascii.eqlIgnoreCase;
 
+/// An arena owned by a single compiler stage.
+///
+/// Each stage allocates into its own arena and releases it as soon as no later stage needs
+/// that data, instead of everything living until the compiler exits. `release` is safe to call
+/// more than once, so a `defer` can back up an early release.
+const StageArena = struct {
+    arena: std.heap.ArenaAllocator,
+    released: bool = false,
+
+    fn init() StageArena {
+        return StageArena{
+            .arena = std.heap.ArenaAllocator.init(std.heap.page_allocator),
+        };
+    }
+
+    fn allocator(self: *StageArena) std.mem.Allocator {
+        return self.arena.allocator();
+    }
+
+    fn release(self: *StageArena) void {
+        if (self.released) return;
+
+        self.arena.deinit();
+        self.released = true;
+    }
+};
+
+/// Releases `stage`, unless it is null. Stages are null when something else owns their release,
+/// like the source when several targets share it.
+fn releaseStage(stage: ?*StageArena) void {
+    if (stage) |it| it.release();
+}
+
 /// A binding to `compiler.extractOptions`,
 ///
 /// Takes in an allocator and a reporter and passes those options into extractOptions, with the command
@@ -26,7 +74,7 @@ const stringCompare = std.ascii.eqlIgnoreCase;
 fn getOptions(allocator: anytype, reporter: *compiler_output.Reporter) compiler.Options {
     const args = std.process.argsAlloc(allocator) catch {
         reporter.errorMessage("failed to allocate a separate argument buffer. out of memory.", .{});
-        std.process.exit(1);
+        reporter.exit(1);
     };
 
     return compiler.extractOptions(allocator, args, reporter);
@@ -58,62 +106,241 @@ fn vendorStringToVendor(str: []const u8) compiler_vendors.Tag {
         return .siax;
     }
 
+    if (stringCompare(str, "standard")) {
+        return .standard;
+    }
+
     return .unknown;
 }
 
+pub const TargetError = error{
+    /// A target without a format, or with an endianness other than `be` or `le`
+    InvalidTarget,
+
+    /// Two targets of the same format, or with the same output file. They would write over each
+    /// other.
+    DuplicateTarget,
+};
+
+/// One format to generate, from `--format`.
+pub const Target = struct {
+    format: compiler_vendors.Tag,
+
+    /// The format as it was written
+    name: []const u8,
+    endian: std.builtin.Endian,
+    output: []const u8,
+};
+
+/// Reads the targets of `--format`. `spec` is a comma separated list of
+/// `FORMAT[:be|:le][=OUTFILE]`. Targets without an endianness use `endian`. Targets without an
+/// output file use `output`, followed by `.FORMAT` when there is more than one target.
+pub fn parseTargets(allocator: std.mem.Allocator, spec: []const u8, output: []const u8, endian: std.builtin.Endian) ![]Target {
+    var targets = std.ArrayList(Target).init(allocator);
+    errdefer targets.deinit();
+
+    const target_count = std.mem.count(u8, spec, ",") + 1;
+
+    var parts = std.mem.splitScalar(u8, spec, ',');
+
+    while (parts.next()) |part| {
+        var format_part = part;
+        var target_output: ?[]const u8 = null;
+        var target_endian = endian;
+
+        if (std.mem.indexOfScalar(u8, format_part, '=')) |at| {
+            target_output = format_part[at + 1 ..];
+            format_part = format_part[0..at];
+        }
+
+        if (std.mem.indexOfScalar(u8, format_part, ':')) |at| {
+            const endian_name = format_part[at + 1 ..];
+
+            if (stringCompare(endian_name, "be")) {
+                target_endian = .big;
+            } else if (stringCompare(endian_name, "le")) {
+                target_endian = .little;
+            } else {
+                return error.InvalidTarget;
+            }
+
+            format_part = format_part[0..at];
+        }
+
+        if (format_part.len == 0) {
+            return error.InvalidTarget;
+        }
+
+        if (target_output == null) {
+            target_output = if (target_count == 1) output else try std.fmt.allocPrint(allocator, "{s}.{s}", .{ output, format_part });
+        }
+
+        for (targets.items) |earlier| {
+            if (stringCompare(earlier.name, format_part) or std.mem.eql(u8, earlier.output, target_output.?)) {
+                return error.DuplicateTarget;
+            }
+        }
+
+        try targets.append(Target{
+            .format = vendorStringToVendor(format_part),
+            .name = format_part,
+            .endian = target_endian,
+            .output = target_output.?,
+        });
+    }
+
+    return targets.toOwnedSlice();
+}
+
+/// A single target's compile of the shared program. Several of them run at once, one per thread,
+/// so everything shared is only read. Errors exit the process, like every other compile error.
+const TargetCompile = struct {
+    target: Target,
+    target_count: usize,
+    program: *const ir.Program,
+    file_name: []const u8,
+    file_body: []const u8,
+    lexer: *lexer.Lexer,
+    report: *compiler_output.Reporter,
+    optimization_level: u8,
+    optimization_stats: bool,
+
+    /// The passes of `-Ono-NAME`, every one of them exists
+    disabled_passes: []const []const u8,
+
+    index_procedures: bool,
+    tracer: ?*trace.Tracer,
+    profile: ?*const profile.Profile,
+    map_file: ?[]const u8,
+
+    /// Every library of `-l`, each target picks the ones of its format
+    libraries: []const archive.Library,
+
+    /// The directory of `--codegen-cache`, shared by every target
+    cache_dir: ?std.fs.Dir,
+
+    /// Collects the outputs to write them in one batch (`--io-uring`). Null writes each one
+    /// right away.
+    outputs: ?*batch_io.Outputs,
+
+    /// Released by the compile once it no longer needs them. Null when other targets still do.
+    ir_arena: ?*StageArena,
+    source_arena: ?*StageArena,
+};
+
+/// Where `target`'s source map goes. With several targets, each one gets its own.
+fn mapFileFor(allocator: std.mem.Allocator, map_file: []const u8, target: Target, target_count: usize) ![]const u8 {
+    if (target_count == 1) return map_file;
+
+    return std.fmt.allocPrint(allocator, "{s}.{s}", .{ map_file, target.name });
+}
+
+fn compileTarget(job: TargetCompile) void {
+    // the vendor and the linked binary of this target
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    const target_scope = trace.begin(job.tracer, "target", job.target.name);
+    defer target_scope.end();
+
+    // errors move the lexer to where they are, targets that fail at once must not share one.
+    // the copy shares the input and the tokens, which are only read.
+    var target_lexer = job.lexer.*;
+
+    // every target has its own source map, the offsets differ
+    var map: source_map.SourceMap = undefined;
+    var map_ptr: ?*source_map.SourceMap = null;
+    var map_file = job.map_file;
+
+    if (job.map_file) |file| {
+        map = source_map.SourceMap.init(allocator, job.file_name, job.file_body) catch {
+            job.report.errorMessage("failed to allocate a source map. out of memory.", .{});
+            job.report.exit(1);
+        };
+        map_ptr = &map;
+
+        map_file = mapFileFor(allocator, file, job.target, job.target_count) catch {
+            job.report.errorMessage("failed to allocate a source map. out of memory.", .{});
+            job.report.exit(1);
+        };
+    }
+
+    generateMethod(job.target.format, .{
+        .parent_allocator = allocator,
+        .program = job.program,
+        .outfile = job.target.output,
+        .file_name = job.file_name,
+        .lexer = &target_lexer,
+        .report = job.report,
+        .endian = job.target.endian,
+        .target_name = job.target.name,
+        .optimization_level = job.optimization_level,
+        .optimization_stats = job.optimization_stats,
+        .disabled_passes = job.disabled_passes,
+        .index_procedures = job.index_procedures,
+        .tracer = job.tracer,
+        .source_map = map_ptr,
+        .map_file = map_file,
+        .profile = job.profile,
+        .libraries = job.libraries,
+        .cache_dir = job.cache_dir,
+        .outputs = job.outputs,
+        .ir_arena = job.ir_arena,
+        .source_arena = job.source_arena,
+    }) catch |err| {
+        job.report.errorMessage("could not compile '{s}' for {s} ({any})", .{ job.file_name, job.target.name, err });
+        job.report.exit(1);
+    };
+}
+
 fn generateMethod(format: anytype, ctx: anytype) !void {
     switch (format) {
         .openlud => {
-            var gen = codegen.Vendor(i8).init(ctx.parent_allocator);
-            var link = linker.Linker(i8).init(ctx.parent_allocator);
-
-            try drivers.openlud.vendor(&gen);
-
-            // generate the procedure map
-            const res = try gen.generateBinary(ctx.tree);
-            switch (res) {
-                .ok => {},
-                else => |_| {
-                    ctx.report.genError(res, &gen, ctx);
-                    return;
-                },
-            }
+            var isa = codegen.Isa(i8).init(ctx.parent_allocator);
+            try drivers.openlud.vendor(&isa);
 
-            // generate the optimized binary
-            link.linkOptimizedWithContext(drivers.openlud.ctx, &gen, gen.procedure_map) catch |err| ctx.report.linkerError(err, link, ctx);
-            link.writeToFile(ctx.outfile, ctx.endian) catch |err| ctx.report.linkerWriteError(err, link, ctx);
+            try compileWith(i8, &isa, ctx, .{
+                .name = "openlud",
+                .link = drivers.openlud.ctx,
+            });
         },
 
         .nexfuse => {
-            var gen = codegen.Vendor(u8).init(ctx.parent_allocator);
-            var link = linker.Linker(u8).init(ctx.parent_allocator);
-
-            try drivers.nexfuse.runtime(&gen);
-
-            const res = try gen.generateBinary(ctx.tree);
-            switch (res) {
-                .ok => {},
-                else => |_| {
-                    ctx.report.genError(res, &gen, ctx);
-                    return;
-                },
-            }
+            var isa = codegen.Isa(u8).init(ctx.parent_allocator);
+            try drivers.nexfuse.runtime(&isa);
 
-            // TODO: nexfuse binaries should be optimized, however
-            // TODO: some instructions are lost when optimizations occur.
+            // procedures keep their headings, so cold ones can be called instead of folded
+            try compileWith(u8, &isa, ctx, .{
+                .name = "nexfuse",
+                .link = drivers.nexfuse.ctx_no_folding,
+                .indexed = drivers.nexfuse.ctx_indexed,
+                .call_instruction = drivers.nexfuse.call_instruction,
+            });
+        },
 
-            if (ctx.optimization_level > 0) {
-                link.linkOptimizedWithContext(drivers.nexfuse.ctx_no_folding, &gen, gen.procedure_map) catch |err| ctx.report.linkerError(err, link, ctx);
-            } else {
-                link.linkUnOptimizedWithContext(drivers.nexfuse.ctx_no_folding, gen.procedure_map) catch |err| ctx.report.linkerError(err, link, ctx);
-            }
-            link.writeToFile(ctx.outfile, ctx.endian) catch |err| ctx.report.linkerWriteError(err, link, ctx);
+        .standard => {
+            // NexFUSE is the reference encoding, the other 8-bit formats only narrow what the
+            // program may use down to the instructions every one of them has
+            var openlud_isa = codegen.Isa(i8).init(ctx.parent_allocator);
+            var isa = codegen.Isa(u8).init(ctx.parent_allocator);
+
+            try drivers.openlud.vendor(&openlud_isa);
+            try drivers.nexfuse.runtime(&isa);
+
+            try hybrid.restrictToStandard(u8, ctx.parent_allocator, &isa, .{ &openlud_isa, &isa });
+
+            try compileWith(u8, &isa, ctx, .{
+                .name = "standard",
+                .link = drivers.nexfuse.ctx_no_folding,
+            });
         },
 
         else => {
             if (format == .unknown) {
                 ctx.report.errorMessage("you must select a format with `--format' before compiling.  (see --format in the OPTIONS section)", .{});
-                std.process.exit(1);
+                ctx.report.exit(1);
             }
 
             ctx.report.errorMessage("format '{any}' is not currently supported.", .{format});
@@ -121,9 +348,189 @@ fn generateMethod(format: anytype, ctx: anytype) !void {
     }
 }
 
+/// Generates `ctx.program` with `isa`, optimizes, links and writes it. `driver` describes the
+/// format:
+///
+/// * `name`: the format the libraries and cache entries are picked by
+/// * `link`: the linker context
+/// * `indexed`: the linker context of `--index-procedures`, when the format has an index table
+/// * `call_instruction`: the instruction cold procedures are called with, when procedures keep
+///   their headings
+fn compileWith(comptime T: type, isa: *const codegen.Isa(T), ctx: anytype, driver: anytype) !void {
+    var gen = codegen.Vendor(T).init(ctx.parent_allocator, isa);
+    var link = linker.Linker(T).init(ctx.parent_allocator);
+
+    var cache: codegen_cache.Cache = undefined;
+    try configureVendor(T, &gen, &cache, ctx, driver);
+
+    link.source_map = ctx.source_map;
+    link.profile = ctx.profile;
+    link.call_graph = &gen.call_graph;
+
+    var manager = passes.PassManager(T).init(ctx.parent_allocator, ctx.optimization_level);
+    defer manager.deinit();
+
+    try passes.registerDefaultPasses(T, &manager);
+    manager.disabled = ctx.disabled_passes;
+
+    const pass_ctx = passes.Context{ .start_definition = driver.link.start_definition };
+
+    // the passes before codegen change a copy of the program, which lives until it is generated
+    var prepared_arena = std.heap.ArenaAllocator.init(ctx.parent_allocator);
+    defer prepared_arena.deinit();
+
+    const program = try manager.prepare(prepared_arena.allocator(), &gen, ctx.program, pass_ctx);
+
+    // generate the procedure map
+    const codegen_stage = trace.begin(ctx.tracer, "stage", "codegen");
+    const res = try gen.generateProgram(program);
+    codegen_stage.end();
+
+    switch (res) {
+        .ok => {},
+        else => |_| {
+            ctx.report.genError(res, &gen, ctx);
+            return;
+        },
+    }
+
+    // the procedure map holds everything the linker needs
+    releaseStage(ctx.ir_arena);
+
+    try optimize(T, &manager, &gen, ctx, pass_ctx);
+
+    const link_stage = trace.begin(ctx.tracer, "stage", "link");
+    linkFor(T, &link, &gen, driver) catch |err| ctx.report.linkerError(err, link, ctx);
+    link_stage.end();
+
+    // procedure names point into the source, they are not needed past linking
+    writeSourceMap(ctx);
+    releaseStage(ctx.source_arena);
+
+    const write_stage = trace.begin(ctx.tracer, "stage", "write");
+    writeOutput(ctx, &link);
+    write_stage.end();
+}
+
+/// Sets up `gen` for a target the same way for every format, from `ctx` and `driver` (see
+/// `compileWith`). `cache` has to live as long as `gen`.
+fn configureVendor(comptime T: type, gen: *codegen.Vendor(T), cache: *codegen_cache.Cache, ctx: anytype, driver: anytype) !void {
+    gen.libraries = try librariesFor(ctx.parent_allocator, ctx.libraries, driver.name);
+    gen.cache = cacheFor(cache, ctx, driver.name);
+
+    gen.tracer = ctx.tracer;
+    gen.source_map = ctx.source_map;
+    gen.profile = ctx.profile;
+
+    if (@hasField(@TypeOf(driver), "indexed")) {
+        gen.index_procedures = ctx.index_procedures;
+    }
+
+    if (@hasField(@TypeOf(driver), "call_instruction")) {
+        gen.call_instruction = driver.call_instruction;
+    }
+}
+
+/// Links what `gen` generated with the context `driver` has for it (see `compileWith`).
+fn linkFor(comptime T: type, link: *linker.Linker(T), gen: *codegen.Vendor(T), driver: anytype) !void {
+    if (@hasField(@TypeOf(driver), "indexed")) {
+        if (gen.index_procedures) {
+            return link.linkIndexedWithContext(driver.indexed, gen.procedure_indices, gen.procedure_map);
+        }
+    }
+
+    return link.linkUnOptimizedWithContext(driver.link, gen.procedure_map);
+}
+
+/// The libraries of `libraries` made for `format`.
+fn librariesFor(allocator: std.mem.Allocator, libraries: []const archive.Library, format: []const u8) ![]const archive.Library {
+    var matching = std.ArrayList(archive.Library).init(allocator);
+
+    for (libraries) |library| {
+        if (std.mem.eql(u8, library.format, format)) try matching.append(library);
+    }
+
+    return matching.toOwnedSlice();
+}
+
+/// Points `cache` at the directory of `--codegen-cache`, for `format`. Null without one.
+fn cacheFor(cache: *codegen_cache.Cache, ctx: anytype, format: []const u8) ?*codegen_cache.Cache {
+    const dir = ctx.cache_dir orelse return null;
+
+    cache.* = .{ .dir = dir, .format = format };
+
+    return cache;
+}
+
+/// Runs the optimization passes of `manager` over `gen`'s procedure map, and prints what each of
+/// them, and the ones before codegen, did with `-Ostats`.
+fn optimize(comptime T: type, manager: *passes.PassManager(T), gen: *codegen.Vendor(T), ctx: anytype, pass_ctx: passes.Context) !void {
+    const optimize_stage = trace.begin(ctx.tracer, "stage", "optimize");
+    defer optimize_stage.end();
+
+    try manager.run(gen, pass_ctx);
+
+    if (ctx.optimization_stats) {
+        // written at once, so the tables of parallel targets do not interleave
+        var output = std.ArrayList(u8).init(ctx.parent_allocator);
+        defer output.deinit();
+
+        try output.writer().print("{s} ({s}, -O{d}):\n", .{ ctx.file_name, ctx.target_name, ctx.optimization_level });
+        try manager.writeStats(output.writer());
+
+        if (gen.cache) |cache| {
+            try output.writer().print("codegen cache: {d} hits, {d} misses\n", .{ cache.hits, cache.misses });
+        }
+
+        std.io.getStdErr().writeAll(output.items) catch {};
+    }
+}
+
+/// Writes the `--emit-map` sidecar. Procedure names in the map point into the source, so this
+/// runs after linking and before the source is released.
+fn writeSourceMap(ctx: anytype) void {
+    if (ctx.source_map) |map| {
+        if (ctx.outputs) |outputs| {
+            var text = std.ArrayList(u8).init(ctx.parent_allocator);
+            defer text.deinit();
+
+            map.write(text.writer()) catch |err| {
+                ctx.report.errorMessage("could not write source map '{s}' ({any})", .{ ctx.map_file.?, err });
+                ctx.report.exit(1);
+            };
+
+            outputs.add(ctx.map_file.?, text.items) catch |err| {
+                ctx.report.errorMessage("could not write source map '{s}' ({any})", .{ ctx.map_file.?, err });
+                ctx.report.exit(1);
+            };
+
+            return;
+        }
+
+        map.writeToFile(ctx.map_file.?) catch |err| {
+            ctx.report.errorMessage("could not write source map '{s}' ({any})", .{ ctx.map_file.?, err });
+            ctx.report.exit(1);
+        };
+    }
+}
+
+/// Writes the linked binary to `ctx.outfile`, or hands it to `ctx.outputs` to be written with
+/// the outputs of every other target.
+fn writeOutput(ctx: anytype, link: anytype) void {
+    if (ctx.outputs) |outputs| {
+        const bytes = link.encode(ctx.parent_allocator, ctx.endian) catch |err| ctx.report.linkerWriteError(err, link.*, ctx);
+        outputs.add(ctx.outfile, bytes) catch |err| ctx.report.linkerWriteError(err, link.*, ctx);
+
+        return;
+    }
+
+    link.writeToFile(ctx.outfile, ctx.endian) catch |err| ctx.report.linkerWriteError(err, link.*, ctx);
+}
+
 fn checkNumberSizeFor(vm: compiler_vendors.Tag) usize {
     switch (vm) {
         .openlud,
+        .standard,
         => {
             return std.math.maxInt(i8);
         },
@@ -165,6 +572,48 @@ test checkNumberSizeFor {
     try std.testing.expectEqual(checkNumberSizeFor(.siax), std.math.maxInt(i32));
     try std.testing.expectEqual(checkNumberSizeFor(.solarisvm), std.math.maxInt(u32));
     try std.testing.expectEqual(checkNumberSizeFor(.mercury), std.math.maxInt(u8));
+    try std.testing.expectEqual(checkNumberSizeFor(.standard), std.math.maxInt(i8));
+}
+
+test StageArena {
+    var stage = StageArena.init();
+    defer stage.release();
+
+    const buffer = try stage.allocator().alloc(u8, 64);
+    try std.testing.expectEqual(64, buffer.len);
+
+    stage.release();
+    try std.testing.expect(stage.released);
+
+    // releasing twice is harmless, the deferred release above relies on it
+    stage.release();
+}
+
+test parseTargets {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const single = try parseTargets(arena.allocator(), "nexfuse", "a.out", .little);
+
+    try std.testing.expectEqual(1, single.len);
+    try std.testing.expectEqualStrings("a.out", single[0].output);
+
+    const targets = try parseTargets(arena.allocator(), "nexfuse,openlud:be=lud.bin", "a.out", .little);
+
+    try std.testing.expectEqual(2, targets.len);
+    try std.testing.expect(targets[0].format == .nexfuse);
+    try std.testing.expectEqualStrings("a.out.nexfuse", targets[0].output);
+    try std.testing.expectEqual(.little, targets[0].endian);
+    try std.testing.expect(targets[1].format == .openlud);
+    try std.testing.expectEqualStrings("lud.bin", targets[1].output);
+    try std.testing.expectEqual(.big, targets[1].endian);
+
+    try std.testing.expectError(error.InvalidTarget, parseTargets(arena.allocator(), "nexfuse:middle", "a.out", .little));
+    try std.testing.expectError(error.InvalidTarget, parseTargets(arena.allocator(), "nexfuse,", "a.out", .little));
+
+    try std.testing.expectError(error.DuplicateTarget, parseTargets(arena.allocator(), "nexfuse,nexfuse", "a.out", .little));
+    try std.testing.expectError(error.DuplicateTarget, parseTargets(arena.allocator(), "nexfuse:be,nexfuse:le", "a.out", .little));
+    try std.testing.expectError(error.DuplicateTarget, parseTargets(arena.allocator(), "nexfuse=a.bin,openlud=a.bin", "a.out", .little));
 }
 
 test vendorStringToVendor {
@@ -174,42 +623,159 @@ test vendorStringToVendor {
     try std.testing.expect(vendorStringToVendor("solarisvm") == .solarisvm);
     try std.testing.expect(vendorStringToVendor("jade") == .jade);
     try std.testing.expect(vendorStringToVendor("siax") == .siax);
+    try std.testing.expect(vendorStringToVendor("standard") == .standard);
     try std.testing.expect(vendorStringToVendor("unknown") == .unknown);
 }
 
+/// Lexes, parses, preprocesses and lowers into `lowering` with the stages overlapping
+/// (`--pipeline`, see `pipeline.zig`). Errors are reported as the serial stages would, in the same
+/// order. Returns what preprocessing found.
+fn lowerPipelined(
+    report: *compiler_output.Reporter,
+    file: []const u8,
+    lex: *lexer.Lexer,
+    ast_arena: *StageArena,
+    opts: *compiler.Options,
+    lowering: *ir.Lowering,
+    tracer: ?*trace.Tracer,
+) preprocessor.PreprocessorResult {
+    // the parser's thread owns the AST arena, directives get an arena of their own on this thread
+    var pp_arena = StageArena.init();
+    defer pp_arena.release();
+
+    var pp = compiler_pp.initDefaultRuntime(pp_arena.allocator(), opts, tracer) catch |err| report.printError(lex, file, err);
+    defer pp.deinit();
+
+    // the lexer's stream only passes tokens through, the parser keeps the ones it read
+    var tokens = token_stream.TokenStream.init(ast_arena.allocator());
+    var pars = parser.Parser.init(ast_arena.allocator(), &tokens);
+
+    const out = pipeline.lowerPipelined(lex, &pars, &pp, lowering, tracer) catch |err| {
+        report.errorMessage("could not start the pipeline for '{s}' ({any})", .{ file, err });
+        report.exit(1);
+    };
+
+    if (out.lex_error) |err| report.printError(lex, file, err);
+    if (out.parse_error) |err| report.astError(err, .{ .file_name = file }, lex, &pars);
+    if (out.directive_error) |err| report.printError(lex, file, err);
+
+    if (out.lower_error) |err| {
+        report.errorMessage("could not lower '{s}' ({any})", .{ file, err });
+        report.exit(1);
+    }
+
+    return out.preprocess_result;
+}
+
 /// Runs the standard VASM compiler.
 pub fn runCompilerFrontend() !void {
     var report = compiler_output.Reporter.init();
 
+    // lives until exit: options, targets and the trace. every target has its own arena.
     var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
     defer arena.deinit();
 
     const allocator = arena.allocator();
 
+    // the input text. identifiers and spans point into it, so it lives until linking is done.
+    var source_arena = StageArena.init();
+    defer source_arena.release();
+
+    // the token stream, released once the AST is built
+    var token_arena = StageArena.init();
+    defer token_arena.release();
+
+    // the AST and preprocessor state, released once the program is lowered
+    var ast_arena = StageArena.init();
+    defer ast_arena.release();
+
     // the command-line options.
     var opts = getOptions(allocator, &report);
 
+    // diagnostics are collected from here on, unless they are printed as they come. targets add
+    // them from their threads, the sink has an arena of its own.
+    var sink_arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer sink_arena.deinit();
+
+    var sink = diagnostics.Sink.init(sink_arena.allocator(), opts.diagnostics_format);
+    defer sink.deinit();
+
+    if (opts.diagnostics_format != .text) report.sink = &sink;
+    defer report.flush();
+
     // if there's no files, then exit
     if (opts.files.items.len == 0) {
         report.errorMessage("no input files", .{});
-        std.process.exit(1);
+        report.exit(1);
     }
 
+    // records a chrome trace of the compile when `--trace` is given
+    var tracer = trace.Tracer.init(allocator);
+    const tracer_ptr: ?*trace.Tracer = if (opts.trace_file != null) &tracer else null;
+
     // for each file, compile it
     const file = opts.files.items[0];
 
-    var lex = lexer.Lexer.init(allocator);
-    var pars = parser.Parser.init(allocator, &lex.stream);
+    const file_scope = trace.begin(tracer_ptr, "file", file);
+
+    var lex = lexer.Lexer.init(token_arena.allocator());
+    var pars = parser.Parser.init(ast_arena.allocator(), &lex.stream);
 
-    const file_body = std.fs.cwd().readFileAlloc(allocator, file, std.math.maxInt(usize)) catch |err| {
-        report.errorMessage("could not create buffer for file '{s}` ({any})", .{ file, err });
-        std.process.exit(1);
+    // `--io-uring` reads and writes through io_uring where the system has it
+    const io_backend: batch_io.Backend = if (opts.io_uring) .io_uring else .syscalls;
+
+    const read_stage = trace.begin(tracer_ptr, "stage", "read");
+    const file_body = switch (batch_io.readFiles(source_arena.allocator(), std.fs.cwd(), &.{file}, io_backend)) {
+        .ok => |contents| contents[0],
+        .failed => |failure| {
+            report.errorMessage("could not create buffer for file '{s}` ({any})", .{ file, failure.err });
+            report.exit(1);
+        },
     };
+    read_stage.end();
 
     lex.setInputText(file_body);
 
+    // execution counts for `--profile-use`
+    var prof: profile.Profile = undefined;
+    var profile_ptr: ?*const profile.Profile = null;
+
+    if (opts.profile_file) |profile_file| {
+        const profile_text = std.fs.cwd().readFileAlloc(allocator, profile_file, std.math.maxInt(usize)) catch |err| {
+            report.errorMessage("could not read profile '{s}' ({any})", .{ profile_file, err });
+            report.exit(1);
+        };
+
+        prof = profile.Profile.parse(allocator, profile_text) catch |err| {
+            report.errorMessage("could not read profile '{s}' ({any})", .{ profile_file, err });
+            report.exit(1);
+        };
+        profile_ptr = &prof;
+    }
+
+    // `-l` libraries stay mapped until every target is done
+    const libraries = openLibraries(allocator, &report, &opts);
+    defer for (libraries) |*library| library.close();
+
+    var cache_dir: ?std.fs.Dir = null;
+    defer if (cache_dir) |*dir| dir.close();
+
+    if (opts.codegen_cache) |path| {
+        cache_dir = std.fs.cwd().makeOpenPath(path, .{}) catch |err| {
+            report.errorMessage("could not open codegen cache '{s}' ({any})", .{ path, err });
+            report.exit(1);
+        };
+    }
+
     if (opts.stylist) {
-        diagnostic.reportStylist(allocator, &report, .{
+        const stylist_stage = trace.begin(tracer_ptr, "stage", "stylist");
+        defer stylist_stage.end();
+
+        // suggestions are printed right away, nothing outlives the report
+        var stylist_arena = StageArena.init();
+        defer stylist_arena.release();
+
+        diagnostic.reportStylist(stylist_arena.allocator(), &report, .{
             .filename = file,
             .body = file_body,
             .lexer = &lex,
@@ -217,18 +783,46 @@ pub fn runCompilerFrontend() !void {
         });
     }
 
-    lex.startLexingInputText() catch |err| report.printError(&lex, file, err);
+    const last_cached_vm_choice = opts.format;
 
-    var ast = pars.createRootNode() catch |err| report.astError(err, .{
-        .file_name = file,
-    }, &lex, &pars);
+    // the format-neutral program every target generates from, released once codegen is done
+    var ir_arena = StageArena.init();
+    defer ir_arena.release();
 
-    const last_cached_vm_choice = opts.format;
+    // with `--pipeline`, lowered along with lexing and parsing. Otherwise, once the targets are known.
+    var lowering: ir.Lowering = undefined;
+    var ast: parser.Node = undefined;
+    var res: preprocessor.PreprocessorResult = .{ .ok = 0 };
 
-    // THE PREPROCESSOR
-    // runs before compilation, manages compiler variables, etc. Macros are initially ignored by
-    // the compiler.
-    const res = compiler_pp.preprocessWithDefaultRuntime(allocator, &opts, &ast) catch |err| report.printError(&lex, file, err);
+    if (opts.pipeline) {
+        lowering = ir.Lowering.init(ir_arena.allocator());
+        res = lowerPipelined(&report, file, &lex, &ast_arena, &opts, &lowering, tracer_ptr);
+
+        // the lexer only handed its tokens over, the parser's copies are in the AST arena
+        token_arena.release();
+        lex.resetStream(allocator);
+    } else {
+        const lex_stage = trace.begin(tracer_ptr, "stage", "lex");
+        lex.startLexingInputText() catch |err| report.printError(&lex, file, err);
+        lex_stage.end();
+
+        const parse_stage = trace.begin(tracer_ptr, "stage", "parse");
+        ast = pars.createRootNode() catch |err| report.astError(err, .{
+            .file_name = file,
+        }, &lex, &pars);
+        parse_stage.end();
+
+        // the AST holds copies of every token it needs, the stream can go
+        token_arena.release();
+        lex.resetStream(allocator);
+
+        // THE PREPROCESSOR
+        // runs before compilation, manages compiler variables, etc. Macros are initially ignored by
+        // the compiler.
+        const preprocess_stage = trace.begin(tracer_ptr, "stage", "preprocess");
+        res = compiler_pp.preprocessWithDefaultRuntime(ast_arena.allocator(), &opts, &ast, tracer_ptr) catch |err| report.printError(&lex, file, err);
+        preprocess_stage.end();
+    }
 
     if (last_cached_vm_choice != null and opts.format != null and !stringCompare(last_cached_vm_choice.?, opts.format.?) and !stringCompare(last_cached_vm_choice.?, "none")) {
         std.log.warn("conflicting `compat` and `--format` options.", .{});
@@ -242,28 +836,475 @@ pub fn runCompilerFrontend() !void {
         report.printPreprocessError(res, &lex);
     }
 
-    const selected_vm = vendorStringToVendor(opts.format.?);
+    const program = if (opts.pipeline) lowering.finish() else lower: {
+        const lower_stage = trace.begin(tracer_ptr, "stage", "lower");
+        defer lower_stage.end();
+
+        break :lower ir.lower(ir_arena.allocator(), ast) catch |err| {
+            report.errorMessage("could not lower '{s}' ({any})", .{ file, err });
+            report.exit(1);
+        };
+    };
+
+    // the program holds copies of everything codegen needs
+    ast_arena.release();
+
+    // `-c` stops at the format-neutral program, for linking into other programs later
+    if (opts.compile_only) {
+        writeObject(allocator, &report, &program, opts.output);
+
+        file_scope.end();
+        finishCompile(allocator, &report, &opts, &.{}, &tracer);
+
+        return;
+    }
+
+    const targets = parseTargets(allocator, opts.format.?, opts.output, opts.endian) catch |err| {
+        report.errorMessage("invalid format '{s}' ({any})", .{ opts.format.?, err });
+        report.exit(1);
+    };
+
+    var max_number_size: usize = std.math.maxInt(usize);
+
+    for (targets) |target| {
+        if (target.format == .unknown) {
+            report.errorMessage("unknown format '{s}'", .{target.name});
+            report.exit(1);
+        }
 
-    if (selected_vm == .unknown) {
-        report.errorMessage("unknown format '{s}'", .{opts.format.?});
-        std.process.exit(1);
+        max_number_size = @min(max_number_size, checkNumberSizeFor(target.format));
     }
 
-    lex.rules.max_number_size = checkNumberSizeFor(selected_vm);
+    lex.rules.max_number_size = max_number_size;
     lex.rules.check_for_big_numbers = !opts.allow_big_numbers;
 
-    try generateMethod(selected_vm, .{
-        .parent_allocator = allocator,
-        .tree = ast,
-        .outfile = opts.output,
+    checkDisabledPasses(allocator, &report, &opts);
+
+    // objects given after the source are linked into its program (see `object.zig`)
+    const linked = if (opts.files.items.len > 1)
+        linkObjects(&report, &opts, program, source_arena.allocator(), ir_arena.allocator(), io_backend, tracer_ptr)
+    else
+        program;
+
+    // the outputs of every target, written together once all of them are done
+    var outputs = batch_io.Outputs.init(std.heap.page_allocator);
+    defer outputs.deinit();
+
+    var job = TargetCompile{
+        .target = targets[0],
+        .target_count = targets.len,
+        .program = &linked,
         .file_name = file,
+        .file_body = file_body,
         .lexer = &lex,
         .report = &report,
-        .endian = opts.endian,
         .optimization_level = opts.optimization_level,
-    });
+        .optimization_stats = opts.optimization_stats,
+        .disabled_passes = opts.disabled_passes.items,
+        .index_procedures = opts.index_procedures,
+        .tracer = tracer_ptr,
+        .profile = profile_ptr,
+        .map_file = opts.map_file,
+        .libraries = libraries,
+        .cache_dir = cache_dir,
+        .outputs = if (opts.io_uring) &outputs else null,
+        .ir_arena = &ir_arena,
+        .source_arena = &source_arena,
+    };
+
+    if (targets.len == 1) {
+        compileTarget(job);
+    } else {
+        // every target reads the same program, each on its own thread. The program and the
+        // source are released once all of them are done.
+        job.ir_arena = null;
+        job.source_arena = null;
+
+        const threads = try allocator.alloc(std.Thread, targets.len);
+
+        for (targets, threads) |target, *thread| {
+            job.target = target;
+
+            thread.* = std.Thread.spawn(.{}, compileTarget, .{job}) catch |err| {
+                report.errorMessage("could not start a compile for {s} ({any})", .{ target.name, err });
+                report.exit(1);
+            };
+        }
+
+        for (threads) |thread| {
+            thread.join();
+        }
+    }
+
+    if (opts.io_uring) {
+        const write_stage = trace.begin(tracer_ptr, "stage", "write");
+        defer write_stage.end();
+
+        if (outputs.flush(io_backend)) |failure| {
+            report.errorMessage("could not write '{s}' ({any})", .{ failure.path, failure.err });
+            report.exit(1);
+        }
+    }
+
+    file_scope.end();
+
+    finishCompile(allocator, &report, &opts, targets, &tracer);
+}
+
+/// Writes what a compile writes besides its outputs: the depfile and the trace.
+fn finishCompile(allocator: std.mem.Allocator, report: *compiler_output.Reporter, opts: *const compiler.Options, targets: []const Target, tracer: *trace.Tracer) void {
+    if (opts.emit_depfile or opts.depfile != null) {
+        writeDepfile(allocator, opts, targets) catch |err| {
+            report.errorMessage("could not write depfile for '{s}' ({any})", .{ opts.files.items[0], err });
+            report.exit(1);
+        };
+    }
+
+    if (opts.trace_file) |trace_file| {
+        tracer.writeToFile(trace_file) catch |err| {
+            report.errorMessage("could not write trace file '{s}' ({any})", .{ trace_file, err });
+            report.exit(1);
+        };
+    }
+}
+
+/// Writes `program` to the object file `path` (`-c`).
+fn writeObject(allocator: std.mem.Allocator, report: *compiler_output.Reporter, program: *const ir.Program, path: []const u8) void {
+    var bytes = std.ArrayList(u8).init(allocator);
+    defer bytes.deinit();
+
+    object.write(program, bytes.writer()) catch |err| {
+        report.errorMessage("could not write object '{s}' ({any})", .{ path, err });
+        report.exit(1);
+    };
+
+    std.fs.cwd().writeFile(.{ .sub_path = path, .data = bytes.items }) catch |err| {
+        report.errorMessage("could not write object '{s}' ({any})", .{ path, err });
+        report.exit(1);
+    };
+}
+
+/// Reads the objects given after the source file and links their procedures, then the ones of
+/// `program`, into a single program. Objects are read into `source_allocator`, names point into
+/// them the way they point into the source.
+fn linkObjects(
+    report: *compiler_output.Reporter,
+    opts: *const compiler.Options,
+    program: ir.Program,
+    source_allocator: std.mem.Allocator,
+    ir_allocator: std.mem.Allocator,
+    backend: batch_io.Backend,
+    tracer: ?*trace.Tracer,
+) ir.Program {
+    const scope = trace.begin(tracer, "stage", "link objects");
+    defer scope.end();
+
+    const paths = opts.files.items[1..];
+
+    const contents = switch (batch_io.readFiles(source_allocator, std.fs.cwd(), paths, backend)) {
+        .ok => |contents| contents,
+        .failed => |failure| {
+            report.errorMessage("could not read object '{s}' ({any})", .{ failure.path, failure.err });
+            report.exit(1);
+        },
+    };
+
+    // every object, then the source
+    const units = ir_allocator.alloc(ir.Program, paths.len + 1) catch {
+        report.errorMessage("failed to allocate objects. out of memory.", .{});
+        report.exit(1);
+    };
+
+    for (paths, contents, units[0..paths.len]) |path, bytes, *unit| {
+        unit.* = object.read(ir_allocator, bytes) catch |err| {
+            if (err == error.NotAnObject) {
+                report.errorMessage("'{s}' is not an object, only the first input is compiled from source (see -c)", .{path});
+            } else {
+                report.errorMessage("could not read object '{s}' ({any})", .{ path, err });
+            }
+
+            report.exit(1);
+        };
+    }
+
+    units[paths.len] = program;
+
+    return object.link(ir_allocator, units) catch |err| {
+        report.errorMessage("could not link objects into '{s}' ({any})", .{ opts.files.items[0], err });
+        report.exit(1);
+    };
+}
+
+/// Makes sure every pass of `-Ono-NAME` exists. Passes have the same names in every format.
+fn checkDisabledPasses(allocator: std.mem.Allocator, report: *compiler_output.Reporter, opts: *const compiler.Options) void {
+    var manager = passes.PassManager(u8).init(allocator, opts.optimization_level);
+    defer manager.deinit();
+
+    passes.registerDefaultPasses(u8, &manager) catch {
+        report.errorMessage("failed to allocate optimization passes. out of memory.", .{});
+        report.exit(1);
+    };
+
+    manager.disabled = opts.disabled_passes.items;
+
+    if (manager.unknownDisabled()) |name| {
+        report.errorMessage("there is no optimization pass named '{s}' (see -Ostats)", .{name});
+        report.exit(1);
+    }
+}
+
+/// Opens the libraries of `-l` (see `archive.zig`).
+fn openLibraries(allocator: std.mem.Allocator, report: *compiler_output.Reporter, opts: *const compiler.Options) []archive.Library {
+    const libraries = allocator.alloc(archive.Library, opts.libraries.items.len) catch {
+        report.errorMessage("failed to allocate libraries. out of memory.", .{});
+        report.exit(1);
+    };
+
+    for (opts.libraries.items, libraries) |path, *library| {
+        library.* = archive.Library.open(allocator, std.fs.cwd(), path) catch |err| {
+            report.errorMessage("could not open library '{s}' ({any})", .{ path, err });
+            report.exit(1);
+        };
+    }
+
+    return libraries;
+}
+
+/// Writes the depfile (`-MD`, `-MF`): every output of every target (or the object, with `-c`)
+/// depends on the input files, the profile and the libraries, the only files a compile reads.
+fn writeDepfile(allocator: std.mem.Allocator, opts: *const compiler.Options, targets: []const Target) !void {
+    var rule = depfile.Depfile.init(allocator);
+    defer rule.deinit();
+
+    if (opts.compile_only) try rule.addTarget(opts.output);
+
+    for (targets) |target| {
+        try rule.addTarget(target.output);
+
+        if (opts.map_file) |map_file| {
+            try rule.addTarget(try mapFileFor(allocator, map_file, target, targets.len));
+        }
+    }
+
+    for (opts.files.items) |file| {
+        try rule.addDependency(file);
+    }
+
+    if (opts.profile_file) |profile_file| {
+        try rule.addDependency(profile_file);
+    }
+
+    for (opts.libraries.items) |library| {
+        try rule.addDependency(library);
+    }
+
+    const path = opts.depfile orelse try std.fmt.allocPrint(allocator, "{s}.d", .{opts.output});
+
+    try rule.writeToFile(path);
+}
+
+/// An input of `vasm ar`, lowered on its own.
+const ArchiveInput = struct {
+    path: []const u8,
+    program: ir.Program,
+
+    /// Null for objects, they have no source to point errors at
+    lexer: ?*lexer.Lexer,
+};
+
+/// `vasm ar`: generates every procedure of the inputs, sources or objects, for `--format` and
+/// packs them into the library `-o` (see `archive.zig`). Takes the options of a compile, after
+/// `ar`.
+fn runArchiver(args: [][:0]u8) !void {
+    var report = compiler_output.Reporter.init();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    // `ar` stands where the program name stands in a compile
+    var opts = compiler.extractOptions(allocator, args, &report);
+
+    if (opts.files.items.len == 0) {
+        report.errorMessage("no input files", .{});
+        report.exit(1);
+    }
+
+    const contents = switch (batch_io.readFiles(allocator, std.fs.cwd(), opts.files.items, .syscalls)) {
+        .ok => |contents| contents,
+        .failed => |failure| {
+            report.errorMessage("could not create buffer for file '{s}` ({any})", .{ failure.path, failure.err });
+            report.exit(1);
+        },
+    };
+
+    // `--format` wins over `compat`, as in a compile
+    const requested_format = opts.format.?;
+
+    const inputs = try allocator.alloc(ArchiveInput, contents.len);
+    const units = try allocator.alloc(ir.Program, contents.len);
+
+    for (opts.files.items, contents, inputs, units) |path, bytes, *input, *unit| {
+        input.* = try lowerArchiveInput(allocator, &report, &opts, path, bytes);
+        unit.* = input.program;
+    }
+
+    if (!stringCompare(requested_format, "none")) opts.format = requested_format;
+
+    // every procedure is packed on its own, identical ones are not merged
+    const program = object.link(allocator, units) catch |err| {
+        report.errorMessage("could not link the inputs of '{s}' ({any})", .{ opts.output, err });
+        report.exit(1);
+    };
+
+    var library = std.ArrayList(u8).init(allocator);
+
+    switch (vendorStringToVendor(opts.format.?)) {
+        .openlud => {
+            var isa = codegen.Isa(i8).init(allocator);
+            try drivers.openlud.vendor(&isa);
+
+            try packLibrary(i8, allocator, &report, &isa, &program, inputs, "openlud", library.writer());
+        },
+
+        .nexfuse => {
+            var isa = codegen.Isa(u8).init(allocator);
+            try drivers.nexfuse.runtime(&isa);
+
+            try packLibrary(u8, allocator, &report, &isa, &program, inputs, "nexfuse", library.writer());
+        },
+
+        else => {
+            report.errorMessage("libraries can only be made for nexfuse and openlud, not '{s}'. (see --format in the OPTIONS section)", .{opts.format.?});
+            report.exit(1);
+        },
+    }
+
+    std.fs.cwd().writeFile(.{ .sub_path = opts.output, .data = library.items }) catch |err| {
+        report.errorMessage("could not write library '{s}' ({any})", .{ opts.output, err });
+        report.exit(1);
+    };
+}
+
+/// Lexes, parses, preprocesses and lowers the source `bytes`, or reads them when they are an
+/// object.
+fn lowerArchiveInput(
+    allocator: std.mem.Allocator,
+    report: *compiler_output.Reporter,
+    opts: *compiler.Options,
+    path: []const u8,
+    bytes: []const u8,
+) !ArchiveInput {
+    if (object.isObject(bytes)) {
+        const program = object.read(allocator, bytes) catch |err| {
+            report.errorMessage("could not read object '{s}' ({any})", .{ path, err });
+            report.exit(1);
+        };
+
+        return ArchiveInput{ .path = path, .program = program, .lexer = null };
+    }
+
+    const lex = try allocator.create(lexer.Lexer);
+    lex.* = lexer.Lexer.init(allocator);
+    lex.setInputText(bytes);
+
+    lex.startLexingInputText() catch |err| report.printError(lex, path, err);
+
+    var pars = parser.Parser.init(allocator, &lex.stream);
+    var ast = pars.createRootNode() catch |err| report.astError(err, .{
+        .file_name = path,
+    }, lex, &pars);
+
+    const res = compiler_pp.preprocessWithDefaultRuntime(allocator, opts, &ast, null) catch |err| report.printError(lex, path, err);
+
+    if (res != .ok) {
+        report.printPreprocessError(res, lex);
+    }
+
+    const program = ir.lower(allocator, ast) catch |err| {
+        report.errorMessage("could not lower '{s}' ({any})", .{ path, err });
+        report.exit(1);
+    };
+
+    return ArchiveInput{ .path = path, .program = program, .lexer = lex };
+}
+
+/// Generates every procedure of `program` and writes the ones that refer to no other procedure
+/// to `writer`, as a library for `format`. `inputs` are the units `program` was linked from.
+fn packLibrary(
+    comptime T: type,
+    allocator: std.mem.Allocator,
+    report: *compiler_output.Reporter,
+    isa: *const codegen.Isa(T),
+    program: *const ir.Program,
+    inputs: []const ArchiveInput,
+    format: []const u8,
+    writer: anytype,
+) !void {
+    var gen = codegen.Vendor(T).init(allocator, isa);
+
+    for (program.procedures.items, 0..) |*procedure, index| {
+        const res = try gen.generateBinaryProcedure(procedure);
+
+        if (res != .ok) {
+            // linking keeps the procedures of every input together, in order
+            var first: usize = 0;
+
+            const input = for (inputs) |unit| {
+                first += unit.program.procedures.items.len;
+                if (index < first) break unit;
+            } else unreachable;
+
+            if (input.lexer) |lex| {
+                report.genError(res, &gen, .{ .lexer = lex, .file_name = input.path });
+            }
+
+            report.errorMessage("could not generate '{s}' from '{s}' for {s} ({s})", .{ procedure.name, input.path, format, @tagName(res) });
+            report.exit(1);
+        }
+    }
+
+    var procedures = std.ArrayList(archive.Procedure).init(allocator);
+    var it = gen.procedure_map.iterator();
+
+    while (it.next()) |entry| {
+        const name = entry.key_ptr.*;
+
+        // folded calls count as references of the caller as well
+        const refers = for (gen.call_graph.edges.keys()) |edge| {
+            if (std.mem.eql(u8, edge.caller, name)) break true;
+        } else false;
+
+        if (refers) {
+            report.leaveNote("'{s}' refers to other procedures by name, it is left out of the library", .{name});
+            continue;
+        }
+
+        try procedures.append(.{
+            .name = name,
+            .binary = try archive.encode(T, allocator, entry.value_ptr.items),
+        });
+    }
+
+    try archive.write(allocator, writer, format, @sizeOf(T), procedures.items);
 }
 
 pub fn main() !void {
+    // `vasm lsp` serves an editor and `vasm ar` makes libraries, instead of compiling
+    const args = try std.process.argsAlloc(std.heap.page_allocator);
+    defer std.process.argsFree(std.heap.page_allocator, args);
+
+    if (args.len == 2 and std.mem.eql(u8, args[1], "lsp")) {
+        var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+        defer _ = gpa.deinit();
+
+        return lsp.serve(gpa.allocator(), std.io.getStdIn().reader(), std.io.getStdOut().writer());
+    }
+
+    if (args.len >= 2 and std.mem.eql(u8, args[1], "ar")) {
+        return runArchiver(args[1..]);
+    }
+
     try runCompilerFrontend();
 }
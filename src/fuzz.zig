@@ -0,0 +1,147 @@
+//! ## Fuzzing
+//!
+//! A fuzz target for the lexer, the parser and code generation, looking for performance cliffs.
+//!
+//! ```
+//! zig build fuzz --fuzz
+//! ```
+//!
+//! Every input is lexed, parsed and generated for each platform driver while being timed.
+//! Compiler errors are expected, as most fuzzed inputs are not valid LR Assembly. However an input
+//! whose cost goes over its budget (`base_budget_ns` plus `budget_per_byte_ns` for each byte)
+//! fails the test, so the fuzzer keeps it. Super-linear behaviour (for example from the parser
+//! rewinding `stream_pos` or the lexer stepping back a character) shows up here long before a
+//! large program hits it.
+//!
+//! Without `--fuzz` the step runs the seed corpus once.
+//!
+
+const std = @import("std");
+const builtin = @import("builtin");
+const lexer = @import("lexer.zig");
+const parser = @import("parser.zig");
+const codegen = @import("codegen.zig");
+const drivers = @import("drivers.zig");
+
+/// Time every input gets no matter its size. Covers the vendor setup for each driver.
+pub const base_budget_ns: u64 = 5 * std.time.ns_per_ms;
+
+/// Time each byte of input adds to the budget. Linear passes stay far below this.
+pub const budget_per_byte_ns: u64 = 20 * std.time.ns_per_us;
+
+/// The measured cost of compiling one input.
+pub const Cost = struct {
+    input_len: usize,
+    elapsed_ns: u64,
+
+    pub fn budget(self: *const Cost) u64 {
+        return base_budget_ns + self.input_len * budget_per_byte_ns;
+    }
+
+    pub fn nanosecondsPerByte(self: *const Cost) u64 {
+        return self.elapsed_ns / @max(self.input_len, 1);
+    }
+
+    pub fn exceedsBudget(self: *const Cost) bool {
+        return self.elapsed_ns > self.budget();
+    }
+};
+
+/// Runs `input` through the lexer, parser and the code generator of `populate`'s platform.
+/// Any compiler error ends the run early, only the time spent matters here.
+fn compileWith(comptime T: type, allocator: std.mem.Allocator, input: []const u8, populate: anytype) void {
+    var lex = lexer.Lexer.init(allocator);
+
+    // the frontend limits number sizes to the format, instructions assume it
+    lex.rules.max_number_size = std.math.maxInt(T);
+    lex.setInputText(input);
+    lex.startLexingInputText() catch return;
+
+    var pars = parser.Parser.init(allocator, &lex.stream);
+    const root = pars.createRootNode() catch return;
+
+    var isa = codegen.Isa(T).init(allocator);
+    populate(&isa) catch return;
+
+    var gen = codegen.Vendor(T).init(allocator, &isa);
+
+    _ = gen.generateBinary(root) catch return;
+}
+
+/// Compiles `input` for every platform driver and returns how long it took.
+pub fn measure(input: []const u8) !Cost {
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+
+    var timer = try std.time.Timer.start();
+
+    compileWith(i8, arena.allocator(), input, drivers.openlud.vendor);
+    _ = arena.reset(.retain_capacity);
+    compileWith(u8, arena.allocator(), input, drivers.nexfuse.runtime);
+
+    return Cost{
+        .input_len = input.len,
+        .elapsed_ns = timer.read(),
+    };
+}
+
+/// Fails with `error.PerformanceCliff` if compiling `input` goes over its budget.
+pub fn checkInput(input: []const u8) !void {
+    const cost = try measure(input);
+
+    if (cost.exceedsBudget()) {
+        std.debug.print("performance cliff: {d} bytes took {d}ns ({d}ns per byte, budget {d}ns)\n", .{
+            cost.input_len,
+            cost.elapsed_ns,
+            cost.nanosecondsPerByte(),
+            cost.budget(),
+        });
+
+        return error.PerformanceCliff;
+    }
+}
+
+const corpus = [_][]const u8{
+    @embedFile("asm/algo.asm"),
+    @embedFile("asm/asides.asm"),
+    @embedFile("asm/helloworld.asm"),
+    @embedFile("asm/procedure.asm"),
+    @embedFile("asm/ranges.asm"),
+    @embedFile("asm/set.s"),
+    @embedFile("asm/simple_algo.s"),
+};
+
+test "fuzz lexer, parser and codegen" {
+    try checkInput(std.testing.fuzzInput(.{ .corpus = &corpus }));
+}
+
+test "seed corpus compiles" {
+    for (corpus) |input| {
+        _ = try measure(input);
+    }
+}
+
+test "seed corpus stays within budget" {
+    // wall-clock budgets only mean something in an optimized build, debug builds and loaded
+    // machines go over them without any cliff
+    if (builtin.mode != .ReleaseFast) return error.SkipZigTest;
+
+    for (corpus) |input| {
+        try checkInput(input);
+    }
+}
+
+test "cost budget" {
+    const cheap = Cost{ .input_len = 10, .elapsed_ns = base_budget_ns };
+    const cliff = Cost{ .input_len = 10, .elapsed_ns = base_budget_ns + 10 * budget_per_byte_ns + 1 };
+
+    try std.testing.expect(!cheap.exceedsBudget());
+    try std.testing.expect(cliff.exceedsBudget());
+    try std.testing.expectEqual(cliff.elapsed_ns / 10, cliff.nanosecondsPerByte());
+}
+
+test "empty input" {
+    const cost = try measure("");
+
+    try std.testing.expectEqual(0, cost.input_len);
+}
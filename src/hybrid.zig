@@ -30,7 +30,12 @@
 //! ```
 //!
 //! So this functionality is primarily for telling which implementations have the SAME functions, but
-//! this does not mean that they have the same parameters or functionality.
+//! this does not mean that they have the same functionality.
+//!
+//! Instruction sets are compared as bitsets. Every instruction name seen across the vendors gets an
+//! ID in `InstructionIds`, each vendor's set becomes a bitset over those IDs, and the standard graph
+//! is the AND of every bitset. An instruction whose annotation (the operands it takes) is not the
+//! same in every vendor is left out after that, it would fail or miscompile on one of them.
 //!
 
 const std = @import("std");
@@ -39,33 +44,180 @@ const parser = @import("parser.zig");
 const ir = @import("instruction_result.zig");
 
 const Allocator = std.mem.Allocator;
-const Vendor = codegen.Vendor;
+const Isa = codegen.Isa;
+
+/// A set of instructions, indexed by the IDs of an `InstructionIds`.
+pub const InstructionBits = std.DynamicBitSetUnmanaged;
 
-pub fn generateHybridVendor(comptime T: type, vendor_list: std.ArrayList(Vendor(T)), allocator: Allocator) !Vendor(T) {
-    var return_vendor = Vendor(T).init(allocator);
+/// The global instruction ID space. Every instruction name is given an ID the first time it is seen.
+pub const InstructionIds = struct {
+    names: std.StringArrayHashMap(void),
 
-    for (vendor_list.items) |vendor| {
-        var instruction_keyiter = vendor.instruction_set.keyIterator();
+    pub fn init(allocator: Allocator) InstructionIds {
+        return InstructionIds{
+            .names = std.StringArrayHashMap(void).init(allocator),
+        };
+    }
+
+    pub fn deinit(self: *InstructionIds) void {
+        self.names.deinit();
+    }
+
+    /// Gives every instruction of `isa` an ID.
+    pub fn register(self: *InstructionIds, isa: anytype) !void {
+        var instruction_keyiter = isa.instruction_set.keyIterator();
 
         while (instruction_keyiter.next()) |key| {
-            var instruction_is_standard: bool = true;
+            try self.names.put(key.*, {});
+        }
+    }
 
-            for (vendor_list.items) |other_vendor| {
-                if (!other_vendor.instruction_set.contains(key.*)) {
-                    instruction_is_standard = false;
-                }
-            }
+    pub fn count(self: *const InstructionIds) usize {
+        return self.names.count();
+    }
+
+    pub fn getName(self: *const InstructionIds, id: usize) []const u8 {
+        return self.names.keys()[id];
+    }
+
+    /// The instructions `isa` implements. `isa` must have been registered.
+    pub fn bitsOf(self: *const InstructionIds, allocator: Allocator, isa: anytype) !InstructionBits {
+        var bits = try InstructionBits.initEmpty(allocator, self.count());
+
+        var instruction_keyiter = isa.instruction_set.keyIterator();
+
+        while (instruction_keyiter.next()) |key| {
+            bits.set(self.names.getIndex(key.*).?);
+        }
+
+        return bits;
+    }
+};
+
+/// The operands `isa` annotates `name` with. Null without an annotation, the instruction takes
+/// anything then.
+fn signatureOf(isa: anytype, name: []const u8) ?[]const codegen.Type {
+    const annotation = isa.annotations.get(name) orelse return null;
+
+    return annotation.type_list.items;
+}
+
+fn sameSignature(first: ?[]const codegen.Type, second: ?[]const codegen.Type) bool {
+    const first_types = first orelse return second == null;
+    const second_types = second orelse return false;
+
+    if (first_types.len != second_types.len) return false;
+
+    for (first_types, second_types) |first_type, second_type| {
+        if (!std.meta.eql(first_type, second_type)) return false;
+    }
+
+    return true;
+}
+
+/// The instructions every ISA in `isas` implements with the same operands. `isas` is a tuple of
+/// ISA pointers, so the ISAs of different formats can be compared.
+pub fn standardInstructions(allocator: Allocator, ids: *InstructionIds, isas: anytype) !InstructionBits {
+    inline for (isas) |isa| {
+        try ids.register(isa);
+    }
+
+    var standard = try InstructionBits.initFull(allocator, ids.count());
+    errdefer standard.deinit(allocator);
+
+    inline for (isas) |isa| {
+        var bits = try ids.bitsOf(allocator, isa);
+        defer bits.deinit(allocator);
+
+        standard.setIntersection(bits);
+    }
+
+    for (0..ids.count()) |id| {
+        if (!standard.isSet(id)) continue;
+
+        const name = ids.getName(id);
+
+        inline for (isas) |isa| {
+            if (!sameSignature(signatureOf(isas[0], name), signatureOf(isa, name))) standard.unset(id);
+        }
+    }
+
+    return standard;
+}
+
+/// Builds the ISA of the hybrid vendor: the instructions every ISA in `isa_list` implements.
+pub fn generateHybridIsa(comptime T: type, isa_list: std.ArrayList(Isa(T)), allocator: Allocator) !Isa(T) {
+    var return_isa = Isa(T).init(allocator);
+
+    var ids = InstructionIds.init(allocator);
+    defer ids.deinit();
+
+    for (isa_list.items) |*isa| {
+        try ids.register(isa);
+    }
+
+    var standard = try InstructionBits.initFull(allocator, ids.count());
+    defer standard.deinit(allocator);
+
+    for (isa_list.items) |*isa| {
+        var bits = try ids.bitsOf(allocator, isa);
+        defer bits.deinit(allocator);
+
+        standard.setIntersection(bits);
+    }
 
-            if (instruction_is_standard and return_vendor.instruction_set.get(key.*) == null) {
-                try return_vendor.implementInstruction(
-                    key.*,
-                    vendor.instruction_set.getPtr(key.*).?,
-                );
+    for (0..ids.count()) |id| {
+        if (!standard.isSet(id)) continue;
+
+        const name = ids.getName(id);
+
+        for (isa_list.items) |*isa| {
+            if (!sameSignature(signatureOf(&isa_list.items[0], name), signatureOf(isa, name))) standard.unset(id);
+        }
+    }
+
+    // the first ISA that implements an instruction provides its function
+    var standard_iter = standard.iterator(.{});
+
+    while (standard_iter.next()) |id| {
+        const name = ids.getName(id);
+
+        for (isa_list.items) |*isa| {
+            if (isa.instruction_set.getPtr(name)) |instruction| {
+                try return_isa.implementInstruction(name, instruction);
+                break;
             }
         }
     }
 
-    return return_vendor;
+    return return_isa;
+}
+
+/// Turns `base` into a hybrid ISA by removing every instruction that is not implemented by all
+/// of `isas` (a tuple of ISA pointers, which may be of other formats). The rest of `base`,
+/// its bytes and annotations, is kept as is.
+pub fn restrictToStandard(comptime T: type, allocator: Allocator, base: *Isa(T), isas: anytype) !void {
+    var ids = InstructionIds.init(allocator);
+    defer ids.deinit();
+
+    var standard = try standardInstructions(allocator, &ids, isas);
+    defer standard.deinit(allocator);
+
+    var instruction_set = std.StringHashMap(codegen.Instruction(T)).init(base.parent_allocator);
+    errdefer instruction_set.deinit();
+
+    var standard_iter = standard.iterator(.{});
+
+    while (standard_iter.next()) |id| {
+        const name = ids.getName(id);
+
+        if (base.instruction_set.get(name)) |instruction| {
+            try instruction_set.put(name, instruction);
+        }
+    }
+
+    base.instruction_set.deinit();
+    base.instruction_set = instruction_set;
 }
 
 pub fn a(_: *codegen.Generator(i8), _: *codegen.Vendor(i8), _: []parser.Value) codegen.InstructionError!ir.InstructionResult {
@@ -73,13 +225,13 @@ pub fn a(_: *codegen.Generator(i8), _: *codegen.Vendor(i8), _: []parser.Value) c
 }
 
 test {
-    var vend1 = Vendor(i8).init(std.testing.allocator);
-    var vend2 = Vendor(i8).init(std.testing.allocator);
+    var vend1 = Isa(i8).init(std.testing.allocator);
+    var vend2 = Isa(i8).init(std.testing.allocator);
 
     defer vend1.deinit();
     defer vend2.deinit();
 
-    var vendors = std.ArrayList(Vendor(i8)).init(std.testing.allocator);
+    var vendors = std.ArrayList(Isa(i8)).init(std.testing.allocator);
     defer vendors.deinit();
 
     try vend1.createAndImplementInstruction(i8, "hello", &a);
@@ -89,20 +241,20 @@ test {
     try vendors.append(vend1);
     try vendors.append(vend2);
 
-    var hy = try generateHybridVendor(i8, vendors, std.testing.allocator);
+    var hy = try generateHybridIsa(i8, vendors, std.testing.allocator);
     defer hy.deinit();
 
     try std.testing.expectEqual(1, hy.instruction_set.count());
 }
 
 test {
-    var vend1 = Vendor(i8).init(std.testing.allocator);
-    var vend2 = Vendor(i8).init(std.testing.allocator);
+    var vend1 = Isa(i8).init(std.testing.allocator);
+    var vend2 = Isa(i8).init(std.testing.allocator);
 
     defer vend1.deinit();
     defer vend2.deinit();
 
-    var vendors = std.ArrayList(Vendor(i8)).init(std.testing.allocator);
+    var vendors = std.ArrayList(Isa(i8)).init(std.testing.allocator);
     defer vendors.deinit();
 
     // vend 1 & vend 2 have hello
@@ -132,7 +284,7 @@ test {
     try vendors.append(vend1);
     try vendors.append(vend2);
 
-    var hy = try generateHybridVendor(i8, vendors, std.testing.allocator);
+    var hy = try generateHybridIsa(i8, vendors, std.testing.allocator);
     defer hy.deinit();
 
     // the intersection has both hello and world instructions
@@ -140,3 +292,80 @@ test {
     try std.testing.expectEqual(true, hy.instruction_set.contains("hello"));
     try std.testing.expectEqual(true, hy.instruction_set.contains("world"));
 }
+
+pub fn b(_: *codegen.Generator(u8), _: *codegen.Vendor(u8), _: []parser.Value) codegen.InstructionError!ir.InstructionResult {
+    return .ok;
+}
+
+test standardInstructions {
+    var vend1 = Isa(i8).init(std.testing.allocator);
+    var vend2 = Isa(u8).init(std.testing.allocator);
+
+    defer vend1.deinit();
+    defer vend2.deinit();
+
+    try vend1.createAndImplementInstruction(i8, "hello", &a);
+    try vend1.createAndImplementInstruction(i8, "world", &a);
+    try vend2.createAndImplementInstruction(u8, "world", &b);
+    try vend2.createAndImplementInstruction(u8, "again", &b);
+
+    var ids = InstructionIds.init(std.testing.allocator);
+    defer ids.deinit();
+
+    var standard = try standardInstructions(std.testing.allocator, &ids, .{ &vend1, &vend2 });
+    defer standard.deinit(std.testing.allocator);
+
+    try std.testing.expectEqual(3, ids.count());
+    try std.testing.expectEqual(1, standard.count());
+
+    var standard_iter = standard.iterator(.{});
+    try std.testing.expectEqualStrings("world", ids.getName(standard_iter.next().?));
+}
+
+test restrictToStandard {
+    var vend1 = Isa(i8).init(std.testing.allocator);
+    var vend2 = Isa(u8).init(std.testing.allocator);
+
+    defer vend1.deinit();
+    defer vend2.deinit();
+
+    try vend1.createAndImplementInstruction(i8, "hello", &a);
+    try vend2.createAndImplementInstruction(u8, "hello", &b);
+    try vend2.createAndImplementInstruction(u8, "world", &b);
+
+    vend2.end_byte = 22;
+
+    try restrictToStandard(u8, std.testing.allocator, &vend2, .{ &vend1, &vend2 });
+
+    try std.testing.expectEqual(1, vend2.instruction_set.count());
+    try std.testing.expect(vend2.instruction_set.contains("hello"));
+    try std.testing.expectEqual(22, vend2.end_byte);
+}
+
+test "instructions with other operands" {
+    // annotations are not freed with their ISA
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var vend1 = Isa(i8).init(arena.allocator());
+    var vend2 = Isa(u8).init(arena.allocator());
+
+    try vend1.createAndImplementInstructionWithAnnotation(i8, "mov", &a, &.{ codegen.Type.init(.register), codegen.Type.init(.number) });
+    try vend2.createAndImplementInstructionWithAnnotation(u8, "mov", &b, &.{ codegen.Type.init(.register), codegen.Type.init(.number) });
+    try vend1.createAndImplementInstructionWithAnnotation(i8, "echo", &a, &.{codegen.Type.init(.literal)});
+    try vend2.createAndImplementInstructionWithAnnotation(u8, "echo", &b, &.{codegen.Type.init(.register)});
+    try vend1.createAndImplementInstructionWithAnnotation(i8, "clear", &a, &.{});
+    try vend2.createAndImplementInstruction(u8, "clear", &b);
+
+    var ids = InstructionIds.init(std.testing.allocator);
+    defer ids.deinit();
+
+    var standard = try standardInstructions(std.testing.allocator, &ids, .{ &vend1, &vend2 });
+    defer standard.deinit(std.testing.allocator);
+
+    // `echo` takes another operand, `clear` is annotated in only one of them
+    try std.testing.expectEqual(1, standard.count());
+
+    var standard_iter = standard.iterator(.{});
+    try std.testing.expectEqualStrings("mov", ids.getName(standard_iter.next().?));
+}
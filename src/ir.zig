@@ -0,0 +1,420 @@
+//! ## Intermediate Representation
+//!
+//! A format-neutral form of a program, between the syntax tree and `codegen.Vendor`. Lowering
+//! resolves everything that does not depend on the target format once, so a single parse can be
+//! generated for several formats:
+//!
+//! * Asides are expanded. Operands that name a `:set` value hold that value instead.
+//! * Every statement is known to be either a call to an earlier procedure or an instruction.
+//! * Each procedure lists the procedures it calls, which makes up the call graph.
+//!
+//! A `Program` is only read after lowering, any number of vendors can generate from it at once.
+//! Names and values still point into the source, which has to outlive the program.
+//!
+
+const std = @import("std");
+const parser = @import("parser.zig");
+const token_stream = @import("token_stream.zig");
+
+const Identifier = token_stream.Identifier;
+const Span = token_stream.Span;
+const Node = parser.Node;
+const Value = parser.Value;
+const Aside = @import("ctypes/Aside.zig");
+
+pub const Error = error{
+    /// A node that can not be at the root of a program, like a stray instruction
+    InvalidExpressionRoot,
+};
+
+pub const StatementTag = enum {
+    /// A call to a procedure defined earlier, which is folded in or called depending on the format
+    call,
+
+    /// An instruction of the target format
+    instruction,
+};
+
+pub const Statement = union(StatementTag) {
+    call: Identifier,
+    instruction: Instruction,
+
+    /// The name the statement was written with.
+    pub fn name(self: *const Statement) Identifier {
+        return switch (self.*) {
+            .call => |callee| callee,
+            .instruction => |ins| ins.name,
+        };
+    }
+};
+
+pub const Instruction = struct {
+    name: Identifier,
+
+    /// Operands with asides already expanded
+    operands: []Value,
+};
+
+pub const Procedure = struct {
+    name: []const u8,
+    statements: std.ArrayList(Statement),
+
+    /// Names of the procedures called by this one, each listed once, in order of their first call.
+    callees: std.ArrayList([]const u8),
+};
+
+/// Best to allocate with an arena.
+pub const Program = struct {
+    parent_allocator: std.mem.Allocator,
+
+    /// In source order. A procedure can only call procedures before it.
+    procedures: std.ArrayList(Procedure),
+
+    pub fn init(parent_allocator: std.mem.Allocator) Program {
+        return Program{
+            .parent_allocator = parent_allocator,
+            .procedures = std.ArrayList(Procedure).init(parent_allocator),
+        };
+    }
+
+    pub fn deinit(self: *Program) void {
+        for (self.procedures.items) |*procedure| {
+            for (procedure.statements.items) |statement| {
+                switch (statement) {
+                    .instruction => |ins| self.parent_allocator.free(ins.operands),
+                    .call => {},
+                }
+            }
+
+            procedure.statements.deinit();
+            procedure.callees.deinit();
+        }
+
+        self.procedures.deinit();
+    }
+
+    /// A copy whose procedures can be changed without changing this program. Operands are shared
+    /// with it, so the copy is not freed with `deinit`. Best to allocate with an arena.
+    pub fn clone(self: *const Program, allocator: std.mem.Allocator) !Program {
+        var copy = Program.init(allocator);
+        try copy.procedures.ensureTotalCapacity(self.procedures.items.len);
+
+        for (self.procedures.items) |procedure| {
+            var statements = try std.ArrayList(Statement).initCapacity(allocator, procedure.statements.items.len);
+            statements.appendSliceAssumeCapacity(procedure.statements.items);
+
+            var callees = try std.ArrayList([]const u8).initCapacity(allocator, procedure.callees.items.len);
+            callees.appendSliceAssumeCapacity(procedure.callees.items);
+
+            copy.procedures.appendAssumeCapacity(Procedure{
+                .name = procedure.name,
+                .statements = statements,
+                .callees = callees,
+            });
+        }
+
+        return copy;
+    }
+
+    /// The procedure named `name`. With several definitions, the last one.
+    pub fn getProcedure(self: *const Program, name: []const u8) ?*const Procedure {
+        var i = self.procedures.items.len;
+
+        while (i > 0) {
+            i -= 1;
+
+            if (std.mem.eql(u8, self.procedures.items[i].name, name)) {
+                return &self.procedures.items[i];
+            }
+        }
+
+        return null;
+    }
+
+    /// The lowest register from R1 up to `highest` (at most R255) that no instruction of the
+    /// program names. Null when the program names every one of them.
+    pub fn findUnusedRegister(self: *const Program, highest: usize) ?usize {
+        var named = std.StaticBitSet(256).initEmpty();
+
+        for (self.procedures.items) |procedure| {
+            for (procedure.statements.items) |statement| {
+                if (statement != .instruction) continue;
+
+                for (statement.instruction.operands) |operand| {
+                    if (operand != .register) continue;
+
+                    const number = operand.register.getRegisterNumber();
+                    if (number < named.capacity()) named.set(number);
+                }
+            }
+        }
+
+        for (1..@min(highest, named.capacity() - 1) + 1) |number| {
+            if (!named.isSet(number)) return number;
+        }
+
+        return null;
+    }
+
+    /// Finds forwarding procedures, whose only statement calls another procedure with
+    /// `call_instruction`, and maps each one to the procedure its chain of forwards ends at. Calling
+    /// a forwarding procedure is the same as calling that procedure directly. Forwards that end in a
+    /// cycle are left out.
+    pub fn findForwards(self: *const Program, allocator: std.mem.Allocator, call_instruction: []const u8) !std.StringHashMap([]const u8) {
+        // procedure -> the procedure it calls
+        var direct = std.StringHashMap([]const u8).init(allocator);
+        defer direct.deinit();
+
+        for (self.procedures.items) |procedure| {
+            // a later definition replaces an earlier one
+            _ = direct.remove(procedure.name);
+
+            if (procedure.statements.items.len != 1) continue;
+
+            const statement = procedure.statements.items[0];
+
+            if (statement != .instruction) continue;
+
+            const ins = statement.instruction;
+
+            if (!std.mem.eql(u8, ins.name.toString(), call_instruction)) continue;
+            if (ins.operands.len != 1 or ins.operands[0] != .identifier) continue;
+
+            try direct.put(procedure.name, ins.operands[0].identifier.toString());
+        }
+
+        var forwards = std.StringHashMap([]const u8).init(allocator);
+        errdefer forwards.deinit();
+
+        var iterator = direct.iterator();
+
+        next_forward: while (iterator.next()) |entry| {
+            var target = entry.value_ptr.*;
+            var steps: usize = 0;
+
+            while (direct.get(target)) |next| {
+                steps += 1;
+
+                // longer than every forward at once, it loops
+                if (steps > direct.count()) continue :next_forward;
+
+                target = next;
+            }
+
+            try forwards.put(entry.key_ptr.*, target);
+        }
+
+        return forwards;
+    }
+};
+
+/// Lowers the (preprocessed) syntax tree `root` into a program. The tree can be freed afterwards,
+/// the source it was parsed from can not.
+pub fn lower(parent_allocator: std.mem.Allocator, root: Node) !Program {
+    var lowering = Lowering.init(parent_allocator);
+    errdefer lowering.deinit();
+
+    switch (root) {
+        .root => |root_node| {
+            for (root_node.children.items) |child| {
+                try lowering.add(child);
+            }
+        },
+
+        else => {},
+    }
+
+    return lowering.finish();
+}
+
+/// Lowers a tree one root node at a time, in source order, for a parser that hands nodes over
+/// as it finishes them (see `pipeline.zig`).
+pub const Lowering = struct {
+    program: Program,
+
+    /// `:set` values seen so far
+    expandables: std.StringHashMap(Value),
+
+    /// Procedures defined so far, a name only refers to a procedure after its definition
+    defined: std.StringHashMap(void),
+
+    pub fn init(parent_allocator: std.mem.Allocator) Lowering {
+        return Lowering{
+            .program = Program.init(parent_allocator),
+            .expandables = std.StringHashMap(Value).init(parent_allocator),
+            .defined = std.StringHashMap(void).init(parent_allocator),
+        };
+    }
+
+    /// Frees the program as well, unless it was taken with `finish`.
+    pub fn deinit(self: *Lowering) void {
+        self.program.deinit();
+        self.expandables.deinit();
+        self.defined.deinit();
+    }
+
+    /// Lowers `node`, a child of the root.
+    pub fn add(self: *Lowering, node: Node) !void {
+        switch (node) {
+            .procedure => |proc| {
+                const procedure = try lowerProcedure(self.program.parent_allocator, proc, &self.expandables, &self.defined);
+
+                try self.program.procedures.append(procedure);
+                try self.defined.put(proc.header, {});
+            },
+
+            // macros are handled by the preprocessor
+            .macro => {},
+
+            .aside => |aside| try expandAside(&self.expandables, aside),
+
+            else => return error.InvalidExpressionRoot,
+        }
+    }
+
+    /// The lowered program, owned by the caller.
+    pub fn finish(self: *Lowering) Program {
+        self.expandables.deinit();
+        self.defined.deinit();
+
+        return self.program;
+    }
+};
+
+/// Lowers a single procedure. A name in `defined` is a call, an operand named in `expandables`
+/// holds its value. Lowering a whole tree builds both up as it goes, an editor that only lowers
+/// the procedure that changed passes in what comes before it.
+pub fn lowerProcedure(
+    parent_allocator: std.mem.Allocator,
+    proc: parser.Procedure,
+    expandables: *const std.StringHashMap(Value),
+    defined: *const std.StringHashMap(void),
+) !Procedure {
+    var procedure = Procedure{
+        .name = proc.header,
+        .statements = std.ArrayList(Statement).init(parent_allocator),
+        .callees = std.ArrayList([]const u8).init(parent_allocator),
+    };
+
+    try procedure.statements.ensureTotalCapacity(proc.children.items.len);
+
+    for (proc.children.items) |child| {
+        switch (child) {
+            .instruction_call => |ins| {
+                const name = ins.name.toString();
+
+                // user-defined procedures take precedence over instructions
+                if (defined.contains(name)) {
+                    try procedure.statements.append(Statement{ .call = ins.name });
+
+                    if (!containsName(procedure.callees.items, name)) {
+                        try procedure.callees.append(name);
+                    }
+
+                    continue;
+                }
+
+                const operands = try parent_allocator.alloc(Value, ins.parameters.items.len);
+
+                for (ins.parameters.items, operands) |parameter, *operand| {
+                    operand.* = parameter;
+
+                    if (parameter == .identifier) {
+                        if (expandables.get(parameter.identifier.toString())) |value| {
+                            operand.* = value;
+                        }
+                    }
+                }
+
+                try procedure.statements.append(Statement{
+                    .instruction = Instruction{
+                        .name = ins.name,
+                        .operands = operands,
+                    },
+                });
+            },
+
+            else => {},
+        }
+    }
+
+    return procedure;
+}
+
+pub fn expandAside(expandables: *std.StringHashMap(Value), aside: Aside) !void {
+    if (std.ascii.eqlIgnoreCase(aside.name.toString(), "set")) {
+        const ident_name = aside.parameters.items[0].toIdentifier().toString();
+        const value = aside.parameters.items[1];
+
+        try expandables.put(ident_name, value);
+    }
+}
+
+fn containsName(names: []const []const u8, name: []const u8) bool {
+    for (names) |it| {
+        if (std.mem.eql(u8, it, name)) return true;
+    }
+
+    return false;
+}
+
+fn lowerText(allocator: std.mem.Allocator, text: []const u8) !Program {
+    var lexer = @import("lexer.zig").Lexer.init(allocator);
+
+    lexer.setInputText(text);
+    try lexer.startLexingInputText();
+
+    var pars = parser.Parser.init(allocator, &lexer.stream);
+
+    return lower(allocator, try pars.createRootNode());
+}
+
+test "lowering calls and instructions" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const program = try lowerText(arena.allocator(), "b: a\n\na: mov\n\n_start: a\nb\na\n");
+
+    try std.testing.expectEqual(3, program.procedures.items.len);
+
+    // `a` is not defined yet when `b` is
+    const b = program.getProcedure("b").?;
+    try std.testing.expect(b.statements.items[0] == .instruction);
+    try std.testing.expectEqual(0, b.callees.items.len);
+
+    const start = program.getProcedure("_start").?;
+    try std.testing.expectEqual(3, start.statements.items.len);
+    try std.testing.expect(start.statements.items[0] == .call);
+    try std.testing.expectEqualStrings("b", start.statements.items[1].name().toString());
+
+    try std.testing.expectEqual(2, start.callees.items.len);
+    try std.testing.expectEqualStrings("a", start.callees.items[0]);
+    try std.testing.expectEqualStrings("b", start.callees.items[1]);
+}
+
+test "lowering expands asides" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const program = try lowerText(arena.allocator(), ":set VALUE 10\n_start: mov R1, VALUE\n");
+
+    const operands = program.getProcedure("_start").?.statements.items[0].instruction.operands;
+
+    try std.testing.expectEqual(2, operands.len);
+    try std.testing.expectEqual(10, operands[1].toNumber().getNumber());
+}
+
+test "finding forwarding procedures" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const program = try lowerText(arena.allocator(), "c: mov R1, 1\n\nb: jmp c\n\na: jmp b\n\nx: jmp y\n\ny: jmp x\n\n_start: jmp a\nmov R1, 2\n");
+
+    var forwards = try program.findForwards(arena.allocator(), "jmp");
+
+    try std.testing.expectEqual(2, forwards.count());
+    try std.testing.expectEqualStrings("c", forwards.get("a").?);
+    try std.testing.expectEqualStrings("c", forwards.get("b").?);
+    try std.testing.expect(forwards.get("x") == null);
+    try std.testing.expect(forwards.get("_start") == null);
+}
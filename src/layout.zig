@@ -0,0 +1,357 @@
+//! ## Procedure Layout
+//!
+//! Orders non-folded procedures so callers and their callees end up next to each other in the
+//! binary, which keeps the code a VM runs together in its cache. This is the procedure placement
+//! of Pettis and Hansen:
+//!
+//! 1. Every procedure starts as a chain of its own.
+//! 2. Call graph edges are visited heaviest first. An edge between two chains merges them, in the
+//!    orientation that puts the caller and callee closest together.
+//! 3. Chains are placed heaviest first, procedures without calls keep their order at the end.
+//!
+//! Linkers place `_start` after every other procedure, so it is pinned to the end: its chain is
+//! never turned around and goes last, which puts the procedures it calls right before it.
+//!
+//! Edges are weighed by how often codegen saw the call (static counts). With a profile, each call
+//! also counts as often as the callee ran.
+//!
+
+const std = @import("std");
+const profile = @import("profile.zig");
+
+/// A call from one procedure to another.
+pub const Edge = struct {
+    caller: []const u8,
+    callee: []const u8,
+};
+
+const EdgeContext = struct {
+    pub fn hash(self: EdgeContext, edge: Edge) u32 {
+        _ = self;
+
+        var hasher = std.hash.Wyhash.init(0);
+        hasher.update(edge.caller);
+        hasher.update(&.{0});
+        hasher.update(edge.callee);
+
+        return @truncate(hasher.final());
+    }
+
+    pub fn eql(self: EdgeContext, a: Edge, b: Edge, b_index: usize) bool {
+        _ = self;
+        _ = b_index;
+
+        return std.mem.eql(u8, a.caller, b.caller) and std.mem.eql(u8, a.callee, b.callee);
+    }
+};
+
+/// Calls between procedures, with the number of times each one was seen.
+pub const CallGraph = struct {
+    edges: std.ArrayHashMap(Edge, u64, EdgeContext, true),
+
+    pub fn init(parent_allocator: std.mem.Allocator) CallGraph {
+        return CallGraph{
+            .edges = std.ArrayHashMap(Edge, u64, EdgeContext, true).init(parent_allocator),
+        };
+    }
+
+    pub fn deinit(self: *CallGraph) void {
+        self.edges.deinit();
+    }
+
+    pub fn addCall(self: *CallGraph, caller: []const u8, callee: []const u8, count: u64) error{OutOfMemory}!void {
+        const entry = try self.edges.getOrPut(.{ .caller = caller, .callee = callee });
+
+        if (!entry.found_existing) entry.value_ptr.* = 0;
+        entry.value_ptr.* +|= count;
+    }
+
+    /// Gives `caller` the calls of `folded`, whose body was folded into it.
+    pub fn addFolded(self: *CallGraph, caller: []const u8, folded: []const u8) error{OutOfMemory}!void {
+        const count = self.edges.count();
+
+        // adding calls can move the keys, index them again every time
+        for (0..count) |i| {
+            const edge = self.edges.keys()[i];
+
+            if (std.mem.eql(u8, edge.caller, folded)) {
+                try self.addCall(caller, edge.callee, self.edges.values()[i]);
+            }
+        }
+    }
+};
+
+const WeightedEdge = struct {
+    a: usize,
+    b: usize,
+    weight: u64,
+
+    fn heavier(context: void, lhs: WeightedEdge, rhs: WeightedEdge) bool {
+        _ = context;
+        return lhs.weight > rhs.weight;
+    }
+};
+
+const Chain = struct {
+    members: std.ArrayList(usize),
+
+    /// Sort key, heavier chains are placed first
+    weight: u64 = 0,
+};
+
+/// Orders `names` by call affinity. Calls to or from procedures not in `names` are ignored.
+/// `last` (when it is in `names`) is placed last, whatever the weight of its chain. The result is
+/// owned by the caller.
+pub fn affinityOrder(allocator: std.mem.Allocator, names: []const []const u8, last: ?[]const u8, graph: *const CallGraph, prof: ?*const profile.Profile) ![][]const u8 {
+    var arena = std.heap.ArenaAllocator.init(allocator);
+    defer arena.deinit();
+
+    const temporary = arena.allocator();
+
+    var index_of = std.StringHashMap(usize).init(temporary);
+    try index_of.ensureTotalCapacity(@intCast(names.len));
+
+    for (names, 0..) |name, i| {
+        index_of.putAssumeCapacity(name, i);
+    }
+
+    var edges = std.ArrayList(WeightedEdge).init(temporary);
+    var iterator = graph.edges.iterator();
+
+    while (iterator.next()) |entry| {
+        const a = index_of.get(entry.key_ptr.caller) orelse continue;
+        const b = index_of.get(entry.key_ptr.callee) orelse continue;
+
+        if (a == b) continue;
+
+        var weight = entry.value_ptr.*;
+
+        if (prof) |p| {
+            weight *|= @max(1, p.countOf(entry.key_ptr.callee));
+        }
+
+        try edges.append(.{ .a = a, .b = b, .weight = weight });
+    }
+
+    std.sort.block(WeightedEdge, edges.items, {}, WeightedEdge.heavier);
+
+    // chain id -> chain, and procedure -> the id of its chain
+    const chains = try temporary.alloc(Chain, names.len);
+    const chain_of = try temporary.alloc(usize, names.len);
+
+    for (chains, chain_of, 0..) |*chain, *id, i| {
+        chain.* = Chain{ .members = std.ArrayList(usize).init(temporary) };
+        try chain.members.append(i);
+        id.* = i;
+    }
+
+    const pinned: ?usize = if (last) |name| index_of.get(name) else null;
+
+    for (edges.items) |edge| {
+        var first = chain_of[edge.a];
+        var second = chain_of[edge.b];
+
+        var a = edge.a;
+        var b = edge.b;
+
+        chains[first].weight +|= edge.weight;
+
+        if (first == second) continue;
+
+        // the chain of `last` ends with it, so it goes after the other one and is never turned
+        const pins_first = if (pinned) |index| chain_of[index] == first else false;
+
+        if (pins_first) {
+            std.mem.swap(usize, &first, &second);
+            std.mem.swap(usize, &a, &b);
+        }
+
+        const pins_second = if (pinned) |index| chain_of[index] == second else false;
+
+        try merge(&chains[first], &chains[second], a, b, pins_second);
+
+        for (chains[first].members.items) |member| {
+            chain_of[member] = first;
+        }
+    }
+
+    // with a profile, the hottest procedure of a chain decides where it goes
+    if (prof) |p| {
+        for (chains) |*chain| {
+            if (chain.members.items.len == 0) continue;
+
+            chain.weight = 0;
+
+            for (chain.members.items) |member| {
+                chain.weight = @max(chain.weight, p.countOf(names[member]));
+            }
+        }
+    }
+
+    var placed = std.ArrayList(*const Chain).init(temporary);
+
+    for (chains) |*chain| {
+        if (chain.members.items.len > 0) try placed.append(chain);
+    }
+
+    std.sort.block(*const Chain, placed.items, {}, heavierChain);
+
+    if (pinned) |index| {
+        const chain = &chains[chain_of[index]];
+        const at = std.mem.indexOfScalar(*const Chain, placed.items, chain).?;
+
+        _ = placed.orderedRemove(at);
+        placed.appendAssumeCapacity(chain);
+    }
+
+    const order = try allocator.alloc([]const u8, names.len);
+    var at: usize = 0;
+
+    for (placed.items) |chain| {
+        for (chain.members.items) |member| {
+            order[at] = names[member];
+            at += 1;
+        }
+    }
+
+    return order;
+}
+
+fn heavierChain(context: void, lhs: *const Chain, rhs: *const Chain) bool {
+    _ = context;
+    return lhs.weight > rhs.weight;
+}
+
+/// Appends `second` to `first`, turning either of them around so `a` (in `first`) and `b` (in
+/// `second`) end up as close as they can. `second` keeps its direction when it is `fixed`. The
+/// weight of `second` joins `first`, `second` is emptied.
+fn merge(first: *Chain, second: *Chain, a: usize, b: usize, fixed: bool) !void {
+    const first_len = first.members.items.len;
+    const second_len = second.members.items.len;
+
+    const at_a = std.mem.indexOfScalar(usize, first.members.items, a).?;
+    const at_b = std.mem.indexOfScalar(usize, second.members.items, b).?;
+
+    // elements between `a` and the end of `first`, and between the start of `second` and `b`,
+    // for each way of turning the chains
+    const a_to_end = [2]usize{ first_len - 1 - at_a, at_a };
+    const start_to_b = [2]usize{ at_b, second_len - 1 - at_b };
+
+    var best_first: usize = 0;
+    var best_second: usize = 0;
+
+    for (0..2) |turn_first| {
+        for (0..@as(usize, if (fixed) 1 else 2)) |turn_second| {
+            if (a_to_end[turn_first] + start_to_b[turn_second] < a_to_end[best_first] + start_to_b[best_second]) {
+                best_first = turn_first;
+                best_second = turn_second;
+            }
+        }
+    }
+
+    if (best_first == 1) std.mem.reverse(usize, first.members.items);
+    if (best_second == 1) std.mem.reverse(usize, second.members.items);
+
+    try first.members.appendSlice(second.members.items);
+    first.weight +|= second.weight;
+
+    second.members.clearRetainingCapacity();
+    second.weight = 0;
+}
+
+test affinityOrder {
+    var graph = CallGraph.init(std.testing.allocator);
+    defer graph.deinit();
+
+    try graph.addCall("a", "c", 10);
+    try graph.addCall("e", "c", 5);
+    try graph.addCall("b", "d", 1);
+    try graph.addCall("b", "outside", 50);
+
+    const names = [_][]const u8{ "a", "b", "c", "d", "e", "lonely" };
+
+    const order = try affinityOrder(std.testing.allocator, &names, null, &graph, null);
+    defer std.testing.allocator.free(order);
+
+    // `e` joins the chain of `a` and `c` next to `c`
+    const expected = [_][]const u8{ "e", "c", "a", "b", "d", "lonely" };
+
+    for (expected, order) |want, got| {
+        try std.testing.expectEqualStrings(want, got);
+    }
+}
+
+test "affinity with a profile" {
+    var graph = CallGraph.init(std.testing.allocator);
+    defer graph.deinit();
+
+    try graph.addCall("a", "b", 1);
+    try graph.addCall("c", "d", 1);
+
+    var prof = profile.Profile.init(std.testing.allocator);
+    defer prof.deinit();
+
+    try prof.add("d", 1000);
+    try prof.add("b", 3);
+
+    const names = [_][]const u8{ "a", "b", "c", "d" };
+
+    const order = try affinityOrder(std.testing.allocator, &names, null, &graph, &prof);
+    defer std.testing.allocator.free(order);
+
+    // the chain with the hot `d` goes first
+    try std.testing.expectEqualStrings("c", order[0]);
+    try std.testing.expectEqualStrings("d", order[1]);
+    try std.testing.expectEqualStrings("a", order[2]);
+    try std.testing.expectEqualStrings("b", order[3]);
+}
+
+test "merging turns chains around" {
+    var first = Chain{ .members = std.ArrayList(usize).init(std.testing.allocator) };
+    defer first.members.deinit();
+
+    var second = Chain{ .members = std.ArrayList(usize).init(std.testing.allocator) };
+    defer second.members.deinit();
+
+    try first.members.appendSlice(&.{ 0, 1, 2 });
+    try second.members.appendSlice(&.{ 3, 4, 5 });
+
+    first.weight = 4;
+    second.weight = 7;
+
+    // 0 and 5 are at the far ends, both chains have to turn around
+    try merge(&first, &second, 0, 5, false);
+
+    try std.testing.expectEqualSlices(usize, &.{ 2, 1, 0, 5, 4, 3 }, first.members.items);
+    try std.testing.expectEqual(0, second.members.items.len);
+    try std.testing.expectEqual(11, first.weight);
+    try std.testing.expectEqual(0, second.weight);
+
+    try second.members.appendSlice(&.{ 6, 7 });
+
+    // a fixed chain keeps its direction, even with 6 further from `first`
+    try merge(&first, &second, 3, 7, true);
+
+    try std.testing.expectEqualSlices(usize, &.{ 2, 1, 0, 5, 4, 3, 6, 7 }, first.members.items);
+}
+
+test "procedures `_start` calls go right before it" {
+    var graph = CallGraph.init(std.testing.allocator);
+    defer graph.deinit();
+
+    try graph.addCall("_start", "c", 100);
+    try graph.addCall("c", "d", 5);
+    try graph.addCall("a", "b", 50);
+
+    const names = [_][]const u8{ "_start", "a", "b", "c", "d" };
+
+    const order = try affinityOrder(std.testing.allocator, &names, "_start", &graph, null);
+    defer std.testing.allocator.free(order);
+
+    // the chain of `_start` is the heaviest one, it goes last all the same
+    const expected = [_][]const u8{ "a", "b", "d", "c", "_start" };
+
+    for (expected, order) |want, got| {
+        try std.testing.expectEqualStrings(want, got);
+    }
+}
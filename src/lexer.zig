@@ -57,6 +57,12 @@ pub const LexerError = error{
     /// A char literal is never closed (EOF encountered)
     LiteralNeverClosed,
 
+    /// A token is longer than a span can hold (see `Span.len`)
+    TokenTooLong,
+
+    /// The input text is larger than a span can address (see `Span.begin`)
+    InputTooLarge,
+
     /// A number is too large (requires the lexer check_for_big_numbers)
     NumberTooBig,
 };
@@ -138,6 +144,13 @@ pub const Lexer = struct {
         self.position = 0;
     }
 
+    /// Replaces the token stream with an empty one allocated with `parent_allocator`. Used once
+    /// the memory behind the old stream is released. The input text is kept, so diagnostics
+    /// can still show source locations.
+    pub fn resetStream(self: *Lexer, parent_allocator: std.mem.Allocator) void {
+        self.stream = TokenStream.init(parent_allocator);
+    }
+
     pub fn incrementLineNumber(self: *Lexer) void {
         self.area.incrementLineNumber();
         self.area.resetCharacterPosition();
@@ -173,6 +186,22 @@ pub const Lexer = struct {
         return self.input_text[begin..end];
     }
 
+    /// A span from `begin` up to (not including) the current position.
+    pub fn spanFrom(self: *const Lexer, begin: usize) LexerError!Span {
+        return Span{
+            .begin = @intCast(begin),
+            .len = std.math.cast(u16, self.getCurrentPosition() - begin) orelse return error.TokenTooLong,
+        };
+    }
+
+    /// A span over the single character at the current position.
+    pub fn spanOfCurrentCharacter(self: *const Lexer) Span {
+        return Span{
+            .begin = @intCast(self.getCurrentPosition()),
+            .len = 1,
+        };
+    }
+
     pub fn isInRange(self: *const Lexer) bool {
         return self.position < self.input_text.len;
     }
@@ -191,6 +220,11 @@ pub const Lexer = struct {
             return error.NoInput;
         }
 
+        // every span offset has to fit
+        if (self.input_text.len > std.math.maxInt(u32)) {
+            return error.InputTooLarge;
+        }
+
         while (!self.atEndOfInput()) {
             const current_character = self.getCurrentCharacter();
 
@@ -229,13 +263,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .newline,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.area.char_pos,
-                            .char_begin = self.area.char_pos,
-                            .end = self.area.char_pos + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
 
@@ -246,13 +274,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .colon,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.area.char_pos,
-                            .char_begin = self.area.char_pos,
-                            .end = self.area.char_pos + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -261,13 +283,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .dot,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.area.char_pos,
-                            .char_begin = self.area.char_pos,
-                            .end = self.area.char_pos + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -276,13 +292,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .at_symbol,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.area.char_pos,
-                            .char_begin = self.area.char_pos,
-                            .end = self.area.char_pos + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -291,14 +301,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .comma,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.area.char_pos,
-                            .char_begin = self.area.char_pos,
-
-                            .end = self.area.char_pos + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -307,13 +310,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .bracket_open,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.area.char_pos,
-                            .char_begin = self.area.char_pos,
-                            .end = self.area.char_pos + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -322,13 +319,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .bracket_close,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.area.char_pos,
-                            .char_begin = self.area.char_pos,
-                            .end = self.area.char_pos + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -337,13 +328,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .curly_open,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .char_begin = self.area.char_pos,
-                            .begin = self.getCurrentPosition(),
-                            .end = self.getCurrentPosition() + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -352,13 +337,7 @@ pub const Lexer = struct {
                 try self.stream.addOne(Token{
                     .operator = Operator{
                         .kind = .curly_close,
-                        .position = self.getCurrentPosition(),
-                        .span = Span{
-                            .begin = self.getCurrentPosition(),
-                            .char_begin = self.area.char_pos,
-                            .end = self.getCurrentPosition() + 1,
-                            .line_number = self.getLineNumber(),
-                        },
+                        .span = self.spanOfCurrentCharacter(),
                     },
                 });
             },
@@ -373,24 +352,20 @@ pub const Lexer = struct {
 
     pub fn consumeIdentifierThenAdd(self: *Lexer) !void {
         const beginning_of_identifier = self.getCurrentPosition();
-        const beginning_of_identifier_area = self.area.char_pos;
+        const begin_char = self.area.char_pos;
 
         while (self.isInRange() and self.rules.identifierMatches(self.getCurrentCharacter())) {
             self.incrementCharacterPosition();
         }
 
-        const span = Span{
-            .begin = beginning_of_identifier,
-            .end = self.getCurrentPosition(),
-            .char_begin = beginning_of_identifier_area,
-            .line_number = self.getLineNumber(),
+        const span = self.spanFrom(beginning_of_identifier) catch |err| {
+            self.area.char_pos = begin_char; // so the error points at the beginning of the identifier
+            return err;
         };
 
-        const body = self.getInputTextSlice(span.begin, span.end);
-
         try self.stream.addOne(Token{
             .identifier = Identifier{
-                .identifier_string = body,
+                .ptr = self.input_text[beginning_of_identifier..].ptr,
                 .span = span,
             },
         });
@@ -404,14 +379,12 @@ pub const Lexer = struct {
             self.incrementCharacterPosition();
         }
 
-        const span = Span{
-            .begin = beginning_number,
-            .end = self.getCurrentPosition(),
-            .char_begin = begin_char,
-            .line_number = self.getLineNumber(),
+        const span = self.spanFrom(beginning_number) catch |err| {
+            self.area.char_pos = begin_char;
+            return err;
         };
 
-        const body = self.getInputTextSlice(span.begin, span.end);
+        const body = self.getInputTextSlice(span.begin, span.end());
 
         if (self.rules.check_for_big_numbers and std.fmt.parseInt(usize, body, 0) catch 0 > self.rules.max_number_size) {
             self.area.char_pos = begin_char; // so we are now at the beginning of the number
@@ -433,7 +406,7 @@ pub const Lexer = struct {
 
     pub fn consumeLiteral(self: *Lexer) !void {
         const beginning_of_literal = self.getCurrentPosition();
-        const begin_lit = self.area.char_pos;
+        const begin_char = self.area.char_pos;
 
         self.incrementCharacterPosition();
 
@@ -447,20 +420,21 @@ pub const Lexer = struct {
 
         if (!self.isInRange()) return error.LiteralNeverClosed;
 
-        const span = Span{
-            .begin = beginning_of_literal,
-            .char_begin = begin_lit,
-            .end = self.getCurrentPosition(),
-            .line_number = self.getLineNumber(),
-        };
-
         // we are here
         // 'a'
-        //  ^ (beginning of literal + 1)
+        //   ^ (the closing quote, which is a part of the token)
+        const len = std.math.cast(u16, self.getCurrentPosition() + 1 - beginning_of_literal) orelse {
+            self.area.char_pos = begin_char;
+            return error.TokenTooLong;
+        };
+
         const tok = Token{
             .literal = Literal{
-                .character = self.input_text[beginning_of_literal + 1 .. self.getCurrentPosition()],
-                .span = span,
+                .ptr = self.input_text[beginning_of_literal..].ptr,
+                .span = Span{
+                    .begin = @intCast(beginning_of_literal),
+                    .len = len,
+                },
             },
         };
 
@@ -503,9 +477,9 @@ test "using a lexer to parse a string of three identifiers" {
 
     try std.testing.expectEqual(3, lexer.stream.getSizeOfStream());
 
-    const apples = (try lexer.stream.getItemByReferenceOrError(0)).identifier.identifier_string;
-    const middle_word = (try lexer.stream.getItemByReferenceOrError(1)).identifier.identifier_string;
-    const banaenaes = (try lexer.stream.getItemByReferenceOrError(2)).identifier.identifier_string;
+    const apples = (try lexer.stream.getItemByReferenceOrError(0)).identifier.toString();
+    const middle_word = (try lexer.stream.getItemByReferenceOrError(1)).identifier.toString();
+    const banaenaes = (try lexer.stream.getItemByReferenceOrError(2)).identifier.toString();
 
     try std.testing.expectEqualStrings(apples, "apples");
     try std.testing.expectEqualStrings(middle_word, "and");
@@ -575,7 +549,7 @@ test "using a lexer on somewhat applicable code" {
     try std.testing.expectEqual(5, lexer.area.char_pos - 1);
     try std.testing.expectEqual(3, lexer.stream.getSizeOfStream());
     try std.testing.expectEqual(OpKind.at_symbol, (try lexer.stream.getItemByReferenceOrError(0)).operator.kind);
-    try std.testing.expectEqualStrings("sub", (try lexer.stream.getItemByReferenceOrError(1)).identifier.identifier_string);
+    try std.testing.expectEqualStrings("sub", (try lexer.stream.getItemByReferenceOrError(1)).identifier.toString());
     try std.testing.expectEqual(OpKind.colon, (try lexer.stream.getItemByReferenceOrError(2)).operator.kind);
 }
 
@@ -598,7 +572,7 @@ test "using literals in a simple expression" {
     lexer.setInputText("'a'");
     try lexer.startLexingInputText();
     try std.testing.expectEqual(1, lexer.stream.getSizeOfStream());
-    try std.testing.expectEqualStrings("a", (try lexer.stream.getItemByReferenceOrError(0)).literal.character);
+    try std.testing.expectEqualStrings("a", (try lexer.stream.getItemByReferenceOrError(0)).literal.getCharacters());
 }
 
 test "using literals in complex cases" {
@@ -608,9 +582,20 @@ test "using literals in complex cases" {
     lexer.setInputText("'a','b','c'");
     try lexer.startLexingInputText();
     try std.testing.expectEqual(5, lexer.stream.getSizeOfStream());
-    try std.testing.expectEqualStrings("a", (try lexer.stream.getItemByReferenceOrError(0)).literal.character);
-    try std.testing.expectEqualStrings("b", (try lexer.stream.getItemByReferenceOrError(2)).literal.character);
-    try std.testing.expectEqualStrings("c", (try lexer.stream.getItemByReferenceOrError(4)).literal.character);
+    try std.testing.expectEqualStrings("a", (try lexer.stream.getItemByReferenceOrError(0)).literal.getCharacters());
+    try std.testing.expectEqualStrings("b", (try lexer.stream.getItemByReferenceOrError(2)).literal.getCharacters());
+    try std.testing.expectEqualStrings("c", (try lexer.stream.getItemByReferenceOrError(4)).literal.getCharacters());
+}
+
+test "string literals" {
+    var lexer = Lexer.init(std.testing.allocator);
+    defer lexer.deinit();
+
+    lexer.setInputText("'Hi, \\'you\\'',0x0a");
+    try lexer.startLexingInputText();
+
+    try std.testing.expectEqual(3, lexer.stream.getSizeOfStream());
+    try std.testing.expectEqualStrings("Hi, \\'you\\'", (try lexer.stream.getItemByReferenceOrError(0)).literal.getCharacters());
 }
 
 test "erroneous literal" {
@@ -629,7 +614,7 @@ test "escape sequences" {
     try lexer.startLexingInputText();
 
     try std.testing.expectEqual(1, lexer.stream.getSizeOfStream());
-    try std.testing.expectEqualStrings("\\n", (try lexer.stream.getItemByReferenceOrError(0)).literal.character);
+    try std.testing.expectEqualStrings("\\n", (try lexer.stream.getItemByReferenceOrError(0)).literal.getCharacters());
 }
 
 test "number sizes" {
@@ -644,6 +629,39 @@ test "number sizes" {
     try std.testing.expectError(error.NumberTooBig, lexer.startLexingInputText());
 }
 
+test "tokens longer than a span" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var lexer = Lexer.init(arena.allocator());
+
+    const input = "a: mov R1, " ++ [_]u8{'b'} ** (std.math.maxInt(u16) + 1);
+    lexer.setInputText(&input);
+
+    try std.testing.expectError(error.TokenTooLong, lexer.startLexingInputText());
+
+    // the error points at the beginning of the token
+    try std.testing.expectEqual(1, lexer.getLineNumber());
+    try std.testing.expectEqual(12, lexer.area.char_pos);
+}
+
+test "resetting the stream keeps the input text" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var lexer = Lexer.init(arena.allocator());
+
+    lexer.setInputText("a: mov R1, 5\n");
+    try lexer.startLexingInputText();
+    try std.testing.expect(lexer.stream.getSizeOfStream() > 0);
+
+    lexer.resetStream(std.testing.allocator);
+    defer lexer.deinit();
+
+    try std.testing.expectEqual(0, lexer.stream.getSizeOfStream());
+    try std.testing.expectEqualStrings("a: mov R1, 5\n", lexer.input_text);
+}
+
 test "span" {
     var lexer = Lexer.init(std.testing.allocator);
     defer lexer.deinit();
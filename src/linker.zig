@@ -15,8 +15,13 @@ const codegen = @import("codegen.zig");
 const lexer = @import("lexer.zig");
 const parser = @import("parser.zig");
 const instruction_result = @import("instruction_result.zig");
+const source_map = @import("source_map.zig");
+const profile = @import("profile.zig");
+const layout = @import("layout.zig");
+const passes = @import("passes.zig");
 
 const Vendor = codegen.Vendor;
+const Isa = codegen.Isa;
 const Instruction = codegen.Instruction;
 const InstructionError = codegen.InstructionError;
 const Generator = codegen.Generator;
@@ -28,7 +33,10 @@ const InstructionResult = instruction_result.InstructionResult;
 
 pub const VASM_HEADER = "compiled using volt assembler(VASM)";
 
-pub const Error = error{MissingStart};
+pub const Error = error{ MissingStart, TooManyProcedures };
+
+/// An index table entry for a procedure that was referenced but is not in the binary.
+pub const missing_procedure_offset: u32 = std.math.maxInt(u32);
 
 /// ## Linking
 ///
@@ -55,6 +63,17 @@ pub fn Linker(comptime binary_size: type) type {
 
         write_header: bool = false,
 
+        /// Receives where each procedure is placed in the binary. Null disables source maps.
+        source_map: ?*source_map.SourceMap = null,
+
+        /// Weighs the calls of `call_graph`, so the chains holding the hottest procedures go
+        /// first.
+        profile: ?*const profile.Profile = null,
+
+        /// Places non-folded procedures next to the procedures that call them, weighed by the
+        /// profile when there is one. Usually `Vendor.call_graph`.
+        call_graph: ?*const layout.CallGraph = null,
+
         pub fn init(parent_allocator: std.mem.Allocator) Self {
             return Self{
                 .parent_allocator = parent_allocator,
@@ -86,6 +105,7 @@ pub fn Linker(comptime binary_size: type) type {
             var entry_point_encountered: bool = false;
 
             if (proc_map.get(ctx.start_definition)) |start| {
+                try self.placeProcedure(ctx.start_definition);
                 try self.appendBytes(start.items[0..]);
                 entry_point_encountered = true;
             }
@@ -99,21 +119,105 @@ pub fn Linker(comptime binary_size: type) type {
             }
         }
 
-        pub fn linkOptimizedWithContext(self: *Self, ctx: anytype, vendor: *Vendor(binary_size), proc_map: std.StringHashMap(std.ArrayList(binary_size))) !void {
-            try vendor.peephole_optimizer.remember(ctx.start_definition);
-            try vendor.peepholeOptimizeBinary();
+        /// Links without procedure folding, with procedures found through an index table instead
+        /// of by scanning their headings. `procedure_indices` are the vendor's indices, which its
+        /// instructions encoded procedure references with (see `Vendor.procedureReference`).
+        ///
+        /// `ctx` is a non-folding context with a `procedure_table_byte`. The binary starts with:
+        ///
+        /// ```
+        /// [procedure_table_byte] [count] [offset 0] ... [offset count - 1]
+        /// ```
+        ///
+        /// Each offset is a little endian `u32` counted from the first byte after the table. It
+        /// points at the procedure's heading, or at the start procedure's body. Procedures removed
+        /// by the optimizer are `missing_procedure_offset`.
+        pub fn linkIndexedWithContext(self: *Self, ctx: anytype, procedure_indices: std.StringArrayHashMap(void), proc_map: std.StringHashMap(std.ArrayList(binary_size))) !void {
+            if (@bitSizeOf(binary_size) != 8) {
+                @compileError("an index table can only be linked into an 8-bit format");
+            }
+
+            self.write_header = ctx.vasm_header;
+
+            const names = procedure_indices.keys();
+            const count = std.math.cast(binary_size, names.len) orelse return error.TooManyProcedures;
+
+            try self.appendByte(ctx.procedure_table_byte);
+            try self.appendByte(count);
+
+            // the offsets are filled in as procedures are placed
+            const table_begin = self.binary.items.len;
+            try self.binary.appendNTimes(0, names.len * @sizeOf(u32));
+
+            const body_begin = self.binary.items.len;
+
+            const order = try self.placementOrder(names, ctx.start_definition);
+            defer self.parent_allocator.free(order);
+
+            for (order) |name| {
+                if (std.mem.eql(u8, name, ctx.start_definition)) continue;
+
+                const index = procedure_indices.getIndex(name).?;
+                const body = proc_map.get(name) orelse {
+                    self.writeTableOffset(table_begin, index, missing_procedure_offset);
+                    continue;
+                };
+
+                self.writeTableOffset(table_begin, index, @intCast(self.binary.items.len - body_begin));
+
+                try self.appendByte(ctx.procedure_heading_byte);
+                try self.appendByte(@intCast(index));
+                try self.placeProcedure(name);
+                try self.appendBytes(body.items[0..]);
+                if (ctx.proc_end_byte) {
+                    try self.appendByte(ctx.end_byte);
+                }
+                try self.appendByte(ctx.procedure_closing_byte);
+            }
+
+            if (proc_map.get(ctx.start_definition)) |start| {
+                if (procedure_indices.getIndex(ctx.start_definition)) |index| {
+                    self.writeTableOffset(table_begin, index, @intCast(self.binary.items.len - body_begin));
+                }
+
+                try self.placeProcedure(ctx.start_definition);
+                try self.appendBytes(start.items[0..]);
+            } else if (ctx.compile == false) {
+                return error.MissingStart;
+            }
+
+            if (ctx.use_end_byte == true) {
+                try self.appendByte(ctx.end_byte);
+            }
+        }
+
+        fn writeTableOffset(self: *Self, table_begin: usize, index: usize, offset: u32) void {
+            const at = table_begin + index * @sizeOf(u32);
 
-            try self.linkUnOptimizedWithContext(ctx, proc_map);
+            for (std.mem.toBytes(std.mem.nativeToLittle(u32, offset)), 0..) |byte, i| {
+                self.binary.items[at + i] = @bitCast(byte);
+            }
         }
 
         pub fn iterateAndLink(self: *Self, ctx: anytype, proc_map: std.StringHashMap(std.ArrayList(binary_size))) !void {
-            var iterator_procedure_map = proc_map.iterator();
+            var names = std.ArrayList([]const u8).init(self.parent_allocator);
+            defer names.deinit();
+
+            var key_iterator = proc_map.keyIterator();
+
+            while (key_iterator.next()) |key| {
+                try names.append(key.*);
+            }
+
+            const order = try self.placementOrder(names.items, ctx.start_definition);
+            defer self.parent_allocator.free(order);
 
-            while (iterator_procedure_map.next()) |item| {
-                if (!std.mem.eql(u8, item.key_ptr.*, ctx.start_definition)) {
+            for (order) |name| {
+                if (!std.mem.eql(u8, name, ctx.start_definition)) {
                     try self.appendByte(ctx.procedure_heading_byte);
-                    try self.appendByte(@bitCast(item.key_ptr.*[0]));
-                    try self.appendBytes(item.value_ptr.items[0..]); // body of function
+                    try self.appendByte(@bitCast(name[0]));
+                    try self.placeProcedure(name);
+                    try self.appendBytes(proc_map.get(name).?.items[0..]); // body of function
                     if (ctx.proc_end_byte) {
                         try self.appendByte(ctx.end_byte);
                     }
@@ -122,6 +226,24 @@ pub fn Linker(comptime binary_size: type) type {
             }
         }
 
+        /// The order procedures are placed in. By call affinity with a call graph, so hot code
+        /// sits together, otherwise the order of `names`. `start_definition` is placed after every
+        /// other procedure, so the ones it calls are ordered right before it. Owned by the caller.
+        fn placementOrder(self: *Self, names: []const []const u8, start_definition: []const u8) ![][]const u8 {
+            if (self.call_graph) |graph| {
+                return layout.affinityOrder(self.parent_allocator, names, start_definition, graph, self.profile);
+            }
+
+            return self.parent_allocator.dupe([]const u8, names);
+        }
+
+        /// Tells the source map that the procedure `name` starts at the end of the binary.
+        fn placeProcedure(self: *Self, name: []const u8) !void {
+            if (self.source_map) |map| {
+                try map.place(name, self.binary.items.len);
+            }
+        }
+
         /// Populates the binary with the given bytes.
         pub fn appendBytes(self: *Self, bytes: []binary_size) !void {
             try self.binary.appendSlice(bytes);
@@ -133,19 +255,30 @@ pub fn Linker(comptime binary_size: type) type {
         }
 
         pub fn writeToFile(self: *Self, file_name: []const u8, endian: std.builtin.Endian) !void {
-            var file = try std.fs.cwd().createFile(file_name, .{});
-            defer file.close();
-            var writer = file.writer();
+            const bytes = try self.encode(self.parent_allocator, endian);
+            defer self.parent_allocator.free(bytes);
+
+            // a single write, instead of one per element
+            try std.fs.cwd().writeFile(.{ .sub_path = file_name, .data = bytes });
+        }
+
+        /// The bytes `writeToFile` writes, owned by the caller.
+        pub fn encode(self: *const Self, allocator: std.mem.Allocator, endian: std.builtin.Endian) ![]u8 {
+            var bytes = std.ArrayList(u8).init(allocator);
+            errdefer bytes.deinit();
+
+            const element_size = @divExact(@bitSizeOf(binary_size), 8);
+            try bytes.ensureTotalCapacity((if (self.write_header) VASM_HEADER.len else 0) + self.binary.items.len * element_size);
 
             if (self.write_header) {
-                for (VASM_HEADER) |c| {
-                    try writer.writeByte(c);
-                }
+                bytes.appendSliceAssumeCapacity(VASM_HEADER);
             }
 
             for (self.binary.items) |byt| {
-                try writer.writeInt(binary_size, byt, endian);
+                bytes.writer().writeInt(binary_size, byt, endian) catch unreachable;
             }
+
+            return bytes.toOwnedSlice();
         }
     };
 }
@@ -159,6 +292,13 @@ fn movInstructionTest(generator: *Generator(i8), vendor: *Vendor(i8), args: []Va
     return .ok;
 }
 
+fn callInstructionTest(generator: *Generator(i8), vendor: *Vendor(i8), args: []Value) InstructionError!InstructionResult {
+    try generator.append(15);
+    try generator.append(try vendor.procedureReference(args[0].toIdentifier().toString()));
+
+    return .ok;
+}
+
 fn createNodeFrom(alloc: std.mem.Allocator, text: []const u8) !Node {
     var lexer_st = Lexer.init(alloc);
 
@@ -176,7 +316,8 @@ test "creating and using a linker to create a usable binary" {
     const allocatir = arena.allocator();
 
     var link = Linker(i8).init(std.testing.allocator);
-    var vend1 = Vendor(i8).init(allocatir);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
     var mov_ins = Instruction(i8).init("move", &movInstructionTest);
 
     defer link.deinit();
@@ -184,7 +325,7 @@ test "creating and using a linker to create a usable binary" {
 
     const root = try createNodeFrom(allocatir, "_start: move\n");
 
-    try vend1.implementInstruction("move", &mov_ins);
+    try isa.implementInstruction("move", &mov_ins);
     _ = try vend1.generateBinary(root);
 
     try link.linkUnOptimizedWithContext(.{
@@ -206,7 +347,8 @@ test "creating and using a linker to create a usable binary w/ procedures using
     const allocatir = arena.allocator();
 
     var link = Linker(i8).init(std.testing.allocator);
-    var vend1 = Vendor(i8).init(allocatir);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
     var mov_ins = Instruction(i8).init("move", &movInstructionTest);
 
     defer link.deinit();
@@ -214,7 +356,7 @@ test "creating and using a linker to create a usable binary w/ procedures using
 
     const root = try createNodeFrom(allocatir, "a: move\n");
 
-    try vend1.implementInstruction("move", &mov_ins);
+    try isa.implementInstruction("move", &mov_ins);
     _ = try vend1.generateBinary(root);
 
     try link.linkUnOptimizedWithContext(.{
@@ -239,7 +381,8 @@ test "creating and using a linker to create a usable binary w/ procedures using
     const allocatir = arena.allocator();
 
     var link = Linker(i8).init(std.testing.allocator);
-    var vend1 = Vendor(i8).init(allocatir);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
     var mov_ins = Instruction(i8).init("move", &movInstructionTest);
 
     defer link.deinit();
@@ -247,7 +390,7 @@ test "creating and using a linker to create a usable binary w/ procedures using
 
     const root = try createNodeFrom(allocatir, "a: move\n");
 
-    try vend1.implementInstruction("move", &mov_ins);
+    try isa.implementInstruction("move", &mov_ins);
     _ = try vend1.generateBinary(root);
 
     try link.linkUnOptimizedWithContext(.{
@@ -274,7 +417,8 @@ test "creating and using a linker to create a usable binary and writing it to a
     const allocatir = arena.allocator();
 
     var link = Linker(i8).init(std.testing.allocator);
-    var vend1 = Vendor(i8).init(allocatir);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
     var mov_ins = Instruction(i8).init("move", &movInstructionTest);
 
     defer link.deinit();
@@ -282,7 +426,7 @@ test "creating and using a linker to create a usable binary and writing it to a
 
     const root = try createNodeFrom(allocatir, "a: move\n");
 
-    try vend1.implementInstruction("move", &mov_ins);
+    try isa.implementInstruction("move", &mov_ins);
     _ = try vend1.generateBinary(root);
 
     try link.linkUnOptimizedWithContext(.{
@@ -304,14 +448,20 @@ test "creating and using a linker to create a usable binary and writing it to a
     try std.testing.expectEqual(12, link.binary.items[4]);
 
     try link.writeToFile("bin/creating_and_using_a_linker_to_create-x86_64.ol", .little);
+
+    const bytes = try link.encode(std.testing.allocator, .little);
+    defer std.testing.allocator.free(bytes);
+
+    try std.testing.expectEqualSlices(u8, &.{ 10, @bitCast(link.binary.items[1]), 5, 22, 12 }, bytes);
 }
 
-test "creating and using a linker using linkOptimized" {
+test "creating and using a linker after the optimization passes" {
     var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
     const allocatir = arena.allocator();
 
     var link = Linker(i8).init(std.testing.allocator);
-    var vend1 = Vendor(i8).init(allocatir);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
     var mov_ins = Instruction(i8).init("move", &movInstructionTest);
 
     defer link.deinit();
@@ -319,10 +469,14 @@ test "creating and using a linker using linkOptimized" {
 
     const root = try createNodeFrom(allocatir, "a: move\n");
 
-    try vend1.implementInstruction("move", &mov_ins);
+    try isa.implementInstruction("move", &mov_ins);
     _ = try vend1.generateBinary(root);
 
-    try link.linkOptimizedWithContext(.{
+    var manager = passes.PassManager(i8).init(allocatir, 1);
+    try passes.registerDefaultPasses(i8, &manager);
+    try manager.run(&vend1, .{ .start_definition = "_start" });
+
+    try link.linkUnOptimizedWithContext(.{
         .start_definition = "_start",
         .fold_procedures = false,
         .procedure_heading_byte = 10,
@@ -332,8 +486,181 @@ test "creating and using a linker using linkOptimized" {
         .compile = true,
         .vasm_header = false,
         .proc_end_byte = false,
-    }, &vend1, vend1.procedure_map);
+    }, vend1.procedure_map);
 
     try std.testing.expectEqual(1, link.binary.items.len);
     try std.testing.expectEqual(12, link.binary.items[0]);
 }
+
+test "linking with an index table" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+
+    var link = Linker(i8).init(std.testing.allocator);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
+
+    defer link.deinit();
+    defer arena.deinit();
+
+    const root = try createNodeFrom(allocatir, "a: move\nb: call a\n_start: call b\n");
+
+    vend1.index_procedures = true;
+    try isa.createAndImplementInstruction(i8, "move", &movInstructionTest);
+    try isa.createAndImplementInstruction(i8, "call", &callInstructionTest);
+    _ = try vend1.generateBinary(root);
+
+    try link.linkIndexedWithContext(.{
+        .start_definition = "_start",
+        .fold_procedures = false,
+        .procedure_heading_byte = 10,
+        .procedure_closing_byte = 22,
+        .procedure_table_byte = 9,
+        .use_end_byte = true,
+        .end_byte = 12,
+        .compile = false,
+        .vasm_header = false,
+        .proc_end_byte = false,
+    }, vend1.procedure_indices, vend1.procedure_map);
+
+    const expected_bin = [_]i8{
+        9, 3, // table of 3 procedures
+        0, 0, 0, 0, // a
+        4, 0, 0, 0, // b
+        9, 0, 0, 0, // _start
+        10, 0, 5, 22, // a: move
+        10, 1, 15, 0, 22, // b: call a
+        15, 1, // _start: call b
+        12,
+    };
+
+    try std.testing.expectEqualSlices(i8, &expected_bin, link.binary.items);
+}
+
+test "linking with a source map" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+
+    var link = Linker(i8).init(std.testing.allocator);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
+
+    defer link.deinit();
+    defer arena.deinit();
+
+    const text = "a: move\n_start:\n    move\n    a\n";
+    const root = try createNodeFrom(allocatir, text);
+
+    var map = try source_map.SourceMap.init(allocatir, "main.asm", text);
+
+    vend1.source_map = &map;
+    link.source_map = &map;
+
+    try isa.createAndImplementInstruction(i8, "move", &movInstructionTest);
+    _ = try vend1.generateBinary(root);
+
+    try link.linkUnOptimizedWithContext(.{
+        .start_definition = "_start",
+        .fold_procedures = true,
+        .compile = false,
+        .vasm_header = false,
+        .use_end_byte = true,
+        .end_byte = 12,
+        .proc_end_byte = false,
+    }, vend1.procedure_map);
+
+    // _start: move (written in _start), a (folded in from a)
+    try std.testing.expectEqual(2, map.entries.items.len);
+
+    try std.testing.expectEqual(0, map.entries.items[0].begin);
+    try std.testing.expectEqual(3, map.entries.items[0].line);
+    try std.testing.expectEqual(5, map.entries.items[0].column);
+    try std.testing.expectEqual(0, map.entries.items[0].chain.len);
+
+    try std.testing.expectEqual(1, map.entries.items[1].begin);
+    try std.testing.expectEqual(1, map.entries.items[1].line);
+    try std.testing.expectEqual(4, map.entries.items[1].column);
+    try std.testing.expectEqualStrings("a", map.entries.items[1].chain[0]);
+}
+
+test "placing procedures hottest first" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+
+    var link = Linker(i8).init(std.testing.allocator);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
+
+    defer link.deinit();
+    defer arena.deinit();
+
+    const root = try createNodeFrom(allocatir, "a: move\nb:\n    move\n    move\n");
+
+    var prof = profile.Profile.init(allocatir);
+    try prof.add("a", 10);
+    try prof.add("b", 500);
+
+    link.profile = &prof;
+    link.call_graph = &vend1.call_graph;
+
+    try isa.createAndImplementInstruction(i8, "move", &movInstructionTest);
+    _ = try vend1.generateBinary(root);
+
+    try link.linkUnOptimizedWithContext(.{
+        .start_definition = "_start",
+        .fold_procedures = false,
+        .procedure_heading_byte = 10,
+        .procedure_closing_byte = 22,
+        .compile = true,
+        .vasm_header = false,
+        .use_end_byte = false,
+        .proc_end_byte = false,
+    }, vend1.procedure_map);
+
+    const expected_bin = [_]i8{
+        10, 'b', 5, 5, 22, // b is hot
+        10, 'a', 5, 22,
+    };
+
+    try std.testing.expectEqualSlices(i8, &expected_bin, link.binary.items);
+}
+
+test "placing procedures by affinity" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    const allocatir = arena.allocator();
+
+    var link = Linker(i8).init(std.testing.allocator);
+    var isa = Isa(i8).init(allocatir);
+    var vend1 = Vendor(i8).init(allocatir, &isa);
+
+    defer link.deinit();
+    defer arena.deinit();
+
+    const root = try createNodeFrom(allocatir, "c: move\n\nb: move\n\na: call c\ncall c\n\n_start: call b\n");
+
+    link.call_graph = &vend1.call_graph;
+
+    try isa.createAndImplementInstruction(i8, "move", &movInstructionTest);
+    try isa.createAndImplementInstruction(i8, "call", &callInstructionTest);
+    _ = try vend1.generateBinary(root);
+
+    try link.linkUnOptimizedWithContext(.{
+        .start_definition = "_start",
+        .fold_procedures = false,
+        .procedure_heading_byte = 10,
+        .procedure_closing_byte = 22,
+        .compile = true,
+        .vasm_header = false,
+        .use_end_byte = false,
+        .proc_end_byte = false,
+    }, vend1.procedure_map);
+
+    // `a` calls `c` the most, `c` follows it
+    const expected_bin = [_]i8{
+        10, 'a', 15, 'c', 15, 'c', 22,
+        10, 'c', 5,  22,
+        10, 'b', 5,  22,
+    };
+
+    try std.testing.expectEqualSlices(i8, &expected_bin, link.binary.items);
+}
@@ -0,0 +1,1435 @@
+//! ## Language Server
+//!
+//! `vasm lsp` speaks the Language Server Protocol over stdin and stdout, so an editor shows
+//! stylist suggestions and codegen errors while a file is edited, without compiling it.
+//!
+//! A document is kept as lines, each lexed on its own, grouped into sections: one per procedure,
+//! from its `name:` line up to the next one, and the lines before the first procedure (directives
+//! and asides). An edit re-lexes only the lines it touched, parses again only the sections those
+//! lines are in, and checks their procedures against the instruction set the way codegen does
+//! (`Isa.checkInstruction`). Every other section keeps its tokens, syntax tree and diagnostics.
+//! Only an edit to what other procedures depend on (the name of a procedure, or the lines before
+//! the first one) checks every procedure again.
+//!
+//! ```sh
+//! vasm lsp
+//! ```
+//!
+//! Literals end with their line. Procedures are checked for the format of the `[compat ...]`
+//! directive, NexFUSE without one.
+//!
+
+const std = @import("std");
+const lexer = @import("lexer.zig");
+const parser = @import("parser.zig");
+const token_stream = @import("token_stream.zig");
+const codegen = @import("codegen.zig");
+const ir = @import("ir.zig");
+const stylist = @import("stylist.zig");
+const drivers = @import("drivers.zig");
+const compiler_main = @import("compiler_main.zig");
+const compiler_pp = @import("compiler_pp.zig");
+
+const Token = token_stream.Token;
+const Span = token_stream.Span;
+const Value = parser.Value;
+const Node = parser.Node;
+const Aside = @import("ctypes/Aside.zig");
+
+/// The severities of the protocol.
+pub const Severity = enum(u8) {
+    @"error" = 1,
+    warning = 2,
+    information = 3,
+    hint = 4,
+};
+
+/// A problem on a single line. Columns are byte offsets into the line.
+pub const Diagnostic = struct {
+    /// Counted from the first line of whatever holds the diagnostic, a line or a section
+    line: u32 = 0,
+    begin: u32,
+    end: u32,
+    severity: Severity,
+
+    /// Static, or allocated with whatever holds the diagnostic
+    message: []const u8,
+};
+
+/// How positions count characters on a line. The protocol counts UTF-16 code units, unless the
+/// client offers UTF-8.
+pub const Encoding = enum {
+    utf8,
+    utf16,
+};
+
+/// A position as the client sends it, in `Encoding` units.
+pub const Position = struct {
+    line: u32,
+    character: u32,
+};
+
+/// The formats procedures are checked for.
+pub const Format = enum {
+    /// A format without an instruction set here, procedures are not checked
+    none,
+    nexfuse,
+    openlud,
+};
+
+/// The instruction sets of every `Format`. Built once, shared by every document.
+pub const Isas = struct {
+    arena: std.heap.ArenaAllocator,
+    nexfuse: codegen.Isa(u8),
+    openlud: codegen.Isa(i8),
+
+    /// Builds the instruction sets in place, they hold on to their arena.
+    pub fn init(self: *Isas, parent_allocator: std.mem.Allocator) !void {
+        self.arena = std.heap.ArenaAllocator.init(parent_allocator);
+        errdefer self.arena.deinit();
+
+        self.nexfuse = codegen.Isa(u8).init(self.arena.allocator());
+        self.openlud = codegen.Isa(i8).init(self.arena.allocator());
+
+        try drivers.nexfuse.runtime(&self.nexfuse);
+        try drivers.openlud.vendor(&self.openlud);
+    }
+
+    pub fn deinit(self: *Isas) void {
+        self.arena.deinit();
+    }
+
+    fn checkInstruction(self: *const Isas, format: Format, ins: ir.Instruction) ?codegen.Result {
+        return switch (format) {
+            .none => null,
+            .nexfuse => self.nexfuse.checkInstruction(ins),
+            .openlud => self.openlud.checkInstruction(ins),
+        };
+    }
+};
+
+/// A line of a document, lexed on its own. Spans of its tokens count from the start of the line.
+const Line = struct {
+    /// Without the newline. Allocated one byte longer, the newline is lexed with the line.
+    text: []u8,
+
+    tokens: []Token,
+
+    /// Lexer errors and stylist suggestions
+    diagnostics: []Diagnostic,
+
+    fn init(allocator: std.mem.Allocator, text: []const u8) !Line {
+        const buffer = try allocator.alloc(u8, text.len + 1);
+        errdefer allocator.free(buffer);
+
+        @memcpy(buffer[0..text.len], text);
+        buffer[text.len] = '\n';
+
+        var diagnostics = std.ArrayList(Diagnostic).init(allocator);
+        defer diagnostics.deinit();
+
+        var lex = lexer.Lexer.init(allocator);
+        defer lex.deinit();
+
+        lex.setInputText(buffer);
+
+        // the tokens before the error are kept, the parser reports what follows from it
+        lex.startLexingInputText() catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+
+            else => {
+                const at: u32 = @intCast(@min(lex.getCurrentPosition(), text.len));
+
+                try diagnostics.append(Diagnostic{
+                    .begin = at,
+                    .end = at + 1,
+                    .severity = .@"error",
+                    .message = errorMessage(err),
+                });
+            },
+        };
+
+        const suggestions = try stylist.analyze(allocator, buffer);
+        defer suggestions.deinit();
+
+        for (suggestions.items) |suggestion| {
+            // stylist counts columns from 2 on a single line
+            const begin: u32 = @intCast(@min(suggestion.suggestion_location.problematic_area_begin -| 2, text.len));
+            const end: u32 = @intCast(@min(suggestion.suggestion_location.problematic_area_end -| 2, text.len));
+
+            try diagnostics.append(Diagnostic{
+                .begin = begin,
+                .end = @max(end, begin + 1),
+                .severity = switch (suggestion.suggestion_type) {
+                    .undefined_behavior, .non_compliant => .warning,
+                    .good_practice => .information,
+                    .regular => .hint,
+                },
+                .message = suggestion.suggestion_message,
+            });
+        }
+
+        const tokens = try lex.stream.internal_list.toOwnedSlice();
+        errdefer allocator.free(tokens);
+
+        return Line{
+            .text = buffer[0..text.len],
+            .tokens = tokens,
+            .diagnostics = try diagnostics.toOwnedSlice(),
+        };
+    }
+
+    fn deinit(self: *Line, allocator: std.mem.Allocator) void {
+        allocator.free(self.text.ptr[0 .. self.text.len + 1]);
+        allocator.free(self.tokens);
+        allocator.free(self.diagnostics);
+    }
+
+    /// Does a procedure start on the line (`name:`)?
+    fn isHeader(self: *const Line) bool {
+        if (self.tokens.len < 2) return false;
+
+        const colon = self.tokens[1];
+
+        return self.tokens[0] == .identifier and colon == .operator and colon.operator.kind == .colon;
+    }
+};
+
+/// `token`, with its span moved `offset` bytes on.
+fn shifted(token: Token, offset: u32) Token {
+    var moved = token;
+
+    switch (moved) {
+        .identifier => |*it| it.span.begin += offset,
+        .number => |*it| it.span.begin += offset,
+        .operator => |*it| it.span.begin += offset,
+        .literal => |*it| it.span.begin += offset,
+        .unknown => {},
+    }
+
+    return moved;
+}
+
+/// A procedure, or the lines before the first procedure. Parsed as one, spans of its syntax tree
+/// count from the start of the section, as if its lines were a single text.
+const Section = struct {
+    /// The line of the document the section starts at
+    first_line: u32,
+
+    lines: std.ArrayList(Line),
+
+    /// The syntax tree and what parsing found, replaced whenever the section is parsed
+    ast_arena: std.heap.ArenaAllocator,
+    nodes: []Node = &.{},
+    parse_diagnostics: []Diagnostic = &.{},
+
+    /// What checking found, replaced whenever the section is checked
+    check_arena: std.heap.ArenaAllocator,
+    check_diagnostics: []Diagnostic = &.{},
+
+    /// The format the last `[compat ...]` directive of the section chose, found when it is
+    /// checked. Null without one.
+    format: ?Format = null,
+
+    fn create(allocator: std.mem.Allocator, first_line: u32, lines: []const Line) !*Section {
+        const section = try allocator.create(Section);
+        errdefer allocator.destroy(section);
+
+        section.* = Section{
+            .first_line = first_line,
+            .lines = std.ArrayList(Line).init(allocator),
+            .ast_arena = std.heap.ArenaAllocator.init(allocator),
+            .check_arena = std.heap.ArenaAllocator.init(allocator),
+        };
+        errdefer {
+            section.lines.deinit();
+            section.ast_arena.deinit();
+            section.check_arena.deinit();
+        }
+
+        try section.lines.appendSlice(lines);
+        try section.parse();
+
+        return section;
+    }
+
+    /// Frees the section, its lines are only freed with `free_lines`.
+    fn destroy(self: *Section, allocator: std.mem.Allocator, free_lines: bool) void {
+        if (free_lines) {
+            for (self.lines.items) |*line| line.deinit(allocator);
+        }
+
+        self.lines.deinit();
+        self.ast_arena.deinit();
+        self.check_arena.deinit();
+
+        allocator.destroy(self);
+    }
+
+    fn parse(self: *Section) !void {
+        _ = self.ast_arena.reset(.retain_capacity);
+        const arena = self.ast_arena.allocator();
+
+        var stream = token_stream.TokenStream.init(arena);
+        var offset: u32 = 0;
+
+        for (self.lines.items) |line| {
+            for (line.tokens) |token| {
+                try stream.addOne(shifted(token, offset));
+            }
+
+            offset += @intCast(line.text.len + 1);
+        }
+
+        var pars = parser.Parser.init(arena, &stream);
+        var nodes = std.ArrayList(Node).init(arena);
+        var diagnostics = std.ArrayList(Diagnostic).init(arena);
+
+        while (true) {
+            const node = pars.createNextRootChild() catch |err| {
+                if (err == error.OutOfMemory) return error.OutOfMemory;
+
+                // at the token the parser stopped at
+                const tokens = stream.internal_list.items;
+                const span = if (tokens.len == 0) Span{} else tokens[@min(stream.stream_pos, tokens.len - 1)].getSpan();
+
+                try diagnostics.append(self.diagnosticAt(span, .@"error", errorMessage(err)));
+                break;
+            } orelse break;
+
+            try nodes.append(node);
+        }
+
+        self.nodes = nodes.items;
+        self.parse_diagnostics = diagnostics.items;
+    }
+
+    /// A diagnostic for `span`, cut at the end of its line.
+    fn diagnosticAt(self: *const Section, span: Span, severity: Severity, message: []const u8) Diagnostic {
+        var line_start: usize = 0;
+
+        for (self.lines.items, 0..) |line, i| {
+            const line_end = line_start + line.text.len;
+
+            if (span.begin <= line_end or i == self.lines.items.len - 1) {
+                const begin = @min(span.begin -| line_start, line.text.len);
+                const end = @min(span.end() -| line_start, line.text.len);
+
+                return Diagnostic{
+                    .line = @intCast(i),
+                    .begin = @intCast(begin),
+                    .end = @intCast(@max(end, begin + 1)),
+                    .severity = severity,
+                    .message = message,
+                };
+            }
+
+            line_start = line_end + 1;
+        }
+
+        return Diagnostic{ .begin = 0, .end = 1, .severity = severity, .message = message };
+    }
+
+    /// Are the section's own lines free of diagnostics?
+    fn linesAreClean(self: *const Section) bool {
+        for (self.lines.items) |line| {
+            if (line.diagnostics.len > 0) return false;
+        }
+
+        return true;
+    }
+
+    /// Does the section have asides or directives, which change what the sections after it mean?
+    fn setsScope(self: *const Section) bool {
+        for (self.nodes) |node| {
+            if (node == .aside or node == .macro) return true;
+        }
+
+        return false;
+    }
+
+    /// Appends the name of every procedure the section defines to `names`.
+    fn appendNames(self: *const Section, names: *std.ArrayList([]const u8)) !void {
+        for (self.nodes) |node| {
+            if (node == .procedure) try names.append(node.procedure.header);
+        }
+    }
+};
+
+/// An open document.
+pub const Document = struct {
+    allocator: std.mem.Allocator,
+    isas: *const Isas,
+
+    /// In order, every line is in exactly one. Never empty.
+    sections: std.ArrayList(*Section),
+
+    /// The first section that defines each procedure. The names are owned.
+    definitions: std.StringHashMap(*Section),
+
+    /// `:set` values, rebuilt from the sections in order whenever sections are checked (see
+    /// `checkRange`). Names and values point into the lines of the sections.
+    expandables: std.StringHashMap(Value),
+
+    /// From the `[compat ...]` directives, rebuilt along with `expandables`
+    format: Format = .nexfuse,
+
+    pub fn init(allocator: std.mem.Allocator, isas: *const Isas, text: []const u8) !Document {
+        var document = Document{
+            .allocator = allocator,
+            .isas = isas,
+            .sections = std.ArrayList(*Section).init(allocator),
+            .definitions = std.StringHashMap(*Section).init(allocator),
+            .expandables = std.StringHashMap(Value).init(allocator),
+        };
+        errdefer document.deinit();
+
+        var lines = std.ArrayList(Line).init(allocator);
+        defer lines.deinit();
+
+        errdefer for (lines.items) |*line| line.deinit(allocator);
+
+        var pieces = std.mem.splitScalar(u8, text, '\n');
+
+        while (pieces.next()) |piece| {
+            try lines.append(try Line.init(allocator, piece));
+        }
+
+        try document.appendSections(lines.items, 0);
+        lines.clearRetainingCapacity();
+
+        try document.collectDefinitions();
+        try document.checkRange(0, document.sections.items.len);
+
+        return document;
+    }
+
+    pub fn deinit(self: *Document) void {
+        for (self.sections.items) |section| {
+            section.destroy(self.allocator, true);
+        }
+
+        self.sections.deinit();
+        self.clearDefinitions();
+        self.definitions.deinit();
+        self.expandables.deinit();
+    }
+
+    pub fn lineCount(self: *const Document) u32 {
+        const last = self.sections.getLast();
+
+        return last.first_line + @as(u32, @intCast(last.lines.items.len));
+    }
+
+    /// The index of the section `line` is in.
+    fn sectionIndexAt(self: *const Document, line: u32) usize {
+        var low: usize = 0;
+        var high: usize = self.sections.items.len;
+
+        // the last section that starts at or before `line`
+        while (high - low > 1) {
+            const middle = low + (high - low) / 2;
+
+            if (self.sections.items[middle].first_line <= line) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+
+        return low;
+    }
+
+    /// The text of `line`, without its newline.
+    pub fn lineText(self: *const Document, line: u32) []const u8 {
+        const section = self.sections.items[self.sectionIndexAt(line)];
+
+        return section.lines.items[line - section.first_line].text;
+    }
+
+    /// `position` as a line and a byte offset into it, within the document.
+    pub fn byteColumn(self: *const Document, position: Position, encoding: Encoding) Position {
+        const line = @min(position.line, self.lineCount() - 1);
+
+        return Position{
+            .line = line,
+            .character = @intCast(toByteColumn(self.lineText(line), position.character, encoding)),
+        };
+    }
+
+    /// Replaces the text from `start` to `end` (byte columns, see `byteColumn`) with `text`.
+    /// The whole document without a range. A range that ends before it starts is turned around.
+    pub fn replace(self: *Document, range: ?[2]Position, text: []const u8) !void {
+        const from, const to = range orelse {
+            const replacement = try Document.init(self.allocator, self.isas, text);
+
+            self.deinit();
+            self.* = replacement;
+
+            return;
+        };
+
+        const reversed = to.line < from.line or (to.line == from.line and to.character < from.character);
+        const start, const end = if (reversed) .{ to, from } else .{ from, to };
+
+        const edit = try self.splice(start, end, text);
+
+        if (!edit.same_names) try self.collectDefinitions();
+
+        // renamed procedures change what every call means, asides and directives change what
+        // the procedures after them mean
+        const first = if (edit.same_names) edit.first else 0;
+        const last = if (edit.same_names and !edit.sets_scope) edit.first + edit.count else self.sections.items.len;
+
+        try self.checkRange(first, last);
+    }
+
+    /// The sections an edit put in place of the old ones.
+    const Splice = struct {
+        /// Index of the first one
+        first: usize,
+        count: usize,
+
+        /// Do they define the same procedures, in the same order, as the sections they replaced?
+        same_names: bool,
+
+        /// Do they, or the sections they replaced, have asides or directives?
+        sets_scope: bool,
+    };
+
+    /// Replaces the lines the edit touched with the lines of the edited text, and the sections
+    /// they are in with new ones. The document is unchanged when this fails.
+    fn splice(self: *Document, start: Position, end: Position, text: []const u8) !Splice {
+        const start_index = self.sectionIndexAt(start.line);
+        const end_index = self.sectionIndexAt(end.line);
+
+        const start_section = self.sections.items[start_index];
+        const end_section = self.sections.items[end_index];
+
+        const start_line = start_section.lines.items[start.line - start_section.first_line];
+        const end_line = end_section.lines.items[end.line - end_section.first_line];
+
+        const edited = try std.mem.concat(self.allocator, u8, &.{
+            start_line.text[0..@min(start.character, start_line.text.len)],
+            text,
+            end_line.text[@min(end.character, end_line.text.len)..],
+        });
+        defer self.allocator.free(edited);
+
+        var fresh = std.ArrayList(Line).init(self.allocator);
+        defer fresh.deinit();
+
+        errdefer for (fresh.items) |*line| line.deinit(self.allocator);
+
+        var pieces = std.mem.splitScalar(u8, edited, '\n');
+
+        while (pieces.next()) |piece| {
+            try fresh.append(try Line.init(self.allocator, piece));
+        }
+
+        // the sections the edit is in, and the one before when the edit took away the first
+        // line of a procedure (what is left joins the procedure before)
+        var first = start_index;
+
+        if (first > 0 and start.line == start_section.first_line and !fresh.items[0].isHeader()) {
+            first -= 1;
+        }
+
+        const first_line = self.sections.items[first].first_line;
+
+        // every line of the new sections, the lines outside of the edit keep their tokens
+        var region = std.ArrayList(Line).init(self.allocator);
+        defer region.deinit();
+
+        for (self.sections.items[first..start_index]) |section| {
+            try region.appendSlice(section.lines.items);
+        }
+
+        try region.appendSlice(start_section.lines.items[0 .. start.line - start_section.first_line]);
+        try region.appendSlice(fresh.items);
+        try region.appendSlice(end_section.lines.items[end.line - end_section.first_line + 1 ..]);
+
+        const old_count = self.sections.items.len;
+
+        try self.appendSections(region.items, first_line);
+
+        errdefer {
+            for (self.sections.items[old_count..]) |section| section.destroy(self.allocator, false);
+            self.sections.shrinkRetainingCapacity(old_count);
+        }
+
+        var old_names = std.ArrayList([]const u8).init(self.allocator);
+        defer old_names.deinit();
+
+        var new_names = std.ArrayList([]const u8).init(self.allocator);
+        defer new_names.deinit();
+
+        for (self.sections.items[first .. end_index + 1]) |section| {
+            try section.appendNames(&old_names);
+        }
+
+        for (self.sections.items[old_count..]) |section| {
+            try section.appendNames(&new_names);
+        }
+
+        const same_names = sameNames(old_names.items, new_names.items);
+
+        var sets_scope = false;
+
+        for ([_][]const *Section{ self.sections.items[first .. end_index + 1], self.sections.items[old_count..] }) |sections| {
+            for (sections) |section| {
+                if (section.setsScope()) sets_scope = true;
+            }
+        }
+
+        // nothing fails from here on
+        fresh.clearRetainingCapacity();
+
+        const count = self.sections.items.len - old_count;
+
+        if (same_names) {
+            self.redirectDefinitions(self.sections.items[first .. end_index + 1], self.sections.items[old_count..]);
+        }
+
+        // the lines the edit replaced
+        for (self.sections.items[start_index .. end_index + 1]) |section| {
+            for (section.lines.items, section.first_line..) |*line, number| {
+                if (number >= start.line and number <= end.line) line.deinit(self.allocator);
+            }
+        }
+
+        const removed_lines = end_section.first_line + end_section.lines.items.len - first_line;
+        const removed_count = end_index + 1 - first;
+
+        for (self.sections.items[first .. end_index + 1]) |section| {
+            section.destroy(self.allocator, false);
+        }
+
+        // the new sections move from the end into the place of the old ones
+        std.mem.rotate(*Section, self.sections.items[first..], old_count - first);
+        std.mem.copyForwards(*Section, self.sections.items[first + count ..], self.sections.items[first + count + removed_count ..]);
+        self.sections.shrinkRetainingCapacity(self.sections.items.len - removed_count);
+
+        // and the sections after them move by the lines the edit added or removed
+        for (self.sections.items[first + count ..]) |section| {
+            section.first_line = @intCast(section.first_line + region.items.len - removed_lines);
+        }
+
+        return Splice{
+            .first = first,
+            .count = count,
+            .same_names = same_names,
+            .sets_scope = sets_scope,
+        };
+    }
+
+    /// Splits `lines` into sections starting at line `first_line`, and appends them. A section
+    /// starts at the first line, and at every line a procedure starts on.
+    fn appendSections(self: *Document, lines: []const Line, first_line: u32) !void {
+        const old_count = self.sections.items.len;
+
+        errdefer {
+            for (self.sections.items[old_count..]) |section| section.destroy(self.allocator, false);
+            self.sections.shrinkRetainingCapacity(old_count);
+        }
+
+        var begin: usize = 0;
+
+        for (lines, 0..) |line, i| {
+            if (i == 0 or !line.isHeader()) continue;
+
+            try self.appendSection(lines[begin..i], first_line + @as(u32, @intCast(begin)));
+            begin = i;
+        }
+
+        try self.appendSection(lines[begin..], first_line + @as(u32, @intCast(begin)));
+    }
+
+    fn appendSection(self: *Document, lines: []const Line, first_line: u32) !void {
+        try self.sections.ensureUnusedCapacity(1);
+
+        const section = try Section.create(self.allocator, first_line, lines);
+        self.sections.appendAssumeCapacity(section);
+    }
+
+    fn clearDefinitions(self: *Document) void {
+        var names = self.definitions.keyIterator();
+
+        while (names.next()) |name| {
+            self.allocator.free(name.*);
+        }
+
+        self.definitions.clearRetainingCapacity();
+    }
+
+    /// Finds the first definition of every procedure again.
+    fn collectDefinitions(self: *Document) !void {
+        self.clearDefinitions();
+
+        for (self.sections.items) |section| {
+            for (section.nodes) |node| {
+                if (node != .procedure) continue;
+
+                if (self.definitions.contains(node.procedure.header)) continue;
+
+                const name = try self.allocator.dupe(u8, node.procedure.header);
+                errdefer self.allocator.free(name);
+
+                try self.definitions.put(name, section);
+            }
+        }
+    }
+
+    /// Points the definitions in `removed` at the sections in `added`, which define the same
+    /// procedures in the same order.
+    fn redirectDefinitions(self: *Document, removed: []const *Section, added: []const *Section) void {
+        for (added) |section| {
+            for (section.nodes) |node| {
+                if (node != .procedure) continue;
+
+                const entry = self.definitions.getPtr(node.procedure.header) orelse continue;
+
+                // a section before the edit may define it first
+                if (std.mem.indexOfScalar(*Section, removed, entry.*) != null) entry.* = section;
+            }
+        }
+    }
+
+    /// Checks the sections from `begin` up to `end`. The `:set` values and the format are
+    /// rebuilt from every section before them, in order, so none of them point into lines an
+    /// edit freed.
+    fn checkRange(self: *Document, begin: usize, end: usize) !void {
+        self.expandables.clearRetainingCapacity();
+        self.format = .nexfuse;
+
+        for (self.sections.items[0..end], 0..) |section, i| {
+            if (i >= begin) {
+                try self.check(section);
+            } else {
+                try self.replayScope(section);
+            }
+        }
+    }
+
+    /// Applies the asides and the format of a section that is not checked again.
+    fn replayScope(self: *Document, section: *const Section) !void {
+        for (section.nodes) |node| {
+            if (node == .aside and isValidAside(node.aside)) try ir.expandAside(&self.expandables, node.aside);
+        }
+
+        if (section.format) |format| self.format = format;
+    }
+
+    /// Runs the directives and asides of `section`, and checks its procedures with what the
+    /// sections before it set.
+    fn check(self: *Document, section: *Section) !void {
+        _ = section.check_arena.reset(.retain_capacity);
+        const arena = section.check_arena.allocator();
+
+        var diagnostics = std.ArrayList(Diagnostic).init(arena);
+
+        section.format = null;
+
+        // names the procedures of the section can call
+        var defined = std.StringHashMap(void).init(arena);
+
+        for (section.nodes) |node| {
+            switch (node) {
+                .macro => |macro| try self.runDirective(section, node, macro.name, &diagnostics),
+
+                .aside => |aside| {
+                    if (!isValidAside(aside)) {
+                        try diagnostics.append(section.diagnosticAt(aside.span, .@"error", ":set expects a name and a value"));
+                        continue;
+                    }
+
+                    try ir.expandAside(&self.expandables, aside);
+                },
+
+                .procedure => |proc| {
+                    for (proc.children.items) |child| {
+                        if (child != .instruction_call) continue;
+
+                        const name = child.instruction_call.name.toString();
+                        const definition = self.definitions.get(name) orelse continue;
+
+                        if (definition.first_line < section.first_line) try defined.put(name, {});
+                    }
+
+                    const procedure = try ir.lowerProcedure(arena, proc, &self.expandables, &defined);
+
+                    for (procedure.statements.items) |statement| {
+                        if (statement != .instruction) continue;
+
+                        const res = self.isas.checkInstruction(self.format, statement.instruction) orelse continue;
+
+                        try diagnostics.append(try resultDiagnostic(arena, section, res));
+                    }
+
+                    // a procedure can call the procedures before it in the section
+                    try defined.put(proc.header, {});
+                },
+
+                else => {},
+            }
+        }
+
+        section.check_diagnostics = diagnostics.items;
+    }
+
+    fn runDirective(self: *Document, section: *Section, node: Node, name: token_stream.Identifier, diagnostics: *std.ArrayList(Diagnostic)) !void {
+        const arena = section.check_arena.allocator();
+
+        var opts = compiler_main.Options{ .files = undefined };
+
+        var pp = try compiler_pp.initDefaultRuntime(arena, &opts, null);
+        defer pp.deinit();
+
+        var directive = node;
+
+        const res = pp.handleAstDirectives(&directive) catch |err| {
+            try diagnostics.append(section.diagnosticAt(name.span, .@"error", errorMessage(err)));
+            return;
+        };
+
+        if (res == .nonexistent_directive) {
+            try diagnostics.append(section.diagnosticAt(name.span, .@"error", "unknown directive"));
+            return;
+        }
+
+        const format = opts.format orelse return;
+
+        if (std.ascii.eqlIgnoreCase(format, "nexfuse")) {
+            self.format = .nexfuse;
+        } else if (std.ascii.eqlIgnoreCase(format, "openlud")) {
+            self.format = .openlud;
+        } else {
+            self.format = .none;
+
+            try diagnostics.append(section.diagnosticAt(name.span, .information, "procedures are only checked for nexfuse and openlud"));
+        }
+
+        section.format = self.format;
+    }
+
+    /// Writes every diagnostic of the document as a JSON array of protocol diagnostics.
+    pub fn writeDiagnostics(self: *const Document, writer: anytype, encoding: Encoding) !void {
+        try writer.writeByte('[');
+
+        var first = true;
+
+        for (self.sections.items) |section| {
+            if (!section.linesAreClean()) {
+                for (section.lines.items, 0..) |line, i| {
+                    for (line.diagnostics) |diagnostic| {
+                        try writeDiagnostic(writer, &first, line.text, section.first_line + @as(u32, @intCast(i)), diagnostic, encoding);
+                    }
+                }
+            }
+
+            for ([_][]Diagnostic{ section.parse_diagnostics, section.check_diagnostics }) |diagnostics| {
+                for (diagnostics) |diagnostic| {
+                    const line = section.lines.items[diagnostic.line];
+
+                    try writeDiagnostic(writer, &first, line.text, section.first_line + diagnostic.line, diagnostic, encoding);
+                }
+            }
+        }
+
+        const last_line = self.lineCount() - 1;
+        const last_text = self.lineText(last_line);
+
+        // stylist on the whole file, the last line is only empty with a newline before it
+        if (last_text.len > 0) {
+            try writeDiagnostic(writer, &first, last_text, last_line, Diagnostic{
+                .begin = @intCast(last_text.len),
+                .end = @intCast(last_text.len),
+                .severity = .information,
+                .message = "it's good to add a newline near EOF",
+            }, encoding);
+        }
+
+        try writer.writeByte(']');
+    }
+};
+
+/// Is `aside` something `ir.expandAside` can take? `:set` needs a name and a value.
+fn isValidAside(aside: Aside) bool {
+    const parameters = aside.parameters.items;
+
+    if (!std.ascii.eqlIgnoreCase(aside.name.toString(), "set")) return true;
+
+    return parameters.len >= 2 and parameters[0] == .identifier;
+}
+
+fn sameNames(a: []const []const u8, b: []const []const u8) bool {
+    if (a.len != b.len) return false;
+
+    for (a, b) |x, y| {
+        if (!std.mem.eql(u8, x, y)) return false;
+    }
+
+    return true;
+}
+
+/// A diagnostic for what `Isa.checkInstruction` found.
+fn resultDiagnostic(arena: std.mem.Allocator, section: *const Section, res: codegen.Result) !Diagnostic {
+    return switch (res) {
+        .register_number_too_large => |reg| section.diagnosticAt(reg.span, .@"error", "register number too large"),
+        .instruction_doesnt_exist => |span| section.diagnosticAt(span, .@"error", "instruction does not exist for this architecture"),
+        .too_little_params => |info| section.diagnosticAt(info.span, .@"error", "the parameters to this function are incorrect."),
+
+        .params_to_instruction_are_wrong => |mismatch| section.diagnosticAt(mismatch.span, .@"error", try std.fmt.allocPrint(arena, "expected '{s}', got '{s}'", .{
+            @tagName(mismatch.expected),
+            @tagName(mismatch.actual),
+        })),
+
+        .bad_result => |span| section.diagnosticAt(span, .@"error", "bad result"),
+        .instruction_coughed_up_bad_result, .ok => section.diagnosticAt(.{}, .@"error", @tagName(res)),
+    };
+}
+
+/// A message for a lexer or parser error.
+fn errorMessage(err: anyerror) []const u8 {
+    return switch (err) {
+        error.UnexpectedToken => "unexpected token",
+        error.LiteralNeverClosed => "literal is never closed",
+        error.MalformedNumber => "malformed number",
+        error.ExpressionIsNotSubroutine => "expected a procedure (`name:`)",
+        error.EmptySubroutine => "empty procedure",
+        error.MacroNeverClose => "directive is never closed with `]`",
+        error.RangeExpectsSeparator => "range expects separator",
+        error.RangeStartsAfterEnd => "range starts after end (syntax is start:end)",
+        error.OldProcedureSyntax => "`@` procedures are the old syntax, use `name:`",
+        error.FormatMismatch => "compile-if names another format",
+        else => @errorName(err),
+    };
+}
+
+fn writeDiagnostic(writer: anytype, first: *bool, text: []const u8, line: u32, diagnostic: Diagnostic, encoding: Encoding) !void {
+    if (!first.*) try writer.writeByte(',');
+    first.* = false;
+
+    try std.json.stringify(.{
+        .range = .{
+            .start = .{ .line = line, .character = fromByteColumn(text, diagnostic.begin, encoding) },
+            .end = .{ .line = line, .character = fromByteColumn(text, diagnostic.end, encoding) },
+        },
+        .severity = @intFromEnum(diagnostic.severity),
+        .source = "vasm",
+        .message = diagnostic.message,
+    }, .{}, writer);
+}
+
+/// The byte offset of `character` (in `encoding` units) on `text`.
+fn toByteColumn(text: []const u8, character: u32, encoding: Encoding) usize {
+    if (encoding == .utf8) return @min(character, text.len);
+
+    var units: usize = 0;
+    var i: usize = 0;
+
+    while (i < text.len and units < character) {
+        const len = std.unicode.utf8ByteSequenceLength(text[i]) catch 1;
+
+        units += if (len == 4) 2 else 1;
+        i = @min(i + len, text.len);
+    }
+
+    return i;
+}
+
+/// The column of byte offset `byte` on `text`, in `encoding` units.
+fn fromByteColumn(text: []const u8, byte: u32, encoding: Encoding) u32 {
+    const end = @min(byte, text.len);
+
+    if (encoding == .utf8) return @intCast(end);
+
+    var units: u32 = 0;
+    var i: usize = 0;
+
+    while (i < end) {
+        const len = std.unicode.utf8ByteSequenceLength(text[i]) catch 1;
+
+        units += if (len == 4) 2 else 1;
+        i += len;
+    }
+
+    // past the end of the line
+    return units + (byte - @as(u32, @intCast(end)));
+}
+
+/// The largest message body `readMessage` takes. Larger ones are refused before they are
+/// allocated.
+pub const max_message_size = 64 * 1024 * 1024;
+
+/// Reads a message (its `Content-Length` header and body). Null at the end of the input. The
+/// message is owned by the caller.
+pub fn readMessage(allocator: std.mem.Allocator, reader: anytype) !?[]u8 {
+    var length: ?usize = null;
+    var header: [256]u8 = undefined;
+
+    while (true) {
+        const line = (try reader.readUntilDelimiterOrEof(&header, '\n')) orelse return null;
+        const trimmed = std.mem.trimRight(u8, line, "\r");
+
+        // an empty line ends the headers
+        if (trimmed.len == 0) break;
+
+        const name = "Content-Length:";
+
+        if (std.ascii.startsWithIgnoreCase(trimmed, name)) {
+            length = try std.fmt.parseInt(usize, std.mem.trim(u8, trimmed[name.len..], " "), 10);
+        }
+    }
+
+    if ((length orelse return error.MissingContentLength) > max_message_size) return error.MessageTooLarge;
+
+    const body = try allocator.alloc(u8, length.?);
+    errdefer allocator.free(body);
+
+    try reader.readNoEof(body);
+
+    return body;
+}
+
+/// Writes `body` as a message.
+pub fn writeMessage(writer: anytype, body: []const u8) !void {
+    try writer.print("Content-Length: {d}\r\n\r\n", .{body.len});
+    try writer.writeAll(body);
+}
+
+fn field(value: ?std.json.Value, name: []const u8) ?std.json.Value {
+    const object = value orelse return null;
+
+    return if (object == .object) object.object.get(name) else null;
+}
+
+fn string(value: ?std.json.Value) ?[]const u8 {
+    const it = value orelse return null;
+
+    return if (it == .string) it.string else null;
+}
+
+fn integer(value: ?std.json.Value) ?u32 {
+    const it = value orelse return null;
+
+    return if (it == .integer) std.math.cast(u32, it.integer) else null;
+}
+
+fn parsePosition(value: ?std.json.Value) ?Position {
+    return Position{
+        .line = integer(field(value, "line")) orelse return null,
+        .character = integer(field(value, "character")) orelse return null,
+    };
+}
+
+/// The open documents and what the client agreed on.
+pub const Server = struct {
+    allocator: std.mem.Allocator,
+    isas: *Isas,
+
+    /// By URI, the URIs are owned
+    documents: std.StringHashMap(*Document),
+
+    encoding: Encoding = .utf16,
+
+    pub fn init(allocator: std.mem.Allocator) !Server {
+        const isas = try allocator.create(Isas);
+        errdefer allocator.destroy(isas);
+
+        try isas.init(allocator);
+
+        return Server{
+            .allocator = allocator,
+            .isas = isas,
+            .documents = std.StringHashMap(*Document).init(allocator),
+        };
+    }
+
+    pub fn deinit(self: *Server) void {
+        var documents = self.documents.iterator();
+
+        while (documents.next()) |entry| {
+            self.allocator.free(entry.key_ptr.*);
+            self.closeDocument(entry.value_ptr.*);
+        }
+
+        self.documents.deinit();
+        self.isas.deinit();
+        self.allocator.destroy(self.isas);
+    }
+
+    fn closeDocument(self: *Server, document: *Document) void {
+        document.deinit();
+        self.allocator.destroy(document);
+    }
+
+    /// Handles a single message, writing any response and notification to `writer`. False once
+    /// the client asks the server to exit.
+    pub fn handle(self: *Server, message: []const u8, writer: anytype) !bool {
+        const parsed = std.json.parseFromSlice(std.json.Value, self.allocator, message, .{}) catch {
+            try self.respondError(writer, .null, -32700, "parse error");
+            return true;
+        };
+        defer parsed.deinit();
+
+        const request = parsed.value;
+        const id = field(request, "id");
+        const method = string(field(request, "method")) orelse return true;
+        const params = field(request, "params");
+
+        if (std.mem.eql(u8, method, "initialize")) {
+            const encodings = field(field(field(params, "capabilities"), "general"), "positionEncodings");
+
+            if (encodings != null and encodings.? == .array) {
+                for (encodings.?.array.items) |encoding| {
+                    if (std.mem.eql(u8, string(encoding) orelse continue, "utf-8")) self.encoding = .utf8;
+                }
+            }
+
+            try self.respond(writer, id, .{
+                .capabilities = .{
+                    .positionEncoding = if (self.encoding == .utf8) "utf-8" else "utf-16",
+                    .textDocumentSync = .{
+                        .openClose = true,
+                        // incremental
+                        .change = 2,
+                    },
+                },
+                .serverInfo = .{ .name = "vasm" },
+            });
+        } else if (std.mem.eql(u8, method, "shutdown")) {
+            try self.respond(writer, id, @as(?bool, null));
+        } else if (std.mem.eql(u8, method, "exit")) {
+            return false;
+        } else if (std.mem.eql(u8, method, "textDocument/didOpen")) {
+            const document = field(params, "textDocument");
+            const uri = string(field(document, "uri")) orelse return true;
+            const text = string(field(document, "text")) orelse return true;
+
+            try self.open(uri, text);
+            try self.publish(writer, uri);
+        } else if (std.mem.eql(u8, method, "textDocument/didChange")) {
+            const uri = string(field(field(params, "textDocument"), "uri")) orelse return true;
+            const changes = field(params, "contentChanges") orelse return true;
+
+            const document = self.documents.get(uri) orelse return true;
+
+            if (changes != .array) return true;
+
+            for (changes.array.items) |change| {
+                const text = string(field(change, "text")) orelse continue;
+                const range = field(change, "range");
+
+                if (range == null) {
+                    try document.replace(null, text);
+                    continue;
+                }
+
+                const start = parsePosition(field(range, "start")) orelse continue;
+                const end = parsePosition(field(range, "end")) orelse continue;
+
+                try document.replace(.{
+                    document.byteColumn(start, self.encoding),
+                    document.byteColumn(end, self.encoding),
+                }, text);
+            }
+
+            try self.publish(writer, uri);
+        } else if (std.mem.eql(u8, method, "textDocument/didClose")) {
+            const uri = string(field(field(params, "textDocument"), "uri")) orelse return true;
+            const entry = self.documents.fetchRemove(uri) orelse return true;
+
+            defer self.allocator.free(entry.key);
+            self.closeDocument(entry.value);
+
+            // clears what the editor shows
+            try self.publish(writer, uri);
+        } else if (id != null) {
+            try self.respondError(writer, id.?, -32601, "method not found");
+        }
+
+        return true;
+    }
+
+    fn open(self: *Server, uri: []const u8, text: []const u8) !void {
+        const document = try self.allocator.create(Document);
+        errdefer self.allocator.destroy(document);
+
+        document.* = try Document.init(self.allocator, self.isas, text);
+        errdefer document.deinit();
+
+        const entry = try self.documents.getOrPut(uri);
+
+        if (entry.found_existing) {
+            self.closeDocument(entry.value_ptr.*);
+        } else {
+            entry.key_ptr.* = self.allocator.dupe(u8, uri) catch |err| {
+                self.documents.removeByPtr(entry.key_ptr);
+                return err;
+            };
+        }
+
+        entry.value_ptr.* = document;
+    }
+
+    fn respond(self: *Server, writer: anytype, id: ?std.json.Value, result: anytype) !void {
+        var body = std.ArrayList(u8).init(self.allocator);
+        defer body.deinit();
+
+        try std.json.stringify(.{
+            .jsonrpc = "2.0",
+            .id = id orelse .null,
+            .result = result,
+        }, .{}, body.writer());
+
+        try writeMessage(writer, body.items);
+    }
+
+    fn respondError(self: *Server, writer: anytype, id: std.json.Value, code: i32, message: []const u8) !void {
+        var body = std.ArrayList(u8).init(self.allocator);
+        defer body.deinit();
+
+        try std.json.stringify(.{
+            .jsonrpc = "2.0",
+            .id = id,
+            .@"error" = .{ .code = code, .message = message },
+        }, .{}, body.writer());
+
+        try writeMessage(writer, body.items);
+    }
+
+    /// Sends the diagnostics of `uri`, none when it is not open.
+    fn publish(self: *Server, writer: anytype, uri: []const u8) !void {
+        var body = std.ArrayList(u8).init(self.allocator);
+        defer body.deinit();
+
+        const out = body.writer();
+
+        try out.writeAll("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":");
+        try std.json.stringify(uri, .{}, out);
+        try out.writeAll(",\"diagnostics\":");
+
+        if (self.documents.get(uri)) |document| {
+            try document.writeDiagnostics(out, self.encoding);
+        } else {
+            try out.writeAll("[]");
+        }
+
+        try out.writeAll("}}");
+
+        try writeMessage(writer, body.items);
+    }
+};
+
+/// Serves the client on the other end of `reader` and `writer` until it asks the server to exit
+/// or closes its end.
+pub fn serve(allocator: std.mem.Allocator, reader: anytype, writer: anytype) !void {
+    var server = try Server.init(allocator);
+    defer server.deinit();
+
+    var buffered_reader = std.io.bufferedReader(reader);
+    var buffered_writer = std.io.bufferedWriter(writer);
+
+    while (try readMessage(allocator, buffered_reader.reader())) |message| {
+        defer allocator.free(message);
+
+        const more = try server.handle(message, buffered_writer.writer());
+
+        // the client waits on every response
+        try buffered_writer.flush();
+
+        if (!more) return;
+    }
+}
+
+fn testDocument(isas: *const Isas, text: []const u8) !Document {
+    return Document.init(std.testing.allocator, isas, text);
+}
+
+/// Every diagnostic of `document` as JSON.
+fn testDiagnostics(document: *const Document) ![]u8 {
+    var output = std.ArrayList(u8).init(std.testing.allocator);
+    errdefer output.deinit();
+
+    try document.writeDiagnostics(output.writer(), .utf8);
+
+    return output.toOwnedSlice();
+}
+
+test Document {
+    var isas: Isas = undefined;
+    try isas.init(std.testing.allocator);
+    defer isas.deinit();
+
+    var document = try testDocument(&isas, ":set VALUE 7\n\na: mov R1, VALUE\n\n_start: a\nfoo R1\n");
+    defer document.deinit();
+
+    // the asides, `a` and `_start`
+    try std.testing.expectEqual(3, document.sections.items.len);
+    try std.testing.expectEqual(2, document.sections.items[1].first_line);
+    try std.testing.expectEqual(4, document.sections.items[2].first_line);
+    try std.testing.expectEqual(7, document.lineCount());
+
+    const diagnostics = try testDiagnostics(&document);
+    defer std.testing.allocator.free(diagnostics);
+
+    try std.testing.expectEqualStrings(
+        \\[{"range":{"start":{"line":5,"character":0},"end":{"line":5,"character":3}},"severity":1,"source":"vasm","message":"instruction does not exist for this architecture"}]
+    , diagnostics);
+}
+
+test "editing a procedure" {
+    var isas: Isas = undefined;
+    try isas.init(std.testing.allocator);
+    defer isas.deinit();
+
+    var document = try testDocument(&isas, "a: mov R1, 5\n\n_start: a\nfoo R1\n");
+    defer document.deinit();
+
+    const a = document.sections.items[0];
+    const start_line = document.sections.items[1].lines.items[0].text.ptr;
+
+    // `foo` -> `each`
+    try document.replace(.{ .{ .line = 3, .character = 0 }, .{ .line = 3, .character = 3 } }, "each");
+
+    // `a` was not touched, the header of `_start` was not lexed again
+    try std.testing.expectEqual(a, document.sections.items[0]);
+    try std.testing.expectEqual(start_line, document.sections.items[1].lines.items[0].text.ptr);
+    try std.testing.expectEqualStrings("each R1", document.lineText(3));
+
+    const diagnostics = try testDiagnostics(&document);
+    defer std.testing.allocator.free(diagnostics);
+
+    try std.testing.expectEqualStrings("[]", diagnostics);
+
+    // a new procedure in the middle of `_start`
+    try document.replace(.{ .{ .line = 3, .character = 0 }, .{ .line = 3, .character = 0 } }, "b: mov R2, 1\n");
+
+    try std.testing.expectEqual(3, document.sections.items.len);
+    try std.testing.expectEqual(3, document.sections.items[2].first_line);
+    try std.testing.expectEqualStrings("b", document.sections.items[2].nodes[0].procedure.header);
+}
+
+test "renaming a procedure" {
+    var isas: Isas = undefined;
+    try isas.init(std.testing.allocator);
+    defer isas.deinit();
+
+    var document = try testDocument(&isas, "a: mov R1, 5\n_start: a\n");
+    defer document.deinit();
+
+    // `_start` calls `a`, until `a` is called `b`
+    try document.replace(.{ .{ .line = 0, .character = 0 }, .{ .line = 0, .character = 1 } }, "b");
+
+    const diagnostics = try testDiagnostics(&document);
+    defer std.testing.allocator.free(diagnostics);
+
+    try std.testing.expect(std.mem.indexOf(u8, diagnostics, "\"line\":1,\"character\":8") != null);
+
+    // without its header, the body of `_start` is part of `b`
+    try document.replace(.{ .{ .line = 1, .character = 0 }, .{ .line = 1, .character = 8 } }, "");
+
+    try std.testing.expectEqual(1, document.sections.items.len);
+    try std.testing.expectEqualStrings("a", document.lineText(1));
+}
+
+test "editing a :set" {
+    var isas: Isas = undefined;
+    try isas.init(std.testing.allocator);
+    defer isas.deinit();
+
+    var document = try testDocument(&isas, ":set VALUE 7\n\na: mov R1, VALUE\n");
+    defer document.deinit();
+
+    // only `a` is checked again, with what the lines before it set
+    try document.replace(.{ .{ .line = 2, .character = 8 }, .{ .line = 2, .character = 9 } }, "2");
+
+    try std.testing.expectEqualStrings("a: mov R2, VALUE", document.lineText(2));
+    try std.testing.expect(document.expandables.get("VALUE") != null);
+
+    const diagnostics = try testDiagnostics(&document);
+    defer std.testing.allocator.free(diagnostics);
+
+    try std.testing.expectEqualStrings("[]", diagnostics);
+
+    // the line the value pointed into is gone, and so is the value
+    try document.replace(.{ .{ .line = 0, .character = 0 }, .{ .line = 0, .character = 12 } }, "");
+
+    try std.testing.expectEqual(null, document.expandables.get("VALUE"));
+}
+
+test "edits given end first" {
+    var isas: Isas = undefined;
+    try isas.init(std.testing.allocator);
+    defer isas.deinit();
+
+    var document = try testDocument(&isas, "_start: mov R1, 5\nfoo R1\n");
+    defer document.deinit();
+
+    // the same as from line 1, column 0 to column 3
+    try document.replace(.{ .{ .line = 1, .character = 3 }, .{ .line = 1, .character = 0 } }, "each");
+    try std.testing.expectEqualStrings("each R1", document.lineText(1));
+
+    // and across lines
+    try document.replace(.{ .{ .line = 1, .character = 0 }, .{ .line = 0, .character = 12 } }, "R1, 5\n");
+    try std.testing.expectEqualStrings("_start: mov R1, 5", document.lineText(0));
+    try std.testing.expectEqualStrings("each R1", document.lineText(1));
+}
+
+test "messages larger than the limit" {
+    var input = std.ArrayList(u8).init(std.testing.allocator);
+    defer input.deinit();
+
+    try input.writer().print("Content-Length: {d}\r\n\r\n", .{max_message_size + 1});
+
+    var stream = std.io.fixedBufferStream(input.items);
+
+    try std.testing.expectError(error.MessageTooLarge, readMessage(std.testing.allocator, stream.reader()));
+}
+
+test "columns" {
+    try std.testing.expectEqual(3, toByteColumn("ä b", 2, .utf16));
+    try std.testing.expectEqual(2, fromByteColumn("ä b", 3, .utf16));
+    try std.testing.expectEqual(3, fromByteColumn("ä b", 3, .utf8));
+}
+
+test Server {
+    var server = try Server.init(std.testing.allocator);
+    defer server.deinit();
+
+    var output = std.ArrayList(u8).init(std.testing.allocator);
+    defer output.deinit();
+
+    const messages = [_][]const u8{
+        \\{"jsonrpc":"2.0","id":1,"method":"initialize","params":{"capabilities":{"general":{"positionEncodings":["utf-8"]}}}}
+        ,
+        \\{"jsonrpc":"2.0","method":"textDocument/didOpen","params":{"textDocument":{"uri":"file:///a.asm","text":"_start: foo\n"}}}
+        ,
+        \\{"jsonrpc":"2.0","method":"textDocument/didChange","params":{"textDocument":{"uri":"file:///a.asm"},"contentChanges":[{"range":{"start":{"line":0,"character":8},"end":{"line":0,"character":11}},"text":"nop"}]}}
+        ,
+    };
+
+    var input = std.ArrayList(u8).init(std.testing.allocator);
+    defer input.deinit();
+
+    for (messages) |message| {
+        try writeMessage(input.writer(), message);
+    }
+
+    var stream = std.io.fixedBufferStream(input.items);
+
+    while (try readMessage(std.testing.allocator, stream.reader())) |message| {
+        defer std.testing.allocator.free(message);
+
+        try std.testing.expect(try server.handle(message, output.writer()));
+    }
+
+    try std.testing.expectEqual(.utf8, server.encoding);
+
+    // `foo` does not exist, `nop` does
+    try std.testing.expect(std.mem.indexOf(u8, output.items, "\"message\":\"instruction does not exist for this architecture\"") != null);
+    try std.testing.expect(std.mem.endsWith(u8, output.items, "\"diagnostics\":[]}}"));
+
+    try std.testing.expect(!try server.handle("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}", output.writer()));
+}
@@ -0,0 +1,472 @@
+//! ## Object Files
+//!
+//! `-c` stops a compile at the format-neutral program (see `ir.zig`) and writes it to an object
+//! file instead of a binary. Objects given after the source file are linked into its program:
+//!
+//! ```sh
+//! vasm strings.asm -c -o strings.vo
+//! vasm main.asm strings.vo -f nexfuse -o main.bin
+//! ```
+//!
+//! Linking joins the procedures of every object, in the order they were given, and the procedures
+//! of the source file after them, before any binary is generated. Folding, removing procedures
+//! `_start` never reaches and merging identical procedures then see every input at once, the
+//! same as if they were one file. As in a single file, a procedure can only call the procedures
+//! before it, so an object goes after the objects it calls.
+//!
+//! Objects hold no spans. Errors in the procedures of an object point at the start of the source.
+//!
+
+const std = @import("std");
+const ir = @import("ir.zig");
+const parser = @import("parser.zig");
+const token_stream = @import("token_stream.zig");
+
+const Identifier = token_stream.Identifier;
+const Value = parser.Value;
+
+/// Starts every object. The last byte is the version of the encoding.
+pub const magic = "VASMOBJ\x01";
+
+pub const Error = error{
+    /// The input does not start with `magic`
+    NotAnObject,
+
+    /// The input ends in the middle of the program
+    TruncatedObject,
+
+    /// A tag that does not exist, a call to a procedure that is not before the caller, or a count
+    /// larger than the object
+    InvalidObject,
+};
+
+/// Does `bytes` start like an object?
+pub fn isObject(bytes: []const u8) bool {
+    return std.mem.startsWith(u8, bytes, magic);
+}
+
+/// Writes `program` as an object.
+///
+/// ```
+/// magic
+/// u32 procedure count
+///     string name, u32 statement count
+///         u8 tag, string name
+///         instructions: u32 operand count
+///             u8 tag, value
+/// ```
+///
+/// Integers are little endian, strings are a u32 length followed by the bytes.
+pub fn write(program: *const ir.Program, writer: anytype) !void {
+    try writer.writeAll(magic);
+    try writer.writeInt(u32, @intCast(program.procedures.items.len), .little);
+
+    for (program.procedures.items) |*procedure| {
+        try writeString(writer, procedure.name);
+        try writeStatements(writer, procedure);
+    }
+}
+
+fn writeString(writer: anytype, string: []const u8) !void {
+    try writer.writeInt(u32, @intCast(string.len), .little);
+    try writer.writeAll(string);
+}
+
+/// Writes the body of `procedure`, without its name. Spans are left out, so bodies that are the
+/// same write the same bytes wherever they are in the source.
+pub fn writeStatements(writer: anytype, procedure: *const ir.Procedure) !void {
+    try writer.writeInt(u32, @intCast(procedure.statements.items.len), .little);
+
+    for (procedure.statements.items) |statement| {
+        try writer.writeByte(@intFromEnum(statement));
+        try writeString(writer, statement.name().toString());
+
+        if (statement != .instruction) continue;
+
+        try writer.writeInt(u32, @intCast(statement.instruction.operands.len), .little);
+
+        for (statement.instruction.operands) |operand| {
+            try writer.writeByte(@intFromEnum(operand));
+
+            switch (operand) {
+                .identifier => |it| try writeString(writer, it.toString()),
+                .number => |it| try writer.writeInt(i64, it.number, .little),
+                .register => |it| try writer.writeInt(u64, it.register_number, .little),
+                .literal => |it| try writeString(writer, it.ptr[0..it.span.len]),
+
+                .range => |it| {
+                    try writer.writeInt(u32, it.starting_position, .little);
+                    try writer.writeInt(u32, it.ending_position, .little);
+                },
+
+                .nil => {},
+            }
+        }
+    }
+}
+
+/// Reads an object into a program. Names and literals point into `bytes`, which has to outlive
+/// the program. Best to allocate with an arena.
+pub fn read(allocator: std.mem.Allocator, bytes: []const u8) !ir.Program {
+    if (!isObject(bytes)) return error.NotAnObject;
+
+    var reader = Reader{ .bytes = bytes, .pos = magic.len };
+    var program = ir.Program.init(allocator);
+
+    // every procedure so far, calls can only go to them
+    var defined = std.StringHashMap(void).init(allocator);
+    defer defined.deinit();
+
+    const procedure_count = try reader.int(u32);
+
+    for (0..procedure_count) |_| {
+        var procedure = ir.Procedure{
+            .name = try reader.string(),
+            .statements = std.ArrayList(ir.Statement).init(allocator),
+            .callees = std.ArrayList([]const u8).init(allocator),
+        };
+
+        const statement_count = try reader.int(u32);
+
+        for (0..statement_count) |_| {
+            const tag = std.meta.intToEnum(ir.StatementTag, try reader.int(u8)) catch return error.InvalidObject;
+            const name = try Identifier.init(try reader.string());
+
+            if (tag == .call) {
+                if (!defined.contains(name.toString())) return error.InvalidObject;
+
+                try procedure.statements.append(ir.Statement{ .call = name });
+                try addCallee(&procedure, name.toString());
+                continue;
+            }
+
+            // a nil operand is the smallest, a tag alone
+            const operands = try allocator.alloc(Value, try reader.count(1));
+
+            for (operands) |*operand| {
+                operand.* = try reader.value();
+            }
+
+            try procedure.statements.append(ir.Statement{
+                .instruction = ir.Instruction{
+                    .name = name,
+                    .operands = operands,
+                },
+            });
+        }
+
+        try defined.put(procedure.name, {});
+        try program.procedures.append(procedure);
+    }
+
+    return program;
+}
+
+const Reader = struct {
+    bytes: []const u8,
+    pos: usize,
+
+    fn take(self: *Reader, len: usize) ![]const u8 {
+        if (self.bytes.len - self.pos < len) return error.TruncatedObject;
+
+        defer self.pos += len;
+        return self.bytes[self.pos..][0..len];
+    }
+
+    fn int(self: *Reader, comptime T: type) !T {
+        return std.mem.readInt(T, (try self.take(@sizeOf(T)))[0..@sizeOf(T)], .little);
+    }
+
+    /// A count of items of at least `item_size` bytes each. Checked against what is left, so a
+    /// broken object can not make the reader allocate more than its size.
+    fn count(self: *Reader, item_size: usize) !u32 {
+        const value = try self.int(u32);
+
+        if ((self.bytes.len - self.pos) / item_size < value) return error.InvalidObject;
+
+        return value;
+    }
+
+    fn string(self: *Reader) ![]const u8 {
+        const len = try self.int(u32);
+
+        // spans can not be any longer
+        if (len > std.math.maxInt(u16)) return error.InvalidObject;
+
+        return self.take(len);
+    }
+
+    fn value(self: *Reader) !Value {
+        const tag = std.meta.intToEnum(parser.ValueTag, try self.int(u8)) catch return error.InvalidObject;
+
+        return switch (tag) {
+            .identifier => Value{ .identifier = try Identifier.init(try self.string()) },
+            .number => Value{ .number = token_stream.Number.init(try self.int(i64)) },
+            .register => Value{ .register = parser.Register.init(std.math.cast(usize, try self.int(u64)) orelse return error.InvalidObject) },
+            .literal => Value{ .literal = try token_stream.Literal.init(try self.string()) },
+
+            .range => Value{
+                .range = parser.Range{
+                    .starting_position = try self.int(u32),
+                    .ending_position = try self.int(u32),
+                },
+            },
+
+            .nil => Value{ .nil = 0 },
+        };
+    }
+};
+
+fn addCallee(procedure: *ir.Procedure, name: []const u8) !void {
+    for (procedure.callees.items) |callee| {
+        if (std.mem.eql(u8, callee, name)) return;
+    }
+
+    try procedure.callees.append(name);
+}
+
+/// Joins the procedures of `units` into one program, in order. An instruction named after a
+/// procedure of an earlier unit is a call to it, the same as within a unit. Statements are shared
+/// with the units, which have to outlive the program. Best to allocate with an arena.
+pub fn link(allocator: std.mem.Allocator, units: []const ir.Program) !ir.Program {
+    var program = ir.Program.init(allocator);
+
+    // every procedure so far, calls can only go to them
+    var defined = std.StringHashMap(void).init(allocator);
+    defer defined.deinit();
+
+    for (units) |unit| {
+        try program.procedures.ensureUnusedCapacity(unit.procedures.items.len);
+
+        for (unit.procedures.items) |procedure| {
+            var linked = ir.Procedure{
+                .name = procedure.name,
+                .statements = try std.ArrayList(ir.Statement).initCapacity(allocator, procedure.statements.items.len),
+                .callees = std.ArrayList([]const u8).init(allocator),
+            };
+
+            for (procedure.statements.items) |statement| {
+                var resolved = statement;
+
+                if (statement == .instruction and defined.contains(statement.instruction.name.toString())) {
+                    resolved = ir.Statement{ .call = statement.instruction.name };
+                }
+
+                linked.statements.appendAssumeCapacity(resolved);
+
+                if (resolved == .call) try addCallee(&linked, resolved.call.toString());
+            }
+
+            try defined.put(procedure.name, {});
+            program.procedures.appendAssumeCapacity(linked);
+        }
+    }
+
+    return program;
+}
+
+/// Drops every procedure whose statements are the same as the ones of an earlier procedure, and
+/// calls the earlier one wherever the dropped one was called. Procedures compare after their own
+/// calls are redirected, so procedures calling merged ones merge as well. The start procedure,
+/// procedures an operand names (like the target of a `jmp`) and procedures defined more than once
+/// are always kept. Returns how many procedures were dropped. This is the merge-procedures pass
+/// (see `passes.zig`).
+pub fn mergeIdenticalProcedures(allocator: std.mem.Allocator, program: *ir.Program, start_definition: []const u8) !usize {
+    var defined = std.StringHashMap(void).init(allocator);
+    defer defined.deinit();
+
+    var pinned = std.StringHashMap(void).init(allocator);
+    defer pinned.deinit();
+
+    try pinned.put(start_definition, {});
+
+    for (program.procedures.items) |procedure| {
+        if (try defined.fetchPut(procedure.name, {}) != null) try pinned.put(procedure.name, {});
+
+        for (procedure.statements.items) |statement| {
+            if (statement != .instruction) continue;
+
+            for (statement.instruction.operands) |operand| {
+                if (operand == .identifier) try pinned.put(operand.identifier.toString(), {});
+            }
+        }
+    }
+
+    // the encoded statements of every procedure that can be merged into -> its name
+    var bodies = std.StringHashMap([]const u8).init(allocator);
+
+    defer {
+        var keys = bodies.keyIterator();
+        while (keys.next()) |key| allocator.free(key.*);
+
+        bodies.deinit();
+    }
+
+    // dropped procedure -> the one it was merged into
+    var merged = std.StringHashMap([]const u8).init(allocator);
+    defer merged.deinit();
+
+    var kept: usize = 0;
+
+    for (program.procedures.items) |procedure| {
+        var current = procedure;
+
+        for (current.statements.items) |*statement| {
+            if (statement.* != .call) continue;
+
+            const target = merged.get(statement.call.toString()) orelse continue;
+
+            // the call is to another name now, one that is not at the span of the call
+            statement.call = try Identifier.init(target);
+        }
+
+        current.callees.clearRetainingCapacity();
+
+        for (current.statements.items) |statement| {
+            if (statement == .call) try addCallee(&current, statement.call.toString());
+        }
+
+        if (!pinned.contains(current.name)) {
+            var body = std.ArrayList(u8).init(allocator);
+            defer body.deinit();
+
+            try writeStatements(body.writer(), &current);
+
+            if (bodies.get(body.items)) |earlier| {
+                try merged.put(current.name, earlier);
+                continue;
+            }
+
+            const key = try body.toOwnedSlice();
+            errdefer allocator.free(key);
+
+            try bodies.put(key, current.name);
+        }
+
+        program.procedures.items[kept] = current;
+        kept += 1;
+    }
+
+    const dropped = program.procedures.items.len - kept;
+    program.procedures.shrinkRetainingCapacity(kept);
+
+    return dropped;
+}
+
+fn testProgram(allocator: std.mem.Allocator, text: []const u8) !ir.Program {
+    return ir.lower(allocator, try @import("drivers.zig").ast(allocator, text));
+}
+
+test read {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    const program = try testProgram(allocator, "a: mov R1, 5\necho 'Hi'\n_start: a\nlsl R1, x, {0:2}\n");
+
+    var bytes = std.ArrayList(u8).init(allocator);
+    try write(&program, bytes.writer());
+
+    const copy = try read(allocator, bytes.items);
+
+    try std.testing.expectEqual(2, copy.procedures.items.len);
+
+    const a = copy.getProcedure("a").?;
+    try std.testing.expectEqual(5, a.statements.items[0].instruction.operands[1].number.number);
+    try std.testing.expectEqual(1, a.statements.items[0].instruction.operands[0].register.register_number);
+    try std.testing.expectEqualStrings("'Hi'", a.statements.items[1].instruction.operands[0].literal.ptr[0..4]);
+
+    const start = copy.getProcedure("_start").?;
+    try std.testing.expectEqualStrings("a", start.statements.items[0].call.toString());
+    try std.testing.expectEqualStrings("a", start.callees.items[0]);
+    try std.testing.expectEqualStrings("x", start.statements.items[1].instruction.operands[1].identifier.toString());
+    try std.testing.expectEqual(2, start.statements.items[1].instruction.operands[2].range.ending_position);
+
+    try std.testing.expectError(error.NotAnObject, read(allocator, "a: mov R1, 5\n"));
+    try std.testing.expectError(error.TruncatedObject, read(allocator, bytes.items[0 .. bytes.items.len - 1]));
+}
+
+test "invalid objects" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    // a call to a procedure that is not before it
+    var call = std.ArrayList(u8).init(allocator);
+    try call.appendSlice(magic);
+    try call.writer().writeInt(u32, 1, .little);
+    try call.writer().writeInt(u32, 6, .little);
+    try call.appendSlice("_start");
+    try call.writer().writeInt(u32, 1, .little);
+    try call.append(@intFromEnum(ir.StatementTag.call));
+    try call.writer().writeInt(u32, 1, .little);
+    try call.append('a');
+
+    try std.testing.expectError(error.InvalidObject, read(allocator, call.items));
+
+    // an instruction claiming more operands than the object has bytes
+    var huge = std.ArrayList(u8).init(allocator);
+    try huge.appendSlice(magic);
+    try huge.writer().writeInt(u32, 1, .little);
+    try huge.writer().writeInt(u32, 1, .little);
+    try huge.append('a');
+    try huge.writer().writeInt(u32, 1, .little);
+    try huge.append(@intFromEnum(ir.StatementTag.instruction));
+    try huge.writer().writeInt(u32, 3, .little);
+    try huge.appendSlice("mov");
+    try huge.writer().writeInt(u32, std.math.maxInt(u32), .little);
+
+    try std.testing.expectError(error.InvalidObject, read(allocator, huge.items));
+}
+
+test link {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    const units = [_]ir.Program{
+        try testProgram(allocator, "newline: echo 10\n"),
+        try testProgram(allocator, "line: mov R1, 1\nnewline\n"),
+        try testProgram(allocator, "_start: line\nnewline\n"),
+    };
+
+    const program = try link(allocator, &units);
+
+    try std.testing.expectEqual(3, program.procedures.items.len);
+
+    // calls into earlier units, not instructions
+    try std.testing.expect(program.getProcedure("line").?.statements.items[1] == .call);
+    try std.testing.expectEqual(2, program.getProcedure("_start").?.callees.items.len);
+
+    // the units are left as they were
+    try std.testing.expect(units[1].procedures.items[0].statements.items[1] == .instruction);
+}
+
+test mergeIdenticalProcedures {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    const units = [_]ir.Program{
+        try testProgram(allocator, "a: echo 10\nb: a\nc: jmp d\nd: echo 10\n"),
+        try testProgram(allocator, "e: echo 10\nf: e\n_start: f\nb\nc\n"),
+    };
+
+    var program = try link(allocator, &units);
+    try std.testing.expectEqual(2, try mergeIdenticalProcedures(allocator, &program, "_start"));
+
+    // `e` is `a`, so `f` is `b`. `d` is `a` as well, but `jmp` names it.
+    try std.testing.expectEqual(5, program.procedures.items.len);
+    try std.testing.expect(program.getProcedure("e") == null);
+    try std.testing.expect(program.getProcedure("f") == null);
+    try std.testing.expect(program.getProcedure("d") != null);
+
+    const start = program.getProcedure("_start").?;
+    try std.testing.expectEqualStrings("b", start.statements.items[0].call.toString());
+    try std.testing.expectEqualStrings("b", start.callees.items[0]);
+    try std.testing.expectEqual(2, start.callees.items.len);
+}
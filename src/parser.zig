@@ -161,12 +161,7 @@ pub const Value = union(ValueTag) {
 /// A register reference. E.g. R0, R1, R2
 pub const Register = struct {
     register_number: usize,
-    span: Span = Span{
-        .begin = 0,
-        .char_begin = 0,
-        .end = 0,
-        .line_number = 0,
-    },
+    span: Span = .{},
 
     pub fn init(at_number: usize) Register {
         return Register{
@@ -180,14 +175,9 @@ pub const Register = struct {
 };
 
 pub const Range = struct {
-    starting_position: usize,
-    ending_position: usize,
-    span: Span = Span{
-        .begin = 0,
-        .char_begin = 0,
-        .end = 0,
-        .line_number = 0,
-    },
+    starting_position: u32,
+    ending_position: u32,
+    span: Span = .{},
 };
 
 /// Possible types that a `Node` type can be.
@@ -353,28 +343,36 @@ pub const Parser = struct {
             },
         };
 
+        while (try self.createNextRootChild()) |child| {
+            var root = node.asRoot();
+            try root.children.append(child);
+        }
+
+        return node;
+    }
+
+    /// Creates the next node at the root of the tree (a procedure, macro or aside), or null at
+    /// the end of the token stream. Lets the next stage start on a node as soon as it is parsed.
+    pub fn createNextRootChild(self: *Parser) !?Node {
         // while we're not at the end of the token stream
         while (!self.streamIsAtEnd()) {
             const current_token = try self.getCurrentToken();
 
-            switch (current_token.*) {
+            const child = switch (current_token.*) {
                 // if we've encountered an operator
-                .operator => |op| {
+                .operator => |op| blk: {
                     if (op.kind == .newline) {
                         self.incrementCurrentPosition();
                         continue;
                     }
 
-                    var root = node.asRoot();
-                    try root.children.append(try self.createNodeFromOperator(op));
+                    break :blk try self.createNodeFromOperator(op);
                 },
 
                 // since this is the root node, we expect this to be a subroutine. Any
                 // macros or calls where the delimiter is at the beginning of the statement are
                 // already chewed up by the createNodeFromOperator() function.
-                .identifier => |id| {
-                    var root = node.asRoot();
-
+                .identifier => |id| blk: {
                     // we now advance one
                     self.incrementCurrentPosition();
 
@@ -398,7 +396,7 @@ pub const Parser = struct {
                         }
 
                         // we then advance again, and we create a procedure body
-                        try root.children.append(try self.createNodeFromProcedure(id));
+                        break :blk try self.createNodeFromProcedure(id);
                     } else {
                         // we expect a subroutine to kick our journey off,
                         // if the token isn't a subroutine then we can just throw an error,
@@ -410,14 +408,16 @@ pub const Parser = struct {
                 else => {
                     return error.UnexpectedToken;
                 },
-            }
+            };
 
             // when everything else finished doing its magic,
             // move to the next token
             self.incrementCurrentPosition();
+
+            return child;
         }
 
-        return node;
+        return null;
     }
 
     /// Parses the given operator
@@ -466,7 +466,8 @@ pub const Parser = struct {
             return error.AsideExpectsName;
         }
 
-        const name = try self.getCurrentToken();
+        // a copy, reading on can move the tokens of a pipelined stream
+        const name = (try self.getCurrentToken()).*;
 
         if (name.getType() != .identifier) {
             return error.AsideNameMustBeIdentifier;
@@ -494,12 +495,7 @@ pub const Parser = struct {
             .aside = Aside{
                 .name = name_as_identifier,
                 .parameters = params,
-                .span = .{
-                    .begin = name.getSpan().begin,
-                    .char_begin = name.getSpan().char_begin,
-                    .end = name.getSpan().end,
-                    .line_number = name.getSpan().line_number,
-                },
+                .span = name.getSpan(),
             },
         };
     }
@@ -517,7 +513,14 @@ pub const Parser = struct {
             return error.ExpectedToken;
         }
 
-        const name = (try self.getCurrentToken()).identifier;
+        const name_token = try self.getCurrentToken();
+
+        // `[` followed by anything but a name, like `[1]`
+        if (name_token.getType() != .identifier) {
+            return error.UnexpectedToken;
+        }
+
+        const name = name_token.identifier;
 
         var node = Node{
             .macro = Macro{
@@ -560,15 +563,16 @@ pub const Parser = struct {
             .procedure = Procedure{
                 .children = std.ArrayList(Node).init(self.parent_allocator),
                 .documentation = "",
-                .header = name.identifier_string,
+                .header = name.toString(),
             },
         };
 
         // we now parse the tokens in the procedure body
         while (!self.streamIsAtEnd()) {
-            const token = try self.getCurrentToken();
+            // a copy, reading on can move the tokens of a pipelined stream
+            const token = (try self.getCurrentToken()).*;
 
-            switch (token.*) {
+            switch (token) {
                 // if it's an identifier, we can parse this as an instruction
                 .identifier => {
                     var stream = self.getInternalTokens();
@@ -589,7 +593,7 @@ pub const Parser = struct {
 
                     var children = &node.procedure.children;
 
-                    try children.append(try self.createNodeFromInstruction(token.*.identifier));
+                    try children.append(try self.createNodeFromInstruction(token.identifier));
                 },
 
                 .number, .operator => {},
@@ -654,27 +658,27 @@ pub const Parser = struct {
             .identifier => {
                 const ident = token.identifier;
 
-                if (std.ascii.eqlIgnoreCase(ident.identifier_string, "nil")) {
+                if (std.ascii.eqlIgnoreCase(ident.toString(), "nil")) {
                     return Value{
                         .nil = 0,
                     };
                 }
 
-                if (ident.identifier_string[0] == 'R') {
+                if (ident.toString()[0] == 'R') {
                     // NOTE: without this, identifiers that start with R can be parsed as their identifier
                     // and not a register every time
-                    for (ident.identifier_string[1..]) |char| {
+                    for (ident.toString()[1..]) |char| {
                         if (!std.ascii.isDigit(char)) {
                             return Value{
                                 .identifier = ident,
                             };
                         }
                     }
-                    if (ident.identifier_string.len == 1) {
+                    if (ident.toString().len == 1) {
                         return error.RegisterMissingNumber;
                     }
 
-                    const register_number = ident.identifier_string[1..];
+                    const register_number = ident.toString()[1..];
 
                     const reg = Register{
                         .register_number = try std.fmt.parseInt(usize, register_number, 0),
@@ -787,8 +791,8 @@ pub const Parser = struct {
 
         return Value{
             .range = Range{
-                .starting_position = @intCast(start_value.number.getNumber()),
-                .ending_position = @intCast(end_value.number.getNumber()),
+                .starting_position = std.math.cast(u32, start_value.number.getNumber()) orelse return error.InvalidTokenValue,
+                .ending_position = std.math.cast(u32, end_value.number.getNumber()) orelse return error.InvalidTokenValue,
                 .span = start_value.number.span,
             },
         };
@@ -843,12 +847,12 @@ test "creating and using a parser for a multiple proc" {
 
     try std.testing.expectEqualStrings("a", proc1.procedure.header);
     try std.testing.expectEqualStrings("b", proc2.procedure.header);
-    try std.testing.expectEqualStrings("mov", proc1.procedure.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("mov", proc1.procedure.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(2, proc1.procedure.children.items[0].instruction_call.parameters.items.len);
     try std.testing.expectEqual(1, proc1.procedure.children.items[0].instruction_call.parameters.items[0].number.number);
     try std.testing.expectEqual(1, proc1.procedure.children.items[0].instruction_call.parameters.items[1].number.number);
 
-    try std.testing.expectEqualStrings("push", proc2.procedure.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("push", proc2.procedure.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(2, proc2.procedure.children.items[0].instruction_call.parameters.items.len);
     try std.testing.expectEqual(1, proc2.procedure.children.items[0].instruction_call.parameters.items[0].number.number);
     try std.testing.expectEqual(5, proc2.procedure.children.items[0].instruction_call.parameters.items[1].number.number);
@@ -874,7 +878,7 @@ test "creating and using a parser for a multiple procedures with register values
     const proc1 = root.asRoot().children.items[0];
 
     try std.testing.expectEqualStrings("a", proc1.procedure.header);
-    try std.testing.expectEqualStrings("mov", proc1.procedure.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("mov", proc1.procedure.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(1, proc1.procedure.children.items[0].instruction_call.parameters.items.len);
     try std.testing.expectEqual(1, proc1.procedure.children.items[0].instruction_call.parameters.items[0].register.register_number);
 }
@@ -899,7 +903,7 @@ test "creating and using a parser for a multiple procedures with register values
     const proc1 = root.asRoot().children.items[0];
 
     try std.testing.expectEqualStrings("a", proc1.procedure.header);
-    try std.testing.expectEqualStrings("mov", proc1.procedure.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("mov", proc1.procedure.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(1, proc1.procedure.children.items[0].instruction_call.parameters.items.len);
     try std.testing.expectEqual(1, proc1.procedure.children.items[0].instruction_call.parameters.items[0].register.register_number);
 }
@@ -923,7 +927,7 @@ test "creating and using a parser for a macro" {
 
     const macro_call = root.asRoot().children.items[0];
 
-    try std.testing.expectEqualStrings("a", macro_call.macro.name.identifier_string);
+    try std.testing.expectEqualStrings("a", macro_call.macro.name.toString());
 
     try std.testing.expectEqual(3, macro_call.macro.parameters.items.len);
     try std.testing.expectEqual(1, macro_call.macro.parameters.items[0].number.getNumber());
@@ -951,8 +955,8 @@ test "creating and using a parser for a macro 2" {
     const macro_call = root.asRoot().children.items[0];
 
     try std.testing.expectEqual(1, macro_call.macro.parameters.items.len);
-    try std.testing.expectEqualStrings("compat", macro_call.macro.name.identifier_string);
-    try std.testing.expectEqualStrings("nexfuse", macro_call.macro.parameters.items[0].identifier.identifier_string);
+    try std.testing.expectEqualStrings("compat", macro_call.macro.name.toString());
+    try std.testing.expectEqualStrings("nexfuse", macro_call.macro.parameters.items[0].identifier.toString());
 }
 
 test "creating and using a parser for multiple macros" {
@@ -977,10 +981,10 @@ test "creating and using a parser for multiple macros" {
 
     try std.testing.expectEqual(1, macro_call_one.macro.parameters.items.len);
     try std.testing.expectEqual(1, macro_call_two.macro.parameters.items.len);
-    try std.testing.expectEqualStrings("compat", macro_call_one.macro.name.identifier_string);
-    try std.testing.expectEqualStrings("compat", macro_call_two.macro.name.identifier_string);
-    try std.testing.expectEqualStrings("nexfuse", macro_call_one.macro.parameters.items[0].identifier.identifier_string);
-    try std.testing.expectEqualStrings("def", macro_call_two.macro.parameters.items[0].identifier.identifier_string);
+    try std.testing.expectEqualStrings("compat", macro_call_one.macro.name.toString());
+    try std.testing.expectEqualStrings("compat", macro_call_two.macro.name.toString());
+    try std.testing.expectEqualStrings("nexfuse", macro_call_one.macro.parameters.items[0].identifier.toString());
+    try std.testing.expectEqualStrings("def", macro_call_two.macro.parameters.items[0].identifier.toString());
 }
 
 test "creating and using a parser for niladic forms" {
@@ -1004,7 +1008,7 @@ test "creating and using a parser for niladic forms" {
 
     try std.testing.expectEqual(1, start.children.items.len);
     try std.testing.expectEqual(0, start.children.items[0].instruction_call.parameters.items.len);
-    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.toString());
 }
 
 test "creating and using a parser with trailing commas" {
@@ -1028,7 +1032,7 @@ test "creating and using a parser with trailing commas" {
 
     try std.testing.expectEqual(1, start.children.items.len);
     try std.testing.expectEqual(1, start.children.items[0].instruction_call.parameters.items.len);
-    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.toString());
 }
 
 test "creating and using a parser with trailing commas and newline " {
@@ -1052,7 +1056,7 @@ test "creating and using a parser with trailing commas and newline " {
 
     try std.testing.expectEqual(1, start.children.items.len);
     try std.testing.expectEqual(1, start.children.items[0].instruction_call.parameters.items.len);
-    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.toString());
 }
 
 test "ranges" {
@@ -1077,7 +1081,7 @@ test "ranges" {
     try std.testing.expectEqual(1, start.children.items.len);
     try std.testing.expectEqual(1, start.children.items[0].instruction_call.parameters.items.len);
 
-    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(5, start.children.items[0].instruction_call.parameters.items[0].range.starting_position);
     try std.testing.expectEqual(10, start.children.items[0].instruction_call.parameters.items[0].range.ending_position);
 }
@@ -1102,8 +1106,8 @@ test "asides" {
     const aside_1 = root.asRoot().children.items[0].aside;
 
     try std.testing.expectEqual(2, aside_1.parameters.items.len);
-    try std.testing.expectEqualStrings("aside", aside_1.name.identifier_string);
-    try std.testing.expectEqualStrings("A", aside_1.parameters.items[0].identifier.identifier_string);
+    try std.testing.expectEqualStrings("aside", aside_1.name.toString());
+    try std.testing.expectEqualStrings("A", aside_1.parameters.items[0].identifier.toString());
 }
 
 test "ranges with other parameters" {
@@ -1128,7 +1132,7 @@ test "ranges with other parameters" {
     try std.testing.expectEqual(1, start.children.items.len);
     try std.testing.expectEqual(2, start.children.items[0].instruction_call.parameters.items.len);
 
-    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(5, start.children.items[0].instruction_call.parameters.items[0].range.starting_position);
     try std.testing.expectEqual(10, start.children.items[0].instruction_call.parameters.items[0].range.ending_position);
     try std.testing.expectEqual(5, start.children.items[0].instruction_call.parameters.items[1].number.getNumber());
@@ -1156,7 +1160,7 @@ test "nil" {
     try std.testing.expectEqual(1, start.children.items.len);
     try std.testing.expectEqual(1, start.children.items[0].instruction_call.parameters.items.len);
 
-    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(true, start.children.items[0].instruction_call.parameters.items[0].isNil());
 }
 
@@ -1182,7 +1186,7 @@ test "NIL" {
     try std.testing.expectEqual(1, start.children.items.len);
     try std.testing.expectEqual(1, start.children.items[0].instruction_call.parameters.items.len);
 
-    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.identifier_string);
+    try std.testing.expectEqualStrings("halt", start.children.items[0].instruction_call.name.toString());
     try std.testing.expectEqual(true, start.children.items[0].instruction_call.parameters.items[0].isNil());
 }
 
@@ -1313,3 +1317,14 @@ test "error test 8" {
 
     try std.testing.expectError(error.RangeExpectsSeparator, parser.createRootNode());
 }
+
+test "compact values" {
+    // every payload fits in two registers, the tag pushes the union to three. Identifiers and
+    // literals keep a pointer to their text, names from objects have no source to derive it from
+    try std.testing.expect(@sizeOf(Identifier) <= 16);
+    try std.testing.expect(@sizeOf(Number) <= 16);
+    try std.testing.expect(@sizeOf(Range) <= 16);
+    try std.testing.expect(@sizeOf(Register) <= 16);
+    try std.testing.expect(@sizeOf(Literal) <= 16);
+    try std.testing.expect(@sizeOf(Value) <= 24);
+}
@@ -0,0 +1,651 @@
+//! ## Optimization Passes
+//!
+//! Optimizations run as passes. Every pass registers with the lowest `-O` level it runs at, and
+//! the `PassManager` runs the passes of the selected level in the order they were registered,
+//! leaving out the ones `-Ono-NAME` disables.
+//!
+//! Most passes run over the procedure map, between codegen and linking: either once per
+//! procedure, or once over the whole program when they need to see every procedure at once (like
+//! removing procedures the start procedure never reaches). The others change what codegen generates, so they are
+//! applied before it: they run over a copy of the lowered program (like merging identical
+//! procedures), or turn on something codegen does while it generates (like threading jumps).
+//!
+//! The manager records the bytes each pass over the procedure map removed and the time it took,
+//! and how many places each pass before codegen changed. `-Ostats` prints them.
+//!
+//! ```zig
+//! var manager = passes.PassManager(u8).init(allocator, opts.optimization_level);
+//! try passes.registerDefaultPasses(u8, &manager);
+//!
+//! const prepared = try manager.prepare(arena, &vendor, &program, .{ .start_definition = "_start" });
+//! _ = try vendor.generateProgram(prepared);
+//!
+//! try manager.run(&vendor, .{ .start_definition = "_start" });
+//! ```
+//!
+
+const std = @import("std");
+const codegen = @import("codegen.zig");
+const ir = @import("ir.zig");
+const object = @import("object.zig");
+const registers = @import("registers.zig");
+
+const Vendor = codegen.Vendor;
+
+/// What passes know about the link that follows them.
+pub const Context = struct {
+    /// The procedure the program starts at, always in use
+    start_definition: []const u8,
+};
+
+pub fn Pass(comptime format_type: type) type {
+    return struct {
+        name: []const u8,
+
+        /// The lowest `-O` level the pass runs at
+        level: u8,
+
+        /// Runs once for every procedure in the procedure map.
+        procedure: ?*const fn (vendor: *Vendor(format_type), ctx: Context, name: []const u8, binary: *std.ArrayList(format_type)) anyerror!void = null,
+
+        /// Runs once over the whole procedure map.
+        program: ?*const fn (vendor: *Vendor(format_type), ctx: Context) anyerror!void = null,
+
+        /// Runs once over a copy of the lowered program, before codegen. The copy and what the
+        /// pass allocates for it are freed with the arena `allocator` is. Returns how many
+        /// procedures it changed.
+        lowered: ?*const fn (allocator: std.mem.Allocator, program: *ir.Program, ctx: Context) anyerror!usize = null,
+
+        /// Sets up the vendor before codegen, for what the pass does while procedures are
+        /// generated or what it needs of codegen afterwards.
+        codegen: ?*const fn (vendor: *Vendor(format_type)) void = null,
+
+        /// How many places a pass that only runs as part of codegen changed.
+        changes: ?*const fn (vendor: *const Vendor(format_type)) usize = null,
+
+        const Self = @This();
+
+        /// Does the pass change what codegen generates? It is applied by `PassManager.prepare`
+        /// then, before codegen.
+        pub fn beforeCodegen(self: Self) bool {
+            return self.lowered != null or (self.codegen != null and self.procedure == null and self.program == null);
+        }
+    };
+}
+
+/// What a pass did, for `-Ostats`.
+pub const Stats = struct {
+    name: []const u8,
+
+    /// Size of the procedure map before and after the pass, in binary elements. The same for
+    /// passes before codegen, their bytes can not be told apart from the ones of codegen.
+    size_before: usize = 0,
+    size_after: usize = 0,
+
+    /// Null for passes that run as part of codegen, their time is codegen's
+    nanoseconds: ?u64,
+
+    /// How many places a pass before codegen changed: procedures merged, forwards threaded, runs
+    /// of `echo` buffered. Null for passes over the procedure map.
+    changes: ?usize = null,
+
+    pub fn removed(self: Stats) usize {
+        return self.size_before -| self.size_after;
+    }
+};
+
+pub fn PassManager(comptime format_type: type) type {
+    return struct {
+        const Self = @This();
+
+        parent_allocator: std.mem.Allocator,
+
+        /// In the order they run
+        passes: std.ArrayList(Pass(format_type)),
+
+        /// One entry per pass that ran, in the order they ran
+        stats: std.ArrayList(Stats),
+
+        /// The `-O` level. Passes registered above it are skipped.
+        level: u8,
+
+        /// Names of the passes that are skipped whatever their level (`-Ono-NAME`)
+        disabled: []const []const u8 = &.{},
+
+        pub fn init(parent_allocator: std.mem.Allocator, level: u8) Self {
+            return Self{
+                .parent_allocator = parent_allocator,
+                .passes = std.ArrayList(Pass(format_type)).init(parent_allocator),
+                .stats = std.ArrayList(Stats).init(parent_allocator),
+                .level = level,
+            };
+        }
+
+        pub fn deinit(self: *Self) void {
+            self.passes.deinit();
+            self.stats.deinit();
+        }
+
+        /// Adds `pass` after every pass registered so far.
+        pub fn register(self: *Self, pass: Pass(format_type)) !void {
+            try self.passes.append(pass);
+        }
+
+        /// Does `pass` run? It has to be of the level and not disabled.
+        pub fn selects(self: *const Self, pass: Pass(format_type)) bool {
+            if (pass.level > self.level) return false;
+
+            for (self.disabled) |name| {
+                if (std.mem.eql(u8, name, pass.name)) return false;
+            }
+
+            return true;
+        }
+
+        /// The first name of `disabled` no pass is registered with. Null when every one is.
+        pub fn unknownDisabled(self: *const Self) ?[]const u8 {
+            next_name: for (self.disabled) |name| {
+                for (self.passes.items) |pass| {
+                    if (std.mem.eql(u8, name, pass.name)) continue :next_name;
+                }
+
+                return name;
+            }
+
+            return null;
+        }
+
+        /// Applies every selected pass that has to be applied before codegen (see
+        /// `Pass.beforeCodegen`), and sets up `vendor` for the ones after it. Passes over the
+        /// lowered program run on a copy of `program`, allocated with `arena`, which has to live
+        /// until codegen is done. Returns the program to generate, which is `program` itself when
+        /// no pass changes it. `run` finishes the passes after codegen.
+        pub fn prepare(self: *Self, arena: std.mem.Allocator, vendor: *Vendor(format_type), program: *const ir.Program, ctx: Context) !*const ir.Program {
+            var copy: ?*ir.Program = null;
+
+            for (self.passes.items) |pass| {
+                if (!self.selects(pass)) continue;
+
+                if (pass.lowered != null and copy == null) {
+                    copy = try arena.create(ir.Program);
+                    copy.?.* = try program.clone(arena);
+                }
+
+                try self.preparePass(arena, pass, vendor, copy, ctx);
+            }
+
+            return copy orelse program;
+        }
+
+        /// Applies the part of a single pass that comes before codegen, whatever its level.
+        /// `program` is the copy passes over the lowered program change, allocated with `arena`.
+        /// It is only null when the pass has no such part.
+        pub fn preparePass(self: *Self, arena: std.mem.Allocator, pass: Pass(format_type), vendor: *Vendor(format_type), program: ?*ir.Program, ctx: Context) !void {
+            if (pass.lowered) |lowered| {
+                var timer = try std.time.Timer.start();
+                const changes = try lowered(arena, program.?, ctx);
+
+                try self.stats.append(Stats{
+                    .name = pass.name,
+                    .nanoseconds = timer.read(),
+                    .changes = changes,
+                });
+            }
+
+            if (pass.codegen) |setup| {
+                setup(vendor);
+            }
+        }
+
+        /// Runs every selected pass over `vendor`'s procedure map, after codegen. Passes that ran
+        /// as part of codegen only record what they changed.
+        pub fn run(self: *Self, vendor: *Vendor(format_type), ctx: Context) !void {
+            for (self.passes.items) |pass| {
+                if (!self.selects(pass)) continue;
+
+                try self.runPass(pass, vendor, ctx);
+            }
+        }
+
+        /// Runs a single pass over `vendor`'s procedure map, whatever its level. Passes before
+        /// codegen were applied by `prepare`, the ones that ran as part of codegen record what
+        /// they changed.
+        pub fn runPass(self: *Self, pass: Pass(format_type), vendor: *Vendor(format_type), ctx: Context) !void {
+            if (pass.lowered != null) return;
+
+            if (pass.beforeCodegen()) {
+                try self.stats.append(Stats{
+                    .name = pass.name,
+                    .nanoseconds = null,
+                    .changes = if (pass.changes) |changes| changes(vendor) else null,
+                });
+
+                return;
+            }
+
+            const size_before = programSize(format_type, vendor);
+            var timer = try std.time.Timer.start();
+
+            if (pass.program) |program| {
+                try program(vendor, ctx);
+            }
+
+            if (pass.procedure) |procedure| {
+                var iterator = vendor.procedure_map.iterator();
+
+                while (iterator.next()) |entry| {
+                    try procedure(vendor, ctx, entry.key_ptr.*, entry.value_ptr);
+                }
+            }
+
+            try self.stats.append(Stats{
+                .name = pass.name,
+                .size_before = size_before,
+                .size_after = programSize(format_type, vendor),
+                .nanoseconds = timer.read(),
+            });
+        }
+
+        /// The highest level any registered pass runs at.
+        pub fn maxLevel(self: *const Self) u8 {
+            var level: u8 = 0;
+
+            for (self.passes.items) |pass| {
+                level = @max(level, pass.level);
+            }
+
+            return level;
+        }
+
+        /// Writes the stats of every pass that ran as a table. What a pass does not have is `-`.
+        pub fn writeStats(self: *const Self, writer: anytype) !void {
+            try writer.print("{s:<24} {s:>10} {s:>10} {s:>12}\n", .{ "pass", "removed", "changes", "time (us)" });
+
+            for (self.stats.items) |stats| {
+                try writer.print("{s:<24} {d:>10} ", .{ stats.name, stats.removed() });
+
+                if (stats.changes) |changes| {
+                    try writer.print("{d:>10} ", .{changes});
+                } else {
+                    try writer.print("{s:>10} ", .{"-"});
+                }
+
+                if (stats.nanoseconds) |nanoseconds| {
+                    try writer.print("{d:>12.3}\n", .{@as(f64, @floatFromInt(nanoseconds)) / std.time.ns_per_us});
+                } else {
+                    try writer.print("{s:>12}\n", .{"-"});
+                }
+            }
+        }
+    };
+}
+
+/// The size of every procedure in `vendor`'s procedure map, in binary elements.
+pub fn programSize(comptime format_type: type, vendor: *const Vendor(format_type)) usize {
+    var size: usize = 0;
+    var iterator = vendor.procedure_map.valueIterator();
+
+    while (iterator.next()) |binary| {
+        size += binary.items.len;
+    }
+
+    return size;
+}
+
+/// The level identical procedures are merged from (see `object.mergeIdenticalProcedures`).
+/// Dead-procedures then removes the ones nothing calls.
+pub const merge_procedures_level = 1;
+
+/// The level codegen threads jumps from (see `Vendor.thread_jumps`). Threading happens while
+/// procedure references are encoded, dead-procedures then removes the forwards it skipped.
+pub const thread_jumps_level = 1;
+
+/// The level codegen prints long runs of `echo` from a register from (see `Vendor.buffer_echoes`).
+pub const buffer_echoes_level = 1;
+
+/// The level dead writes are removed from. Vendors track registers from it on.
+pub const dead_writes_level = 2;
+
+/// Registers the passes every format runs, in order.
+pub fn registerDefaultPasses(comptime format_type: type, manager: *PassManager(format_type)) !void {
+    try manager.register(.{
+        .name = "merge-procedures",
+        .level = merge_procedures_level,
+        .lowered = &mergeProcedures,
+    });
+
+    try manager.register(.{
+        .name = "thread-jumps",
+        .level = thread_jumps_level,
+        .codegen = &threadJumps(format_type).setup,
+        .changes = &threadJumps(format_type).changes,
+    });
+
+    try manager.register(.{
+        .name = "buffer-echoes",
+        .level = buffer_echoes_level,
+        .codegen = &bufferEchoes(format_type).setup,
+        .changes = &bufferEchoes(format_type).changes,
+    });
+
+    try manager.register(.{
+        .name = "dead-procedures",
+        .level = 1,
+        .program = &deadProcedures(format_type).run,
+    });
+
+    try manager.register(.{
+        .name = "dead-writes",
+        .level = dead_writes_level,
+        .codegen = &deadWrites(format_type).setup,
+        .procedure = &deadWrites(format_type).run,
+    });
+}
+
+fn mergeProcedures(allocator: std.mem.Allocator, program: *ir.Program, ctx: Context) anyerror!usize {
+    return object.mergeIdenticalProcedures(allocator, program, ctx.start_definition);
+}
+
+/// References to procedures that only call another one go to that one (see `Vendor.thread_jumps`).
+/// Formats without a call instruction have no forwards.
+fn threadJumps(comptime format_type: type) type {
+    return struct {
+        fn setup(vendor: *Vendor(format_type)) void {
+            vendor.thread_jumps = true;
+        }
+
+        fn changes(vendor: *const Vendor(format_type)) usize {
+            return vendor.forwards.count();
+        }
+    };
+}
+
+/// Long runs of `echo` print from a register (see `Vendor.buffer_echoes`).
+fn bufferEchoes(comptime format_type: type) type {
+    return struct {
+        fn setup(vendor: *Vendor(format_type)) void {
+            vendor.buffer_echoes = true;
+        }
+
+        fn changes(vendor: *const Vendor(format_type)) usize {
+            return vendor.buffered_runs;
+        }
+    };
+}
+
+/// Removes the procedures the start procedure never reaches, walking the references of
+/// `Vendor.call_graph` from it. A folded procedure's references count as its caller's, so a
+/// procedure that is only folded in is not reached itself. Procedures that only reference each
+/// other are removed together.
+fn deadProcedures(comptime format_type: type) type {
+    return struct {
+        fn run(vendor: *Vendor(format_type), ctx: Context) anyerror!void {
+            const allocator = vendor.parent_allocator;
+
+            // procedure -> the procedures it references
+            var references = std.StringHashMap(std.ArrayListUnmanaged([]const u8)).init(allocator);
+
+            defer {
+                var lists = references.valueIterator();
+                while (lists.next()) |list| list.deinit(allocator);
+
+                references.deinit();
+            }
+
+            for (vendor.call_graph.edges.keys()) |edge| {
+                const entry = try references.getOrPut(edge.caller);
+                if (!entry.found_existing) entry.value_ptr.* = .{};
+
+                try entry.value_ptr.append(allocator, edge.callee);
+            }
+
+            var reached = std.StringHashMap(void).init(allocator);
+            defer reached.deinit();
+
+            var worklist = std.ArrayList([]const u8).init(allocator);
+            defer worklist.deinit();
+
+            try reached.put(ctx.start_definition, {});
+            try worklist.append(ctx.start_definition);
+
+            while (worklist.popOrNull()) |name| {
+                const callees = references.get(name) orelse continue;
+
+                for (callees.items) |callee| {
+                    if (try reached.fetchPut(callee, {}) == null) try worklist.append(callee);
+                }
+            }
+
+            var dead = std.ArrayList([]const u8).init(allocator);
+            defer dead.deinit();
+
+            var names = vendor.procedure_map.keyIterator();
+
+            while (names.next()) |name| {
+                if (!reached.contains(name.*)) try dead.append(name.*);
+            }
+
+            for (dead.items) |name| {
+                var binary = vendor.procedure_map.fetchRemove(name).?.value;
+                binary.deinit();
+            }
+        }
+    };
+}
+
+/// Removes register writes that are never read (see `registers.findDeadWrites`). Folded procedures
+/// are part of their caller's accesses, so writes are followed into them. Only the start procedure
+/// ends the program, every other procedure returns to a caller that may read any register.
+fn deadWrites(comptime format_type: type) type {
+    return struct {
+        fn setup(vendor: *Vendor(format_type)) void {
+            vendor.track_registers = true;
+        }
+
+        fn run(vendor: *Vendor(format_type), ctx: Context, name: []const u8, binary: *std.ArrayList(format_type)) anyerror!void {
+            const accesses = vendor.accesses.getPtr(name) orelse return;
+
+            const live_out = if (std.mem.eql(u8, name, ctx.start_definition))
+                registers.RegisterSet.initEmpty()
+            else
+                registers.RegisterSet.initFull();
+
+            var dead = try registers.findDeadWrites(vendor.parent_allocator, accesses.items, live_out);
+            defer dead.deinit(vendor.parent_allocator);
+
+            if (dead.count() == 0) return;
+
+            // move everything that stays to the front, in one pass
+            var read: usize = 0;
+            var write: usize = 0;
+            var kept: usize = 0;
+
+            for (accesses.items, 0..) |access, i| {
+                const begin: usize = access.begin;
+
+                std.mem.copyForwards(format_type, binary.items[write..], binary.items[read..begin]);
+                write += begin - read;
+                read = begin;
+
+                if (dead.isSet(i)) {
+                    if (vendor.source_map) |map| {
+                        map.removeRange(name, @intCast(write), access.len);
+                    }
+
+                    read += access.len;
+                    continue;
+                }
+
+                var moved = access;
+                moved.begin = @intCast(write);
+
+                accesses.items[kept] = moved;
+                kept += 1;
+            }
+
+            const tail = binary.items.len - read;
+
+            std.mem.copyForwards(format_type, binary.items[write..], binary.items[read..]);
+            binary.shrinkRetainingCapacity(write + tail);
+            accesses.shrinkRetainingCapacity(kept);
+        }
+    };
+}
+
+fn dropLastByte(vendor: *Vendor(u8), ctx: Context, name: []const u8, binary: *std.ArrayList(u8)) anyerror!void {
+    _ = vendor;
+    _ = ctx;
+    _ = name;
+
+    _ = binary.popOrNull();
+}
+
+test PassManager {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    var vendor = Vendor(u8).init(allocator, &isa);
+
+    var start = std.ArrayList(u8).init(allocator);
+    try start.appendSlice(&.{ 1, 2, 3 });
+
+    var unused = std.ArrayList(u8).init(allocator);
+    try unused.appendSlice(&.{ 4, 5 });
+
+    try vendor.procedure_map.put("_start", start);
+    try vendor.procedure_map.put("unused", unused);
+
+    var manager = PassManager(u8).init(allocator, 1);
+    try registerDefaultPasses(u8, &manager);
+    try manager.register(.{ .name = "drop-last-byte", .level = 1, .procedure = &dropLastByte });
+    try manager.register(.{ .name = "too-expensive", .level = 2, .procedure = &dropLastByte });
+
+    try manager.run(&vendor, .{ .start_definition = "_start" });
+
+    // thread-jumps and buffer-echoes only record what they changed while generating, nothing here
+    try std.testing.expectEqual(4, manager.stats.items.len);
+    try std.testing.expectEqualStrings("thread-jumps", manager.stats.items[0].name);
+    try std.testing.expectEqual(0, manager.stats.items[0].changes.?);
+    try std.testing.expectEqualStrings("dead-procedures", manager.stats.items[2].name);
+    try std.testing.expectEqual(2, manager.stats.items[2].removed());
+    try std.testing.expectEqual(1, manager.stats.items[3].removed());
+
+    try std.testing.expect(!vendor.procedure_map.contains("unused"));
+    try std.testing.expectEqual(2, vendor.procedure_map.get("_start").?.items.len);
+
+    var output = std.ArrayList(u8).init(allocator);
+    try manager.writeStats(output.writer());
+
+    try std.testing.expect(std.mem.indexOf(u8, output.items, "drop-last-byte") != null);
+}
+
+test "removing dead writes" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    try @import("platforms/nexfuse.zig").runtime(&isa);
+
+    var vendor = Vendor(u8).init(allocator, &isa);
+    vendor.track_registers = true;
+
+    var lexer = @import("lexer.zig").Lexer.init(allocator);
+    lexer.setInputText("a: mov R1, 5\n\n_start: a\nmov R2, 6\neach R2\n");
+    try lexer.startLexingInputText();
+
+    var parser = @import("parser.zig").Parser.init(allocator, &lexer.stream);
+
+    _ = try vendor.generateBinary(try parser.createRootNode());
+
+    var manager = PassManager(u8).init(allocator, dead_writes_level);
+    try registerDefaultPasses(u8, &manager);
+    try manager.run(&vendor, .{ .start_definition = "_start" });
+
+    // R1 is written in the folded `a`, but never read before the program ends
+    try std.testing.expectEqualSlices(u8, &.{ 41, 2, 6, 0, 42, 2, 0 }, vendor.procedure_map.get("_start").?.items);
+    try std.testing.expectEqual(2, vendor.accesses.get("_start").?.items.len);
+    try std.testing.expectEqual(4, vendor.accesses.get("_start").?.items[1].begin);
+}
+
+test "removing procedures the start procedure never reaches" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    try @import("platforms/nexfuse.zig").runtime(&isa);
+
+    var vendor = Vendor(u8).init(allocator, &isa);
+
+    var lexer = @import("lexer.zig").Lexer.init(allocator);
+    lexer.setInputText("a: jmp b\n\nb: jmp a\n\nc: echo 'C'\n\nd: jmp c\n\n_start: d\n");
+    try lexer.startLexingInputText();
+
+    var parser = @import("parser.zig").Parser.init(allocator, &lexer.stream);
+
+    _ = try vendor.generateBinary(try parser.createRootNode());
+
+    var manager = PassManager(u8).init(allocator, 1);
+    try manager.register(.{ .name = "dead-procedures", .level = 1, .program = &deadProcedures(u8).run });
+    try manager.run(&vendor, .{ .start_definition = "_start" });
+
+    // `a` and `b` reference each other, but nothing reaches them. `d` is folded into `_start`,
+    // which reaches `c` through it.
+    try std.testing.expectEqual(2, vendor.procedure_map.count());
+    try std.testing.expect(vendor.procedure_map.contains("_start"));
+    try std.testing.expect(vendor.procedure_map.contains("c"));
+}
+
+test "passes before codegen" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    try @import("platforms/nexfuse.zig").runtime(&isa);
+
+    var vendor = Vendor(u8).init(allocator, &isa);
+
+    const program = try ir.lower(allocator, try @import("drivers.zig").ast(allocator, "a: echo 10\nb: echo 10\n_start: a\nb\n"));
+
+    var manager = PassManager(u8).init(allocator, 1);
+    manager.disabled = &.{"thread-jumps"};
+    try registerDefaultPasses(u8, &manager);
+
+    const ctx = Context{ .start_definition = "_start" };
+    const prepared = try manager.prepare(allocator, &vendor, &program, ctx);
+
+    // `b` is merged into `a` in a copy, the lowered program is left as it was
+    try std.testing.expectEqual(3, program.procedures.items.len);
+    try std.testing.expectEqual(2, prepared.procedures.items.len);
+
+    try std.testing.expect(!vendor.thread_jumps);
+    try std.testing.expect(vendor.buffer_echoes);
+    try std.testing.expect(!vendor.track_registers);
+
+    _ = try vendor.generateProgram(prepared);
+    try manager.run(&vendor, ctx);
+
+    try std.testing.expectEqual(3, manager.stats.items.len);
+
+    try std.testing.expectEqualStrings("merge-procedures", manager.stats.items[0].name);
+    try std.testing.expectEqual(1, manager.stats.items[0].changes.?);
+
+    try std.testing.expectEqualStrings("buffer-echoes", manager.stats.items[1].name);
+    try std.testing.expectEqual(null, manager.stats.items[1].nanoseconds);
+
+    try std.testing.expectEqualStrings("dead-procedures", manager.stats.items[2].name);
+    try std.testing.expectEqual(null, manager.stats.items[2].changes);
+
+    try std.testing.expectEqual(null, manager.unknownDisabled());
+
+    manager.disabled = &.{ "dead-writes", "dead-code" };
+    try std.testing.expectEqualStrings("dead-code", manager.unknownDisabled().?);
+}
@@ -0,0 +1,336 @@
+//! ## Pipelining
+//!
+//! Lexing, parsing and lowering can run at the same time, each on a thread of its own
+//! (`--pipeline`). Every stage hands what it finished to the next one through a bounded `Queue`:
+//! the lexer hands over tokens as it reads them, the parser hands over every node at the root of
+//! the tree (a procedure, macro or aside) as soon as it is complete, and lowering preprocesses and
+//! lowers each node as it arrives. With the stages overlapping, the front half of a compile takes
+//! about as long as its slowest stage instead of the sum of all of them.
+//!
+//! Codegen does not join the pipeline. The preprocessor picks the format (and with it the
+//! instruction set) only once every macro is seen, and optimization and layout need every
+//! procedure at once.
+//!
+//! ```zig
+//! var tokens = token_stream.TokenStream.init(ast_allocator);
+//! var pars = parser.Parser.init(ast_allocator, &tokens);
+//! var lowering = ir.Lowering.init(ir_allocator);
+//!
+//! const out = try pipeline.lowerPipelined(&lex, &pars, &pp, &lowering, tracer);
+//! ```
+//!
+
+const std = @import("std");
+const lexer = @import("lexer.zig");
+const parser = @import("parser.zig");
+const preprocessor = @import("preprocessor.zig");
+const token_stream = @import("token_stream.zig");
+const ir = @import("ir.zig");
+const trace = @import("trace.zig");
+
+const Token = token_stream.Token;
+const Node = parser.Node;
+
+/// Tokens the lexer can be ahead of the parser.
+pub const token_capacity = 4096;
+
+/// Root nodes the parser can be ahead of lowering.
+pub const node_capacity = 256;
+
+/// A bounded, lock-free queue between one producer and one consumer thread. Either side waits
+/// while the queue is full or empty. Closing it ends the hand-over from either side: the consumer
+/// still gets what was pushed before, the producer's next push fails.
+pub fn Queue(comptime T: type) type {
+    return struct {
+        const Self = @This();
+
+        /// The length is a power of two, so positions wrap with a mask
+        buffer: []T,
+
+        /// The next position to pop, only moved by the consumer
+        head: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+
+        /// The next position to push, only moved by the producer
+        tail: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+
+        closed: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+
+        /// Holds at least `capacity` items.
+        pub fn init(allocator: std.mem.Allocator, capacity: usize) !Self {
+            return Self{
+                .buffer = try allocator.alloc(T, std.math.ceilPowerOfTwoAssert(usize, @max(capacity, 1))),
+            };
+        }
+
+        pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+            allocator.free(self.buffer);
+        }
+
+        /// Adds `item`, waiting while the queue is full. Fails once the queue is closed.
+        pub fn push(self: *Self, item: T) error{Closed}!void {
+            const tail = self.tail.load(.monotonic);
+
+            while (tail - self.head.load(.acquire) == self.buffer.len) {
+                if (self.closed.load(.acquire)) return error.Closed;
+
+                std.Thread.yield() catch {};
+            }
+
+            if (self.closed.load(.acquire)) return error.Closed;
+
+            self.buffer[tail & (self.buffer.len - 1)] = item;
+            self.tail.store(tail + 1, .release);
+        }
+
+        /// Takes the oldest item, waiting while the queue is empty. Null once the queue is closed
+        /// and empty.
+        pub fn pop(self: *Self) ?T {
+            const head = self.head.load(.monotonic);
+
+            while (head == self.tail.load(.acquire)) {
+                if (self.closed.load(.acquire)) {
+                    // an item may have been pushed right before closing
+                    if (head == self.tail.load(.acquire)) return null;
+                    break;
+                }
+
+                std.Thread.yield() catch {};
+            }
+
+            const item = self.buffer[head & (self.buffer.len - 1)];
+            self.head.store(head + 1, .release);
+
+            return item;
+        }
+
+        pub fn close(self: *Self) void {
+            self.closed.store(true, .release);
+        }
+    };
+}
+
+/// How the pipelined stages went. A stage after one that failed only saw part of the input, so
+/// errors are best reported in the order of the fields.
+pub const Output = struct {
+    lex_error: ?anyerror = null,
+    parse_error: ?anyerror = null,
+
+    /// An error from a directive
+    directive_error: ?anyerror = null,
+
+    /// The first directive that does not exist, if any
+    preprocess_result: preprocessor.PreprocessorResult = .{ .ok = 0 },
+
+    lower_error: ?anyerror = null,
+};
+
+fn lexStage(lex: *lexer.Lexer, tokens: *Queue(Token), out: *Output, tracer: ?*trace.Tracer) void {
+    const scope = trace.begin(tracer, "stage", "lex");
+    defer scope.end();
+
+    // the parser may have stopped early and closed the queue, that is its error to report
+    lex.startLexingInputText() catch |err| {
+        if (err != error.Closed) out.lex_error = err;
+    };
+
+    tokens.close();
+}
+
+fn parseStage(pars: *parser.Parser, tokens: *Queue(Token), nodes: *Queue(Node), out: *Output, tracer: ?*trace.Tracer) void {
+    const scope = trace.begin(tracer, "stage", "parse");
+    defer scope.end();
+
+    // stops the lexer as well when parsing ends early
+    defer tokens.close();
+    defer nodes.close();
+
+    if (pars.streamIsAtEnd()) {
+        out.parse_error = error.ParserHasNoInput;
+        return;
+    }
+
+    while (true) {
+        const node = (pars.createNextRootChild() catch |err| {
+            out.parse_error = err;
+            return;
+        }) orelse return;
+
+        // lowering stopped early, it reports why
+        nodes.push(node) catch return;
+    }
+}
+
+/// Lexes `lex`'s input, parses it with `pars`, runs `pp`'s directives and lowers it into
+/// `lowering`, with lexing and parsing on threads of their own. `pars` needs a stream of its own,
+/// not the lexer's, and its allocator is only used by the parser's thread until this returns.
+/// Errors are collected into the output, the caller reports them once every stage has stopped.
+pub fn lowerPipelined(
+    lex: *lexer.Lexer,
+    pars: *parser.Parser,
+    pp: *preprocessor.Preprocessor,
+    lowering: *ir.Lowering,
+    tracer: ?*trace.Tracer,
+) !Output {
+    var out = Output{};
+
+    var tokens = try Queue(Token).init(pars.parent_allocator, token_capacity);
+    defer tokens.deinit(pars.parent_allocator);
+
+    var nodes = try Queue(Node).init(pars.parent_allocator, node_capacity);
+    defer nodes.deinit(pars.parent_allocator);
+
+    // the lexer hands its tokens over instead of keeping them, the parser takes them as it goes
+    lex.stream.sink = &tokens;
+    defer lex.stream.sink = null;
+
+    pars.token_stream_internal.source = &tokens;
+    defer pars.token_stream_internal.source = null;
+
+    const lex_thread = try std.Thread.spawn(.{}, lexStage, .{ lex, &tokens, &out, tracer });
+
+    const parse_thread = std.Thread.spawn(.{}, parseStage, .{ pars, &tokens, &nodes, &out, tracer }) catch |err| {
+        tokens.close();
+        lex_thread.join();
+
+        return err;
+    };
+
+    const scope = trace.begin(tracer, "stage", "lower");
+
+    while (nodes.pop()) |popped| {
+        var node = popped;
+
+        const res = pp.handleAstDirectives(&node) catch |err| {
+            out.directive_error = err;
+            break;
+        };
+
+        if (res != .ok) {
+            out.preprocess_result = res;
+            break;
+        }
+
+        lowering.add(node) catch |err| {
+            out.lower_error = err;
+            break;
+        };
+    }
+
+    scope.end();
+
+    // stops the parser when lowering ended early
+    nodes.close();
+
+    parse_thread.join();
+    lex_thread.join();
+
+    return out;
+}
+
+test Queue {
+    var queue = try Queue(u32).init(std.testing.allocator, 3);
+    defer queue.deinit(std.testing.allocator);
+
+    try std.testing.expectEqual(4, queue.buffer.len);
+
+    try queue.push(1);
+    try queue.push(2);
+    try std.testing.expectEqual(1, queue.pop().?);
+
+    try queue.push(3);
+    queue.close();
+
+    // closed, but what was pushed before still comes out
+    try std.testing.expectError(error.Closed, queue.push(4));
+    try std.testing.expectEqual(2, queue.pop().?);
+    try std.testing.expectEqual(3, queue.pop().?);
+    try std.testing.expectEqual(null, queue.pop());
+}
+
+fn produce(queue: *Queue(usize), count: usize) void {
+    for (0..count) |i| {
+        queue.push(i) catch return;
+    }
+
+    queue.close();
+}
+
+test "handing items over between threads" {
+    var queue = try Queue(usize).init(std.testing.allocator, 4);
+    defer queue.deinit(std.testing.allocator);
+
+    const count = 10_000;
+    const thread = try std.Thread.spawn(.{}, produce, .{ &queue, count });
+
+    var expected: usize = 0;
+
+    while (queue.pop()) |item| {
+        try std.testing.expectEqual(expected, item);
+        expected += 1;
+    }
+
+    thread.join();
+
+    try std.testing.expectEqual(count, expected);
+}
+
+/// Runs the pipeline over `text` the way the frontend does, with an arena for the lexer's thread
+/// and one for the parser's. The program goes to `lowering`.
+fn testPipeline(text: []const u8, lowering: *ir.Lowering) !Output {
+    var lex_arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer lex_arena.deinit();
+
+    var ast_arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer ast_arena.deinit();
+
+    var lex = lexer.Lexer.init(lex_arena.allocator());
+    lex.setInputText(text);
+
+    var tokens = token_stream.TokenStream.init(ast_arena.allocator());
+    var pars = parser.Parser.init(ast_arena.allocator(), &tokens);
+
+    var opts = @import("compiler_main.zig").Options{ .files = undefined };
+
+    var pp = preprocessor.Preprocessor.init(std.testing.allocator, &opts);
+    defer pp.deinit();
+
+    return lowerPipelined(&lex, &pars, &pp, lowering, null);
+}
+
+test lowerPipelined {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var lowering = ir.Lowering.init(arena.allocator());
+
+    const out = try testPipeline(":set VALUE 7\na: mov R1, VALUE\n\n_start: a\nmov R2, 1\n", &lowering);
+
+    try std.testing.expectEqual(null, out.lex_error);
+    try std.testing.expectEqual(null, out.parse_error);
+    try std.testing.expectEqual(null, out.directive_error);
+    try std.testing.expectEqual(null, out.lower_error);
+
+    const program = lowering.finish();
+
+    try std.testing.expectEqual(2, program.procedures.items.len);
+    try std.testing.expectEqual(7, program.getProcedure("a").?.statements.items[0].instruction.operands[1].toNumber().getNumber());
+    try std.testing.expect(program.getProcedure("_start").?.statements.items[0] == .call);
+}
+
+test "pipelined errors" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    // an instruction before the first procedure
+    var lowering = ir.Lowering.init(arena.allocator());
+    const out = try testPipeline("mov R1, 2\n_start: mov R1, 1\n", &lowering);
+
+    try std.testing.expectEqual(null, out.lex_error);
+    try std.testing.expectEqual(error.ExpressionIsNotSubroutine, out.parse_error.?);
+
+    // `[nothing]` is not a directive
+    var macro_lowering = ir.Lowering.init(arena.allocator());
+    const macro_out = try testPipeline("[nothing]\n_start: mov R1, 1\n", &macro_lowering);
+
+    try std.testing.expect(macro_out.preprocess_result == .nonexistent_directive);
+}
@@ -37,10 +37,12 @@
 const std = @import("std");
 const parser = @import("../parser.zig");
 const codegen = @import("../codegen.zig");
+const archive = @import("../archive.zig");
 const instruction_result = @import("../instruction_result.zig");
 const linker = @import("../linker.zig");
 const lexer = @import("../lexer.zig");
 const testing = @import("../testing/expect.zig");
+const profile = @import("../profile.zig");
 
 const Value = parser.Value;
 const ValueTag = parser.ValueTag;
@@ -76,6 +78,21 @@ pub const ctx_no_folding_compile = .{
     .proc_end_byte = true,
 };
 
+/// The non-folded context with an index table, procedure references are indices into it. Used
+/// with `Linker.linkIndexedWithContext` and a vendor with `index_procedures` set.
+pub const ctx_indexed = .{
+    .start_definition = "_start",
+    .fold_procedures = false,
+    .procedure_heading_byte = 10,
+    .procedure_closing_byte = 128,
+    .procedure_table_byte = 9,
+    .compile = false,
+    .vasm_header = false,
+    .use_end_byte = true,
+    .end_byte = 22,
+    .proc_end_byte = true,
+};
+
 pub const ctx_folding = .{
     .start_definition = "_start",
     .fold_procedures = true,
@@ -86,13 +103,17 @@ pub const ctx_folding = .{
     .proc_end_byte = false,
 };
 
-pub fn runtime(vend: *codegen.Vendor(u8)) !void {
-    vend.nul_after_sequence = true;
-    vend.nul_byte = 0;
-    vend.procedure_add_end = true;
-    vend.end_byte = 22;
+/// The instruction cold procedures are called through (see `Vendor.call_instruction`). NexFUSE
+/// calls it gosub, the ISA registers it as jmp.
+pub const call_instruction = "jmp";
+
+pub fn runtime(isa: *codegen.Isa(u8)) !void {
+    isa.nul_after_sequence = true;
+    isa.nul_byte = 0;
+    isa.procedure_add_end = true;
+    isa.end_byte = 22;
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "echo",
         &echoIns,
@@ -101,7 +122,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
         },
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "mov",
         &moveIns,
@@ -112,7 +133,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
     );
 
     // EACH [REGISTER]
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "each",
         &eachIns,
@@ -123,7 +144,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
     );
 
     // RESET [reg]
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "reset",
         &resetIns,
@@ -131,21 +152,21 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
             codegen.Type.init(.register),
         },
     );
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "clear",
         &clearIns,
         &.{},
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "zeroall",
         &clearIns,
         &.{},
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "put",
         &putIns,
@@ -155,7 +176,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
             codegen.Type.init(.number),
         },
     );
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "get",
         &getIns,
@@ -166,7 +187,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
         },
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "add",
         &addIns,
@@ -176,14 +197,14 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
         },
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "nop",
         &nopIns,
         &.{},
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "lar",
         &larIns,
@@ -192,14 +213,14 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
         },
     );
 
-    try vend.createAndImplementInstruction(u8, "lsl", &lslIns); // TODO: var args
+    try isa.createAndImplementInstruction(u8, "lsl", &lslIns); // TODO: var args
 
-    try vend.createAndImplementInstructionWithAnnotation(u8, "in", &inIns, &.{
+    try isa.createAndImplementInstructionWithAnnotation(u8, "in", &inIns, &.{
         codegen.Type.init(.register),
     });
 
     // CMP R1, R2, TRUE_LABEL, FALSE_LABEL
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "cmp",
         &cmpIns,
@@ -211,7 +232,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
         },
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "inc",
         &incIns,
@@ -220,7 +241,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
         },
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "rep",
         &repIns,
@@ -230,7 +251,7 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
         },
     );
 
-    try vend.createAndImplementInstructionWithAnnotation(
+    try isa.createAndImplementInstructionWithAnnotation(
         u8,
         "jmp",
         &gosubIns,
@@ -238,6 +259,32 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
             codegen.Type.init(.identifier),
         },
     );
+
+    // runs of echo print through a register: reset, lsl with every byte of the run, each. Each
+    // of them is 3 bytes with the nul, the bytes of the run come on top of that.
+    isa.echo_buffer = .{
+        .reset = "reset",
+        .fill = "lsl",
+        .print = "each",
+        .echo_size = 3,
+        .overhead = 9,
+    };
+
+    // how instructions use registers, for the dead write pass. cmp, rep, jmp and lar are left
+    // out, they jump or are not understood well enough and stay barriers.
+    try isa.registerEffect("echo", .{ .side_effects = true });
+    try isa.registerEffect("mov", .{ .writes = &.{0} });
+    try isa.registerEffect("each", .{ .reads = &.{0}, .side_effects = true });
+    try isa.registerEffect("reset", .{ .resets = &.{0} });
+    try isa.registerEffect("clear", .{ .resets_all = true });
+    try isa.registerEffect("zeroall", .{ .resets_all = true });
+    try isa.registerEffect("put", .{ .writes = &.{0} });
+    try isa.registerEffect("get", .{ .reads = &.{0}, .writes = &.{2} });
+    try isa.registerEffect("add", .{ .reads = &.{0}, .writes = &.{1} });
+    try isa.registerEffect("nop", .{});
+    try isa.registerEffect("in", .{ .writes = &.{0}, .side_effects = true });
+    try isa.registerEffect("inc", .{ .reads = &.{0}, .writes = &.{0} });
+    try isa.registerEffect("lsl", .{ .writes = &.{0} });
 }
 
 /// Prints a byte to STDOUT.
@@ -246,13 +293,14 @@ pub fn runtime(vend: *codegen.Vendor(u8)) !void {
 ///
 /// Internally this function uses C's printf() function to print the argument as a character.
 /// in VASM this function ensures the type is representable by the charset
+///
+/// A string (`echo 'Hi\n'`) prints each of its bytes with an `echo` of its own, from `-O1` a
+/// long string is filled into a register and printed at once instead (see `Isa.echo_buffer`).
 pub fn echoIns(
     gen: *codegen.Generator(u8),
     vend: *codegen.Vendor(u8),
     args: []parser.Value,
 ) Return {
-    _ = vend;
-
     if (args.len == 0) {
         return Result.expectedParameter("BYTE");
     }
@@ -263,8 +311,24 @@ pub fn echoIns(
         return Result.typeMismatch(.literal, byte.getType());
     }
 
-    try gen.append(40);
-    try gen.append(@intCast(byte.toLiteral().toCharacter()));
+    var characters = byte.toLiteral().iterator();
+    var first = true;
+
+    while (characters.next() catch return Result.otherError("unknown escape sequence")) |character| {
+        // the nul after the last echo is added by codegen
+        if (!first and vend.isa.nul_after_sequence) {
+            try gen.append(vend.isa.nul_byte);
+        }
+
+        try gen.append(40);
+        try gen.append(character);
+
+        first = false;
+    }
+
+    if (first) {
+        return Result.otherError("nothing to echo");
+    }
 
     return .ok;
 }
@@ -441,16 +505,29 @@ pub fn lslIns(
     try gen.append(49);
     try gen.append(@intCast(register.getRegisterNumber()));
 
-    // iterate past register arg
+    // iterate past register arg. The bytes end at the first 0, so none of them can be one.
     for (1..args.len) |i| {
         switch (args[i]) {
             // add number and gen
             .number => |number| {
+                if (number.getNumber() == 0) {
+                    return Result.otherError("lsl can not hold 0");
+                }
+
                 try gen.append(@intCast(number.getNumber()));
             },
 
+            // every byte of a string
             .literal => |literal| {
-                try gen.append(@intCast(literal.toCharacter()));
+                var characters = literal.iterator();
+
+                while (characters.next() catch return Result.otherError("unknown escape sequence")) |character| {
+                    if (character == 0) {
+                        return Result.otherError("a string in lsl can not hold \\0");
+                    }
+
+                    try gen.append(character);
+                }
             },
 
             else => {
@@ -492,12 +569,12 @@ pub fn cmpIns(
     try gen.append(51);
     try gen.append(@intCast(register1.getRegisterNumber()));
     try gen.append(@intCast(register2.getRegisterNumber()));
-    try gen.append(@bitCast(label.identifier_string[0])); // use the first letter of label (assuming folding is off)
-    try gen.append(@bitCast(label2.identifier_string[0])); // use the first letter of label (assuming folding is off)
+    try gen.append(try vend.procedureReference(label.toString())); // folding is off, see `procedureReference`
+    try gen.append(try vend.procedureReference(label2.toString()));
 
     // remember these
-    try vend.peephole_optimizer.remember(label.identifier_string);
-    try vend.peephole_optimizer.remember(label2.identifier_string);
+    try vend.peephole_optimizer.remember(label.toString());
+    try vend.peephole_optimizer.remember(label2.toString());
 
     return .ok;
 }
@@ -520,14 +597,12 @@ pub fn repIns(
     vend: *codegen.Vendor(u8),
     args: []parser.Value,
 ) Return {
-    _ = vend;
-
     // repeats the procedure a certain number of times
     const proc_name = args[0].toIdentifier();
     const times = args[1].toNumber();
 
     try gen.append(53);
-    try gen.append(@bitCast(proc_name.identifier_string[0]));
+    try gen.append(try vend.procedureReference(proc_name.toString()));
     try gen.append(@intCast(times.getNumber()));
 
     return .ok;
@@ -542,10 +617,10 @@ pub fn gosubIns(
 
     // jmp to label
     try gen.append(15);
-    try gen.append(@bitCast(label.identifier_string[0]));
+    try gen.append(try vend.procedureReference(label.toString()));
 
     // so the optimizer doesn't cut the label
-    try vend.peephole_optimizer.remember(label.identifier_string);
+    try vend.peephole_optimizer.remember(label.toString());
 
     return .ok;
 }
@@ -809,6 +884,148 @@ test {
     );
 }
 
+test "calling cold procedures" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    try runtime(&isa);
+
+    var prof = profile.Profile.init(allocator);
+    try prof.add("hot", 1000);
+    try prof.add("cold", 2);
+
+    var vendor = codegen.Vendor(u8).init(allocator, &isa);
+    vendor.profile = &prof;
+    vendor.call_instruction = call_instruction;
+
+    var lex = lexer.Lexer.init(allocator);
+    lex.setInputText("hot: echo 'a'\n\ncold: echo 'b'\n\n_start: hot\ncold\n");
+    try lex.startLexingInputText();
+
+    var pars = parser.Parser.init(allocator, &lex.stream);
+    _ = try vendor.generateBinary(try pars.createRootNode());
+
+    // hot is folded in, cold is a gosub
+    try std.testing.expectEqualSlices(u8, &.{
+        40, 'a', 0, // ECHO a
+        15, 'c', 0, // GOSUB cold
+    }, vendor.procedure_map.get("_start").?.items);
+}
+
+test "buffering echo runs" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    try runtime(&isa);
+
+    var vendor = codegen.Vendor(u8).init(allocator, &isa);
+    vendor.buffer_echoes = true;
+
+    var lex = lexer.Lexer.init(allocator);
+    lex.setInputText("_start: mov R1, 7\necho 'H'\necho 'e'\necho 'l'\necho 'l'\necho 'o'\neach R1\necho '!'\n");
+    try lex.startLexingInputText();
+
+    var pars = parser.Parser.init(allocator, &lex.stream);
+    _ = try vendor.generateBinary(try pars.createRootNode());
+
+    // R1 is taken, so the run of five goes through R2. A single echo does not pay.
+    try std.testing.expectEqualSlices(u8, &.{
+        41, 1,   7,   0, // MOV R1 7
+        43, 2,   0, // RESET R2
+        49, 2,   'H', 'e', 'l', 'l', 'o', 0, // LSL R2 "Hello"
+        42, 2,   0, // EACH R2
+        42, 1,   0, // EACH R1
+        40, '!', 0, // ECHO !
+    }, vendor.procedure_map.get("_start").?.items);
+}
+
+test "buffering echo runs next to library procedures" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    try runtime(&isa);
+
+    // MOV R1 'x', EACH R1: the program never names R1, the library procedure does
+    var bytes = std.ArrayList(u8).init(allocator);
+    try archive.write(allocator, bytes.writer(), "nexfuse", 1, &.{
+        .{ .name = "shout", .binary = &.{ 41, 1, 'x', 0, 42, 1, 0 } },
+    });
+
+    const libraries = [_]archive.Library{try archive.Library.init(bytes.items)};
+
+    var vendor = codegen.Vendor(u8).init(allocator, &isa);
+    vendor.buffer_echoes = true;
+    vendor.libraries = &libraries;
+
+    var lex = lexer.Lexer.init(allocator);
+    lex.setInputText("_start: echo 'H'\necho 'e'\necho 'l'\necho 'l'\necho 'o'\nshout\n");
+    try lex.startLexingInputText();
+
+    var pars = parser.Parser.init(allocator, &lex.stream);
+    _ = try vendor.generateBinary(try pars.createRootNode());
+
+    // buffering through R1 would reset what `shout` leaves in it, so nothing is buffered
+    try std.testing.expectEqual(null, vendor.echo_register);
+    try std.testing.expectEqual(0, vendor.buffered_runs);
+}
+
+test "lsl with 0 bytes" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const allocator = arena.allocator();
+
+    var isa = codegen.Isa(u8).init(allocator);
+    try runtime(&isa);
+
+    // the operands of lsl end at the first 0, anything after it would run as instructions
+    const cases = [_]struct { []const u8, []const u8 }{
+        .{ "_start: lsl R1, 'a\\0b'\n", "a string in lsl can not hold \\0" },
+        .{ "_start: lsl R1, 'a', 0, 'b'\n", "lsl can not hold 0" },
+    };
+
+    for (cases) |case| {
+        const text, const message = case;
+
+        var vendor = codegen.Vendor(u8).init(allocator, &isa);
+
+        var lex = lexer.Lexer.init(allocator);
+        lex.setInputText(text);
+        try lex.startLexingInputText();
+
+        var pars = parser.Parser.init(allocator, &lex.stream);
+        const res = try vendor.generateBinary(try pars.createRootNode());
+
+        try std.testing.expect(res == .instruction_coughed_up_bad_result);
+        try std.testing.expectEqualStrings(message, res.instruction_coughed_up_bad_result.other);
+    }
+}
+
+test "strings" {
+    try expectBin(
+        u8,
+        "_start:\necho 'Hi\\n'\nlsl R1, 'ab', 0x0a",
+        &[_]u8{
+            40, 'H',  0,
+            40, 'i',  0,
+            40, 0x0a, 0,
+            49, 1,    'a', 'b', 0x0a, 0,
+            22,
+        },
+        ctx_folding,
+        runtime,
+    );
+}
+
 test {
     std.testing.refAllDecls(@This());
 }
@@ -31,38 +31,48 @@ const NAME = "openlud";
 /// The binary format size of this platform.
 const SIZE = i8;
 
-/// appends the given instructions and values into `vend`. Required for each VM platform driver.
-pub fn vendor(vend: *codegen.Vendor(i8)) !void {
-    vend.nul_after_sequence = true;
-    vend.nul_byte = 0;
+/// appends the given instructions and values into `isa`. Required for each VM platform driver.
+pub fn vendor(isa: *codegen.Isa(i8)) !void {
+    isa.nul_after_sequence = true;
+    isa.nul_byte = 0;
 
-    try vend.createAndImplementInstructionWithAnnotation(i8, "echo", &echoInstruction, &.{
+    try isa.createAndImplementInstructionWithAnnotation(i8, "echo", &echoInstruction, &.{
         codegen.Type.init(.literal),
     });
-    try vend.createAndImplementInstructionWithAnnotation(i8, "mov", &moveInstruction, &.{
+    try isa.createAndImplementInstructionWithAnnotation(i8, "mov", &moveInstruction, &.{
         codegen.Type.init(.register),
         codegen.Type.init(.number),
     });
-    try vend.createAndImplementInstructionWithAnnotation(i8, "each", &eachInstruction, &.{
+    try isa.createAndImplementInstructionWithAnnotation(i8, "each", &eachInstruction, &.{
         codegen.Type.init(.register),
     });
-    try vend.createAndImplementInstructionWithAnnotation(i8, "init", &initInstruction, &.{
+    try isa.createAndImplementInstructionWithAnnotation(i8, "init", &initInstruction, &.{
         codegen.Type.init(.register),
     });
-    try vend.createAndImplementInstructionWithAnnotation(i8, "put", &putInstruction, &.{
+    try isa.createAndImplementInstructionWithAnnotation(i8, "put", &putInstruction, &.{
         codegen.Type.init(.register),
         codegen.Type.init(.number),
         codegen.Type.init(.number),
     });
-    try vend.createAndImplementInstructionWithAnnotation(i8, "clear", &clearInstruction, &.{});
-    try vend.createAndImplementInstructionWithAnnotation(i8, "reset", &resetInstruction, &.{
+    try isa.createAndImplementInstructionWithAnnotation(i8, "clear", &clearInstruction, &.{});
+    try isa.createAndImplementInstructionWithAnnotation(i8, "reset", &resetInstruction, &.{
         codegen.Type.init(.register),
     });
-    try vend.createAndImplementInstructionWithAnnotation(i8, "get", &getInstruction, &.{
+    try isa.createAndImplementInstructionWithAnnotation(i8, "get", &getInstruction, &.{
         codegen.Type.init(.register),
         codegen.Type.init(.number),
         codegen.Type.init(.register),
     });
+
+    // how instructions use registers, for the dead write pass
+    try isa.registerEffect("echo", .{ .side_effects = true });
+    try isa.registerEffect("mov", .{ .writes = &.{0} });
+    try isa.registerEffect("each", .{ .reads = &.{0}, .side_effects = true });
+    try isa.registerEffect("init", .{ .writes = &.{0} });
+    try isa.registerEffect("put", .{ .writes = &.{0} });
+    try isa.registerEffect("clear", .{ .resets_all = true });
+    try isa.registerEffect("reset", .{ .resets = &.{0} });
+    try isa.registerEffect("get", .{ .reads = &.{0}, .writes = &.{2} });
 }
 
 /// OpenLUD-aware link configuration.
@@ -83,8 +93,6 @@ pub const ctx = .{
 /// *"ECHO will print out a byte as a character"*
 /// - from <https://github.com/thekaigonzalez/openLUD-OBI/blob/main/obi/obirqlist.d>
 pub fn echoInstruction(generator: *codegen.Generator(SIZE), vend: *codegen.Vendor(SIZE), args: []parser.Value) codegen.InstructionError!InstructionResult {
-    _ = vend;
-
     if (args.len == 0) {
         return error.InstructionExpectsDifferentValue;
     }
@@ -97,8 +105,22 @@ pub fn echoInstruction(generator: *codegen.Generator(SIZE), vend: *codegen.Vendo
         };
     }
 
-    try generator.append(40);
-    try generator.append(@intCast(byte.toLiteral().character[0]));
+    var characters = byte.toLiteral().iterator();
+    var first = true;
+
+    // there is no instruction to fill a register with a string, so a string is an echo per byte
+    while (characters.next() catch return InstructionResult.otherError("unknown escape sequence")) |character| {
+        if (!first and vend.isa.nul_after_sequence) try generator.append(vend.isa.nul_byte);
+
+        try generator.append(40);
+        try generator.append(@bitCast(character));
+
+        first = false;
+    }
+
+    if (first) {
+        return InstructionResult.otherError("nothing to echo");
+    }
 
     return .ok;
 }
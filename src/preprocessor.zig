@@ -7,6 +7,7 @@ const compiler_main = @import("compiler_main.zig");
 const lexer = @import("lexer.zig");
 const parser = @import("parser.zig");
 const token_stream = @import("token_stream.zig");
+const trace = @import("trace.zig");
 
 const Options = compiler_main.Options;
 const Value = parser.Value;
@@ -42,6 +43,9 @@ pub const Preprocessor = struct {
     options: *Options,
     directives: std.StringHashMap(Directive),
 
+    /// Receives a trace event for every directive that runs. Null disables tracing.
+    tracer: ?*trace.Tracer = null,
+
     pub fn init(parent_allocator: std.mem.Allocator, options: *Options) Preprocessor {
         return Preprocessor{
             .parent_allocator = parent_allocator,
@@ -76,7 +80,10 @@ pub const Preprocessor = struct {
             },
             .procedure => |_| {},
             .macro => |mac| {
-                if (self.directives.get(mac.name.identifier_string)) |directive| {
+                if (self.directives.get(mac.name.toString())) |directive| {
+                    const scope = trace.begin(self.tracer, "directive", directive.name);
+                    defer scope.end();
+
                     try directive.function(self, mac.parameters.items[0..]);
                 } else {
                     return PreprocessorResult{
@@ -96,7 +103,7 @@ fn testPrepValue(pp: *Preprocessor, args: []const Value) anyerror!void {
     _ = pp;
 
     try std.testing.expectEqual(1, args.len);
-    try std.testing.expectEqualStrings("nexfuse", args[0].identifier.identifier_string);
+    try std.testing.expectEqualStrings("nexfuse", args[0].identifier.toString());
 }
 
 test {
@@ -122,7 +129,7 @@ test {
     const res = try pp.handleAstDirectives(&root);
 
     if (res == .nonexistent_directive) {
-        try std.testing.expectEqualStrings("compat", res.nonexistent_directive.identifier_string);
+        try std.testing.expectEqualStrings("compat", res.nonexistent_directive.toString());
     } else {
         try std.testing.expect(false);
     }
@@ -0,0 +1,134 @@
+//! ## Profiles
+//!
+//! Execution profiles from a VM, read with `--profile-use`. A profile gives each procedure an
+//! execution count, which codegen and the linker use in place of static guesses:
+//!
+//! * Hot procedures keep being folded into their callers, cold ones are called instead, which keeps
+//!   their body in the binary once (see `Vendor.call_instruction`).
+//! * The linker places procedures hottest first, so hot code sits together (see `Linker.profile`).
+//!
+//! The profile is plain text, one procedure per line. Blank lines and lines starting with `#` are
+//! ignored. Per-offset counts can be turned into per-procedure counts with the map from `--emit-map`.
+//!
+//! ```
+//! # procedure count
+//! _start 1
+//! loop 120000
+//! report_error 0
+//! ```
+//!
+
+const std = @import("std");
+
+pub const Error = error{
+    /// A line is not `NAME COUNT`
+    InvalidProfileLine,
+};
+
+/// How often a procedure ran, compared to the hottest one.
+pub const Heat = enum {
+    /// Ran at least `hot_divisor`th as often as the hottest procedure
+    hot,
+
+    /// In the profile, but not hot
+    cold,
+
+    /// Not in the profile, nothing is known about it
+    unknown,
+};
+
+/// A procedure is hot when it ran at least 1/`hot_divisor` as often as the hottest procedure.
+pub const hot_divisor = 10;
+
+/// Best to allocate with an arena.
+pub const Profile = struct {
+    counts: std.StringHashMap(u64),
+    max_count: u64 = 0,
+
+    pub fn init(parent_allocator: std.mem.Allocator) Profile {
+        return Profile{
+            .counts = std.StringHashMap(u64).init(parent_allocator),
+        };
+    }
+
+    pub fn deinit(self: *Profile) void {
+        self.counts.deinit();
+    }
+
+    /// Reads a profile from `text`. Procedure names point into `text`.
+    pub fn parse(parent_allocator: std.mem.Allocator, text: []const u8) !Profile {
+        var profile = Profile.init(parent_allocator);
+        errdefer profile.deinit();
+
+        var lines = std.mem.tokenizeAny(u8, text, "\r\n");
+
+        while (lines.next()) |line| {
+            const trimmed = std.mem.trim(u8, line, " \t");
+
+            if (trimmed.len == 0 or trimmed[0] == '#') continue;
+
+            var fields = std.mem.tokenizeAny(u8, trimmed, " \t");
+
+            const name = fields.next() orelse return error.InvalidProfileLine;
+            const count_text = fields.next() orelse return error.InvalidProfileLine;
+
+            if (fields.next() != null) return error.InvalidProfileLine;
+
+            const count = std.fmt.parseInt(u64, count_text, 10) catch return error.InvalidProfileLine;
+
+            try profile.add(name, count);
+        }
+
+        return profile;
+    }
+
+    /// Adds `count` executions to the procedure `name`.
+    pub fn add(self: *Profile, name: []const u8, count: u64) !void {
+        const entry = try self.counts.getOrPut(name);
+
+        if (!entry.found_existing) entry.value_ptr.* = 0;
+        entry.value_ptr.* +|= count;
+
+        self.max_count = @max(self.max_count, entry.value_ptr.*);
+    }
+
+    /// Executions of `name`, 0 when it is not in the profile.
+    pub fn countOf(self: *const Profile, name: []const u8) u64 {
+        return self.counts.get(name) orelse 0;
+    }
+
+    pub fn heatOf(self: *const Profile, name: []const u8) Heat {
+        const count = self.counts.get(name) orelse return .unknown;
+
+        if (count > 0 and count >= self.max_count / hot_divisor) {
+            return .hot;
+        }
+
+        return .cold;
+    }
+};
+
+test "reading a profile" {
+    var profile = try Profile.parse(std.testing.allocator,
+        \\# procedure count
+        \\_start 1
+        \\loop 1000
+        \\
+        \\report 0
+        \\loop 500
+    );
+    defer profile.deinit();
+
+    try std.testing.expectEqual(1500, profile.countOf("loop"));
+    try std.testing.expectEqual(1500, profile.max_count);
+    try std.testing.expectEqual(Heat.hot, profile.heatOf("loop"));
+    try std.testing.expectEqual(Heat.cold, profile.heatOf("_start"));
+    try std.testing.expectEqual(Heat.cold, profile.heatOf("report"));
+    try std.testing.expectEqual(Heat.unknown, profile.heatOf("other"));
+}
+
+test "invalid profiles" {
+    try std.testing.expectError(error.InvalidProfileLine, Profile.parse(std.testing.allocator, "loop"));
+    try std.testing.expectError(error.InvalidProfileLine, Profile.parse(std.testing.allocator, "loop many"));
+    try std.testing.expectError(error.InvalidProfileLine, Profile.parse(std.testing.allocator, "loop 1 2"));
+}
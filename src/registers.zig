@@ -0,0 +1,205 @@
+//! ## Register Accesses
+//!
+//! What instructions do to registers, for optimizations that track them. A driver describes each
+//! instruction's register operands with an `Effect` (see `Isa.registerEffect`). When a vendor
+//! tracks registers, codegen resolves the effect of every generated instruction into an `Access`
+//! on concrete registers, kept next to the procedure's binary.
+//!
+//! Registers in these formats are stacks: a write (`mov`, `put`) adds to a register and keeps what
+//! was in it, only a reset (`reset`, `clear`) empties it. A write is dead when nothing reads its
+//! register before the register is reset or the program ends, see `findDeadWrites`.
+//!
+//! Instructions without an effect are barriers. They may read any register or jump anywhere, so
+//! nothing before them is ever dead.
+//!
+
+const std = @import("std");
+const parser = @import("parser.zig");
+
+const Value = parser.Value;
+
+/// The registers an 8-bit format can address. Higher registers make an access a barrier.
+pub const RegisterSet = std.StaticBitSet(256);
+
+/// How an instruction uses its operands. Operands are given by their position.
+pub const Effect = struct {
+    /// Registers read
+    reads: []const usize = &.{},
+
+    /// Registers added to
+    writes: []const usize = &.{},
+
+    /// Registers emptied
+    resets: []const usize = &.{},
+
+    /// Empties every register
+    resets_all: bool = false,
+
+    /// Does more than change registers (input, output). Never removed.
+    side_effects: bool = false,
+};
+
+/// How a single generated instruction uses registers, and where its bytes are in the procedure.
+pub const Access = struct {
+    begin: u32 = 0,
+    len: u32 = 0,
+
+    reads: RegisterSet = RegisterSet.initEmpty(),
+    writes: RegisterSet = RegisterSet.initEmpty(),
+    resets: RegisterSet = RegisterSet.initEmpty(),
+    resets_all: bool = false,
+    side_effects: bool = false,
+
+    /// Anything can happen, every register may be read
+    barrier: bool = true,
+
+    /// Resolves `effect` on `operands`. No effect, or a register operand that does not fit a
+    /// `RegisterSet`, gives a barrier.
+    pub fn of(effect: ?Effect, operands: []const Value) Access {
+        const known = effect orelse return Access{};
+
+        var access = Access{
+            .resets_all = known.resets_all,
+            .side_effects = known.side_effects,
+            .barrier = false,
+        };
+
+        const groups = [_]struct { []const usize, *RegisterSet }{
+            .{ known.reads, &access.reads },
+            .{ known.writes, &access.writes },
+            .{ known.resets, &access.resets },
+        };
+
+        for (groups) |group| {
+            for (group[0]) |position| {
+                if (position >= operands.len or operands[position] != .register) {
+                    return Access{};
+                }
+
+                const number = operands[position].register.getRegisterNumber();
+
+                if (number >= RegisterSet.bit_length) {
+                    return Access{};
+                }
+
+                group[1].set(number);
+            }
+        }
+
+        return access;
+    }
+
+    /// Can the instruction go when the registers in `live` are read later on?
+    fn isDeadWith(self: *const Access, live: RegisterSet) bool {
+        if (self.barrier or self.side_effects) return false;
+
+        const changed = if (self.resets_all) RegisterSet.initFull() else self.writes.unionWith(self.resets);
+
+        if (changed.count() == 0) return false;
+
+        return changed.intersectWith(live).count() == 0;
+    }
+};
+
+/// Appends the accesses of a folded procedure to `accesses`, moved to `at`.
+pub fn foldInto(accesses: *std.ArrayList(Access), callee: []const Access, at: usize) !void {
+    for (callee) |access| {
+        var moved = access;
+        moved.begin = @intCast(access.begin + at);
+
+        try accesses.append(moved);
+    }
+}
+
+/// Finds the writes in a straight-line procedure that are never read. `live_out` holds the
+/// registers that may be read after the procedure: none at the end of the program, every one
+/// when it returns to a caller. The result has a bit set for each dead access, owned by the caller.
+pub fn findDeadWrites(allocator: std.mem.Allocator, accesses: []const Access, live_out: RegisterSet) !std.DynamicBitSetUnmanaged {
+    var dead = try std.DynamicBitSetUnmanaged.initEmpty(allocator, accesses.len);
+
+    var live = live_out;
+    var i = accesses.len;
+
+    while (i > 0) {
+        i -= 1;
+
+        const access = &accesses[i];
+
+        if (access.barrier) {
+            live = RegisterSet.initFull();
+            continue;
+        }
+
+        if (access.isDeadWith(live)) {
+            dead.set(i);
+            continue;
+        }
+
+        // a write adds to its register, only a reset ends what was read before it
+        if (access.resets_all) {
+            live = RegisterSet.initEmpty();
+        } else {
+            live = live.differenceWith(access.resets);
+        }
+
+        live.setUnion(access.reads);
+    }
+
+    return dead;
+}
+
+fn testAccess(effect: ?Effect, registers: []const usize) Access {
+    var operands: [4]Value = undefined;
+
+    for (registers, 0..) |number, i| {
+        operands[i] = Value{ .register = parser.Register.init(number) };
+    }
+
+    return Access.of(effect, operands[0..registers.len]);
+}
+
+test findDeadWrites {
+    const mov = Effect{ .writes = &.{0} };
+    const each = Effect{ .reads = &.{0}, .side_effects = true };
+    const reset = Effect{ .resets = &.{0} };
+
+    const accesses = [_]Access{
+        testAccess(mov, &.{1}), // dead, R1 is reset before it is read
+        testAccess(mov, &.{2}),
+        testAccess(reset, &.{1}),
+        testAccess(mov, &.{1}),
+        testAccess(each, &.{1}),
+        testAccess(mov, &.{3}), // dead, the program ends
+        testAccess(each, &.{2}),
+    };
+
+    var dead = try findDeadWrites(std.testing.allocator, &accesses, RegisterSet.initEmpty());
+    defer dead.deinit(std.testing.allocator);
+
+    try std.testing.expectEqual(2, dead.count());
+    try std.testing.expect(dead.isSet(0));
+    try std.testing.expect(dead.isSet(5));
+
+    // returning to a caller keeps every register
+    var returning = try findDeadWrites(std.testing.allocator, &accesses, RegisterSet.initFull());
+    defer returning.deinit(std.testing.allocator);
+
+    try std.testing.expectEqual(1, returning.count());
+    try std.testing.expect(returning.isSet(0));
+}
+
+test "barriers keep every write" {
+    const mov = Effect{ .writes = &.{0} };
+
+    const accesses = [_]Access{
+        testAccess(mov, &.{1}),
+        testAccess(null, &.{}),
+        testAccess(mov, &.{300}),
+    };
+
+    var dead = try findDeadWrites(std.testing.allocator, &accesses, RegisterSet.initEmpty());
+    defer dead.deinit(std.testing.allocator);
+
+    try std.testing.expectEqual(0, dead.count());
+    try std.testing.expect(accesses[2].barrier);
+}
@@ -0,0 +1,230 @@
+//! ## Source Maps
+//!
+//! Maps ranges of a linked binary back to the LR Assembly that generated them, so a VM profiler or
+//! debugger can attribute a bytecode offset to a file, line, column and procedure.
+//!
+//! Codegen records a `Segment` for every instruction it generates, relative to the procedure it is
+//! in (see `Vendor.source_map`). A procedure that is folded into another copies the callee's segments
+//! and adds the callee to their folding chain. The linker then places every procedure it writes
+//! (see `Linker.source_map`), which turns its segments into `Entry`s at absolute offsets.
+//!
+//! The sidecar written by `--emit-map` is plain text, one entry per line:
+//!
+//! ```
+//! vasm-map 1 main.asm
+//! 0 4 3:5 _start
+//! 4 3 7:5 _start b a
+//! ```
+//!
+//! Each entry is `OFFSET LENGTH LINE:COLUMN PROCEDURE [CHAIN...]`, where the chain lists the
+//! folded procedures from the outermost call inwards. Offsets count binary elements.
+//!
+
+const std = @import("std");
+const token_stream = @import("token_stream.zig");
+
+const Span = token_stream.Span;
+
+pub const version = 1;
+
+/// Bytes generated by one instruction, relative to the start of a procedure.
+pub const Segment = struct {
+    begin: u32,
+    len: u32,
+
+    /// The instruction call in the source
+    span: Span,
+
+    /// Procedures folded in to reach the instruction, outermost first. Empty when the instruction
+    /// is written in the procedure itself.
+    chain: []const []const u8 = &.{},
+};
+
+/// A range of the linked binary.
+pub const Entry = struct {
+    begin: u32,
+    len: u32,
+    line: u32,
+    column: u32,
+    procedure: []const u8,
+    chain: []const []const u8,
+};
+
+/// Best to allocate with an arena, segments and chains are never freed one by one.
+pub const SourceMap = struct {
+    parent_allocator: std.mem.Allocator,
+    file_name: []const u8,
+    source: []const u8,
+
+    /// Offset of the first character of each line, for line and column lookups.
+    line_starts: std.ArrayList(u32),
+
+    /// Procedure name -> its segments, filled during codegen.
+    procedures: std.StringHashMap(std.ArrayList(Segment)),
+
+    /// Filled during linking, in output order.
+    entries: std.ArrayList(Entry),
+
+    pub fn init(parent_allocator: std.mem.Allocator, file_name: []const u8, source: []const u8) !SourceMap {
+        var line_starts = std.ArrayList(u32).init(parent_allocator);
+
+        try line_starts.append(0);
+
+        for (source, 0..) |character, i| {
+            if (character == '\n') {
+                try line_starts.append(@intCast(i + 1));
+            }
+        }
+
+        return SourceMap{
+            .parent_allocator = parent_allocator,
+            .file_name = file_name,
+            .source = source,
+            .line_starts = line_starts,
+            .procedures = std.StringHashMap(std.ArrayList(Segment)).init(parent_allocator),
+            .entries = std.ArrayList(Entry).init(parent_allocator),
+        };
+    }
+
+    /// Records the segments of the procedure `name`, replacing any earlier ones.
+    pub fn recordProcedure(self: *SourceMap, name: []const u8, segments: std.ArrayList(Segment)) !void {
+        try self.procedures.put(name, segments);
+    }
+
+    /// Appends the segments of `callee` to `segments`, moved to `at` and with `callee` added to
+    /// their chains. Used when `callee` is folded into another procedure.
+    pub fn foldInto(self: *SourceMap, segments: *std.ArrayList(Segment), callee: []const u8, at: usize) !void {
+        const callee_segments = self.procedures.get(callee) orelse return;
+
+        for (callee_segments.items) |segment| {
+            const chain = try self.parent_allocator.alloc([]const u8, segment.chain.len + 1);
+
+            chain[0] = callee;
+            @memcpy(chain[1..], segment.chain);
+
+            try segments.append(Segment{
+                .begin = @intCast(segment.begin + at),
+                .len = segment.len,
+                .span = segment.span,
+                .chain = chain,
+            });
+        }
+    }
+
+    /// Drops the segments of the procedure `name` in `begin..begin + len`, and moves the ones after
+    /// it back. Used when an optimization removes bytes from a procedure.
+    pub fn removeRange(self: *SourceMap, name: []const u8, begin: u32, len: u32) void {
+        const segments = self.procedures.getPtr(name) orelse return;
+
+        var kept: usize = 0;
+
+        for (segments.items) |segment| {
+            if (segment.begin >= begin and segment.begin < begin + len) continue;
+
+            var moved = segment;
+
+            if (segment.begin >= begin + len) {
+                moved.begin -= len;
+            }
+
+            segments.items[kept] = moved;
+            kept += 1;
+        }
+
+        segments.shrinkRetainingCapacity(kept);
+    }
+
+    /// Places the procedure `name` at offset `at` of the binary. Procedures without segments
+    /// (nothing was recorded for them) are skipped.
+    pub fn place(self: *SourceMap, name: []const u8, at: usize) !void {
+        const segments = self.procedures.get(name) orelse return;
+
+        for (segments.items) |segment| {
+            const line = self.lineOf(segment.span.begin);
+
+            try self.entries.append(Entry{
+                .begin = @intCast(segment.begin + at),
+                .len = segment.len,
+                .line = @intCast(line + 1),
+                .column = segment.span.begin - self.line_starts.items[line] + 1,
+                .procedure = name,
+                .chain = segment.chain,
+            });
+        }
+    }
+
+    /// The line (starting at 0) that `offset` is on.
+    fn lineOf(self: *const SourceMap, offset: u32) usize {
+        var low: usize = 0;
+        var high: usize = self.line_starts.items.len;
+
+        // the last line start that is <= offset
+        while (high - low > 1) {
+            const middle = low + (high - low) / 2;
+
+            if (self.line_starts.items[middle] <= offset) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+
+        return low;
+    }
+
+    pub fn write(self: *const SourceMap, writer: anytype) !void {
+        try writer.print("vasm-map {d} {s}\n", .{ version, self.file_name });
+
+        for (self.entries.items) |entry| {
+            try writer.print("{d} {d} {d}:{d} {s}", .{ entry.begin, entry.len, entry.line, entry.column, entry.procedure });
+
+            for (entry.chain) |procedure| {
+                try writer.print(" {s}", .{procedure});
+            }
+
+            try writer.writeByte('\n');
+        }
+    }
+
+    pub fn writeToFile(self: *const SourceMap, file_name: []const u8) !void {
+        var file = try std.fs.cwd().createFile(file_name, .{});
+        defer file.close();
+
+        var buffered = std.io.bufferedWriter(file.writer());
+
+        try self.write(buffered.writer());
+        try buffered.flush();
+    }
+};
+
+test "line and column lookup" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var map = try SourceMap.init(arena.allocator(), "main.asm", "a:\n  nop\n_start:\n  a\n");
+
+    var segments = std.ArrayList(Segment).init(arena.allocator());
+    try segments.append(.{ .begin = 0, .len = 2, .span = .{ .begin = 5, .len = 3 } });
+    try map.recordProcedure("a", segments);
+
+    var start_segments = std.ArrayList(Segment).init(arena.allocator());
+    try map.foldInto(&start_segments, "a", 1);
+    try map.recordProcedure("_start", start_segments);
+
+    try map.place("_start", 10);
+
+    try std.testing.expectEqual(1, map.entries.items.len);
+
+    const entry = map.entries.items[0];
+
+    try std.testing.expectEqual(11, entry.begin);
+    try std.testing.expectEqual(2, entry.line);
+    try std.testing.expectEqual(3, entry.column);
+    try std.testing.expectEqualStrings("_start", entry.procedure);
+    try std.testing.expectEqualStrings("a", entry.chain[0]);
+
+    var output = std.ArrayList(u8).init(arena.allocator());
+    try map.write(output.writer());
+
+    try std.testing.expectEqualStrings("vasm-map 1 main.asm\n11 2 2:3 _start a\n", output.items);
+}
@@ -1,14 +1,19 @@
 const std = @import("std");
 const stylist = @import("stylist.zig");
 const compiler_output = @import("compiler_output.zig");
+const diagnostics = @import("diagnostics.zig");
 
 pub fn reportStylist(allocator: anytype, reporter: *compiler_output.Reporter, ctx: anytype) void {
     const report = stylist.analyze(allocator, ctx.body) catch {
         reporter.errorMessage("failed to run stylist.", .{});
-        std.process.exit(1);
+        reporter.exit(1);
     };
 
     for (report.items) |ding| {
+        if (reporter.addToSink(suggestionSeverity(ding.suggestion_type), @tagName(ding.suggestion_type), suggestionLocation(ctx.filename, ding.suggestion_location), "{s}", .{
+            ding.suggestion_message,
+        })) continue;
+
         reporter.stylistMessage("{s}:{d}:{d}: ({s}) {s}", .{
             ctx.filename,
             ding.suggestion_location.line_number,
@@ -29,10 +34,49 @@ pub fn reportStylist(allocator: anytype, reporter: *compiler_output.Reporter, ct
 
     if (report.items.len > 0 and ctx.options.strict_stylist) {
         reporter.errorMessage("too many stylist errors, can not continue. (--enforce-stylist)", .{});
-        std.process.exit(1);
+        reporter.exit(1);
     }
 }
 
+/// Suggestions that point at broken code are warnings, the others notes.
+fn suggestionSeverity(suggestion: stylist.SuggestionType) diagnostics.Severity {
+    return switch (suggestion) {
+        .undefined_behavior, .non_compliant => .warning,
+        .good_practice, .regular => .note,
+    };
+}
+
+/// Where a suggestion is, in 1-based columns. The stylist counts the columns of the first line
+/// from 2 and of the others from 3. Suggestions about the whole file have no location.
+fn suggestionLocation(filename: []const u8, location: stylist.SuggestionLocation) ?diagnostics.Location {
+    if (location.line_number == 0) return null;
+
+    const offset: usize = if (location.line_number == 1) 1 else 2;
+
+    return .{
+        .file = filename,
+        .line = location.line_number,
+        .column = location.problematic_area_begin -| offset,
+        .end_column = location.problematic_area_end -| offset,
+    };
+}
+
+test suggestionLocation {
+    const location = suggestionLocation("a.asm", .{
+        .line_number = 2,
+        .problematic_area_begin = 12,
+        .problematic_area_end = 13,
+    }).?;
+
+    try std.testing.expectEqual(10, location.column);
+    try std.testing.expectEqual(11, location.end_column.?);
+    try std.testing.expectEqual(null, suggestionLocation("a.asm", .{
+        .line_number = 0,
+        .problematic_area_begin = 0,
+        .problematic_area_end = 1,
+    }));
+}
+
 pub fn suggestionToStr(suggestion: stylist.SuggestionType) []const u8 {
     return switch (suggestion) {
         .good_practice => "good practice",
@@ -1,11 +1,22 @@
 //! ## Testing Utilities
 //!
+//! `expectBin` checks the bytes a program compiles to. `expectSameBehaviour` checks what the
+//! optimizer does to a NexFUSE program instead: it runs the binary in `vm.zig` without
+//! optimizations and with every optimization pass added in turn, linked with and without an index
+//! table, and fails on the first pass that changes what the program prints or how it ends.
+//!
 const std = @import("std");
 const parser = @import("../parser.zig");
 const codegen = @import("../codegen.zig");
+const compiler_main = @import("../compiler_main.zig");
+const compiler_pp = @import("../compiler_pp.zig");
 const instruction_result = @import("../instruction_result.zig");
+const ir = @import("../ir.zig");
 const linker = @import("../linker.zig");
 const lexer = @import("../lexer.zig");
+const passes = @import("../passes.zig");
+const nexfuse = @import("../platforms/nexfuse.zig");
+const vm = @import("vm.zig");
 
 pub fn expectBin(comptime T: type, text: []const u8, bin: []const T, ctx: anytype, runtime: anytype) !void {
     var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
@@ -13,9 +24,10 @@ pub fn expectBin(comptime T: type, text: []const u8, bin: []const T, ctx: anytyp
     defer arena.deinit();
 
     var link = linker.Linker(T).init(allocator);
-    var vend1 = codegen.Vendor(T).init(allocator);
+    var isa = codegen.Isa(T).init(allocator);
+    var vend1 = codegen.Vendor(T).init(allocator, &isa);
 
-    try runtime(&vend1);
+    try runtime(&isa);
 
     const root = try ast(allocator, text);
 
@@ -33,6 +45,176 @@ pub fn expectBin(comptime T: type, text: []const u8, bin: []const T, ctx: anytyp
     }
 }
 
+/// How a NexFUSE binary is linked.
+pub const Layout = enum {
+    /// References are heading bytes (`drivers.nexfuse.ctx_no_folding`)
+    headings,
+
+    /// References are indices into a table (`--index-procedures`, `drivers.nexfuse.ctx_indexed`)
+    indexed,
+};
+
+/// Where an optimized program first behaved differently from the unoptimized one.
+pub const Divergence = struct {
+    level: u8,
+    layout: Layout,
+
+    /// The pass the difference showed up with, whether it runs before codegen or after it. Null
+    /// when the program already behaved differently without any pass, linked with `layout`.
+    pass: ?[]const u8,
+
+    expected: vm.Run,
+    actual: vm.Run,
+};
+
+/// Compiles `text` for NexFUSE at `-O0` and runs it. Then, for every higher level and every
+/// layout, compiles and runs it again with none of the passes `register_passes` registered for
+/// the level, then with one more of them at a time, in order. Returns the first run that does not
+/// match `-O0`, naming the pass it was the first to run with. Fails with `error.DoesNotCompile`
+/// when `text` does not compile at `-O0`. Best to allocate with an arena.
+pub fn findDivergence(
+    allocator: std.mem.Allocator,
+    text: []const u8,
+    options: vm.Options,
+    register_passes: *const fn (manager: *passes.PassManager(u8)) anyerror!void,
+) !?Divergence {
+    const unoptimized = Compile{ .level = 0, .layout = .headings, .register_passes = register_passes };
+
+    const expected = runNexfuse(allocator, text, options, unoptimized) catch |err| switch (err) {
+        error.OutOfMemory => return err,
+        else => return error.DoesNotCompile,
+    };
+
+    var manager = passes.PassManager(u8).init(allocator, 0);
+    try register_passes(&manager);
+
+    for (1..@as(usize, manager.maxLevel()) + 1) |n| {
+        const level: u8 = @intCast(n);
+
+        for (std.enums.values(Layout)) |layout| {
+            var compile = Compile{ .level = level, .layout = layout, .register_passes = register_passes, .pass_count = 0 };
+
+            const linked = try runNexfuse(allocator, text, options, compile);
+
+            if (!expected.eql(&linked)) {
+                return Divergence{ .level = level, .layout = layout, .pass = null, .expected = expected, .actual = linked };
+            }
+
+            for (manager.passes.items, 1..) |pass, count| {
+                if (pass.level > level) continue;
+
+                compile.pass_count = count;
+
+                const actual = try runNexfuse(allocator, text, options, compile);
+
+                if (!expected.eql(&actual)) {
+                    return Divergence{ .level = level, .layout = layout, .pass = pass.name, .expected = expected, .actual = actual };
+                }
+            }
+        }
+    }
+
+    return null;
+}
+
+/// Fails when an optimization level changes what `text` does on NexFUSE, see `findDivergence`.
+pub fn expectSameBehaviour(text: []const u8, options: vm.Options) !void {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const divergence = try findDivergence(arena.allocator(), text, options, &defaultPasses) orelse return;
+
+    std.debug.print("-O{d} changed the behaviour of the program linked with {s} after '{s}'\n", .{
+        divergence.level,
+        @tagName(divergence.layout),
+        divergence.pass orelse "no pass",
+    });
+    std.debug.print("  -O0:   \"{s}\" ({any})\n", .{ divergence.expected.output.items, divergence.expected.failure });
+    std.debug.print("  -O{d}:   \"{s}\" ({any})\n", .{ divergence.level, divergence.actual.output.items, divergence.actual.failure });
+
+    return error.OptimizationChangedBehaviour;
+}
+
+fn defaultPasses(manager: *passes.PassManager(u8)) anyerror!void {
+    try passes.registerDefaultPasses(u8, manager);
+}
+
+/// A compile of `runNexfuse`.
+const Compile = struct {
+    level: u8,
+    layout: Layout,
+    register_passes: *const fn (manager: *passes.PassManager(u8)) anyerror!void,
+
+    /// Only the first `pass_count` passes registered can run, the ones after are disabled
+    pass_count: usize = std.math.maxInt(usize),
+};
+
+/// Compiles `text` for NexFUSE the way the frontend does, with the passes of `compile`, and runs
+/// it.
+fn runNexfuse(allocator: std.mem.Allocator, text: []const u8, options: vm.Options, compile: Compile) !vm.Run {
+    const isa = try allocator.create(codegen.Isa(u8));
+    isa.* = codegen.Isa(u8).init(allocator);
+
+    try nexfuse.runtime(isa);
+
+    const vendor = try allocator.create(codegen.Vendor(u8));
+    vendor.* = codegen.Vendor(u8).init(allocator, isa);
+
+    vendor.call_instruction = nexfuse.call_instruction;
+    vendor.index_procedures = compile.layout == .indexed;
+
+    var manager = passes.PassManager(u8).init(allocator, compile.level);
+    defer manager.deinit();
+
+    try compile.register_passes(&manager);
+
+    var disabled = std.ArrayList([]const u8).init(allocator);
+    defer disabled.deinit();
+
+    for (manager.passes.items[@min(compile.pass_count, manager.passes.items.len)..]) |pass| {
+        try disabled.append(pass.name);
+    }
+
+    manager.disabled = disabled.items;
+
+    const pass_ctx = passes.Context{ .start_definition = nexfuse.ctx_no_folding.start_definition };
+
+    const program = try ir.lower(allocator, try preprocessedAst(allocator, text));
+    const prepared = try manager.prepare(allocator, vendor, &program, pass_ctx);
+
+    switch (try vendor.generateProgram(prepared)) {
+        .ok => {},
+        else => return error.CodegenFailed,
+    }
+
+    try manager.run(vendor, pass_ctx);
+
+    var link = linker.Linker(u8).init(allocator);
+    defer link.deinit();
+
+    switch (compile.layout) {
+        .headings => try link.linkUnOptimizedWithContext(nexfuse.ctx_no_folding, vendor.procedure_map),
+        .indexed => try link.linkIndexedWithContext(nexfuse.ctx_indexed, vendor.procedure_indices, vendor.procedure_map),
+    }
+
+    return vm.execute(allocator, link.binary.items, options);
+}
+
+/// Parses `text` and runs its directives like a compile with `-f nexfuse`. A `compat` naming
+/// another format is followed, but the program is generated for NexFUSE all the same, the only
+/// format `vm.zig` runs.
+fn preprocessedAst(allocator: std.mem.Allocator, text: []const u8) !parser.Node {
+    var root = try ast(allocator, text);
+    var opts = compiler_main.Options{ .files = undefined, .format = "nexfuse" };
+
+    switch (try compiler_pp.preprocessWithDefaultRuntime(allocator, &opts, &root, null)) {
+        .ok => {},
+        else => return error.UnknownDirective,
+    }
+
+    return root;
+}
+
 fn ast(allocator: std.mem.Allocator, text: []const u8) !parser.Node {
     var lex = lexer.Lexer.init(allocator);
 
@@ -44,3 +226,92 @@ fn ast(allocator: std.mem.Allocator, text: []const u8) !parser.Node {
 
     return try parse.createRootNode();
 }
+
+fn dropStart(vendor: *codegen.Vendor(u8), ctx: passes.Context, name: []const u8, binary: *std.ArrayList(u8)) anyerror!void {
+    _ = vendor;
+
+    if (std.mem.eql(u8, name, ctx.start_definition)) binary.clearRetainingCapacity();
+}
+
+fn brokenPasses(manager: *passes.PassManager(u8)) anyerror!void {
+    try passes.registerDefaultPasses(u8, manager);
+    try manager.register(.{ .name = "drop-start", .level = 2, .procedure = &dropStart });
+}
+
+fn emptyStart(allocator: std.mem.Allocator, program: *ir.Program, ctx: passes.Context) anyerror!usize {
+    _ = allocator;
+
+    for (program.procedures.items) |*procedure| {
+        if (std.mem.eql(u8, procedure.name, ctx.start_definition)) procedure.statements.clearRetainingCapacity();
+    }
+
+    return 1;
+}
+
+fn brokenLowering(manager: *passes.PassManager(u8)) anyerror!void {
+    try manager.register(.{ .name = "empty-start", .level = 1, .lowered = &emptyStart });
+    try passes.registerDefaultPasses(u8, manager);
+}
+
+test findDivergence {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const divergence = (try findDivergence(arena.allocator(), "_start: echo 'A'\n", .{}, &brokenPasses)).?;
+
+    try std.testing.expectEqual(2, divergence.level);
+    try std.testing.expectEqual(.headings, divergence.layout);
+    try std.testing.expectEqualStrings("drop-start", divergence.pass.?);
+    try std.testing.expectEqualStrings("A", divergence.expected.output.items);
+    try std.testing.expectEqualStrings("", divergence.actual.output.items);
+
+    // passes before codegen are blamed the same way
+    const lowered = (try findDivergence(arena.allocator(), "_start: echo 'A'\n", .{}, &brokenLowering)).?;
+
+    try std.testing.expectEqual(1, lowered.level);
+    try std.testing.expectEqualStrings("empty-start", lowered.pass.?);
+
+    try std.testing.expectError(error.DoesNotCompile, findDivergence(arena.allocator(), "_start: echo nil\n", .{}, &defaultPasses));
+}
+
+test "optimizations keep the behaviour of the samples" {
+    const Sample = struct {
+        text: []const u8,
+
+        /// Does it compile for NexFUSE? The others are samples of compile errors, of other
+        /// formats' instructions or have no `_start`.
+        runs: bool,
+    };
+
+    // every sample, there is no listing a directory at comptime
+    const samples = [_]Sample{
+        .{ .text = @embedFile("../asm/algo.asm"), .runs = true },
+        .{ .text = @embedFile("../asm/asides.asm"), .runs = true },
+        .{ .text = @embedFile("../asm/belittle.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/compat-compif.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/compif.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/endianness.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/helloworld.asm"), .runs = true },
+        .{ .text = @embedFile("../asm/large_num.s"), .runs = false },
+        .{ .text = @embedFile("../asm/macro.asm"), .runs = true },
+        .{ .text = @embedFile("../asm/nila.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/params.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/procedure.asm"), .runs = true },
+        .{ .text = @embedFile("../asm/range-err-2.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/range-err.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/range-start.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/ranges.asm"), .runs = false },
+        .{ .text = @embedFile("../asm/set-error.s"), .runs = false },
+        .{ .text = @embedFile("../asm/set.s"), .runs = true },
+        .{ .text = @embedFile("../asm/simple-str.asm"), .runs = true },
+        .{ .text = @embedFile("../asm/simple_algo.s"), .runs = true },
+        .{ .text = @embedFile("../asm/strings.asm"), .runs = true },
+    };
+
+    for (samples) |sample| {
+        expectSameBehaviour(sample.text, .{}) catch |err| switch (err) {
+            error.DoesNotCompile => try std.testing.expect(!sample.runs),
+            else => return err,
+        };
+    }
+}
@@ -0,0 +1,416 @@
+//! ## NexFUSE Interpreter
+//!
+//! Runs NexFUSE bytecode as produced by `drivers.nexfuse.ctx_no_folding` (or `ctx_folding`), so
+//! tests can compare what binaries *do* instead of the bytes they are made of. Only what a program
+//! can observe is kept: the bytes it printed and how it ended.
+//!
+//! Registers are stacks of bytes, as in `registers.zig`: `mov`, `lsl`, `get` and `in` add to a
+//! register, `reset` and `clear` empty it. `inc` increments the top of a register (an empty one
+//! becomes `1`), `put` overwrites a position and `cmp` compares whole registers. `add` pushes a sum
+//! onto a big register, which `lar` prints as decimal numbers, one per line.
+//!
+//! `jmp`, `cmp` and `rep` call a procedure and return to the next instruction when it ends, the
+//! procedure a reference names is the first one whose heading holds that byte. In binaries with an
+//! index table (`--index-procedures`, see `drivers.nexfuse.ctx_indexed`) a reference is an index
+//! into the table instead, and the table says where the procedure is.
+//!
+
+const std = @import("std");
+
+/// The procedure heading, see `drivers.nexfuse.ctx_no_folding`.
+pub const heading_byte = 10;
+pub const closing_byte = 128;
+pub const end_byte = 22;
+
+/// Starts binaries with an index table, see `drivers.nexfuse.ctx_indexed`. The byte after it is
+/// the number of entries, then every entry is the offset of a procedure's heading from the end of
+/// the table as a little endian `u32`. `_start` has no heading, its entry is its first instruction.
+pub const table_byte = 9;
+
+pub const Opcode = enum(u8) {
+    nul = 0,
+    jmp = 15,
+    echo = 40,
+    mov = 41,
+    each = 42,
+    reset = 43,
+    clear = 44,
+    put = 45,
+    get = 46,
+    add = 47,
+    lar = 48,
+    lsl = 49,
+    in = 50,
+    cmp = 51,
+    inc = 52,
+    rep = 53,
+    end = end_byte,
+    closing = closing_byte,
+    _,
+};
+
+pub const Error = error{
+    /// A byte that is not an instruction, where one was expected
+    InvalidOpcode,
+
+    /// The binary ends in the middle of an instruction or procedure
+    UnexpectedEnd,
+
+    /// A procedure reference no heading holds
+    MissingProcedure,
+
+    /// The program ran for more than `Options.max_steps` instructions
+    StepLimit,
+
+    /// Calls nested deeper than `Options.max_depth`
+    StackOverflow,
+};
+
+pub const Options = struct {
+    /// Bytes `in` reads, one per instruction. Reads past the end give `0`.
+    input: []const u8 = "",
+
+    max_steps: usize = 1_000_000,
+    max_depth: usize = 4096,
+};
+
+/// What a program did.
+pub const Run = struct {
+    output: std.ArrayList(u8),
+
+    /// Null when the program reached its end
+    failure: ?Error = null,
+
+    pub fn deinit(self: *Run) void {
+        self.output.deinit();
+    }
+
+    /// Did both programs print the same and end the same way?
+    pub fn eql(self: *const Run, other: *const Run) bool {
+        return self.failure == other.failure and std.mem.eql(u8, self.output.items, other.output.items);
+    }
+};
+
+/// The length of the instruction at `pos`, operands included.
+pub fn instructionLength(binary: []const u8, pos: usize) Error!usize {
+    const len: usize = switch (@as(Opcode, @enumFromInt(binary[pos]))) {
+        .nul, .clear, .end, .closing => 1,
+        .jmp, .echo, .each, .reset, .lar, .in, .inc => 2,
+        .mov, .add, .rep => 3,
+        .put, .get => 4,
+        .cmp => 5,
+
+        // the bytes run up to the nul after the instruction
+        .lsl => (std.mem.indexOfScalarPos(u8, binary, pos + 2, 0) orelse return error.UnexpectedEnd) - pos,
+
+        _ => return error.InvalidOpcode,
+    };
+
+    if (pos + len > binary.len) return error.UnexpectedEnd;
+
+    return len;
+}
+
+const Frame = struct {
+    /// Where execution continues once the procedure ends
+    return_to: usize,
+
+    /// The start of the procedure's body
+    body: usize,
+
+    /// More runs of the procedure, for `rep`
+    repeats_left: usize = 0,
+};
+
+const Machine = struct {
+    allocator: std.mem.Allocator,
+    binary: []const u8,
+    options: Options,
+
+    /// Heading byte -> the body of the first procedure with it
+    procedures: [256]?usize = [_]?usize{null} ** 256,
+
+    registers: [256]std.ArrayListUnmanaged(u8) = [_]std.ArrayListUnmanaged(u8){.{}} ** 256,
+    big_registers: [256]std.ArrayListUnmanaged(u32) = [_]std.ArrayListUnmanaged(u32){.{}} ** 256,
+
+    frames: std.ArrayListUnmanaged(Frame) = .{},
+    input_pos: usize = 0,
+
+    output: *std.ArrayList(u8),
+
+    fn deinit(self: *Machine) void {
+        for (&self.registers) |*register| register.deinit(self.allocator);
+        for (&self.big_registers) |*register| register.deinit(self.allocator);
+
+        self.frames.deinit(self.allocator);
+    }
+
+    /// Reads the index table at the start of the binary, if there is one. Returns where the
+    /// procedures begin.
+    fn scanTable(self: *Machine) Error!usize {
+        if (self.binary.len == 0 or self.binary[0] != table_byte) return 0;
+        if (self.binary.len < 2) return error.UnexpectedEnd;
+
+        const count = self.binary[1];
+        const body = 2 + @as(usize, count) * @sizeOf(u32);
+
+        if (body > self.binary.len) return error.UnexpectedEnd;
+
+        for (0..count) |index| {
+            const entry = self.binary[2 + index * @sizeOf(u32) ..][0..@sizeOf(u32)];
+            const offset = std.mem.readInt(u32, entry, .little);
+
+            // procedures the optimizer removed
+            if (offset == std.math.maxInt(u32)) continue;
+
+            const at = body + offset;
+            if (at >= self.binary.len) return error.UnexpectedEnd;
+
+            // headings are skipped, `_start` has none
+            self.procedures[index] = if (self.binary[at] == heading_byte) at + 2 else at;
+        }
+
+        return body;
+    }
+
+    /// Finds every procedure heading, returns where `_start` begins. In binaries with an index
+    /// table, the table decides where a reference goes.
+    fn scanProcedures(self: *Machine) Error!usize {
+        var pos: usize = try self.scanTable();
+
+        while (pos < self.binary.len and self.binary[pos] == heading_byte) {
+            if (pos + 2 > self.binary.len) return error.UnexpectedEnd;
+
+            const name = self.binary[pos + 1];
+            pos += 2;
+
+            if (self.procedures[name] == null) self.procedures[name] = pos;
+
+            while (true) {
+                if (pos >= self.binary.len) return error.UnexpectedEnd;
+
+                const opcode = self.binary[pos];
+                pos += try instructionLength(self.binary, pos);
+
+                if (opcode == closing_byte) break;
+            }
+        }
+
+        return pos;
+    }
+
+    fn call(self: *Machine, reference: u8, return_to: usize, repeats: usize) (Error || error{OutOfMemory})!usize {
+        const body = self.procedures[reference] orelse return error.MissingProcedure;
+
+        if (self.frames.items.len >= self.options.max_depth) return error.StackOverflow;
+
+        try self.frames.append(self.allocator, Frame{
+            .return_to = return_to,
+            .body = body,
+            .repeats_left = repeats,
+        });
+
+        return body;
+    }
+
+    fn run(self: *Machine) (Error || error{OutOfMemory})!void {
+        var pos = try self.scanProcedures();
+        var steps: usize = 0;
+
+        while (true) {
+            if (pos >= self.binary.len) return error.UnexpectedEnd;
+
+            steps += 1;
+            if (steps > self.options.max_steps) return error.StepLimit;
+
+            const opcode: Opcode = @enumFromInt(self.binary[pos]);
+            const len = try instructionLength(self.binary, pos);
+            const operands = self.binary[pos + 1 .. pos + len];
+            const next = pos + len;
+
+            pos = next;
+
+            switch (opcode) {
+                .nul => {},
+
+                .end, .closing => {
+                    const frame = if (self.frames.items.len > 0) &self.frames.items[self.frames.items.len - 1] else return;
+
+                    if (frame.repeats_left > 0) {
+                        frame.repeats_left -= 1;
+                        pos = frame.body;
+                    } else {
+                        pos = frame.return_to;
+                        _ = self.frames.pop();
+                    }
+                },
+
+                .jmp => pos = try self.call(operands[0], next, 0),
+
+                .rep => {
+                    if (operands[1] > 0) {
+                        pos = try self.call(operands[0], next, operands[1] - 1);
+                    }
+                },
+
+                .cmp => {
+                    const same = std.mem.eql(u8, self.registers[operands[0]].items, self.registers[operands[1]].items);
+                    pos = try self.call(if (same) operands[2] else operands[3], next, 0);
+                },
+
+                .echo => try self.output.append(operands[0]),
+                .each => try self.output.appendSlice(self.registers[operands[0]].items),
+
+                .mov => try self.registers[operands[0]].append(self.allocator, operands[1]),
+                .lsl => try self.registers[operands[0]].appendSlice(self.allocator, operands[1..]),
+
+                .reset => self.registers[operands[0]].clearRetainingCapacity(),
+
+                .clear => {
+                    for (&self.registers) |*register| register.clearRetainingCapacity();
+                },
+
+                .put => {
+                    const register = &self.registers[operands[0]];
+                    const at: usize = operands[2];
+
+                    if (at >= register.items.len) try register.appendNTimes(self.allocator, 0, at + 1 - register.items.len);
+
+                    register.items[at] = operands[1];
+                },
+
+                .get => {
+                    const source = self.registers[operands[0]].items;
+                    const value = if (operands[1] < source.len) source[operands[1]] else 0;
+
+                    try self.registers[operands[2]].append(self.allocator, value);
+                },
+
+                .add => {
+                    var sum: u32 = 0;
+
+                    for (self.registers[operands[0]].items) |byte| sum +%= byte;
+
+                    try self.big_registers[operands[1]].append(self.allocator, sum);
+                },
+
+                .lar => {
+                    for (self.big_registers[operands[0]].items) |number| {
+                        try self.output.writer().print("{d}\n", .{number});
+                    }
+                },
+
+                .in => {
+                    const byte = if (self.input_pos < self.options.input.len) self.options.input[self.input_pos] else 0;
+                    self.input_pos += 1;
+
+                    try self.registers[operands[0]].append(self.allocator, byte);
+                },
+
+                .inc => {
+                    const register = &self.registers[operands[0]];
+
+                    if (register.items.len == 0) {
+                        try register.append(self.allocator, 1);
+                    } else {
+                        register.items[register.items.len - 1] +%= 1;
+                    }
+                },
+
+                _ => return error.InvalidOpcode,
+            }
+        }
+    }
+};
+
+/// Runs `binary` until it ends, fails, or runs out of steps. The run is owned by the caller.
+pub fn execute(allocator: std.mem.Allocator, binary: []const u8, options: Options) !Run {
+    var result = Run{ .output = std.ArrayList(u8).init(allocator) };
+    errdefer result.deinit();
+
+    var machine = Machine{
+        .allocator = allocator,
+        .binary = binary,
+        .options = options,
+        .output = &result.output,
+    };
+    defer machine.deinit();
+
+    machine.run() catch |err| switch (err) {
+        error.OutOfMemory => return error.OutOfMemory,
+        else => |failure| result.failure = @errorCast(failure),
+    };
+
+    return result;
+}
+
+test execute {
+    // SUB a, ECHO 'B', END ENDSUB, then _start: MOV R1 'A', EACH R1, JMP a, END
+    const binary = [_]u8{
+        10, 'a', 40, 'B', 0, 22, 128,
+        41, 1,   65, 0,
+        42, 1,   0,
+        15, 'a', 0,
+        22,
+    };
+
+    var run = try execute(std.testing.allocator, &binary, .{});
+    defer run.deinit();
+
+    try std.testing.expectEqual(null, run.failure);
+    try std.testing.expectEqualStrings("AB", run.output.items);
+}
+
+test "repeating and comparing" {
+    // SUB a: INC R1, EACH R1 | SUB b: ECHO '!' | _start: REP a 3, CMP R1 R2 b a
+    const binary = [_]u8{
+        10, 'a', 52, 1, 0,   42, 1, 0, 22, 128,
+        10, 'b', 40, '!', 0, 22, 128,
+        41, 2,   3,   0,
+        53, 'a', 3,   0,
+        51, 1,   2,   'b', 'a', 0,
+        22,
+    };
+
+    var run = try execute(std.testing.allocator, &binary, .{});
+    defer run.deinit();
+
+    try std.testing.expectEqual(null, run.failure);
+    try std.testing.expectEqualSlices(u8, &.{ 1, 2, 3, '!' }, run.output.items);
+}
+
+test "index tables" {
+    // TABLE 3: a, _start, b (removed) | SUB 0: ECHO 'B', END ENDSUB | _start: JMP 0, ECHO 'A', END
+    const binary = [_]u8{
+        9,  3,  0,  0,  0,   0, 7, 0, 0, 0, 255, 255, 255, 255,
+        10, 0,  40, 'B', 0,  22, 128,
+        15, 0,  0,  40,  'A', 0, 22,
+    };
+
+    var run = try execute(std.testing.allocator, &binary, .{});
+    defer run.deinit();
+
+    try std.testing.expectEqual(null, run.failure);
+    try std.testing.expectEqualStrings("BA", run.output.items);
+
+    // the reference to the removed `b`
+    var removed = try execute(std.testing.allocator, &.{ 9, 1, 255, 255, 255, 255, 15, 0, 0, 22 }, .{});
+    defer removed.deinit();
+
+    try std.testing.expectEqual(error.MissingProcedure, removed.failure.?);
+}
+
+test "programs that never end" {
+    // SUB a: JMP a
+    const binary = [_]u8{ 10, 'a', 15, 'a', 0, 22, 128, 15, 'a', 0, 22 };
+
+    var run = try execute(std.testing.allocator, &binary, .{ .max_depth = 10 });
+    defer run.deinit();
+
+    try std.testing.expectEqual(error.StackOverflow, run.failure.?);
+
+    var missing = try execute(std.testing.allocator, &.{ 15, 'z', 0, 22 }, .{});
+    defer missing.deinit();
+
+    try std.testing.expectEqual(error.MissingProcedure, missing.failure.?);
+}
@@ -10,6 +10,7 @@
 //! Tokenstream contains a reader for tokens
 
 const std = @import("std");
+const pipeline = @import("pipeline.zig");
 const ArrayList = std.ArrayList;
 
 pub const TokenStreamError = error{
@@ -20,28 +21,66 @@ pub const TokenStreamError = error{
     OutOfMemory,
 };
 
-/// A span from point A to point B
+pub const SpanError = error{
+    /// A token is longer than a span can hold (see `Span.len`)
+    TokenTooLong,
+};
+
+/// A span from point A to point B.
+///
+/// Spans are kept small since one is embedded in every token and value. The offset and length
+/// are stored, the line and column are derived from the source text when a diagnostic needs them.
 pub const Span = struct {
-    begin: usize,
-    end: usize,
-    char_begin: usize,
-    line_number: usize,
+    /// Byte offset of the first character in the source text
+    begin: u32 = 0,
+
+    /// Length in bytes
+    len: u16 = 0,
+
+    /// Byte offset one past the last character
+    pub fn end(self: Span) usize {
+        return @as(usize, self.begin) + self.len;
+    }
+
+    /// The line the span starts on in `source`. Starts at 1.
+    pub fn lineNumber(self: Span, source: []const u8) usize {
+        const until = @min(@as(usize, self.begin), source.len);
+
+        return std.mem.count(u8, source[0..until], "\n") + 1;
+    }
+
+    /// The column the span starts at in `source`. Starts at 1.
+    pub fn column(self: Span, source: []const u8) usize {
+        const until = @min(@as(usize, self.begin), source.len);
+        const line_start = if (std.mem.lastIndexOfScalar(u8, source[0..until], '\n')) |newline| newline + 1 else 0;
+
+        return until - line_start + 1;
+    }
 };
 
 /// An identifier is from A-Z, a-z, 0-9, '_' or '.'
+///
+/// Points at its text in the source, the length of the text is the length of the span. The pointer
+/// is kept besides `span.begin` because names also come from objects and libraries, which have no
+/// source to derive them from. It is what makes a `Value` three registers instead of two.
 pub const Identifier = struct {
-    identifier_string: []const u8,
-    span: Span = Span{
-        .begin = 0,
-        .char_begin = 0,
-        .end = 0,
-        .line_number = 0,
-    },
+    ptr: [*]const u8,
+    span: Span = .{},
 
     const Self = @This();
 
-    pub fn toString(self: *Self) []const u8 {
-        return self.identifier_string;
+    /// Creates an identifier for `string`. The identifier does not copy it.
+    pub fn init(string: []const u8) SpanError!Identifier {
+        return Identifier{
+            .ptr = string.ptr,
+            .span = .{
+                .len = std.math.cast(u16, string.len) orelse return error.TokenTooLong,
+            },
+        };
+    }
+
+    pub fn toString(self: *const Self) []const u8 {
+        return self.ptr[0..self.span.len];
     }
 
     pub fn getSpan(self: *const Self) Span {
@@ -51,12 +90,7 @@ pub const Identifier = struct {
 
 pub const Number = struct {
     number: i64,
-    span: Span = Span{
-        .begin = 0,
-        .char_begin = 0,
-        .end = 0,
-        .line_number = 0,
-    },
+    span: Span = .{},
 
     pub fn init(with_number: i64) Number {
         return Number{
@@ -89,56 +123,82 @@ pub const OperatorKind = enum {
 
 pub const Operator = struct {
     kind: OperatorKind,
-    operator_string: []const u8 = "",
-    position: usize,
-    span: Span = Span{
-        .begin = 0,
-        .char_begin = 0,
-        .end = 0,
-        .line_number = 1,
-    },
+    span: Span = .{},
 };
 
+/// A character or string literal (`'a'`, `'Hello\n'`). Points at the whole token in the source
+/// (quotes included), the length of the token is the length of the span.
 pub const Literal = struct {
-    character: []const u8,
-    span: Span = Span{
-        .begin = 0,
-        .char_begin = 0,
-        .end = 0,
-        .line_number = 0,
-    },
-
-    pub fn init(with_char: u8) Literal {
+    ptr: [*]const u8,
+    span: Span = .{},
+
+    /// Creates a literal from its token text, quotes included (`'a'`). The literal does not copy it.
+    pub fn init(token_text: []const u8) SpanError!Literal {
         return Literal{
-            .character = with_char,
+            .ptr = token_text.ptr,
+            .span = .{
+                .len = std.math.cast(u16, token_text.len) orelse return error.TokenTooLong,
+            },
         };
     }
 
-    pub fn toCharacter(self: *const Literal) u8 {
-        switch (self.character[0]) {
-            '\\' => {
-                switch (self.character[1]) {
-                    'n' => {
-                        return '\n';
-                    },
-                    't' => {
-                        return '\t';
-                    },
-                    'r' => {
-                        return '\r';
-                    },
-                    else => {
-                        @panic("add more escape sequences (TODO)");
-                    },
-                }
-            },
-            else => {
-                return self.character[0];
-            },
-        }
+    /// The characters between the quotes, escape sequences are not decoded.
+    pub fn getCharacters(self: *const Literal) []const u8 {
+        if (self.span.len < 2) return "";
+
+        return self.ptr[1 .. self.span.len - 1];
+    }
+
+    /// Iterates the characters of a string literal (`'Hello\n'`), escape sequences decoded.
+    pub fn iterator(self: *const Literal) Iterator {
+        return Iterator{ .characters = self.getCharacters() };
     }
+
+    pub const Iterator = struct {
+        characters: []const u8,
+        pos: usize = 0,
+
+        pub fn next(self: *Iterator) error{UnknownEscapeSequence}!?u8 {
+            if (self.pos >= self.characters.len) return null;
+
+            const character = self.characters[self.pos];
+            self.pos += 1;
+
+            if (character != '\\') return character;
+
+            // a backslash right before the closing quote
+            if (self.pos >= self.characters.len) return error.UnknownEscapeSequence;
+
+            const escaped = self.characters[self.pos];
+            self.pos += 1;
+
+            return decodeEscape(escaped) orelse error.UnknownEscapeSequence;
+        }
+
+        /// The number of characters left, escape sequences decoded.
+        pub fn count(self: Iterator) error{UnknownEscapeSequence}!usize {
+            var copy = self;
+            var characters: usize = 0;
+
+            while (try copy.next()) |_| characters += 1;
+
+            return characters;
+        }
+    };
 };
 
+/// The character the escape sequence `\c` stands for, null when there is no such sequence.
+fn decodeEscape(c: u8) ?u8 {
+    return switch (c) {
+        'n' => '\n',
+        't' => '\t',
+        'r' => '\r',
+        '0' => 0,
+        '\\', '\'' => c,
+        else => null,
+    };
+}
+
 pub const TokenTag = enum {
     identifier, // abc
     number, // 123
@@ -170,12 +230,7 @@ pub const Token = union(TokenTag) {
             .number => self.number.span,
             .operator => self.operator.span,
             .literal => self.literal.span,
-            else => Span{
-                .begin = 0,
-                .char_begin = 0,
-                .end = 0,
-                .line_number = 1,
-            },
+            else => Span{},
         };
     }
 };
@@ -187,6 +242,14 @@ pub const TokenStream = struct {
     internal_list: ArrayList(Token),
     parent_allocator: std.mem.Allocator,
 
+    /// Added tokens are handed to this queue instead of being kept, for a parser on another
+    /// thread (see `pipeline.zig`).
+    sink: ?*pipeline.Queue(Token) = null,
+
+    /// Tokens are taken from this queue as they are read. A token pointer is only valid until the
+    /// next token is taken, which can move the list.
+    source: ?*pipeline.Queue(Token) = null,
+
     pub fn init(parent_allocator: std.mem.Allocator) TokenStream {
         return TokenStream{
             .stream_pos = 0,
@@ -201,6 +264,8 @@ pub const TokenStream = struct {
     }
 
     pub fn getItemByReferenceOrError(self: *TokenStream, index: usize) TokenStreamError!*Token {
+        try self.fill(index);
+
         if (self.isOutOfRange(index)) {
             return error.IndexOutOfRangeForReference;
         }
@@ -210,9 +275,30 @@ pub const TokenStream = struct {
 
     /// The given [`token`] should outlive or die with the tokenstream. Adds a token into the stream.
     pub fn addOne(self: *TokenStream, token: Token) !void {
+        if (self.sink) |sink| {
+            return sink.push(token);
+        }
+
         try self.internal_list.append(token);
     }
 
+    /// Takes tokens from `source` until `index` is in the stream, or the source is done.
+    fn fill(self: *TokenStream, index: usize) TokenStreamError!void {
+        const source = self.source orelse return;
+
+        while (index >= self.internal_list.items.len) {
+            // room first, so a token is never taken and then lost
+            try self.internal_list.ensureUnusedCapacity(1);
+
+            const token = source.pop() orelse {
+                self.source = null;
+                return;
+            };
+
+            self.internal_list.appendAssumeCapacity(token);
+        }
+    }
+
     pub fn incrementPositionByOne(self: *TokenStream) void {
         self.stream_pos += 1;
     }
@@ -225,11 +311,14 @@ pub const TokenStream = struct {
         return self.internal_list.items.len;
     }
 
-    pub fn isAtEnd(self: *const TokenStream) bool {
-        return self.getCurrentStreamPosition() >= self.getSizeOfStream();
+    pub fn isAtEnd(self: *TokenStream) bool {
+        return self.isOutOfRange(self.getCurrentStreamPosition());
     }
 
-    pub fn isOutOfRange(self: *const TokenStream, index: usize) bool {
+    pub fn isOutOfRange(self: *TokenStream, index: usize) bool {
+        // without memory for more tokens, reading the token reports the error
+        self.fill(index) catch return false;
+
         return index >= self.getSizeOfStream();
     }
 };
@@ -251,21 +340,17 @@ test "iterating a token stream" {
     defer my_token_stream.deinit();
 
     try my_token_stream.addOne(Token{
-        .identifier = Identifier{
-            .identifier_string = "hello, world!",
-        },
+        .identifier = try Identifier.init("hello, world!"),
     });
 
     try my_token_stream.addOne(Token{
-        .identifier = Identifier{
-            .identifier_string = "hello, world!",
-        },
+        .identifier = try Identifier.init("hello, world!"),
     });
 
     try std.testing.expectEqual(2, my_token_stream.getSizeOfStream());
 
     while (!my_token_stream.isAtEnd()) {
-        const str = (try my_token_stream.getItemByReferenceOrError(my_token_stream.getCurrentStreamPosition())).identifier.identifier_string;
+        const str = (try my_token_stream.getItemByReferenceOrError(my_token_stream.getCurrentStreamPosition())).identifier.toString();
 
         try std.testing.expectEqualStrings("hello, world!", str);
 
@@ -286,10 +371,63 @@ test "checking if we're at the end of the stream" {
 
 test "ensuring types" {
     const token = Token{
-        .identifier = .{
-            .identifier_string = "hello, world!",
-        },
+        .identifier = try Identifier.init("hello, world!"),
     };
 
     try std.testing.expectEqual(TokenTag.identifier, token.getType());
 }
+
+test "span line and column" {
+    const source = "a: mov R1, 5\n   each R1\n";
+
+    const each = Span{ .begin = 16, .len = 4 };
+
+    try std.testing.expectEqual(2, each.lineNumber(source));
+    try std.testing.expectEqual(4, each.column(source));
+    try std.testing.expectEqual(20, each.end());
+
+    const first = Span{ .begin = 0, .len = 1 };
+
+    try std.testing.expectEqual(1, first.lineNumber(source));
+    try std.testing.expectEqual(1, first.column(source));
+}
+
+test "compact tokens" {
+    try std.testing.expectEqual(8, @sizeOf(Span));
+    try std.testing.expect(@sizeOf(Token) <= 24);
+
+    const literal = try Literal.init("'\\n'");
+
+    try std.testing.expectEqualStrings("\\n", literal.getCharacters());
+    var characters = literal.iterator();
+    try std.testing.expectEqual('\n', (try characters.next()).?);
+    try std.testing.expectEqualStrings("abc", (try Identifier.init("abc")).toString());
+}
+
+test "tokens longer than a span" {
+    const long = [_]u8{'a'} ** (std.math.maxInt(u16) + 1);
+
+    try std.testing.expectError(error.TokenTooLong, Identifier.init(&long));
+    try std.testing.expectError(error.TokenTooLong, Literal.init(&long));
+    try std.testing.expectEqual(std.math.maxInt(u16), (try Identifier.init(long[1..])).span.len);
+}
+
+test "string literals" {
+    const hello = try Literal.init("'Hi\\n'");
+
+    var characters = hello.iterator();
+
+    try std.testing.expectEqual(3, try characters.count());
+    try std.testing.expectEqual('H', (try characters.next()).?);
+    try std.testing.expectEqual('i', (try characters.next()).?);
+    try std.testing.expectEqual('\n', (try characters.next()).?);
+    try std.testing.expectEqual(null, try characters.next());
+
+    var quote = (try Literal.init("'\\''")).iterator();
+    try std.testing.expectEqual('\'', (try quote.next()).?);
+
+    var unknown = (try Literal.init("'a\\q'")).iterator();
+
+    try std.testing.expectEqual('a', (try unknown.next()).?);
+    try std.testing.expectError(error.UnknownEscapeSequence, unknown.next());
+}
@@ -0,0 +1,202 @@
+//! ## Tracing
+//!
+//! Records compiler events in the Chrome trace event format, so a compile can be opened
+//! in Perfetto or `chrome://tracing`. Every event is a complete (`"ph": "X"`) event with a
+//! begin timestamp, a duration, and the id of the thread that produced it, so parallel
+//! work and stalls line up on their own tracks.
+//!
+//! A null tracer is always valid. Every function that takes a `?*Tracer` is a no-op when
+//! tracing is disabled, so call sites never need to branch.
+//!
+//! ```zig
+//! const scope = trace.begin(vendor.tracer, "codegen", procedure_name);
+//! defer scope.end();
+//! ```
+//!
+
+const std = @import("std");
+
+/// A single finished event. Timestamps are in microseconds relative to `Tracer.origin`.
+pub const Event = struct {
+    name: []const u8,
+    category: []const u8,
+    begin: i64,
+    duration: i64,
+    thread_id: std.Thread.Id,
+};
+
+/// Collects events from any number of threads.
+pub const Tracer = struct {
+    parent_allocator: std.mem.Allocator,
+    events: std.ArrayList(Event),
+
+    /// Guards `events`. Events can come from any compile thread.
+    mutex: std.Thread.Mutex = .{},
+
+    /// Timestamp (in microseconds) the tracer was created at. Every event is relative to it.
+    origin: i64,
+
+    pub fn init(parent_allocator: std.mem.Allocator) Tracer {
+        return Tracer{
+            .parent_allocator = parent_allocator,
+            .events = std.ArrayList(Event).init(parent_allocator),
+            .origin = std.time.microTimestamp(),
+        };
+    }
+
+    pub fn deinit(self: *Tracer) void {
+        for (self.events.items) |event| {
+            self.parent_allocator.free(event.name);
+        }
+
+        self.events.deinit();
+    }
+
+    /// Microseconds elapsed since the tracer was created.
+    pub fn now(self: *const Tracer) i64 {
+        return std.time.microTimestamp() - self.origin;
+    }
+
+    /// A copy of `name` the tracer owns, as names often point into source buffers that are
+    /// released before the event ends. Null when it can not be made.
+    fn ownName(self: *Tracer, name: []const u8) ?[]const u8 {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        return self.parent_allocator.dupe(u8, name) catch null;
+    }
+
+    /// Records a finished event, taking `owned_name` (see `ownName`). Tracing is best-effort,
+    /// an event that can not be stored is dropped rather than failing the compile.
+    fn complete(self: *Tracer, category: []const u8, owned_name: []const u8, begin_at: i64) void {
+        const end_at = self.now();
+
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        self.events.append(Event{
+            .name = owned_name,
+            .category = category,
+            .begin = begin_at,
+            .duration = end_at - begin_at,
+            .thread_id = std.Thread.getCurrentId(),
+        }) catch {
+            self.parent_allocator.free(owned_name);
+        };
+    }
+
+    /// Writes every recorded event as a Chrome trace JSON object.
+    pub fn writeJson(self: *Tracer, writer: anytype) !void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        try writer.writeAll("{\"traceEvents\":[");
+
+        for (self.events.items, 0..) |event, i| {
+            if (i > 0) try writer.writeAll(",\n");
+
+            try std.json.stringify(.{
+                .name = event.name,
+                .cat = event.category,
+                .ph = "X",
+                .ts = event.begin,
+                .dur = event.duration,
+                .pid = 1,
+                .tid = event.thread_id,
+            }, .{}, writer);
+        }
+
+        try writer.writeAll("],\"displayTimeUnit\":\"ms\"}\n");
+    }
+
+    pub fn writeToFile(self: *Tracer, file_name: []const u8) !void {
+        var file = try std.fs.cwd().createFile(file_name, .{});
+        defer file.close();
+
+        var buffered = std.io.bufferedWriter(file.writer());
+
+        try self.writeJson(buffered.writer());
+        try buffered.flush();
+    }
+};
+
+/// An open event. Closed with `end`, which records it into the tracer it was opened on.
+pub const Scope = struct {
+    tracer: ?*Tracer,
+    category: []const u8,
+
+    /// Owned by the tracer, so the event can outlive what it was named after
+    name: []const u8,
+    begin_at: i64,
+
+    pub fn end(self: Scope) void {
+        if (self.tracer) |tracer| {
+            tracer.complete(self.category, self.name, self.begin_at);
+        }
+    }
+};
+
+/// Opens an event named `name` under `category`. A null `tracer` gives an inert scope, and so
+/// does a name the tracer can not copy.
+pub fn begin(tracer: ?*Tracer, category: []const u8, name: []const u8) Scope {
+    const t = tracer orelse return Scope{ .tracer = null, .category = category, .name = name, .begin_at = 0 };
+    const owned_name = t.ownName(name) orelse return Scope{ .tracer = null, .category = category, .name = name, .begin_at = 0 };
+
+    return Scope{
+        .tracer = t,
+        .category = category,
+        .name = owned_name,
+        .begin_at = t.now(),
+    };
+}
+
+test "recording events" {
+    var tracer = Tracer.init(std.testing.allocator);
+    defer tracer.deinit();
+
+    const outer = begin(&tracer, "stage", "codegen");
+    const inner = begin(&tracer, "codegen", "_start");
+    inner.end();
+    outer.end();
+
+    try std.testing.expectEqual(2, tracer.events.items.len);
+    try std.testing.expectEqualStrings("_start", tracer.events.items[0].name);
+    try std.testing.expectEqualStrings("stage", tracer.events.items[1].category);
+    try std.testing.expect(tracer.events.items[1].duration >= tracer.events.items[0].duration);
+    try std.testing.expectEqual(std.Thread.getCurrentId(), tracer.events.items[0].thread_id);
+}
+
+test "names released before the event ends" {
+    var tracer = Tracer.init(std.testing.allocator);
+    defer tracer.deinit();
+
+    var source = "main".*;
+
+    const scope = begin(&tracer, "target", &source);
+    @memset(&source, 0);
+    scope.end();
+
+    try std.testing.expectEqualStrings("main", tracer.events.items[0].name);
+}
+
+test "disabled tracing" {
+    const scope = begin(null, "stage", "lex");
+    scope.end();
+
+    try std.testing.expectEqual(0, scope.begin_at);
+}
+
+test "chrome trace json" {
+    var tracer = Tracer.init(std.testing.allocator);
+    defer tracer.deinit();
+
+    begin(&tracer, "file", "main.asm").end();
+
+    var output = std.ArrayList(u8).init(std.testing.allocator);
+    defer output.deinit();
+
+    try tracer.writeJson(output.writer());
+
+    try std.testing.expect(std.mem.startsWith(u8, output.items, "{\"traceEvents\":[{\"name\":\"main.asm\",\"cat\":\"file\",\"ph\":\"X\""));
+    try std.testing.expect(std.mem.indexOf(u8, output.items, "\"tid\":") != null);
+}
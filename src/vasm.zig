@@ -12,6 +12,23 @@ pub const nexfuse = @import("platforms/nexfuse.zig");
 pub const stylist = @import("stylist.zig");
 pub const hybrid = @import("hybrid.zig");
 pub const pp = @import("preprocessor.zig");
+pub const trace = @import("trace.zig");
+pub const source_map = @import("source_map.zig");
+pub const profile = @import("profile.zig");
+pub const intermediate = @import("ir.zig");
+pub const passes = @import("passes.zig");
+pub const registers = @import("registers.zig");
+pub const layout = @import("layout.zig");
+pub const expect = @import("testing/expect.zig");
+pub const vm = @import("testing/vm.zig");
+pub const pipeline = @import("pipeline.zig");
+pub const batch_io = @import("batch_io.zig");
+pub const depfile = @import("depfile.zig");
+pub const lsp = @import("lsp.zig");
+pub const object = @import("object.zig");
+pub const archive = @import("archive.zig");
+pub const codegen_cache = @import("codegen_cache.zig");
+pub const diagnostics = @import("diagnostics.zig");
 
 test {
     std.testing.refAllDecls(@This());